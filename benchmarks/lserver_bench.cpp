@@ -0,0 +1,282 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2021, Amin Saba
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cstring>
+#include <string>
+#ifdef USE_PMR_POOL_RESOURCE
+#include <memory_resource>
+#endif
+
+#include <benchmark/benchmark.h>
+
+#include "basic_pool.hpp"
+#include "common.hpp"
+#include "dynamic_queue.hpp"
+#include "dynamic_string.hpp"
+#include "http_header.hpp"
+#include "program.hpp"
+
+using namespace lserver;
+
+/*
+ * Microbenchmarks for the core building blocks of LServer. The numbers
+ * depend on the USE_TBB and USE_PMR_POOL cmake options, so the variant
+ * this binary was built with is reported in the benchmark context.
+ */
+
+namespace {
+
+  /*
+   * Minimal pooled type
+   */
+  struct BenchItem {
+    LS_SANITIZE
+
+    void finalize() { }
+    std::size_t payload_[8];
+  };
+
+  /*
+   * Shared by all threads of the contended pool benchmark
+   */
+  BasicPool<BenchItem> shared_pool{0, false};
+
+  constexpr char http_request[] = "POST /sinkhole/ HTTP/1.1\r\n"
+                                  "Host: 127.0.0.1:15001\r\n"
+                                  "User-Agent: lserver_bench\r\n"
+                                  "Accept: */*\r\n"
+                                  "Connection: keep-alive\r\n"
+                                  "Content-Length: 11\r\n"
+                                  "Content-Type: text/plain\r\n"
+                                  "\r\n";
+
+  constexpr char vscript[] = "109\n"
+                             "[\n"
+                             "{\"0\": {\"LOCK\" : \"1\"}},\n"
+                             "{\"0\": {\"LOOP\" : \"100\"}},\n"
+                             "{\"0\": {\"UNLOCK\" : \"1\"}},\n"
+                             "{\"0\": {\"DOWNLOAD\" : \"1048576\"}}\n"
+                             "]\n"
+                             "ABCD";
+
+  uint8_t*
+  vscript_data()
+  {
+    return reinterpret_cast<uint8_t*>(const_cast<char*>(vscript));
+  }
+
+} // namespace
+
+static void
+BM_Pool_borrow_put_back(benchmark::State& state)
+{
+  BasicPool<BenchItem> pool{0, false};
+
+  for (auto _: state) {
+    auto p = pool.borrow();
+    benchmark::DoNotOptimize(p);
+    pool.put_back(p);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_Pool_borrow_put_back);
+
+static void
+BM_Pool_borrow_put_back_contended(benchmark::State& state)
+{
+  for (auto _: state) {
+    auto p = shared_pool.borrow();
+    benchmark::DoNotOptimize(p);
+    shared_pool.put_back(p);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_Pool_borrow_put_back_contended)->ThreadRange(1, 16)->UseRealTime();
+
+static void
+BM_DynamicQueue_push_pop(benchmark::State& state)
+{
+  DynamicQueue<> q;
+  std::size_t const n = state.range(0);
+
+  for (auto _: state) {
+    auto qb = q.prepare(n);
+    q.push(qb);
+    benchmark::DoNotOptimize(q.front());
+    q.pop();
+    q.free(qb);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_DynamicQueue_push_pop)->Arg(64)->Arg(256 * 1024);
+
+static void
+BM_DynamicString_printf(benchmark::State& state)
+{
+#ifdef USE_PMR_POOL_RESOURCE
+  std::pmr::unsynchronized_pool_resource mr;
+  DynamicString ds{64, mr};
+#else
+  DynamicString ds{64};
+#endif
+
+  for (auto _: state) {
+    ds.clear();
+    ds.printf("HTTP/1.1 %d %s", 200, "OK");
+    ds.printf("\r\n");
+    ds.printf("Content-Length: %d", 1048576);
+    benchmark::DoNotOptimize(ds.data());
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_DynamicString_printf);
+
+static void
+BM_HttpRequestHeader_try_parse(benchmark::State& state)
+{
+  HttpRequestHeader header;
+  std::size_t const len = strlen(http_request);
+
+  for (auto _: state) {
+    header.reset();
+    auto end = header.try_parse(http_request, len);
+    benchmark::DoNotOptimize(end);
+  }
+  state.SetBytesProcessed(state.iterations() * len);
+}
+BENCHMARK(BM_HttpRequestHeader_try_parse);
+
+static void
+BM_HttpResponseHeader_prepare(benchmark::State& state)
+{
+#ifdef USE_PMR_POOL_RESOURCE
+  std::pmr::unsynchronized_pool_resource mr;
+  DynamicString ds{64, mr};
+#else
+  DynamicString ds{64};
+#endif
+  HttpResponseHeader header{&ds};
+
+  for (auto _: state) {
+    header.prepare(200, 1048576, true);
+    benchmark::DoNotOptimize(ds.data());
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_HttpResponseHeader_prepare);
+
+static void
+BM_Program_try_parse(benchmark::State& state)
+{
+  std::size_t const len = strlen(vscript);
+
+  for (auto _: state) {
+    Program program;
+    std::size_t consume_len;
+    auto status =
+        Program::try_parse(program, consume_len, vscript_data(), len);
+    if (status != SUCCESS) {
+      state.SkipWithError("Invalid VScript");
+      break;
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * len);
+}
+BENCHMARK(BM_Program_try_parse);
+
+/*
+ * Feeding a sinkhole program, which is the hot path of bulk uploads.
+ */
+static void
+BM_Program_feed_sinkhole(benchmark::State& state)
+{
+  LSVirtualMachine vm;
+  std::vector<uint8_t> chunk(state.range(0));
+  Program program = Program::sinkhole();
+  program.set_vm(&vm);
+
+  for (auto _: state) {
+    auto finished = program.feed(data(chunk), size(chunk), false);
+    benchmark::DoNotOptimize(finished);
+  }
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_Program_feed_sinkhole)->Arg(1024)->Arg(256 * 1024);
+
+/*
+ * Feeding a program that executes its instructions. Parsing is excluded
+ * from the measurement.
+ */
+static void
+BM_Program_feed_vscript(benchmark::State& state)
+{
+  LSVirtualMachine vm;
+  std::size_t const len = strlen(vscript);
+
+  for (auto _: state) {
+    state.PauseTiming();
+    Program program;
+    std::size_t consume_len;
+    if (Program::try_parse(program, consume_len, vscript_data(), len) !=
+        SUCCESS) {
+      state.SkipWithError("Invalid VScript");
+      break;
+    }
+    program.set_vm(&vm);
+    state.ResumeTiming();
+
+    auto finished = program.feed(vscript_data() + consume_len,
+                                 len - consume_len, true);
+    benchmark::DoNotOptimize(finished);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_Program_feed_vscript);
+
+int
+main(int argc, char** argv)
+{
+#ifdef USE_TBB
+  benchmark::AddCustomContext("USE_TBB", "ON");
+#else
+  benchmark::AddCustomContext("USE_TBB", "OFF");
+#endif
+#ifdef USE_PMR_POOL_RESOURCE
+  benchmark::AddCustomContext("USE_PMR_POOL", "ON");
+#else
+  benchmark::AddCustomContext("USE_PMR_POOL", "OFF");
+#endif
+
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv))
+    return 1;
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  return 0;
+}
@@ -0,0 +1,187 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2021, Amin Saba
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <thread>
+
+#include "autoscaler.hpp"
+
+namespace lserver {
+
+  Autoscaler::Autoscaler(ServerManager& manager, LSConfig const& config)
+      : manager_{manager}
+      , config_{config}
+  { }
+
+  void
+  Autoscaler::service_func()
+  {
+    for (ServerManager::ServerHandle sh = 0;
+         manager_.validate_server_handle(sh); ++sh) {
+      if (states_.size() <= static_cast<std::size_t>(sh))
+        states_.resize(sh + 1);
+      manager_.get_server(sh)->probe_contexts();
+    }
+
+    /*
+     * The probes posted above are measured during the sleep
+     */
+    std::this_thread::sleep_for(
+        std::chrono::milliseconds(config_.autoscaler_interval_ms_));
+
+    for (std::size_t sh = 0; sh < states_.size(); ++sh)
+      step(sh, states_[sh]);
+  }
+
+  void
+  Autoscaler::step(ServerManager::ServerHandle sh, ServerState& state)
+  {
+    auto* server = manager_.get_server(sh);
+    auto info = server->get_server_info();
+    bool first_sample = state.cpu_time_us.empty();
+    auto load = measure(info, state);
+
+    if (first_sample)
+      return;
+
+    if (state.cooldown > 0) {
+      state.cooldown--;
+      return;
+    }
+
+    bool overloaded =
+        load.busy_ratio > config_.autoscaler_scale_up_busy_ratio_ ||
+        load.lag_us > config_.autoscaler_scale_up_lag_us_ ||
+        (config_.autoscaler_scale_up_sessions_ &&
+         load.sessions > config_.autoscaler_scale_up_sessions_);
+    bool underloaded =
+        load.busy_ratio < config_.autoscaler_scale_down_busy_ratio_ &&
+        load.lag_us < config_.autoscaler_scale_down_lag_us_;
+
+    state.up_streak = overloaded ? state.up_streak + 1 : 0;
+    state.down_streak = underloaded ? state.down_streak + 1 : 0;
+
+    if (state.up_streak >= config_.autoscaler_scale_up_samples_ &&
+        load.active_cnt < config_.max_num_workers_) {
+      lslog_note(1, "Autoscaler: server", sh, "busy", load.busy_ratio, "lag",
+                 load.lag_us, "us; adding a context");
+      scale_up(server);
+      state.up_streak = 0;
+      state.cooldown = config_.autoscaler_cooldown_samples_;
+
+    } else if (state.down_streak >= config_.autoscaler_scale_down_samples_ &&
+               load.active_cnt > config_.num_workers_) {
+      lslog_note(1, "Autoscaler: server", sh, "busy", load.busy_ratio, "lag",
+                 load.lag_us, "us; deactivating a context");
+      scale_down(server, info);
+      state.down_streak = 0;
+      state.cooldown = config_.autoscaler_cooldown_samples_;
+    }
+  }
+
+  auto
+  Autoscaler::measure(ServerInfo const& info, ServerState& state) -> Load
+  {
+    using namespace std::chrono;
+
+    Load load;
+    auto now = steady_clock::now();
+    auto elapsed_us = duration_cast<microseconds>(now - state.time).count();
+    uint64_t busy_us = 0;
+    std::size_t threads_cnt = 0;
+    std::map<std::size_t, uint64_t> cpu_time_us;
+
+    for (auto const& ci: info.contexts_info_) {
+      if (!ci.active_)
+        continue;
+
+      load.active_cnt++;
+      load.sessions += ci.active_sessions_cnt_;
+      load.lag_us = std::max(load.lag_us, ci.loop_lag_us_);
+      cpu_time_us[ci.context_index_] = ci.cpu_time_us_;
+
+      /*
+       * Contexts that were just (re)activated have no previous sample
+       */
+      auto prev = state.cpu_time_us.find(ci.context_index_);
+      if (prev != state.cpu_time_us.end() && ci.cpu_time_us_ >= prev->second) {
+        busy_us += ci.cpu_time_us_ - prev->second;
+        threads_cnt += ci.threads_cnt_;
+      }
+    }
+
+    if (load.active_cnt)
+      load.sessions /= load.active_cnt;
+    if (threads_cnt && elapsed_us > 0)
+      load.busy_ratio = static_cast<double>(busy_us) / (elapsed_us * threads_cnt);
+
+    state.cpu_time_us = std::move(cpu_time_us);
+    state.time = now;
+    return load;
+  }
+
+  void
+  Autoscaler::scale_up(AbstractServer* server)
+  {
+    try {
+      server->add_context(config_.num_threads_per_worker_);
+    } catch (std::logic_error& ex) {
+      lslog_note(1, "Autoscaler: cannot add a context:", ex.what());
+    }
+  }
+
+  void
+  Autoscaler::scale_down(AbstractServer* server, ServerInfo const& info)
+  {
+    /*
+     * Prefer the context with the fewest sessions to drain. The one that
+     * is held by the acceptor returns EBUSY, so try the next one.
+     */
+    std::vector<ContextInfo> candidates;
+    std::copy_if(info.contexts_info_.begin(), info.contexts_info_.end(),
+                 std::back_inserter(candidates),
+                 [](auto const& ci) { return ci.active_; });
+    std::sort(candidates.begin(), candidates.end(),
+              [](auto const& a, auto const& b) {
+                return a.active_sessions_cnt_ < b.active_sessions_cnt_;
+              });
+
+    for (auto const& ci: candidates) {
+      try {
+        if (server->deactivate_context(ci.context_index_) == 0)
+          return;
+      } catch (std::logic_error& ex) {
+        lslog_note(1, "Autoscaler: cannot deactivate a context:", ex.what());
+        return;
+      }
+    }
+  }
+
+} // namespace lserver
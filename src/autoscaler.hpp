@@ -0,0 +1,90 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2021, Amin Saba
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <map>
+#include <vector>
+
+#include "config.hpp"
+#include "manager.hpp"
+#include "service.hpp"
+#include "stats.hpp"
+
+namespace lserver {
+
+  /*
+   * Adds and deactivates LSContexts of the managed servers, within
+   * [num_workers, max_num_workers], based on the CPU busy ratio of their
+   * threads, the lag of their event loops, and their number of active
+   * sessions.
+   *
+   * Hysteresis: a scale up (down) needs the signals to stay above (below)
+   * the scale up (down) thresholds for a number of consecutive samples,
+   * and every change is followed by a cooldown period, so that the
+   * signals can settle before the next decision.
+   */
+  class Autoscaler : public Service<Autoscaler> {
+  public:
+    Autoscaler(ServerManager& manager, LSConfig const& config);
+    /* This function will be called by the service loop of the CRTP
+     * base Service<Autoscaler> */
+    void service_func();
+
+  private:
+    struct Load {
+      double busy_ratio = 0;
+      uint64_t lag_us = 0;
+      double sessions = 0;
+      std::size_t active_cnt = 0;
+    };
+
+    struct ServerState {
+      /*
+       * CPU time of each LSContext at the previous sample
+       */
+      std::map<std::size_t, uint64_t> cpu_time_us;
+      std::chrono::steady_clock::time_point time;
+      std::size_t up_streak = 0;
+      std::size_t down_streak = 0;
+      std::size_t cooldown = 0;
+    };
+
+    void step(ServerManager::ServerHandle sh, ServerState& state);
+    Load measure(ServerInfo const& info, ServerState& state);
+    void scale_up(AbstractServer* server);
+    void scale_down(AbstractServer* server, ServerInfo const& info);
+
+    ServerManager& manager_;
+    LSConfig const& config_;
+    std::vector<ServerState> states_;
+  };
+
+} // namespace lserver
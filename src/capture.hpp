@@ -0,0 +1,419 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2021, Amin Saba
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ios>
+#include <map>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <unordered_set>
+#include <vector>
+
+#include "common.hpp"
+
+namespace lserver {
+
+  /*
+   * On-disk format of a capture of raw inbound byte streams:
+   *
+   *   CaptureFileHeader
+   *   CaptureRecord [payload] [padding]
+   *   CaptureRecord [payload] [padding]
+   *   ...
+   *
+   * Every record starts at an 8-byte aligned offset, so a capture can be
+   * mapped into memory and read in place. Integers are stored in host
+   * byte order. A truncated last record is ignored by the reader.
+   *
+   * The writer reserves the room of the closing record of a stream when it
+   * opens it, so every stream is closed, even when the file fills up. A
+   * stream that lost data because of that is closed by a kTruncate record
+   * instead of a kClose.
+   */
+  struct CaptureFileHeader {
+    static constexpr char kMagic[8] = {'L', 'S', 'C', 'A', 'P', 'T', 'R', 0};
+    static constexpr uint32_t kVersion = 1;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    /*
+     * Wall clock time of the start of the capture, in nanoseconds since
+     * the epoch. Informational only.
+     */
+    uint64_t start_time_ns;
+  };
+
+  struct CaptureRecord {
+    enum Type : uint32_t { kOpen = 1, kData = 2, kClose = 3, kTruncate = 4 };
+
+    /*
+     * Nanoseconds since the start of the capture
+     */
+    uint64_t time_ns;
+    /*
+     * Identifies the connection. Never 0.
+     */
+    uint64_t stream_id;
+    uint32_t type;
+    /*
+     * Length of the payload following this record (kData only)
+     */
+    uint32_t length;
+  };
+
+  static_assert(sizeof(CaptureFileHeader) % 8 == 0);
+  static_assert(sizeof(CaptureRecord) % 8 == 0);
+
+  inline constexpr std::size_t
+  capture_padded(std::size_t n)
+  {
+    return (n + 7) & ~std::size_t{7};
+  }
+
+  /*
+   * Appends sampled connections of a server to a capture file. It is
+   * shared by all the sessions of a server, on all threads.
+   */
+  class CaptureWriter {
+  public:
+    /*
+     * @param sampling_rate Fraction of the connections to capture [0, 1]
+     * @param max_size The capture stops when the file reaches this size
+     * Throws std::system_error if the file cannot be created.
+     */
+    CaptureWriter(std::string const& path, double sampling_rate,
+                  std::size_t max_size);
+    CaptureWriter(CaptureWriter const&) = delete;
+    CaptureWriter& operator=(CaptureWriter const&) = delete;
+    ~CaptureWriter() noexcept;
+
+    /*
+     * Decides whether a new connection is sampled. Returns the stream id
+     * that the connection should use, or 0 if it is not captured.
+     */
+    uint64_t open_stream();
+    void write(uint64_t stream_id, uint8_t const* data, std::size_t len);
+    void close_stream(uint64_t stream_id);
+    void flush();
+
+  private:
+    /*
+     * Returns false if the record was dropped because the file is full
+     */
+    bool append(uint64_t stream_id, CaptureRecord::Type type,
+                uint8_t const* data, std::size_t len);
+
+    std::mutex mtx_;
+    std::FILE* file_;
+    std::chrono::steady_clock::time_point start_;
+    double sampling_rate_;
+    std::size_t max_size_;
+    std::size_t size_ = 0;
+    /*
+     * Room kept for the closing records of the open streams
+     */
+    std::size_t reserved_ = 0;
+    /*
+     * Open streams that lost data
+     */
+    std::unordered_set<uint64_t> truncated_;
+    std::atomic<uint64_t> connections_cnt_ = 0;
+    std::atomic<uint64_t> next_stream_id_ = 1;
+    std::atomic<bool> full_ = false;
+  };
+
+  struct CaptureChunk {
+    std::chrono::nanoseconds time;
+    uint8_t const* data;
+    std::size_t length;
+  };
+
+  /*
+   * A single captured connection. Times are relative to the start of the
+   * capture.
+   */
+  struct CaptureStream {
+    uint64_t id;
+    std::chrono::nanoseconds open_time;
+    /*
+     * Equals the time of the last chunk if the close was not captured.
+     */
+    std::chrono::nanoseconds close_time;
+    std::vector<CaptureChunk> chunks;
+    /*
+     * False if the stream was not closed in the capture (e.g. the server
+     * crashed), or lost data because the capture file was full. Replays
+     * skip such streams.
+     */
+    bool complete = false;
+  };
+
+  /*
+   * Maps a capture file and indexes its streams. The payload of the
+   * chunks points into the mapping, so it is valid as long as the reader.
+   */
+  class CaptureReader {
+  public:
+    /*
+     * Throws std::ios_base::failure if the file cannot be mapped, or is
+     * not a capture.
+     */
+    explicit CaptureReader(std::string const& path);
+    CaptureReader(CaptureReader const&) = delete;
+    CaptureReader& operator=(CaptureReader const&) = delete;
+    ~CaptureReader() noexcept;
+
+    /*
+     * Ordered by open time
+     */
+    std::vector<CaptureStream> const& streams() const;
+
+  private:
+    void index();
+
+    void* map_ = MAP_FAILED;
+    std::size_t size_ = 0;
+    std::vector<CaptureStream> streams_;
+  };
+
+  inline CaptureWriter::CaptureWriter(std::string const& path,
+                                      double sampling_rate,
+                                      std::size_t max_size)
+      : file_{std::fopen(path.c_str(), "wb")}
+      , start_{std::chrono::steady_clock::now()}
+      , sampling_rate_{sampling_rate}
+      , max_size_{max_size}
+  {
+    if (!file_)
+      throw std::system_error{errno, std::system_category(), path};
+
+    std::setvbuf(file_, nullptr, _IOFBF, 1 << 20);
+
+    CaptureFileHeader header{};
+    std::memcpy(header.magic, CaptureFileHeader::kMagic, sizeof(header.magic));
+    header.version = CaptureFileHeader::kVersion;
+    header.start_time_ns =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch())
+            .count();
+    std::fwrite(&header, sizeof(header), 1, file_);
+    size_ = sizeof(header);
+  }
+
+  inline CaptureWriter::~CaptureWriter() noexcept
+  {
+    std::fclose(file_);
+  }
+
+  inline uint64_t
+  CaptureWriter::open_stream()
+  {
+    if (full_.load(std::memory_order_relaxed))
+      return 0;
+
+    /*
+     * Deterministic sampling that spreads the captured connections evenly
+     * over the accepted ones.
+     */
+    auto n = connections_cnt_.fetch_add(1, std::memory_order_relaxed);
+    if (std::floor((n + 1) * sampling_rate_) == std::floor(n * sampling_rate_))
+      return 0;
+
+    auto id = next_stream_id_.fetch_add(1, std::memory_order_relaxed);
+    return append(id, CaptureRecord::kOpen, nullptr, 0) ? id : 0;
+  }
+
+  inline void
+  CaptureWriter::write(uint64_t stream_id, uint8_t const* data,
+                       std::size_t len)
+  {
+    append(stream_id, CaptureRecord::kData, data, len);
+  }
+
+  inline void
+  CaptureWriter::close_stream(uint64_t stream_id)
+  {
+    append(stream_id, CaptureRecord::kClose, nullptr, 0);
+  }
+
+  inline void
+  CaptureWriter::flush()
+  {
+    std::unique_lock _{mtx_};
+    std::fflush(file_);
+  }
+
+  inline bool
+  CaptureWriter::append(uint64_t stream_id, CaptureRecord::Type type,
+                        uint8_t const* data, std::size_t len)
+  {
+    static constexpr char padding[8] = {};
+
+    CaptureRecord rec{};
+    rec.stream_id = stream_id;
+    rec.type = type;
+    rec.length = len;
+    auto padded_len = capture_padded(len);
+
+    std::unique_lock _{mtx_};
+
+    if (type == CaptureRecord::kClose) {
+      /*
+       * Always fits, its room was reserved by the open
+       */
+      reserved_ -= sizeof(rec);
+      if (truncated_.erase(stream_id)) LS_UNLIKELY
+        rec.type = CaptureRecord::kTruncate;
+    } else {
+      auto needed = sizeof(rec) + padded_len;
+      if (type == CaptureRecord::kOpen)
+        needed += sizeof(rec);
+
+      if (full_.load(std::memory_order_relaxed) ||
+          size_ + reserved_ + needed > max_size_) LS_UNLIKELY {
+        if (!full_.exchange(true, std::memory_order_relaxed))
+          lslog_note(1, "Capture file is full");
+        if (type == CaptureRecord::kData)
+          truncated_.insert(stream_id);
+        return false;
+      }
+
+      if (type == CaptureRecord::kOpen)
+        reserved_ += sizeof(rec);
+    }
+
+    /*
+     * Taking the time stamp under the lock keeps the records ordered
+     */
+    rec.time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::steady_clock::now() - start_)
+                      .count();
+    std::fwrite(&rec, sizeof(rec), 1, file_);
+    if (len) {
+      std::fwrite(data, 1, len, file_);
+      std::fwrite(padding, 1, padded_len - len, file_);
+    }
+    size_ += sizeof(rec) + padded_len;
+    return true;
+  }
+
+  inline CaptureReader::CaptureReader(std::string const& path)
+  {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      throw std::ios_base::failure{"Cannot open " + path};
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      size_ = st.st_size;
+      map_ = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    ::close(fd);
+
+    if (map_ == MAP_FAILED)
+      throw std::ios_base::failure{"Cannot map " + path};
+
+    auto const* header = static_cast<CaptureFileHeader const*>(map_);
+    if (size_ < sizeof(CaptureFileHeader) ||
+        std::memcmp(header->magic, CaptureFileHeader::kMagic,
+                    sizeof(header->magic)) ||
+        header->version != CaptureFileHeader::kVersion) {
+      munmap(map_, size_);
+      throw std::ios_base::failure{path + " is not a capture file"};
+    }
+
+    index();
+  }
+
+  inline CaptureReader::~CaptureReader() noexcept
+  {
+    munmap(map_, size_);
+  }
+
+  inline std::vector<CaptureStream> const&
+  CaptureReader::streams() const
+  {
+    return streams_;
+  }
+
+  inline void
+  CaptureReader::index()
+  {
+    using std::chrono::nanoseconds;
+
+    auto const* base = static_cast<uint8_t const*>(map_);
+    std::size_t offset = sizeof(CaptureFileHeader);
+    std::map<uint64_t, std::size_t> open_streams;
+
+    while (offset + sizeof(CaptureRecord) <= size_) {
+      auto const* rec = reinterpret_cast<CaptureRecord const*>(base + offset);
+      auto const* payload = base + offset + sizeof(CaptureRecord);
+      offset += sizeof(CaptureRecord) + capture_padded(rec->length);
+      if (offset > size_)
+        break;
+
+      nanoseconds time{rec->time_ns};
+
+      if (rec->type == CaptureRecord::kOpen) {
+        open_streams[rec->stream_id] = streams_.size();
+        streams_.push_back({rec->stream_id, time, time, {}});
+        continue;
+      }
+
+      auto it = open_streams.find(rec->stream_id);
+      if (it == open_streams.end())
+        continue;
+
+      auto& stream = streams_[it->second];
+      stream.close_time = time;
+      if (rec->type == CaptureRecord::kData) {
+        stream.chunks.push_back({time, payload, rec->length});
+        continue;
+      }
+
+      stream.complete = rec->type == CaptureRecord::kClose;
+      open_streams.erase(it);
+    }
+  }
+
+} // namespace lserver
@@ -27,7 +27,10 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <algorithm>
 #include <cstdint>
+#include <limits>
+#include <stdexcept>
 #include <string>
 
 #include "common.hpp"
@@ -50,7 +53,27 @@ namespace lserver {
     control_listen_port_ = read_config<uint16_t>("control_server", "port");
 
     listen_address_ = read_config<string>("listen", "ip");
-    listen_port_ = read_config<uint16_t>("listen", "port");
+    if (is_unix_address(listen_address_)) {
+      listen_unix_path_ = unix_address_path(listen_address_);
+      if (listen_unix_path_.empty() ||
+          listen_unix_path_.size() >= sizeof(sockaddr_un::sun_path)) {
+        lslog(0, "Bad unix socket path: ", listen_address_);
+        throw ConfigParseError{};
+      }
+      listen_port_ = read_config_or<uint16_t>("listen", "port", 0);
+    } else {
+      listen_port_ = read_config<uint16_t>("listen", "port");
+    }
+    listen_protocol_ = read_config_or<string>("listen", "protocol", "http");
+
+    if (listen_protocol_ != "http" && listen_protocol_ != "tcp_sink" &&
+        listen_protocol_ != "tcp_echo" && listen_protocol_ != "rpc" &&
+        listen_protocol_ != "resp" && listen_protocol_ != "h2c" &&
+        listen_protocol_ != "udp_sink" && listen_protocol_ != "udp_echo" &&
+        listen_protocol_ != "udp_vscript") {
+      lslog(0, "Unknown listen protocol: ", listen_protocol_);
+      throw ConfigParseError{};
+    }
 
     reuse_address_ = read_config<bool>("listen", "reuse_address");
     separate_acceptor_thread_ =
@@ -72,6 +95,19 @@ namespace lserver {
     num_threads_per_worker_ =
         read_config<size_t>("concurrency", "num_threads_per_worker");
 
+    drain_timeout_ms_ =
+        read_config_or<size_t>("concurrency", "drain_timeout_ms", 30000);
+    spin_budget_us_ =
+        read_config_or<uint64_t>("concurrency", "spin_budget_us", 0);
+    busy_poll_us_ = read_config_or<int>("concurrency", "busy_poll_us", 0);
+    single_threaded_contexts_ =
+        read_config_or<bool>("concurrency", "single_threaded_contexts", false);
+
+    if (single_threaded_contexts_ && num_threads_per_worker_ != 1) {
+      lslog(0, "single_threaded_contexts requires num_threads_per_worker: 1");
+      throw ConfigParseError{};
+    }
+
     max_session_pool_size_ =
         read_config<size_t>("sessions", "max_session_pool_size");
 
@@ -79,7 +115,190 @@ namespace lserver {
 
     eager_session_pool_ = read_config<bool>("sessions", "eager_session_pool");
 
+    rebalance_on_context_change_ =
+        read_config_or<bool>("sessions", "rebalance_on_context_change", false);
+    speculative_io_budget_ =
+        read_config_or<size_t>("sessions", "speculative_io_budget", 0);
+    send_high_watermark_ =
+        read_config_or<size_t>("sessions", "send_high_watermark", 0);
+    send_low_watermark_ =
+        read_config_or<size_t>("sessions", "send_low_watermark", 0);
+    max_send_bytes_ = read_config_or<size_t>("sessions", "max_send_bytes", 0);
+    tcp_info_sample_ratio_ =
+        read_config_or<double>("sessions", "tcp_info_sample_ratio", 0);
+
+    if (send_high_watermark_ && send_low_watermark_ >= send_high_watermark_) {
+      lslog(0, "send_low_watermark must be below send_high_watermark");
+      throw ConfigParseError{};
+    }
+
+    socket_buffer_min_ =
+        read_config_or<size_t>("sessions", "socket_buffer_min", 0);
+    socket_buffer_max_ =
+        read_config_or<size_t>("sessions", "socket_buffer_max", 0);
+
+    if (socket_buffer_max_ &&
+        (socket_buffer_min_ == 0 || socket_buffer_min_ > socket_buffer_max_ ||
+         socket_buffer_max_ > std::numeric_limits<int>::max())) {
+      lslog(0, "socket_buffer_min must be positive and not above "
+               "socket_buffer_max");
+      throw ConfigParseError{};
+    }
+
     header_interval_ = read_config<size_t>("logging", "header_interval");
+
+    auto& so = socket_options_;
+    so.tcp_nodelay =
+        read_config_or<bool>("socket_options", "tcp_nodelay", false);
+    so.tcp_cork = read_config_or<bool>("socket_options", "tcp_cork", false);
+    so.tcp_quickack =
+        read_config_or<bool>("socket_options", "tcp_quickack", false);
+    so.rcvbuf = read_config_or<int>("socket_options", "rcvbuf", 0);
+    so.sndbuf = read_config_or<int>("socket_options", "sndbuf", 0);
+    so.notsent_lowat =
+        read_config_or<int>("socket_options", "notsent_lowat", 0);
+    so.defer_accept_s =
+        read_config_or<int>("socket_options", "defer_accept_s", 0);
+    so.fastopen_qlen =
+        read_config_or<int>("socket_options", "fastopen_qlen", 0);
+
+    capture_enabled_ = read_config_or<bool>("capture", "enabled", false);
+    capture_file_ =
+        read_config_or<string>("capture", "file", "lserver.capture");
+    capture_sampling_rate_ =
+        read_config_or<double>("capture", "sampling_rate", 0.01);
+    capture_max_size_ =
+        read_config_or<size_t>("capture", "max_size", 1ul << 30);
+
+    if (capture_sampling_rate_ < 0 || capture_sampling_rate_ > 1) {
+      lslog(0, "capture sampling_rate must be in [0, 1]");
+      throw ConfigParseError{};
+    }
+
+    tls_enabled_ = read_config_or<bool>("tls", "enabled", false);
+    tls_certificate_file_ =
+        read_config_or<string>("tls", "certificate_file", "");
+    tls_private_key_file_ =
+        read_config_or<string>("tls", "private_key_file", "");
+    tls_ktls_ = read_config_or<bool>("tls", "ktls", true);
+
+    if (tls_enabled_ &&
+        (tls_certificate_file_.empty() || tls_private_key_file_.empty())) {
+      lslog(0, "tls requires certificate_file and private_key_file");
+      throw ConfigParseError{};
+    }
+
+    udp_batch_size_ = read_config_or<size_t>("udp", "batch_size", 32);
+    udp_max_datagram_size_ =
+        read_config_or<size_t>("udp", "max_datagram_size", 1472);
+    udp_gro_ = read_config_or<bool>("udp", "gro", true);
+    udp_gso_ = read_config_or<bool>("udp", "gso", true);
+
+    if (udp_batch_size_ == 0 || udp_batch_size_ > 1024) {
+      lslog(0, "udp batch_size must be in [1, 1024]");
+      throw ConfigParseError{};
+    }
+    if (udp_max_datagram_size_ == 0 || udp_max_datagram_size_ > 65507) {
+      lslog(0, "udp max_datagram_size must be in [1, 65507]");
+      throw ConfigParseError{};
+    }
+    if (listen_protocol_.starts_with("udp_") && !listen_unix_path_.empty()) {
+      lslog(0, "The udp protocols cannot listen on a unix socket");
+      throw ConfigParseError{};
+    }
+    if (listen_protocol_.starts_with("udp_") && tls_enabled_) {
+      lslog(0, "tls is not supported by the udp protocols");
+      throw ConfigParseError{};
+    }
+
+    autoscaler_enabled_ = read_config_or<bool>("autoscaler", "enabled", false);
+    autoscaler_interval_ms_ =
+        read_config_or<size_t>("autoscaler", "interval_ms", 1000);
+    autoscaler_scale_up_busy_ratio_ =
+        read_config_or<double>("autoscaler", "scale_up_busy_ratio", 0.75);
+    autoscaler_scale_down_busy_ratio_ =
+        read_config_or<double>("autoscaler", "scale_down_busy_ratio", 0.25);
+    autoscaler_scale_up_lag_us_ =
+        read_config_or<size_t>("autoscaler", "scale_up_lag_us", 2000);
+    autoscaler_scale_down_lag_us_ =
+        read_config_or<size_t>("autoscaler", "scale_down_lag_us", 200);
+    autoscaler_scale_up_sessions_ =
+        read_config_or<size_t>("autoscaler", "scale_up_sessions", 0);
+    autoscaler_scale_up_samples_ =
+        read_config_or<size_t>("autoscaler", "scale_up_samples", 2);
+    autoscaler_scale_down_samples_ =
+        read_config_or<size_t>("autoscaler", "scale_down_samples", 30);
+    autoscaler_cooldown_samples_ =
+        read_config_or<size_t>("autoscaler", "cooldown_samples", 5);
+
+    if (autoscaler_scale_down_busy_ratio_ >= autoscaler_scale_up_busy_ratio_ ||
+        autoscaler_scale_down_lag_us_ >= autoscaler_scale_up_lag_us_) {
+      lslog(0, "autoscaler scale down thresholds must be below the scale up "
+               "thresholds");
+      throw ConfigParseError{};
+    }
+
+    try {
+      parse_thread_setups();
+    } catch (std::logic_error& ex) {
+      lslog(0, "Error while parsing thread setup:", ex.what());
+      throw ConfigParseError{};
+    }
+  }
+
+  void
+  LSConfig::parse_thread_setups()
+  {
+    using std::string;
+
+    auto read_setup = [this](string const& role) {
+      ThreadSetup setup;
+      setup.policy = parse_sched_policy(
+          read_config_or<string>("threads", role + "_policy", "other"));
+      setup.priority =
+          read_config_or<int>("threads", role + "_priority", 0);
+      if (setup.priority < sched_get_priority_min(setup.policy) ||
+          setup.priority > sched_get_priority_max(setup.policy))
+        throw std::out_of_range{"Bad priority for " + role + " threads"};
+      return setup;
+    };
+
+    auto worker_setup = read_setup("worker");
+    for (auto const& cpus: read_config_or<std::vector<string>>(
+             "threads", "worker_cpus", {})) {
+      auto& setup = worker_thread_setups_.emplace_back(worker_setup);
+      setup.cpus = parse_cpu_list(cpus);
+    }
+    if (worker_thread_setups_.empty())
+      worker_thread_setups_.push_back(worker_setup);
+
+    acceptor_thread_setup_ = read_setup("acceptor");
+    acceptor_thread_setup_.cpus =
+        parse_cpu_list(read_config_or<string>("threads", "acceptor_cpus", ""));
+
+    control_thread_setup_.cpus =
+        parse_cpu_list(read_config_or<string>("threads", "control_cpus", ""));
+
+    /*
+     * Threads inherit the affinity of the thread that creates them. Once
+     * any thread is pinned, the threads that are not pinned explicitly
+     * get all the CPUs of the process, which are those of the main thread
+     * at this point.
+     */
+    auto pinned = [](ThreadSetup const& setup) { return !setup.cpus.empty(); };
+    if (std::none_of(worker_thread_setups_.begin(),
+                     worker_thread_setups_.end(), pinned) &&
+        !pinned(acceptor_thread_setup_) && !pinned(control_thread_setup_))
+      return;
+
+    auto process_cpus = current_thread_cpus();
+    for (auto& setup: worker_thread_setups_)
+      if (!pinned(setup))
+        setup.cpus = process_cpus;
+    if (!pinned(acceptor_thread_setup_))
+      acceptor_thread_setup_.cpus = process_cpus;
+    if (!pinned(control_thread_setup_))
+      control_thread_setup_.cpus = process_cpus;
   }
 
   template <class T>
@@ -93,4 +312,13 @@ namespace lserver {
       throw ConfigParseError{};
     }
   }
+
+  template <class T>
+  T
+  LSConfig::read_config_or(std::string L1, std::string L2, T fallback)
+  {
+    if (!config_[L1] || !config_[L1][L2])
+      return fallback;
+    return read_config<T>(L1, L2);
+  }
 } // namespace lserver
\ No newline at end of file
@@ -29,8 +29,14 @@
 
 #pragma once
 
+#include <string>
+#include <vector>
+
 #include <yaml-cpp/yaml.h>
 
+#include "socket_options.hpp"
+#include "thread_setup.hpp"
+
 namespace lserver {
   struct ConfigParseError : std::exception { };
 
@@ -42,32 +48,113 @@ namespace lserver {
     LSConfig(int argc, char* argv[]);
 
     std::string listen_address_;
+    /*
+     * Path of the Unix domain socket to listen on, if listen_address_ is
+     * "unix:PATH". Empty for a TCP listener.
+     */
+    std::string listen_unix_path_;
+    /*
+     * Protocol served on the listening socket: "http", "h2c", "tcp_sink",
+     * "tcp_echo", "rpc", "resp", "udp_sink", "udp_echo" or "udp_vscript"
+     */
+    std::string listen_protocol_;
     std::string control_listen_address_;
     std::size_t num_workers_;
     std::size_t max_num_workers_;
+    std::size_t drain_timeout_ms_;
+    uint64_t spin_budget_us_;
+    int busy_poll_us_;
     std::size_t num_threads_per_worker_;
     std::size_t max_session_pool_size_;
     std::size_t max_transfer_sz_;
+    std::size_t speculative_io_budget_;
+    std::size_t send_high_watermark_;
+    std::size_t send_low_watermark_;
+    std::size_t max_send_bytes_;
+    double tcp_info_sample_ratio_;
+    std::size_t socket_buffer_min_;
+    std::size_t socket_buffer_max_;
     std::size_t max_connections_per_source_;
     std::size_t header_interval_;
+    std::string capture_file_;
+    std::string tls_certificate_file_;
+    std::string tls_private_key_file_;
+    double capture_sampling_rate_;
+    std::size_t capture_max_size_;
+    /*
+     * Datagrams per recvmmsg()/sendmmsg() call of the udp protocols, and
+     * the size their replies are cut into.
+     */
+    std::size_t udp_batch_size_;
+    std::size_t udp_max_datagram_size_;
+    std::size_t autoscaler_interval_ms_;
+    double autoscaler_scale_up_busy_ratio_;
+    double autoscaler_scale_down_busy_ratio_;
+    std::size_t autoscaler_scale_up_lag_us_;
+    std::size_t autoscaler_scale_down_lag_us_;
+    std::size_t autoscaler_scale_up_sessions_;
+    std::size_t autoscaler_scale_up_samples_;
+    std::size_t autoscaler_scale_down_samples_;
+    std::size_t autoscaler_cooldown_samples_;
     uint16_t listen_port_;
     uint16_t control_listen_port_;
     bool reuse_address_;
     bool socket_close_linger_;
     bool socket_close_linger_timeout_;
     bool eager_session_pool_;
+    bool rebalance_on_context_change_;
     bool separate_acceptor_thread_;
+    /*
+     * Run the workers without strands or I/O locking. Their thread count
+     * is then fixed to one.
+     */
+    bool single_threaded_contexts_;
+    bool capture_enabled_;
+    bool tls_enabled_;
+    /*
+     * Hand the keys of each TLS connection to the kernel after its
+     * handshake, if the kernel supports it.
+     */
+    bool tls_ktls_;
+    /*
+     * Use UDP_GRO/UDP_SEGMENT on the udp sockets if the kernel supports
+     * them.
+     */
+    bool udp_gro_;
+    bool udp_gso_;
+    bool autoscaler_enabled_;
+    /*
+     * Setup of the threads of each worker LSContext, by index. If there are
+     * more LSContexts than items, the items are reused from the start.
+     */
+    std::vector<ThreadSetup> worker_thread_setups_;
+    ThreadSetup acceptor_thread_setup_;
+    /*
+     * Setup of the control server, portal, autoscaler and signal threads.
+     * It is applied to the main thread before they are created, and they
+     * inherit it.
+     */
+    ThreadSetup control_thread_setup_;
+    SocketOptions socket_options_;
 
   private:
     /*
      * Read indivisual items from the config YAML file.
      */
     void parse_config();
+    void parse_thread_setups();
     /*
      * Parse an item of type T with level 1 key L1 and level 2 key L2
      */
     template <class T>
     T read_config(std::string L1, std::string L2);
+    /*
+     * Same as read_config, but returns 'fallback' if the item is missing.
+     * This is used for the items that were added after the initial
+     * config format, so that older config files are still valid.
+     */
+    template <class T>
+    T read_config_or(std::string L1, std::string L2, T fallback);
 
     YAML::Node config_;
   };
@@ -30,10 +30,20 @@
 #include "control_server.hpp"
 #include "common.hpp"
 #include "stats.hpp"
+#include "thread_setup.hpp"
 #include "timing.hpp"
 
 namespace lserver {
 
+  static void
+  set_histogram_summary(HistogramSummaryRec* msg,
+                        HistogramSummary const& summary)
+  {
+    msg->set_p50(summary.p50_);
+    msg->set_p99(summary.p99_);
+    msg->set_max(summary.max_);
+  }
+
   ControlServer::ControlServer(ServerManager& manager,
                                std::string const& bind_address)
       : manager_{manager}
@@ -50,7 +60,10 @@ namespace lserver {
     builder_.AddListeningPort(bind_address, grpc::InsecureServerCredentials());
     builder_.RegisterService(this);
     grpc_server_ = std::unique_ptr(builder_.BuildAndStart());
-    thread_ = std::thread{[this]() { this->grpc_server_->Wait(); }};
+    thread_ = std::thread{[this]() {
+      set_thread_name("lscontrol");
+      this->grpc_server_->Wait();
+    }};
     lslog_note(1, "LS control server listening on ", bind_address);
   }
 
@@ -87,6 +100,12 @@ namespace lserver {
           session_stats.stats_bytes_received_delta_);
       stats_rec->set_stats_bytes_sent_delta(
           session_stats.stats_bytes_sent_delta_);
+      stats_rec->set_stats_transactions_cnt_total(
+          session_stats.stats_transactions_cnt_total_);
+      stats_rec->set_stats_bytes_received_total(
+          session_stats.stats_bytes_received_total_);
+      stats_rec->set_stats_bytes_sent_total(
+          session_stats.stats_bytes_sent_total_);
     }
 
     return Status::OK;
@@ -96,21 +115,70 @@ namespace lserver {
   ControlServer::AddContext(ServerContext* context,
                             const AddContextRequest* request,
                             AddContextReply* reply)
-  {
+  try {
     manager_.get_server(request->server_id())
         ->add_context(request->num_threads());
     return Status::OK;
+  } catch (std::logic_error& ex) {
+    return Status{grpc::StatusCode::FAILED_PRECONDITION, ex.what()};
   }
 
   Status
   ControlServer::DeactivateContext(ServerContext* context,
                                    const DeactivateContextRequest* request,
                                    DeactivateContextReply* reply)
-  {
-    int rc = manager_.get_server(request->server_id())
-                 ->deactivate_context(request->context_index());
+  try {
+    auto server = manager_.get_server(request->server_id());
+    int rc = request->drain()
+                 ? server->drain_context(
+                       request->context_index(),
+                       std::chrono::milliseconds{request->drain_timeout_ms()})
+                 : server->deactivate_context(request->context_index());
     reply->set_status_code(rc);
     return Status::OK;
+  } catch (std::logic_error& ex) {
+    return Status{grpc::StatusCode::FAILED_PRECONDITION, ex.what()};
+  }
+
+  Status
+  ControlServer::SetContextThreads(ServerContext* context,
+                                   const SetContextThreadsRequest* request,
+                                   SetContextThreadsReply* reply)
+  try {
+    manager_.get_server(request->server_id())
+        ->set_context_threads(request->context_index(),
+                              request->num_threads());
+    return Status::OK;
+  } catch (std::logic_error& ex) {
+    return Status{grpc::StatusCode::FAILED_PRECONDITION, ex.what()};
+  }
+
+  Status
+  ControlServer::RebalanceContexts(ServerContext* context,
+                                   const RebalanceContextsRequest* request,
+                                   RebalanceContextsReply* reply)
+  try {
+    reply->set_scheduled_cnt(
+        manager_.get_server(request->server_id())->rebalance_contexts());
+    return Status::OK;
+  } catch (std::logic_error& ex) {
+    return Status{grpc::StatusCode::FAILED_PRECONDITION, ex.what()};
+  }
+
+  Status
+  ControlServer::SetContextRunMode(ServerContext* context,
+                                   const SetContextRunModeRequest* request,
+                                   SetContextRunModeReply* reply)
+  try {
+    if (request->busy_poll_us() < 0)
+      throw std::logic_error{"busy_poll_us should not be negative"};
+    manager_.get_server(request->server_id())
+        ->set_context_run_mode(
+            request->context_index(),
+            RunMode{request->spin_budget_us(), request->busy_poll_us()});
+    return Status::OK;
+  } catch (std::logic_error& ex) {
+    return Status{grpc::StatusCode::FAILED_PRECONDITION, ex.what()};
   }
 
   Status
@@ -120,6 +188,14 @@ namespace lserver {
   {
     auto servers_info = manager_.get_servers_info();
 
+    /*
+     * Refresh the event loop lag (i.e. the wakeup latency) of the
+     * LSContexts for the next call.
+     */
+    for (ServerManager::ServerHandle sh = 0;
+         manager_.validate_server_handle(sh); ++sh)
+      manager_.get_server(sh)->probe_contexts();
+
     for (auto const& server_info: servers_info) {
       /*
        * 1 ServerInfo instance for each server
@@ -136,6 +212,24 @@ namespace lserver {
         ci->set_strand_pool_size(context_info.strand_pool_size_);
         ci->set_strand_pool_flight(context_info.strand_pool_flight_);
         ci->set_active(context_info.active_);
+        ci->set_cpu_time_us(context_info.cpu_time_us_);
+        ci->set_loop_lag_us(context_info.loop_lag_us_);
+        ci->set_draining(context_info.draining_);
+        ci->set_drain_remaining_ms(context_info.drain_remaining_ms_);
+        ci->set_drain_forced_cnt(context_info.drain_forced_cnt_);
+        ci->set_spin_budget_us(context_info.spin_budget_us_);
+        ci->set_busy_poll_us(context_info.busy_poll_us_);
+        ci->set_spin_sleeps_cnt(context_info.spin_sleeps_cnt_);
+        ci->set_spin_idle_us(context_info.spin_idle_us_);
+        ci->set_tcp_info_samples_cnt(context_info.tcp_info_samples_cnt_);
+        set_histogram_summary(ci->mutable_tcp_rtt_us(),
+                              context_info.tcp_rtt_us_);
+        set_histogram_summary(ci->mutable_tcp_total_retrans(),
+                              context_info.tcp_total_retrans_);
+        set_histogram_summary(ci->mutable_tcp_snd_cwnd(),
+                              context_info.tcp_snd_cwnd_);
+        set_histogram_summary(ci->mutable_tcp_unacked_bytes(),
+                              context_info.tcp_unacked_bytes_);
       }
     }
     return Status::OK;
@@ -78,6 +78,25 @@ namespace lserver {
     Status DeactivateContext(ServerContext* context,
                              const DeactivateContextRequest* request,
                              DeactivateContextReply* reply);
+    /*
+     * Change the number of threads of an active LSContext in place.
+     */
+    Status SetContextThreads(ServerContext* context,
+                             const SetContextThreadsRequest* request,
+                             SetContextThreadsReply* reply);
+    /*
+     * Ask idle sessions to move from the overloaded LSContexts of a server
+     * to its least loaded ones.
+     */
+    Status RebalanceContexts(ServerContext* context,
+                             const RebalanceContextsRequest* request,
+                             RebalanceContextsReply* reply);
+    /*
+     * Switch an LSContext between blocking and spinning for events.
+     */
+    Status SetContextRunMode(ServerContext* context,
+                             const SetContextRunModeRequest* request,
+                             SetContextRunModeReply* reply);
     /*
      * Extrac operation and structural data at the level of LSContexts
      * from all servers.
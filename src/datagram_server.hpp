@@ -0,0 +1,805 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2021, Amin Saba
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <thread>
+#include <vector>
+
+#include <asio.hpp>
+
+#include "common.hpp"
+#include "config.hpp"
+#include "io_context_pool.hpp"
+#include "server.hpp"
+#include "socket_options.hpp"
+#ifdef ENABLE_STATISTICS
+#include "stats.hpp"
+#endif
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+namespace lserver {
+
+  using udp = asio::ip::udp;
+
+  /*
+   * The reply to a datagram, which a datagram protocol fills in place. It
+   * leaves as datagrams of at most max_datagram_size bytes each.
+   */
+  class DatagramReply {
+  public:
+    explicit DatagramReply(std::vector<uint8_t>& buffer)
+        : buffer_{buffer}
+        , start_{buffer.size()}
+    { }
+
+    /*
+     * Appends 'n' bytes to the reply and returns them
+     */
+    uint8_t*
+    append(std::size_t n)
+    {
+      auto size = buffer_.size();
+      buffer_.resize(size + n);
+      return buffer_.data() + size;
+    }
+
+    std::size_t size() const noexcept { return buffer_.size() - start_; }
+
+  private:
+    std::vector<uint8_t>& buffer_;
+    std::size_t start_;
+  };
+
+  /*
+   * A datagram protocol has no connection and no Session. Each endpoint of
+   * a DatagramServer owns an instance of it, which sees the datagrams of
+   * that endpoint one by one, in its own thread.
+   */
+#ifdef __cpp_concepts
+  template <class P>
+  concept IsDatagramProtocol =
+      requires(P& p, std::span<uint8_t> datagram, DatagramReply& reply) {
+        p.on_datagram(datagram, reply);
+      };
+#define DATAGRAM_CONCEPT requires IsDatagramProtocol<P>
+#else
+#define DATAGRAM_CONCEPT
+#endif
+
+  /*
+   * Per server settings of the datagram endpoints
+   */
+  struct DatagramOptions {
+    uint16_t port_ = 0;
+    /*
+     * Datagrams received or sent by a single recvmmsg() or sendmmsg()
+     */
+    std::size_t batch_size_ = 32;
+    /*
+     * Replies are cut into datagrams of this size
+     */
+    std::size_t max_datagram_size_ = 1472;
+    bool gro_ = true;
+    bool gso_ = true;
+    SocketOptions socket_options_;
+  };
+
+  /*
+   * A UDP socket of a DatagramServer, bound to the port of the server with
+   * SO_REUSEPORT on one LSContext, so that the kernel spreads the flows
+   * over the LSContexts. The socket is read and written without blocking
+   * in batches, and the endpoint waits for readiness through asio. Only
+   * one operation of an endpoint is ever pending, so its handlers never
+   * run concurrently, even on an LSContext with several threads.
+   */
+  template <class P>
+  DATAGRAM_CONCEPT class DatagramEndpoint {
+  public:
+    explicit DatagramEndpoint(DatagramOptions const& options);
+    DatagramEndpoint(DatagramEndpoint const&) = delete;
+    DatagramEndpoint& operator=(DatagramEndpoint const&) = delete;
+
+    /*
+     * Opens and binds the socket on 'lscontext', and starts receiving.
+     * Throws std::system_error if the socket cannot be bound.
+     */
+    void open(LSContext& lscontext);
+    /*
+     * Asks the endpoint to close, from any thread. The endpoint closes in
+     * its own thread, and then releases its LSContext.
+     */
+    void close();
+    bool closed() const noexcept { return !open_.load(); }
+    /*
+     * The port the socket is bound to, e.g. when it was opened on port 0
+     */
+    uint16_t port() const noexcept { return port_; }
+#ifdef ENABLE_STATISTICS
+    SessionStatsDelta& get_stats_delta() { return stats_; }
+#endif
+
+  private:
+    /*
+     * A datagram of a reply, or a run of them that leaves in a single
+     * sendmmsg() entry with UDP_SEGMENT: all but the last are 'segment'
+     * bytes long.
+     */
+    struct Outgoing {
+      std::size_t peer_;
+      std::size_t offset_;
+      std::size_t length_;
+      std::size_t segment_;
+      std::size_t count_;
+    };
+
+    static constexpr std::size_t kBufferSize = 65536;
+    /*
+     * Datagrams handled before the endpoint goes through the reactor
+     * again, so that it does not starve the other handlers of its
+     * LSContext.
+     */
+    static constexpr std::size_t kBatchesPerWakeup = 8;
+    /*
+     * Limits of a UDP_SEGMENT send
+     */
+    static constexpr std::size_t kMaxSegments = 64;
+    static constexpr std::size_t kMaxSegmentedSize = 65507;
+
+    void receive();
+    void on_readable();
+    /*
+     * Hands the 'n' datagrams received to the protocol and queues their
+     * replies.
+     */
+    void handle(std::size_t n);
+    void queue_reply(std::size_t peer, std::size_t offset, std::size_t length);
+    /*
+     * Sends the queued replies. Returns false if the socket is full, in
+     * which case the endpoint waits until it can send the rest, and then
+     * resumes receiving.
+     */
+    bool flush();
+    void finalize();
+
+    DatagramOptions const& options_;
+    P protocol_;
+    LSContext* lscontext_ = nullptr;
+    std::optional<udp::socket> socket_;
+    /*
+     * Guards the descriptor between close() and finalize()
+     */
+    std::mutex mtx_;
+    int fd_ = -1;
+    uint16_t port_ = 0;
+    std::atomic<bool> open_ = false;
+    std::atomic<bool> closing_ = false;
+    bool gro_ = false;
+    bool gso_ = false;
+
+    std::vector<uint8_t> rx_;
+    std::vector<iovec> rx_iov_;
+    std::vector<sockaddr_storage> rx_peers_;
+    std::vector<mmsghdr> rx_msgs_;
+    /*
+     * Room for the UDP_GRO control message of each datagram
+     */
+    static constexpr std::size_t kControlSize = CMSG_SPACE(sizeof(int));
+    std::vector<uint8_t> rx_control_;
+
+    std::vector<uint8_t> tx_;
+    std::vector<Outgoing> outgoing_;
+    std::vector<iovec> tx_iov_;
+    std::vector<mmsghdr> tx_msgs_;
+    std::vector<uint8_t> tx_control_;
+    /*
+     * Index of the first entry of tx_msgs_ not sent yet
+     */
+    std::size_t tx_next_ = 0;
+#ifdef ENABLE_STATISTICS
+    SessionStatsDelta stats_;
+#endif
+  };
+
+  /*
+   * A server of a connectionless protocol over UDP. It runs one
+   * DatagramEndpoint per active LSContext of its pool, and follows the
+   * LSContexts as they are added, deactivated and drained.
+   */
+  template <class P>
+  DATAGRAM_CONCEPT class DatagramServer final : public AbstractServer {
+  public:
+    DatagramServer(LSConfig config);
+    ~DatagramServer() override = default;
+    void stop() override;
+    void wait() override;
+    /*
+     * Opens the endpoints of the LSContexts that do not have one.
+     */
+    void dispatch();
+    void add_context(std::size_t thread_cnt) override;
+    int deactivate_context(std::size_t context_index) override;
+    int drain_context(std::size_t context_index,
+                      std::chrono::milliseconds timeout) override;
+    void set_context_threads(std::size_t context_index,
+                             std::size_t thread_cnt) override;
+    void set_context_run_mode(std::size_t context_index,
+                              RunMode mode) override;
+    ServerInfo get_server_info() const override;
+    void probe_contexts() override;
+    /*
+     * Datagrams are spread by the kernel, there is nothing to move.
+     */
+    std::size_t rebalance_contexts() override { return 0; }
+#ifdef ENABLE_STATISTICS
+    LSStats get_stats() const override;
+#endif
+
+  private:
+    LSConfig config_;
+    DatagramOptions options_;
+    LSContextPool workers_pool_;
+    /*
+     * Indexed like the LSContexts of workers_pool_. An endpoint is kept
+     * when its LSContext is deactivated, and reopened if it is reused.
+     */
+    std::vector<std::unique_ptr<DatagramEndpoint<P>>> endpoints_;
+    std::mutex endpoints_mtx_;
+#ifdef ENABLE_STATISTICS
+    ServerStats stats_;
+    mutable PoolStats pool_stats_;
+    mutable SessionStats session_stats_;
+#endif
+  };
+
+  template <class P>
+  DATAGRAM_CONCEPT
+  DatagramEndpoint<P>::DatagramEndpoint(DatagramOptions const& options)
+      : options_{options}
+  {
+    auto batch = options_.batch_size_;
+    rx_.resize(batch * kBufferSize);
+    rx_iov_.resize(batch);
+    rx_peers_.resize(batch);
+    rx_msgs_.resize(batch);
+    rx_control_.resize(batch * kControlSize);
+
+    for (std::size_t i = 0; i < batch; ++i) {
+      rx_iov_[i] = {rx_.data() + i * kBufferSize, kBufferSize};
+      auto& hdr = rx_msgs_[i].msg_hdr;
+      hdr.msg_iov = &rx_iov_[i];
+      hdr.msg_iovlen = 1;
+      hdr.msg_name = &rx_peers_[i];
+    }
+  }
+
+  template <class P>
+  DATAGRAM_CONCEPT void
+  DatagramEndpoint<P>::open(LSContext& lscontext)
+  {
+    lscontext.ref();
+    lscontext_ = &lscontext;
+    closing_.store(false);
+
+    try {
+      socket_.emplace(lscontext.get_io_context(), udp::v4());
+      socket_->set_option(asio::socket_base::reuse_address(true));
+      int fd = socket_->native_handle();
+      int one = 1;
+      if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0)
+        throw std::system_error{errno, std::system_category(),
+                                "SO_REUSEPORT"};
+      socket_->bind(udp::endpoint{udp::v4(), options_.port_});
+      socket_->non_blocking(true);
+      port_ = socket_->local_endpoint().port();
+    } catch (...) {
+      socket_ = std::nullopt;
+      lscontext_ = nullptr;
+      lscontext.deref();
+      throw;
+    }
+
+    int fd = socket_->native_handle();
+    auto& so = options_.socket_options_;
+    if (so.rcvbuf)
+      set_socket_option(fd, SOL_SOCKET, SO_RCVBUF, so.rcvbuf, "SO_RCVBUF");
+    if (so.sndbuf)
+      set_socket_option(fd, SOL_SOCKET, SO_SNDBUF, so.sndbuf, "SO_SNDBUF");
+    lscontext.tune_socket(fd);
+
+    /*
+     * Both need Linux 4.18+ (GSO) and 5.0+ (GRO). UDP_SEGMENT is set per
+     * send, so setting it to zero here only checks for support.
+     */
+    int on = 1;
+    int off = 0;
+    gro_ = options_.gro_ &&
+           setsockopt(fd, IPPROTO_UDP, UDP_GRO, &on, sizeof(on)) == 0;
+    gso_ = options_.gso_ &&
+           setsockopt(fd, IPPROTO_UDP, UDP_SEGMENT, &off, sizeof(off)) == 0;
+
+    {
+      std::scoped_lock _{mtx_};
+      fd_ = fd;
+    }
+    open_.store(true);
+
+    /*
+     * The socket operations of a single threaded LSContext may only be
+     * initiated from its own thread.
+     */
+    asio::post(lscontext.get_io_context(), [this]() { receive(); });
+  }
+
+  template <class P>
+  DATAGRAM_CONCEPT void
+  DatagramEndpoint<P>::close()
+  {
+    std::scoped_lock _{mtx_};
+    if (fd_ < 0)
+      return;
+
+    /*
+     * Even on an unconnected UDP socket, this wakes up the pending wait
+     * of the endpoint, which sees closing_ and closes the socket.
+     */
+    closing_.store(true);
+    ::shutdown(fd_, SHUT_RD);
+  }
+
+  template <class P>
+  DATAGRAM_CONCEPT void
+  DatagramEndpoint<P>::receive()
+  {
+    socket_->async_wait(udp::socket::wait_read,
+                        [this](std::error_code error) {
+                          if (error || closing_.load()) LS_UNLIKELY
+                            finalize();
+                          else
+                            on_readable();
+                        });
+  }
+
+  template <class P>
+  DATAGRAM_CONCEPT void
+  DatagramEndpoint<P>::on_readable()
+  {
+    int fd = socket_->native_handle();
+    auto batch = options_.batch_size_;
+
+    for (std::size_t round = 0; round < kBatchesPerWakeup; ++round) {
+      for (std::size_t i = 0; i < batch; ++i) {
+        auto& hdr = rx_msgs_[i].msg_hdr;
+        hdr.msg_namelen = sizeof(sockaddr_storage);
+        hdr.msg_control = gro_ ? rx_control_.data() + i * kControlSize
+                               : nullptr;
+        hdr.msg_controllen = gro_ ? kControlSize : 0;
+      }
+
+      int n = ::recvmmsg(fd, rx_msgs_.data(), batch, MSG_DONTWAIT, nullptr);
+      if (n <= 0) {
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+            errno != EINTR) LS_UNLIKELY
+          lslog(3, "recvmmsg failed: ", std::strerror(errno));
+        break;
+      }
+
+      handle(n);
+      if (!flush())
+        return;
+      if (static_cast<std::size_t>(n) < batch)
+        break;
+    }
+
+    receive();
+  }
+
+  template <class P>
+  DATAGRAM_CONCEPT void
+  DatagramEndpoint<P>::handle(std::size_t n)
+  {
+    for (std::size_t i = 0; i < n; ++i) {
+      auto& hdr = rx_msgs_[i].msg_hdr;
+      std::size_t length = rx_msgs_[i].msg_len;
+      auto data = static_cast<uint8_t*>(rx_iov_[i].iov_base);
+
+      if (hdr.msg_flags & MSG_TRUNC) LS_UNLIKELY
+        continue;
+
+      /*
+       * A GRO buffer holds several datagrams of the same flow, all of
+       * 'segment' bytes but the last.
+       */
+      std::size_t segment = length;
+      if (gro_) {
+        for (auto cm = CMSG_FIRSTHDR(&hdr); cm; cm = CMSG_NXTHDR(&hdr, cm)) {
+          if (cm->cmsg_level == IPPROTO_UDP && cm->cmsg_type == UDP_GRO) {
+            int size;
+            std::memcpy(&size, CMSG_DATA(cm), sizeof(size));
+            segment = size;
+          }
+        }
+      }
+
+      std::size_t offset = 0;
+      do {
+        auto size = std::min(segment, length - offset);
+        auto start = tx_.size();
+        DatagramReply reply{tx_};
+
+        protocol_.on_datagram(std::span<uint8_t>{data + offset, size}, reply);
+        if (reply.size() > 0)
+          queue_reply(i, start, reply.size());
+#ifdef ENABLE_STATISTICS
+        stats_.stats_transactions_cnt_delta_.fetch_add(1);
+        stats_.stats_bytes_received_delta_.fetch_add(size);
+#endif
+        offset += size;
+      } while (offset < length);
+    }
+  }
+
+  template <class P>
+  DATAGRAM_CONCEPT void
+  DatagramEndpoint<P>::queue_reply(std::size_t peer, std::size_t offset,
+                                   std::size_t length)
+  {
+    auto max = options_.max_datagram_size_;
+
+    while (length > 0) {
+      auto size = std::min(length, max);
+
+      /*
+       * A datagram joins the run before it if they go to the same peer,
+       * the run has only full segments so far and room for one more, and
+       * it is not longer than them.
+       */
+      if (gso_ && !outgoing_.empty()) {
+        auto& last = outgoing_.back();
+        if (last.peer_ == peer && last.length_ == last.segment_ * last.count_ &&
+            size <= last.segment_ && last.count_ < kMaxSegments &&
+            last.length_ + size <= kMaxSegmentedSize) {
+          last.length_ += size;
+          ++last.count_;
+          offset += size;
+          length -= size;
+          continue;
+        }
+      }
+
+      outgoing_.push_back({peer, offset, size, size, 1});
+      offset += size;
+      length -= size;
+    }
+  }
+
+  template <class P>
+  DATAGRAM_CONCEPT bool
+  DatagramEndpoint<P>::flush()
+  {
+    /*
+     * The entries are built once all the replies are in place, since tx_
+     * may move while it grows.
+     */
+    if (tx_msgs_.size() != outgoing_.size()) {
+      auto n = outgoing_.size();
+      tx_iov_.resize(n);
+      tx_msgs_.resize(n);
+      tx_control_.assign(n * kControlSize, 0);
+
+      for (std::size_t i = 0; i < n; ++i) {
+        auto& out = outgoing_[i];
+        tx_iov_[i] = {tx_.data() + out.offset_, out.length_};
+        auto& hdr = tx_msgs_[i].msg_hdr;
+        hdr = {};
+        hdr.msg_name = &rx_peers_[out.peer_];
+        hdr.msg_namelen = rx_msgs_[out.peer_].msg_hdr.msg_namelen;
+        hdr.msg_iov = &tx_iov_[i];
+        hdr.msg_iovlen = 1;
+
+        if (out.count_ > 1) {
+          hdr.msg_control = tx_control_.data() + i * kControlSize;
+          hdr.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+          auto cm = CMSG_FIRSTHDR(&hdr);
+          cm->cmsg_level = IPPROTO_UDP;
+          cm->cmsg_type = UDP_SEGMENT;
+          cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+          auto segment = static_cast<uint16_t>(out.segment_);
+          std::memcpy(CMSG_DATA(cm), &segment, sizeof(segment));
+        }
+      }
+    }
+
+    int fd = socket_->native_handle();
+    while (tx_next_ < tx_msgs_.size()) {
+      auto left = std::min<std::size_t>(tx_msgs_.size() - tx_next_, 1024);
+      int n = ::sendmmsg(fd, tx_msgs_.data() + tx_next_, left, MSG_DONTWAIT);
+
+      if (n > 0) LS_LIKELY {
+#ifdef ENABLE_STATISTICS
+        for (auto i = tx_next_; i < tx_next_ + n; ++i)
+          stats_.stats_bytes_sent_delta_.fetch_add(outgoing_[i].length_);
+#endif
+        tx_next_ += n;
+        continue;
+      }
+
+      if (errno == EINTR)
+        continue;
+
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        socket_->async_wait(udp::socket::wait_write,
+                            [this](std::error_code error) {
+                              if (error || closing_.load()) LS_UNLIKELY
+                                finalize();
+                              else if (flush())
+                                receive();
+                            });
+        return false;
+      }
+
+      /*
+       * The entry is dropped, like a datagram lost on the way. A device
+       * that cannot segment fails GSO sends with EIO, and later replies
+       * then leave one datagram per entry.
+       */
+      if (errno == EIO && outgoing_[tx_next_].count_ > 1 && gso_) {
+        lslog(1, "UDP GSO is not supported by the device, disabling it");
+        gso_ = false;
+      } else {
+        lslog(3, "sendmmsg failed: ", std::strerror(errno));
+      }
+      ++tx_next_;
+    }
+
+    tx_.clear();
+    outgoing_.clear();
+    tx_msgs_.clear();
+    tx_next_ = 0;
+    return true;
+  }
+
+  template <class P>
+  DATAGRAM_CONCEPT void
+  DatagramEndpoint<P>::finalize()
+  {
+    {
+      std::scoped_lock _{mtx_};
+      fd_ = -1;
+    }
+
+    asio::error_code ec;
+    socket_->close(ec);
+    socket_ = std::nullopt;
+    tx_.clear();
+    outgoing_.clear();
+    tx_msgs_.clear();
+    tx_next_ = 0;
+
+    /*
+     * The LSContext may be reused as soon as it is released, and the
+     * endpoint reopened on it.
+     */
+    auto lscontext = lscontext_;
+    lscontext_ = nullptr;
+    open_.store(false);
+    lscontext->deref();
+  }
+
+  template <class P>
+  DATAGRAM_CONCEPT
+  DatagramServer<P>::DatagramServer(LSConfig config)
+      : config_{config}
+      , options_{.port_ = config_.listen_port_,
+                 .batch_size_ = config_.udp_batch_size_,
+                 .max_datagram_size_ = config_.udp_max_datagram_size_,
+                 .gro_ = config_.udp_gro_,
+                 .gso_ = config_.udp_gso_,
+                 .socket_options_ = config_.socket_options_}
+      , workers_pool_{config_.num_workers_, config_.max_num_workers_,
+                      config_.num_threads_per_worker_, "lsworker",
+                      config_.worker_thread_setups_,
+                      RunMode{config_.spin_budget_us_, config_.busy_poll_us_},
+                      is_single_threaded_v<P>}
+  {
+    endpoints_.resize(config_.max_num_workers_);
+  }
+
+  template <class P>
+  DATAGRAM_CONCEPT void
+  DatagramServer<P>::dispatch()
+  {
+    std::scoped_lock _{endpoints_mtx_};
+
+    workers_pool_.for_each_active_context([this](LSContext& lscontext,
+                                                 std::size_t index) {
+      auto& endpoint = endpoints_[index];
+      if (!endpoint)
+        endpoint = std::make_unique<DatagramEndpoint<P>>(options_);
+      if (endpoint->closed())
+        endpoint->open(lscontext);
+    });
+  }
+
+  template <class P>
+  DATAGRAM_CONCEPT void
+  DatagramServer<P>::stop()
+  {
+    {
+      std::scoped_lock _{endpoints_mtx_};
+      for (auto& endpoint: endpoints_) {
+        if (endpoint)
+          endpoint->close();
+      }
+    }
+
+    /*
+     * The endpoints close in the threads of their LSContexts, which must
+     * still be running. A stuck handler is not waited for forever.
+     */
+    auto deadline = std::chrono::steady_clock::now() + 1s;
+    for (auto& endpoint: endpoints_) {
+      while (endpoint && !endpoint->closed() &&
+             std::chrono::steady_clock::now() < deadline)
+        std::this_thread::sleep_for(1ms);
+    }
+
+    workers_pool_.stop();
+    lslog_note(0, "Workers pool stopped");
+  }
+
+  template <class P>
+  DATAGRAM_CONCEPT void
+  DatagramServer<P>::wait()
+  {
+    workers_pool_.wait();
+  }
+
+  template <class P>
+  DATAGRAM_CONCEPT void
+  DatagramServer<P>::add_context(std::size_t thread_cnt)
+  {
+    workers_pool_.add_context(thread_cnt);
+    dispatch();
+  }
+
+  template <class P>
+  DATAGRAM_CONCEPT int
+  DatagramServer<P>::deactivate_context(std::size_t context_index)
+  {
+    int rc = workers_pool_.deactivate_context(context_index);
+    if (rc == 0) {
+      std::scoped_lock _{endpoints_mtx_};
+      if (auto& endpoint = endpoints_[context_index])
+        endpoint->close();
+    }
+    return (rc);
+  }
+
+  template <class P>
+  DATAGRAM_CONCEPT int
+  DatagramServer<P>::drain_context(std::size_t context_index,
+                                   std::chrono::milliseconds timeout)
+  {
+    if (timeout == 0ms)
+      timeout = std::chrono::milliseconds{config_.drain_timeout_ms_};
+    workers_pool_.drain_context(context_index, timeout);
+
+    /*
+     * An endpoint has no transaction to finish, so it closes right away,
+     * and the kernel moves its flows to the other endpoints.
+     */
+    std::scoped_lock _{endpoints_mtx_};
+    if (auto& endpoint = endpoints_[context_index])
+      endpoint->close();
+    return (0);
+  }
+
+  template <class P>
+  DATAGRAM_CONCEPT void
+  DatagramServer<P>::set_context_threads(std::size_t context_index,
+                                         std::size_t thread_cnt)
+  {
+    workers_pool_.set_context_threads(context_index, thread_cnt);
+  }
+
+  template <class P>
+  DATAGRAM_CONCEPT void
+  DatagramServer<P>::set_context_run_mode(std::size_t context_index,
+                                          RunMode mode)
+  {
+    workers_pool_.set_context_run_mode(context_index, mode);
+  }
+
+  template <class P>
+  DATAGRAM_CONCEPT ServerInfo
+  DatagramServer<P>::get_server_info() const
+  {
+    ServerInfo si;
+    si.contexts_info_ = workers_pool_.get_contexts_info();
+    return si;
+  }
+
+  template <class P>
+  DATAGRAM_CONCEPT void
+  DatagramServer<P>::probe_contexts()
+  {
+    workers_pool_.probe_lag();
+  }
+
+#ifdef ENABLE_STATISTICS
+  template <class P>
+  DATAGRAM_CONCEPT LSStats
+  DatagramServer<P>::get_stats() const
+  {
+    session_stats_.clear();
+    pool_stats_.clear();
+
+    for (auto const& endpoint: endpoints_) {
+      if (!endpoint)
+        continue;
+      pool_stats_.num_items_total_.fetch_add(1);
+      if (!endpoint->closed())
+        pool_stats_.num_items_in_flight_.fetch_add(1);
+
+      auto& delta = endpoint->get_stats_delta();
+      auto transactions = delta.stats_transactions_cnt_delta_.exchange(0);
+      auto received = delta.stats_bytes_received_delta_.exchange(0);
+      auto sent = delta.stats_bytes_sent_delta_.exchange(0);
+
+      session_stats_.stats_transactions_cnt_delta_.fetch_add(transactions);
+      session_stats_.stats_bytes_received_delta_.fetch_add(received);
+      session_stats_.stats_bytes_sent_delta_.fetch_add(sent);
+      session_stats_.stats_transactions_cnt_total_.fetch_add(transactions);
+      session_stats_.stats_bytes_received_total_.fetch_add(received);
+      session_stats_.stats_bytes_sent_total_.fetch_add(sent);
+    }
+
+    return LSStats(stats_, pool_stats_, session_stats_);
+  }
+#endif
+} // namespace lserver
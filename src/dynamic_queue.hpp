@@ -32,7 +32,7 @@
 #ifdef USE_PMR_POOL_RESOURCE
 #include <memory_resource>
 #endif
-#include <queue>
+#include <deque>
 
 #include "dynamic_string.hpp"
 #include "pool.hpp"
@@ -42,7 +42,7 @@
 namespace lserver {
 
   /*
-   * DynamicQueue is a thin wrapper around std::queue.
+   * DynamicQueue is a thin wrapper around std::deque used as a queue.
    * It also provides a couple of methods that encapsulate the logic of
    * constructing and destructing QBs that are actually the items
    * that are queued. It uses a single pool resource to allocate the
@@ -70,12 +70,18 @@ namespace lserver {
     void pop();
     void clear();
     QB* front();
+    /*
+     * Calls 'f' on the queued items from the front, until it returns false
+     * or the items run out.
+     */
+    template <class F>
+    void for_each(F&& f);
     std::size_t size() const noexcept;
     bool empty() const noexcept;
 
   private:
     static inline QueueBufferPool<QB> queue_buffer_pool_{0, false};
-    std::queue<QB*> q_{};
+    std::deque<QB*> q_{};
     mutable std::mutex mtx_;
   };
 
@@ -95,7 +101,7 @@ namespace lserver {
   DynamicQueue<QB>::push(QB* qb)
   {
     std::scoped_lock _{mtx_};
-    q_.push(qb);
+    q_.push_back(qb);
   }
 
   template <class QB>
@@ -106,6 +112,17 @@ namespace lserver {
     return q_.front();
   }
 
+  template <class QB>
+  template <class F>
+  inline void
+  DynamicQueue<QB>::for_each(F&& f)
+  {
+    std::scoped_lock _{mtx_};
+    for (auto qb: q_)
+      if (!f(qb))
+        break;
+  }
+
   template <class QB>
   inline void
   DynamicQueue<QB>::free(QB* qb) noexcept(std::is_nothrow_destructible_v<QB>)
@@ -118,7 +135,7 @@ namespace lserver {
   DynamicQueue<QB>::pop()
   {
     std::scoped_lock _{mtx_};
-    q_.pop();
+    q_.pop_front();
   }
 
   template <class QB>
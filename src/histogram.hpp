@@ -0,0 +1,182 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2021, Amin Saba
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+
+namespace lserver {
+
+  /*
+   * A fixed-size log-linear histogram in the spirit of HdrHistogram. Values
+   * below 128 are recorded exactly, and larger values are recorded with
+   * 64 sub-buckets per power of two, which bounds the relative error of
+   * reported values to less than 2%, over the whole uint64_t range.
+   * Recording a value is O(1) and does not allocate.
+   *
+   * This class is not thread-safe. Use one instance per thread (or
+   * LSContext) and merge() them.
+   */
+  class LatencyHistogram {
+  public:
+    LatencyHistogram() = default;
+
+    void record(uint64_t value, uint64_t count = 1) noexcept;
+    void merge(LatencyHistogram const& other) noexcept;
+    void clear() noexcept;
+    /*
+     * Returns the value at percentile 'p' (0 < p <= 100). Returns 0 if
+     * the histogram is empty.
+     */
+    uint64_t value_at_percentile(double p) const noexcept;
+    uint64_t count() const noexcept;
+    uint64_t min() const noexcept;
+    uint64_t max() const noexcept;
+    double mean() const noexcept;
+
+  private:
+    static constexpr std::size_t kLinearBits = 7;
+    static constexpr std::size_t kLinearCnt = 1ul << kLinearBits;
+    static constexpr std::size_t kSubBucketCnt = kLinearCnt / 2;
+    static constexpr std::size_t kBucketsCnt =
+        kLinearCnt + (64 - kLinearBits) * kSubBucketCnt;
+
+    static std::size_t index_of(uint64_t value) noexcept;
+    /*
+     * Returns the highest value that is recorded in bucket 'index'
+     */
+    static uint64_t value_of(std::size_t index) noexcept;
+
+    std::array<uint64_t, kBucketsCnt> counts_{};
+    uint64_t total_count_ = 0;
+    uint64_t min_ = std::numeric_limits<uint64_t>::max();
+    uint64_t max_ = 0;
+    /*
+     * Kept as double to avoid overflow on long runs.
+     */
+    double sum_ = 0;
+  };
+
+  inline std::size_t
+  LatencyHistogram::index_of(uint64_t value) noexcept
+  {
+    if (value < kLinearCnt)
+      return value;
+
+    std::size_t shift = std::bit_width(value) - kLinearBits;
+    std::size_t sub = (value >> shift) - kSubBucketCnt;
+    return kLinearCnt + (shift - 1) * kSubBucketCnt + sub;
+  }
+
+  inline uint64_t
+  LatencyHistogram::value_of(std::size_t index) noexcept
+  {
+    if (index < kLinearCnt)
+      return index;
+
+    std::size_t shift = (index - kLinearCnt) / kSubBucketCnt + 1;
+    uint64_t sub = (index - kLinearCnt) % kSubBucketCnt + kSubBucketCnt;
+    return (sub << shift) + ((uint64_t{1} << shift) - 1);
+  }
+
+  inline void
+  LatencyHistogram::record(uint64_t value, uint64_t count) noexcept
+  {
+    counts_[index_of(value)] += count;
+    total_count_ += count;
+    min_ = std::min(min_, value);
+    max_ = std::max(max_, value);
+    sum_ += static_cast<double>(value) * count;
+  }
+
+  inline void
+  LatencyHistogram::merge(LatencyHistogram const& other) noexcept
+  {
+    for (std::size_t i = 0; i < kBucketsCnt; ++i)
+      counts_[i] += other.counts_[i];
+    total_count_ += other.total_count_;
+    min_ = std::min(min_, other.min_);
+    max_ = std::max(max_, other.max_);
+    sum_ += other.sum_;
+  }
+
+  inline void
+  LatencyHistogram::clear() noexcept
+  {
+    *this = LatencyHistogram{};
+  }
+
+  inline uint64_t
+  LatencyHistogram::value_at_percentile(double p) const noexcept
+  {
+    if (total_count_ == 0)
+      return 0;
+
+    auto rank = static_cast<uint64_t>(std::ceil(p / 100.0 * total_count_));
+    rank = std::clamp<uint64_t>(rank, 1, total_count_);
+
+    uint64_t seen = 0;
+    for (std::size_t i = 0; i < kBucketsCnt; ++i) {
+      seen += counts_[i];
+      if (seen >= rank)
+        return std::min(value_of(i), max_);
+    }
+    return max_;
+  }
+
+  inline uint64_t
+  LatencyHistogram::count() const noexcept
+  {
+    return total_count_;
+  }
+
+  inline uint64_t
+  LatencyHistogram::min() const noexcept
+  {
+    return total_count_ ? min_ : 0;
+  }
+
+  inline uint64_t
+  LatencyHistogram::max() const noexcept
+  {
+    return max_;
+  }
+
+  inline double
+  LatencyHistogram::mean() const noexcept
+  {
+    return total_count_ ? sum_ / total_count_ : 0;
+  }
+
+} // namespace lserver
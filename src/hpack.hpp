@@ -0,0 +1,581 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2021, Amin Saba
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "common.hpp"
+
+namespace lserver {
+
+  /*
+   * HPACK, the header compression of HTTP/2 (RFC 7541).
+   */
+  namespace hpack_impl {
+
+    struct StaticEntry {
+      std::string_view name;
+      std::string_view value;
+    };
+
+    /*
+     * Appendix A of RFC 7541. Index 1 is at position 0.
+     */
+    inline constexpr std::array<StaticEntry, 61> kStaticTable{{
+        {":authority", ""},
+        {":method", "GET"},
+        {":method", "POST"},
+        {":path", "/"},
+        {":path", "/index.html"},
+        {":scheme", "http"},
+        {":scheme", "https"},
+        {":status", "200"},
+        {":status", "204"},
+        {":status", "206"},
+        {":status", "304"},
+        {":status", "400"},
+        {":status", "404"},
+        {":status", "500"},
+        {"accept-charset", ""},
+        {"accept-encoding", "gzip, deflate"},
+        {"accept-language", ""},
+        {"accept-ranges", ""},
+        {"accept", ""},
+        {"access-control-allow-origin", ""},
+        {"age", ""},
+        {"allow", ""},
+        {"authorization", ""},
+        {"cache-control", ""},
+        {"content-disposition", ""},
+        {"content-encoding", ""},
+        {"content-language", ""},
+        {"content-length", ""},
+        {"content-location", ""},
+        {"content-range", ""},
+        {"content-type", ""},
+        {"cookie", ""},
+        {"date", ""},
+        {"etag", ""},
+        {"expect", ""},
+        {"expires", ""},
+        {"from", ""},
+        {"host", ""},
+        {"if-match", ""},
+        {"if-modified-since", ""},
+        {"if-none-match", ""},
+        {"if-range", ""},
+        {"if-unmodified-since", ""},
+        {"last-modified", ""},
+        {"link", ""},
+        {"location", ""},
+        {"max-forwards", ""},
+        {"proxy-authenticate", ""},
+        {"proxy-authorization", ""},
+        {"range", ""},
+        {"referer", ""},
+        {"refresh", ""},
+        {"retry-after", ""},
+        {"server", ""},
+        {"set-cookie", ""},
+        {"strict-transport-security", ""},
+        {"transfer-encoding", ""},
+        {"user-agent", ""},
+        {"vary", ""},
+        {"via", ""},
+        {"www-authenticate", ""},
+    }};
+
+    /*
+     * Code lengths of the Huffman code of Appendix B, for the symbols 0-255
+     * and EOS (256). The code is canonical, so the codes themselves follow
+     * from their lengths.
+     */
+    inline constexpr std::array<uint8_t, 257> kHuffmanLengths{
+        13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+        28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+        6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+        5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+        13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+        7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+        15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+        6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+        20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+        24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+        22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+        21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+        26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+        19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+        20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+        26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+        30
+    };
+
+    inline constexpr int kHuffmanMaxBits = 30;
+    inline constexpr int kHuffmanMinBits = 5;
+    inline constexpr uint16_t kHuffmanEos = 256;
+
+    /*
+     * Decoding tables of the canonical code: the codes of each length are
+     * consecutive, starting at 'first_code[len]', and belong to the
+     * symbols 'symbols[first_index[len]]' onwards.
+     */
+    struct HuffmanTables {
+      std::array<uint32_t, kHuffmanMaxBits + 1> first_code{};
+      std::array<uint16_t, kHuffmanMaxBits + 1> first_index{};
+      std::array<uint16_t, kHuffmanMaxBits + 1> count{};
+      std::array<uint16_t, 257> symbols{};
+    };
+
+    constexpr HuffmanTables
+    make_huffman_tables()
+    {
+      HuffmanTables t;
+      for (auto len: kHuffmanLengths)
+        ++t.count[len];
+
+      uint32_t code = 0;
+      uint16_t index = 0;
+      for (int len = 1; len <= kHuffmanMaxBits; ++len) {
+        code <<= 1;
+        t.first_code[len] = code;
+        t.first_index[len] = index;
+        code += t.count[len];
+        index += t.count[len];
+      }
+
+      std::array<uint16_t, kHuffmanMaxBits + 1> next = t.first_index;
+      for (uint16_t sym = 0; sym < 257; ++sym)
+        t.symbols[next[kHuffmanLengths[sym]]++] = sym;
+      return t;
+    }
+
+    inline constexpr HuffmanTables kHuffman = make_huffman_tables();
+
+    /*
+     * Appends the decoding of the Huffman encoded string [in, in + len) to
+     * 'out'. Returns false if the encoding is invalid.
+     */
+    inline bool
+    huffman_decode(uint8_t const* in, std::size_t len, std::string& out)
+    {
+      uint64_t acc = 0;
+      int bits = 0;
+
+      for (std::size_t i = 0; i < len; ++i) {
+        acc = (acc << 8) | in[i];
+        bits += 8;
+
+        while (bits >= kHuffmanMinBits) {
+          int max_len = std::min(bits, kHuffmanMaxBits);
+          int code_len = kHuffmanMinBits;
+          for (; code_len <= max_len; ++code_len) {
+            uint32_t code = (acc >> (bits - code_len)) & ((1u << code_len) - 1);
+            uint32_t offset = code - kHuffman.first_code[code_len];
+            if (code >= kHuffman.first_code[code_len] &&
+                offset < kHuffman.count[code_len]) {
+              auto sym =
+                  kHuffman.symbols[kHuffman.first_index[code_len] + offset];
+              if (sym == kHuffmanEos) LS_UNLIKELY
+                return false;
+              out.push_back(static_cast<char>(sym));
+              bits -= code_len;
+              acc &= (uint64_t{1} << bits) - 1;
+              break;
+            }
+          }
+          /*
+           * The code is longer than the bits at hand
+           */
+          if (code_len > max_len)
+            break;
+        }
+      }
+
+      /*
+       * What is left must be a prefix of EOS, i.e. all ones, shorter than
+       * a byte.
+       */
+      return bits < 8 && acc == (uint64_t{1} << bits) - 1;
+    }
+
+  } // namespace hpack_impl
+
+  /*
+   * Decodes the header blocks of a connection. It keeps the dynamic table,
+   * so the blocks must be decoded in the order they arrive.
+   */
+  class HpackDecoder {
+  public:
+    /*
+     * 'max_table_size' is the SETTINGS_HEADER_TABLE_SIZE of the decoder
+     */
+    explicit HpackDecoder(std::size_t max_table_size = 4096);
+
+    /*
+     * Calls 'on_header(name, value)' for each header field of the block.
+     * The arguments are valid only during the call. Returns false on a
+     * compression error, after which the connection must be closed.
+     */
+    template <class F>
+    bool decode(uint8_t const* data, std::size_t len, F&& on_header);
+    std::size_t table_size() const noexcept;
+
+  private:
+    /*
+     * Decodes an integer with a 'prefix_bits' prefix at 'p', and advances
+     * 'p' past it.
+     */
+    static bool decode_integer(uint8_t const*& p, uint8_t const* end,
+                               int prefix_bits, uint64_t& value);
+    /*
+     * Decodes a string literal at 'p' into 'out'. If it is Huffman
+     * encoded, 'buffer' holds the decoding.
+     */
+    static bool decode_string(uint8_t const*& p, uint8_t const* end,
+                              std::string& buffer, std::string_view& out);
+    bool lookup(uint64_t index, std::string_view& name,
+                std::string_view& value) const;
+    void insert(std::string_view name, std::string_view value);
+    void evict(std::size_t max_size);
+
+    static constexpr std::size_t kEntryOverhead = 32;
+
+    /*
+     * The newest entry is at the front
+     */
+    std::deque<std::pair<std::string, std::string>> table_;
+    std::size_t table_size_ = 0;
+    /*
+     * The size set by the encoder, at most 'max_table_size_'
+     */
+    std::size_t table_capacity_;
+    std::size_t max_table_size_;
+    std::string name_buffer_;
+    std::string value_buffer_;
+  };
+
+  /*
+   * Encodes header fields without the dynamic table, so it has no state.
+   * Fields of the static table are encoded as a single index, and others
+   * as literals that name a static table entry where possible.
+   */
+  class HpackEncoder {
+  public:
+    /*
+     * Upper bound of the encoded size of a field
+     */
+    static constexpr std::size_t max_size(std::string_view name,
+                                          std::string_view value) noexcept;
+    /*
+     * Write the encoding to 'out', and return the end of it
+     */
+    static uint8_t* encode_status(int code, uint8_t* out) noexcept;
+    static uint8_t* encode(std::string_view name, std::string_view value,
+                           uint8_t* out) noexcept;
+
+  private:
+    static uint8_t* encode_integer(uint64_t value, int prefix_bits,
+                                   uint8_t first, uint8_t* out) noexcept;
+    static uint8_t* encode_string(std::string_view s, uint8_t* out) noexcept;
+  };
+
+  inline HpackDecoder::HpackDecoder(std::size_t max_table_size)
+      : table_capacity_{max_table_size}
+      , max_table_size_{max_table_size}
+  { }
+
+  inline bool
+  HpackDecoder::decode_integer(uint8_t const*& p, uint8_t const* end,
+                               int prefix_bits, uint64_t& value)
+  {
+    if (p == end) LS_UNLIKELY
+      return false;
+
+    uint64_t max_prefix = (1u << prefix_bits) - 1;
+    value = *p++ & max_prefix;
+    if (value < max_prefix)
+      return true;
+
+    /*
+     * Larger values than 2^35 are never legitimate
+     */
+    for (int shift = 0; shift <= 28; shift += 7) {
+      if (p == end) LS_UNLIKELY
+        return false;
+      auto b = *p++;
+      value += uint64_t{b & 0x7fu} << shift;
+      if (!(b & 0x80))
+        return true;
+    }
+    return false;
+  }
+
+  inline bool
+  HpackDecoder::decode_string(uint8_t const*& p, uint8_t const* end,
+                              std::string& buffer, std::string_view& out)
+  {
+    if (p == end) LS_UNLIKELY
+      return false;
+
+    bool huffman = *p & 0x80;
+    uint64_t len;
+    if (!decode_integer(p, end, 7, len) ||
+        len > static_cast<uint64_t>(end - p)) LS_UNLIKELY
+      return false;
+
+    if (huffman) {
+      buffer.clear();
+      if (!hpack_impl::huffman_decode(p, len, buffer)) LS_UNLIKELY
+        return false;
+      out = buffer;
+    } else
+      out = {reinterpret_cast<char const*>(p), len};
+
+    p += len;
+    return true;
+  }
+
+  inline bool
+  HpackDecoder::lookup(uint64_t index, std::string_view& name,
+                       std::string_view& value) const
+  {
+    using hpack_impl::kStaticTable;
+
+    if (index == 0) LS_UNLIKELY
+      return false;
+    if (index <= kStaticTable.size()) LS_LIKELY {
+      name = kStaticTable[index - 1].name;
+      value = kStaticTable[index - 1].value;
+      return true;
+    }
+
+    index -= kStaticTable.size() + 1;
+    if (index >= table_.size()) LS_UNLIKELY
+      return false;
+    name = table_[index].first;
+    value = table_[index].second;
+    return true;
+  }
+
+  inline void
+  HpackDecoder::evict(std::size_t max_size)
+  {
+    while (table_size_ > max_size) {
+      auto& oldest = table_.back();
+      table_size_ -= oldest.first.size() + oldest.second.size() + kEntryOverhead;
+      table_.pop_back();
+    }
+  }
+
+  inline void
+  HpackDecoder::insert(std::string_view name, std::string_view value)
+  {
+    auto size = name.size() + value.size() + kEntryOverhead;
+    /*
+     * The name may refer to an entry that the insertion evicts
+     */
+    std::pair<std::string, std::string> entry{name, value};
+
+    if (size > table_capacity_) {
+      evict(0);
+      return;
+    }
+    evict(table_capacity_ - size);
+    table_.push_front(std::move(entry));
+    table_size_ += size;
+  }
+
+  template <class F>
+  inline bool
+  HpackDecoder::decode(uint8_t const* data, std::size_t len, F&& on_header)
+  {
+    auto p = data;
+    auto end = data + len;
+    /*
+     * Size updates are only allowed at the start of a block
+     */
+    bool first = true;
+
+    while (p < end) {
+      std::string_view name;
+      std::string_view value;
+      uint64_t index;
+      auto b = *p;
+
+      if (b & 0x80) {
+        /*
+         * Indexed field
+         */
+        if (!decode_integer(p, end, 7, index) ||
+            !lookup(index, name, value)) LS_UNLIKELY
+          return false;
+        on_header(name, value);
+      } else if ((b & 0xe0) == 0x20) {
+        /*
+         * Dynamic table size update
+         */
+        if (!first || !decode_integer(p, end, 5, index) ||
+            index > max_table_size_) LS_UNLIKELY
+          return false;
+        table_capacity_ = index;
+        evict(table_capacity_);
+        continue;
+      } else {
+        /*
+         * Literal field, with incremental indexing (01), without indexing
+         * (0000) or never indexed (0001)
+         */
+        bool indexing = b & 0x40;
+        if (!decode_integer(p, end, indexing ? 6 : 4, index)) LS_UNLIKELY
+          return false;
+
+        if (index) {
+          std::string_view unused;
+          if (!lookup(index, name, unused)) LS_UNLIKELY
+            return false;
+          /*
+           * The name may be in the dynamic table, which the insertion
+           * below may change
+           */
+          if (indexing && index > hpack_impl::kStaticTable.size()) {
+            name_buffer_ = name;
+            name = name_buffer_;
+          }
+        } else if (!decode_string(p, end, name_buffer_, name)) LS_UNLIKELY
+          return false;
+
+        if (!decode_string(p, end, value_buffer_, value)) LS_UNLIKELY
+          return false;
+
+        on_header(name, value);
+        if (indexing)
+          insert(name, value);
+      }
+      first = false;
+    }
+    return true;
+  }
+
+  inline std::size_t
+  HpackDecoder::table_size() const noexcept
+  {
+    return table_size_;
+  }
+
+  constexpr std::size_t
+  HpackEncoder::max_size(std::string_view name, std::string_view value) noexcept
+  {
+    /*
+     * A prefix byte, and up to 5 bytes for each length
+     */
+    return 1 + 10 + name.size() + value.size();
+  }
+
+  inline uint8_t*
+  HpackEncoder::encode_integer(uint64_t value, int prefix_bits, uint8_t first,
+                               uint8_t* out) noexcept
+  {
+    uint64_t max_prefix = (1u << prefix_bits) - 1;
+    if (value < max_prefix) {
+      *out++ = first | value;
+      return out;
+    }
+
+    *out++ = first | max_prefix;
+    value -= max_prefix;
+    while (value >= 0x80) {
+      *out++ = 0x80 | (value & 0x7f);
+      value >>= 7;
+    }
+    *out++ = value;
+    return out;
+  }
+
+  inline uint8_t*
+  HpackEncoder::encode_string(std::string_view s, uint8_t* out) noexcept
+  {
+    out = encode_integer(s.size(), 7, 0, out);
+    std::memcpy(out, s.data(), s.size());
+    return out + s.size();
+  }
+
+  inline uint8_t*
+  HpackEncoder::encode_status(int code, uint8_t* out) noexcept
+  {
+    /*
+     * The common codes are static table entries 8-14
+     */
+    switch (code) {
+    LS_LIKELY case 200: *out++ = 0x80 | 8; return out;
+    case 204: *out++ = 0x80 | 9; return out;
+    case 206: *out++ = 0x80 | 10; return out;
+    case 304: *out++ = 0x80 | 11; return out;
+    case 400: *out++ = 0x80 | 12; return out;
+    case 404: *out++ = 0x80 | 13; return out;
+    case 500: *out++ = 0x80 | 14; return out;
+    }
+
+    char digits[3] = {char('0' + code / 100 % 10), char('0' + code / 10 % 10),
+                      char('0' + code % 10)};
+    return encode(":status", {digits, 3}, out);
+  }
+
+  inline uint8_t*
+  HpackEncoder::encode(std::string_view name, std::string_view value,
+                       uint8_t* out) noexcept
+  {
+    using hpack_impl::kStaticTable;
+
+    std::size_t name_index = 0;
+    for (std::size_t i = 0; i < kStaticTable.size(); ++i) {
+      if (kStaticTable[i].name != name)
+        continue;
+      if (kStaticTable[i].value == value)
+        return encode_integer(i + 1, 7, 0x80, out);
+      if (!name_index)
+        name_index = i + 1;
+    }
+
+    /*
+     * Literal without indexing
+     */
+    out = encode_integer(name_index, 4, 0, out);
+    if (!name_index)
+      out = encode_string(name, out);
+    return encode_string(value, out);
+  }
+} // namespace lserver
@@ -40,12 +40,19 @@ namespace lserver {
 
   using DynQue = DynamicQueue<>;
 
-  class Http final : public Session<Http> {
-    using BaseSession = Session<Http>;
+  /*
+   * 'Threading' is the threading policy of the protocol, see
+   * MultiThreaded and SingleThreaded.
+   */
+  template <class Threading>
+  class BasicHttp final : public Session<BasicHttp<Threading>> {
+    using BaseSession = Session<BasicHttp<Threading>>;
 
   public:
-    Http();
-    ~Http() = default;
+    using threading_policy = Threading;
+
+    BasicHttp();
+    ~BasicHttp() = default;
     /*
      * Primes the state of the protocol instance and starts
      * the main session loop.
@@ -53,7 +60,7 @@ namespace lserver {
     void start();
     /*
      * operator new is overriden to observe the alignment
-     * requirement of Http/Session
+     * requirement of BasicHttp/Session
      */
     void* operator new(std::size_t n);
     void operator delete(void* ptr, std::size_t n);
@@ -96,28 +103,35 @@ namespace lserver {
     DynamicString* d_;
   };
 
-  Http::Http()
+  using Http = BasicHttp<MultiThreaded>;
+
+  template <class Threading>
+  BasicHttp<Threading>::BasicHttp()
       : response_header_{BaseSession::prepare_send_buffer(64)}
       , d_{BaseSession::prepare_send_buffer(256 * 1024)}
   { }
 
+  template <class Threading>
   char const*
-  Http::get_config_name()
+  BasicHttp<Threading>::get_config_name()
   {
     return config_name_;
   }
 
+  template <class Threading>
   void
-  Http::start()
+  BasicHttp<Threading>::start()
   {
     reset();
   }
 
+  template <class Threading>
   void*
-  Http::operator new(std::size_t n)
+  BasicHttp<Threading>::operator new(std::size_t n)
   {
     void* ptr = std::aligned_alloc(
-        std::max(alignof(BaseSession), alignof(Http)), n * sizeof(BaseSession));
+        std::max(alignof(BaseSession), alignof(BasicHttp)),
+        n * sizeof(BaseSession));
 
     if (!ptr)
       LS_UNLIKELY
@@ -131,34 +145,39 @@ namespace lserver {
     return ptr;
   }
 
+  template <class Threading>
   void
-  Http::operator delete(void* ptr, std::size_t n)
+  BasicHttp<Threading>::operator delete(void* ptr, std::size_t n)
   {
     free(ptr);
   }
 
+  template <class Threading>
   inline void
-  Http::on_error(std::error_code error)
+  BasicHttp<Threading>::on_error(std::error_code error)
   {
     lslog(
         3, "Http service: ",
         std::error_condition{error.value(), std::system_category()}.message());
   }
 
+  template <class Threading>
   inline uintptr_t
-  Http::get_id()
+  BasicHttp<Threading>::get_id()
   {
     return reinterpret_cast<uintptr_t>(this);
   }
 
+  template <class Threading>
   inline void
-  Http::on_closed()
+  BasicHttp<Threading>::on_closed()
   {
     program_.reset();
   }
 
+  template <class Threading>
   inline auto
-  Http::on_sent()
+  BasicHttp<Threading>::on_sent()
   {
     if (program_.has_more_data())
       LS_LIKELY
@@ -172,8 +191,12 @@ namespace lserver {
      * Output stream is finished and we are not going to send more data.
      */
 
-    transaction_finished();
-    auto keep_alive = request_header_.get_keep_alive();
+    BaseSession::transaction_finished();
+    /*
+     * The response may have asked the client to close the connection,
+     * even though the request allowed keep-alive.
+     */
+    auto keep_alive = response_header_.keep_alive_;
     if (keep_alive)
       LS_LIKELY
       {
@@ -188,8 +211,9 @@ namespace lserver {
     }
   }
 
+  template <class Threading>
   inline bool
-  Http::try_handle_header()
+  BasicHttp<Threading>::try_handle_header()
   {
     auto header_end_offset = request_header_.try_parse(
         reinterpret_cast<char const*>(BaseSession::data()),
@@ -198,8 +222,12 @@ namespace lserver {
     if (header_end_offset)
       LS_LIKELY
       {
+        /*
+         * The bytes received by the session are counted from the first
+         * byte of the header, so the expected length includes it.
+         */
         BaseSession::set_expected_data_length(
-            request_header_.get_content_length());
+            *header_end_offset + request_header_.get_content_length());
 
         /*
          * Consume header size bytes from the input stream, so that
@@ -212,11 +240,12 @@ namespace lserver {
     return false;
   }
 
+  template <class Threading>
   inline auto
-  Http::on_data()
+  BasicHttp<Threading>::on_data()
   {
 #if ENABLE_LS_SANITIZE
-    assert(engaged_);
+    assert(this->engaged_);
 #endif
 
     if (!request_header_.is_ready())
@@ -305,7 +334,8 @@ namespace lserver {
          * program.
          */
         auto prog_resp = program_.get_response();
-        respond(prog_resp.code, request_header_.get_keep_alive(),
+        respond(prog_resp.code,
+                request_header_.get_keep_alive() && !BaseSession::draining(),
                 prog_resp.download_size, {});
         /*
          * Inform the session that the input stream is finished and we don't
@@ -320,9 +350,10 @@ namespace lserver {
     return BaseSession::kContinue;
   }
 
+  template <class Threading>
   void
-  Http::respond(int code, bool keep_alive, std::size_t size,
-                std::initializer_list<std::string> headers)
+  BasicHttp<Threading>::respond(int code, bool keep_alive, std::size_t size,
+                                std::initializer_list<std::string> headers)
   {
     assert(!response_header_.is_sent());
 
@@ -331,8 +362,9 @@ namespace lserver {
     response_header_.set_sent();
   }
 
+  template <class Threading>
   void
-  Http::reset()
+  BasicHttp<Threading>::reset()
   {
     // TODO clean it up and reuse rather than delete/new
     program_.reset();
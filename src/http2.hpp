@@ -0,0 +1,1208 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2021, Amin Saba
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "common.hpp"
+#include "hpack.hpp"
+#include "http_header.hpp"
+#include "program.hpp"
+#include "session.hpp"
+
+namespace lserver {
+
+  inline constexpr std::string_view kHttp2Preface =
+      "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+  enum class Http2FrameType : uint8_t {
+    kData = 0,
+    kHeaders = 1,
+    kPriority = 2,
+    kRstStream = 3,
+    kSettings = 4,
+    kPushPromise = 5,
+    kPing = 6,
+    kGoaway = 7,
+    kWindowUpdate = 8,
+    kContinuation = 9,
+  };
+
+  enum Http2Flags : uint8_t {
+    kHttp2EndStream = 0x1,
+    kHttp2Ack = 0x1,
+    kHttp2EndHeaders = 0x4,
+    kHttp2Padded = 0x8,
+    kHttp2Priority = 0x20,
+  };
+
+  enum Http2Error : uint32_t {
+    kHttp2NoError = 0x0,
+    kHttp2ProtocolError = 0x1,
+    kHttp2FlowControlError = 0x3,
+    kHttp2StreamClosed = 0x5,
+    kHttp2FrameSizeError = 0x6,
+    kHttp2RefusedStream = 0x7,
+    kHttp2CompressionError = 0x9,
+    kHttp2EnhanceYourCalm = 0xb,
+  };
+
+  enum Http2Setting : uint16_t {
+    kHttp2HeaderTableSize = 0x1,
+    kHttp2EnablePush = 0x2,
+    kHttp2MaxConcurrentStreams = 0x3,
+    kHttp2InitialWindowSize = 0x4,
+    kHttp2MaxFrameSize = 0x5,
+  };
+
+  /*
+   * Every HTTP/2 frame starts with this header, in network byte order
+   */
+  struct Http2FrameHeader {
+    static constexpr std::size_t kSize = 9;
+
+    uint32_t length = 0;
+    Http2FrameType type = Http2FrameType::kData;
+    uint8_t flags = 0;
+    uint32_t stream_id = 0;
+
+    void encode(uint8_t* out) const noexcept;
+    static Http2FrameHeader decode(uint8_t const* in) noexcept;
+  };
+
+  /*
+   * HTTP/2 over cleartext TCP (h2c). A client either starts with the
+   * connection preface (prior knowledge), or upgrades from an HTTP/1.1
+   * request with "Upgrade: h2c", which then becomes stream 1.
+   *
+   * Each stream runs its own VScript program, routed by :path like Http
+   * does with the URL, so many transactions share a connection at once.
+   * The frames written while handling a read, or after a send completes,
+   * are coalesced into a few large buffers that leave in a single gather
+   * write. Responses are interleaved one DATA frame per stream at a time,
+   * within the flow control windows granted by the client.
+   *
+   * 'Threading' is the threading policy of the protocol, see MultiThreaded
+   * and SingleThreaded.
+   */
+  template <class Threading>
+  class BasicHttp2 final : public Session<BasicHttp2<Threading>> {
+    using BaseSession = Session<BasicHttp2<Threading>>;
+
+  public:
+    using threading_policy = Threading;
+    /*
+     * Frames of the multiplexed streams are sent while the connection
+     * keeps receiving
+     */
+    using duplex_policy = FullDuplex;
+
+    void start();
+
+    /*
+     * "callbacks" called by the CRTP base (Session)
+     */
+    void on_error(std::error_code error);
+    void on_closed();
+    auto on_sent();
+    auto on_data();
+
+  private:
+    enum class State { kStart, kPreface, kFrames };
+
+    struct Stream {
+      enum class Kind { kVScript, kSinkhole, kNotFound };
+
+      uint32_t id = 0;
+      Kind kind = Kind::kNotFound;
+      Program program;
+      /*
+       * The request body received before its program is complete
+       */
+      std::vector<uint8_t> body;
+      bool parsed = false;
+      bool failed = false;
+      bool remote_closed = false;
+      bool headers_sent = false;
+      /*
+       * Waits for a WINDOW_UPDATE of the stream
+       */
+      bool blocked = false;
+      int code = 200;
+      std::size_t remaining = 0;
+      int64_t send_window = 0;
+      int64_t recv_window = 0;
+    };
+
+    /*
+     * Handles the HTTP/1.1 request of an upgrade, or detects the preface.
+     * Returns false if more data is needed.
+     */
+    bool handle_start(uint8_t* data, std::size_t size, std::size_t& offset);
+    void handle_frame(Http2FrameHeader const& header, uint8_t* payload);
+    void handle_data(Http2FrameHeader const& header, uint8_t* payload);
+    void handle_headers(Http2FrameHeader const& header, uint8_t* payload);
+    void handle_settings(Http2FrameHeader const& header, uint8_t* payload);
+    void handle_window_update(Http2FrameHeader const& header,
+                              uint8_t* payload);
+    /*
+     * Handles a complete header block, of one HEADERS frame or of a
+     * HEADERS frame and its CONTINUATION frames.
+     */
+    void end_headers(uint32_t stream_id, uint8_t const* block,
+                     std::size_t len, bool end_stream);
+    /*
+     * Strips the padding of a DATA or HEADERS frame
+     */
+    bool unpad(Http2FrameHeader const& header, uint8_t*& payload,
+               std::size_t& len);
+    Http2Error apply_setting(uint16_t id, uint32_t value);
+
+    Stream& open_stream(uint32_t id, std::string const& path);
+    /*
+     * Feeds request body bytes to the program of 's'. 'eof' is set with
+     * the last of them, and queues the response.
+     */
+    void on_body(Stream& s, uint8_t* data, std::size_t len, bool eof);
+    void close_stream(uint32_t id);
+    void unblock(Stream& s);
+
+    /*
+     * Writes the HEADERS and DATA frames of the ready streams
+     */
+    void write_responses();
+    void write_response_headers(Stream& s);
+    /*
+     * Returns room for 'n' bytes at the end of the frame buffers
+     */
+    uint8_t* reserve(std::size_t n);
+    /*
+     * Writes a frame header and returns room for its payload
+     */
+    uint8_t* write_frame(std::size_t len, Http2FrameType type, uint8_t flags,
+                         uint32_t stream_id);
+    void write_raw(std::string_view s);
+    void write_settings();
+    void write_window_update(uint32_t stream_id, uint32_t increment);
+    void write_rst_stream(uint32_t stream_id, Http2Error error);
+    void write_goaway(Http2Error error);
+    /*
+     * Fails the connection: it closes after a GOAWAY
+     */
+    void connection_error(Http2Error error);
+    /*
+     * Hands the frames written so far to the session
+     */
+    void flush();
+    void release_buffers();
+    bool should_close() const noexcept;
+
+    static constexpr std::size_t kReadSize = 64 * 1024;
+    static constexpr std::size_t kFrameBufferSz = 64 * 1024;
+    /*
+     * SETTINGS_MAX_FRAME_SIZE is left at its default, so every frame fits
+     * in the receive buffer.
+     */
+    static constexpr std::size_t kMaxFrameSize = 16384;
+    static constexpr std::size_t kMaxConcurrentStreams = 256;
+    static constexpr int64_t kDefaultWindow = 65535;
+    static constexpr int64_t kMaxWindow = 0x7fffffff;
+    static constexpr int64_t kStreamWindow = 1 << 20;
+    static constexpr int64_t kConnectionWindow = 16 << 20;
+    /*
+     * No more DATA frames are written while this many bytes wait to be
+     * sent
+     */
+    static constexpr std::size_t kMaxQueuedBytes = 1 << 20;
+    /*
+     * Limits of the buffered program text and header blocks of a stream
+     */
+    static constexpr std::size_t kMaxProgramSize = 64 * 1024;
+    static constexpr std::size_t kMaxHeaderBlock = 64 * 1024;
+
+    static inline LSVirtualMachine vm_;
+    static inline std::string const vscript_url = "/vscript/";
+    static inline std::string const sinkhole_url = "/sinkhole/";
+
+    State state_ = State::kStart;
+    /*
+     * The HTTP/1.1 request of an upgrade, and the offset of its body
+     */
+    HttpRequestHeader request_header_;
+    std::size_t upgrade_header_end_ = 0;
+    HpackDecoder decoder_;
+    std::unordered_map<uint32_t, std::unique_ptr<Stream>> streams_;
+    /*
+     * Closed streams, kept for reuse
+     */
+    std::vector<std::unique_ptr<Stream>> spare_;
+    /*
+     * Ids of the streams with a response to write, in round robin order
+     */
+    std::deque<uint32_t> ready_;
+    uint32_t last_stream_id_ = 0;
+    /*
+     * The stream of the CONTINUATION frames expected next, if not 0
+     */
+    uint32_t continuation_stream_ = 0;
+    bool continuation_end_stream_ = false;
+    std::vector<uint8_t> header_block_;
+
+    int64_t conn_send_window_ = kDefaultWindow;
+    int64_t conn_recv_window_ = kDefaultWindow;
+    int64_t peer_initial_window_ = kDefaultWindow;
+    std::size_t peer_max_frame_size_ = kMaxFrameSize;
+
+    bool goaway_sent_ = false;
+    bool goaway_received_ = false;
+    bool closing_ = false;
+
+    /*
+     * Frame buffers handed to the session and not sent yet, followed by
+     * those still being written, from index 'unsent_'. The session calls
+     * on_sent() once its queue is empty, i.e. all of them are sent.
+     */
+    std::vector<DynamicString*> in_flight_;
+    std::size_t unsent_ = 0;
+    std::size_t queued_bytes_ = 0;
+  };
+
+  using Http2 = BasicHttp2<MultiThreaded>;
+
+  namespace http2_impl {
+    inline uint32_t
+    read32(uint8_t const* p) noexcept
+    {
+      return (uint32_t{p[0]} << 24) | (uint32_t{p[1]} << 16) |
+             (uint32_t{p[2]} << 8) | p[3];
+    }
+
+    inline void
+    write32(uint8_t* p, uint32_t v) noexcept
+    {
+      p[0] = v >> 24;
+      p[1] = v >> 16;
+      p[2] = v >> 8;
+      p[3] = v;
+    }
+
+    /*
+     * Decodes base64url without padding, as used by HTTP2-Settings.
+     * Returns false on an invalid character.
+     */
+    inline bool
+    base64url_decode(std::string_view in, std::vector<uint8_t>& out)
+    {
+      uint32_t acc = 0;
+      int bits = 0;
+
+      for (auto c: in) {
+        int v;
+        if (c >= 'A' && c <= 'Z')
+          v = c - 'A';
+        else if (c >= 'a' && c <= 'z')
+          v = c - 'a' + 26;
+        else if (c >= '0' && c <= '9')
+          v = c - '0' + 52;
+        else if (c == '-')
+          v = 62;
+        else if (c == '_')
+          v = 63;
+        else if (c == '=')
+          break;
+        else
+          return false;
+
+        acc = (acc << 6) | v;
+        bits += 6;
+        if (bits >= 8) {
+          bits -= 8;
+          out.push_back(acc >> bits);
+          acc &= (1u << bits) - 1;
+        }
+      }
+      return true;
+    }
+  } // namespace http2_impl
+
+  inline void
+  Http2FrameHeader::encode(uint8_t* out) const noexcept
+  {
+    out[0] = length >> 16;
+    out[1] = length >> 8;
+    out[2] = length;
+    out[3] = static_cast<uint8_t>(type);
+    out[4] = flags;
+    http2_impl::write32(out + 5, stream_id);
+  }
+
+  inline Http2FrameHeader
+  Http2FrameHeader::decode(uint8_t const* in) noexcept
+  {
+    return {.length = (uint32_t{in[0]} << 16) | (uint32_t{in[1]} << 8) | in[2],
+            .type = static_cast<Http2FrameType>(in[3]),
+            .flags = in[4],
+            .stream_id = http2_impl::read32(in + 5) & 0x7fffffff};
+  }
+
+  template <class Threading>
+  inline void
+  BasicHttp2<Threading>::start()
+  {
+    /*
+     * The session object is reused for new connections
+     */
+    BaseSession::reset_buffers();
+    request_header_.reset();
+    decoder_ = HpackDecoder{};
+    state_ = State::kStart;
+    last_stream_id_ = 0;
+    continuation_stream_ = 0;
+    conn_send_window_ = kDefaultWindow;
+    conn_recv_window_ = kDefaultWindow;
+    peer_initial_window_ = kDefaultWindow;
+    peer_max_frame_size_ = kMaxFrameSize;
+    goaway_sent_ = goaway_received_ = closing_ = false;
+    BaseSession::reserve_receive_buffer(kReadSize);
+  }
+
+  template <class Threading>
+  inline void
+  BasicHttp2<Threading>::on_error(std::error_code error)
+  {
+    lslog(
+        3, "Http2 service: ",
+        std::error_condition{error.value(), std::system_category()}.message());
+  }
+
+  template <class Threading>
+  inline void
+  BasicHttp2<Threading>::on_closed()
+  {
+    while (!streams_.empty())
+      close_stream(streams_.begin()->first);
+    ready_.clear();
+    release_buffers();
+  }
+
+  template <class Threading>
+  inline void
+  BasicHttp2<Threading>::release_buffers()
+  {
+    for (auto buffer: in_flight_)
+      BaseSession::release_send_buffer(buffer);
+    in_flight_.clear();
+    unsent_ = 0;
+    queued_bytes_ = 0;
+  }
+
+  template <class Threading>
+  inline bool
+  BasicHttp2<Threading>::should_close() const noexcept
+  {
+    return closing_ ||
+           ((goaway_sent_ || goaway_received_) && streams_.empty());
+  }
+
+  template <class Threading>
+  inline auto
+  BasicHttp2<Threading>::on_sent()
+  {
+    release_buffers();
+
+    if (BaseSession::draining() && !goaway_sent_) LS_UNLIKELY
+      write_goaway(kHttp2NoError);
+    write_responses();
+    flush();
+
+    if (should_close()) LS_UNLIKELY
+      return BaseSession::kClose;
+    /*
+     * The next read is already in flight
+     */
+    return BaseSession::kData;
+  }
+
+  template <class Threading>
+  inline uint8_t*
+  BasicHttp2<Threading>::reserve(std::size_t n)
+  {
+    if (in_flight_.size() == unsent_ ||
+        in_flight_.back()->size() + n > in_flight_.back()->capacity()) {
+      auto buffer = BaseSession::prepare_send_buffer(kFrameBufferSz);
+      buffer->clear();
+      if (n > buffer->capacity()) LS_UNLIKELY
+        buffer->resize(n);
+      in_flight_.push_back(buffer);
+    }
+
+    auto buffer = in_flight_.back();
+    auto p = reinterpret_cast<uint8_t*>(buffer->data()) + buffer->size();
+    buffer->fill(buffer->size() + n);
+    queued_bytes_ += n;
+    return p;
+  }
+
+  template <class Threading>
+  inline uint8_t*
+  BasicHttp2<Threading>::write_frame(std::size_t len, Http2FrameType type,
+                                     uint8_t flags, uint32_t stream_id)
+  {
+    auto p = reserve(Http2FrameHeader::kSize + len);
+    Http2FrameHeader{.length = static_cast<uint32_t>(len),
+                     .type = type,
+                     .flags = flags,
+                     .stream_id = stream_id}
+        .encode(p);
+    return p + Http2FrameHeader::kSize;
+  }
+
+  template <class Threading>
+  inline void
+  BasicHttp2<Threading>::write_raw(std::string_view s)
+  {
+    std::memcpy(reserve(s.size()), s.data(), s.size());
+  }
+
+  template <class Threading>
+  inline void
+  BasicHttp2<Threading>::write_settings()
+  {
+    auto p = write_frame(12, Http2FrameType::kSettings, 0, 0);
+    p[0] = 0;
+    p[1] = kHttp2MaxConcurrentStreams;
+    http2_impl::write32(p + 2, kMaxConcurrentStreams);
+    p[6] = 0;
+    p[7] = kHttp2InitialWindowSize;
+    http2_impl::write32(p + 8, kStreamWindow);
+
+    /*
+     * The connection window can only be raised by WINDOW_UPDATE
+     */
+    write_window_update(0, kConnectionWindow - conn_recv_window_);
+    conn_recv_window_ = kConnectionWindow;
+  }
+
+  template <class Threading>
+  inline void
+  BasicHttp2<Threading>::write_window_update(uint32_t stream_id,
+                                             uint32_t increment)
+  {
+    auto p = write_frame(4, Http2FrameType::kWindowUpdate, 0, stream_id);
+    http2_impl::write32(p, increment);
+  }
+
+  template <class Threading>
+  inline void
+  BasicHttp2<Threading>::write_rst_stream(uint32_t stream_id,
+                                          Http2Error error)
+  {
+    auto p = write_frame(4, Http2FrameType::kRstStream, 0, stream_id);
+    http2_impl::write32(p, error);
+  }
+
+  template <class Threading>
+  inline void
+  BasicHttp2<Threading>::write_goaway(Http2Error error)
+  {
+    auto p = write_frame(8, Http2FrameType::kGoaway, 0, 0);
+    http2_impl::write32(p, last_stream_id_);
+    http2_impl::write32(p + 4, error);
+    goaway_sent_ = true;
+  }
+
+  template <class Threading>
+  inline void
+  BasicHttp2<Threading>::connection_error(Http2Error error)
+  {
+    lslog(3, "Http2 service: connection error ", error);
+    if (!closing_)
+      write_goaway(error);
+    closing_ = true;
+  }
+
+  template <class Threading>
+  inline void
+  BasicHttp2<Threading>::flush()
+  {
+    if (in_flight_.size() > unsent_)
+      BaseSession::send(in_flight_.begin() + unsent_, in_flight_.end());
+    unsent_ = in_flight_.size();
+  }
+
+  template <class Threading>
+  inline auto
+  BasicHttp2<Threading>::open_stream(uint32_t id, std::string const& path)
+      -> Stream&
+  {
+    std::unique_ptr<Stream> s;
+    if (!spare_.empty()) {
+      s = std::move(spare_.back());
+      spare_.pop_back();
+      s->body.clear();
+    } else
+      s = std::make_unique<Stream>();
+
+    s->id = id;
+    s->parsed = s->failed = s->remote_closed = false;
+    s->headers_sent = s->blocked = false;
+    s->code = 200;
+    s->remaining = 0;
+    s->send_window = peer_initial_window_;
+    s->recv_window = kStreamWindow;
+    s->program = Program{};
+
+    /*
+     * Route the stream by its path, the same way Http does by URL
+     */
+    if (url_prefix(vscript_url, path))
+      s->kind = Stream::Kind::kVScript;
+    else if (url_prefix(sinkhole_url, path)) {
+      s->kind = Stream::Kind::kSinkhole;
+      s->program = Program::sinkhole();
+      s->program.set_vm(&vm_);
+    } else
+      s->kind = Stream::Kind::kNotFound;
+
+    BaseSession::transaction_started();
+    return *(streams_[id] = std::move(s));
+  }
+
+  template <class Threading>
+  inline void
+  BasicHttp2<Threading>::close_stream(uint32_t id)
+  {
+    auto it = streams_.find(id);
+    if (it == streams_.end())
+      return;
+
+    it->second->program.reset();
+    spare_.push_back(std::move(it->second));
+    streams_.erase(it);
+    BaseSession::transaction_finished();
+  }
+
+  template <class Threading>
+  inline void
+  BasicHttp2<Threading>::unblock(Stream& s)
+  {
+    if (s.blocked && s.send_window > 0) {
+      s.blocked = false;
+      ready_.push_back(s.id);
+    }
+  }
+
+  template <class Threading>
+  inline void
+  BasicHttp2<Threading>::on_body(Stream& s, uint8_t* data, std::size_t len,
+                                 bool eof)
+  {
+    switch (s.kind) {
+    case Stream::Kind::kVScript:
+      if (s.parsed)
+        s.program.feed(data, len, eof);
+      else if (!s.failed) {
+        /*
+         * Buffer the body until the program text is complete
+         */
+        s.body.insert(s.body.end(), data, data + len);
+        std::size_t consume_len;
+        auto status = Program::try_parse(s.program, consume_len,
+                                         s.body.data(), s.body.size());
+        if (status == SUCCESS) {
+          s.parsed = true;
+          s.program.set_vm(&vm_);
+          s.program.feed(s.body.data() + consume_len,
+                         s.body.size() - consume_len, eof);
+          s.body.clear();
+        } else if (status == FAILED || eof ||
+                   s.body.size() > kMaxProgramSize) {
+          s.failed = true;
+          s.body.clear();
+        }
+      }
+      break;
+    case Stream::Kind::kSinkhole:
+      s.program.feed(data, len, eof);
+      break;
+    case Stream::Kind::kNotFound:
+      break;
+    }
+
+    if (!eof)
+      return;
+
+    s.remote_closed = true;
+    if (s.kind == Stream::Kind::kNotFound)
+      s.code = 404;
+    else if (s.failed)
+      s.code = 400;
+    else {
+      auto response = s.program.get_response();
+      s.code = response.code;
+      s.remaining = response.download_size;
+    }
+    ready_.push_back(s.id);
+  }
+
+  template <class Threading>
+  inline void
+  BasicHttp2<Threading>::write_response_headers(Stream& s)
+  {
+    uint8_t block[32];
+    char length[20];
+    auto length_end = std::to_chars(length, length + sizeof(length),
+                                    s.remaining)
+                          .ptr;
+
+    auto end = HpackEncoder::encode_status(s.code, block);
+    end = HpackEncoder::encode("content-length",
+                               {length, std::size_t(length_end - length)},
+                               end);
+
+    auto len = end - block;
+    uint8_t flags = kHttp2EndHeaders | (s.remaining ? 0 : kHttp2EndStream);
+    std::memcpy(write_frame(len, Http2FrameType::kHeaders, flags, s.id), block,
+                len);
+    s.headers_sent = true;
+  }
+
+  template <class Threading>
+  inline void
+  BasicHttp2<Threading>::write_responses()
+  {
+    /*
+     * Each pass writes at most one frame per stream, so that the streams
+     * share the connection.
+     */
+    bool progress = true;
+    while (progress && queued_bytes_ < kMaxQueuedBytes) {
+      progress = false;
+
+      for (auto n = ready_.size(); n > 0 && queued_bytes_ < kMaxQueuedBytes;
+           --n) {
+        auto id = ready_.front();
+        ready_.pop_front();
+        auto it = streams_.find(id);
+        if (it == streams_.end())
+          continue;
+        auto& s = *it->second;
+
+        if (!s.headers_sent) {
+          write_response_headers(s);
+          progress = true;
+          if (!s.remaining) {
+            close_stream(id);
+            continue;
+          }
+        }
+
+        auto len = std::min<int64_t>(
+            {static_cast<int64_t>(std::min(s.remaining, peer_max_frame_size_)),
+             conn_send_window_, s.send_window});
+        if (len <= 0) {
+          if (s.send_window <= 0)
+            s.blocked = true;
+          else
+            ready_.push_back(id);
+          continue;
+        }
+
+        bool last = static_cast<std::size_t>(len) == s.remaining;
+        /*
+         * Like Http, the downloaded bytes carry no data of their own
+         */
+        std::memset(write_frame(len, Http2FrameType::kData,
+                                last ? kHttp2EndStream : 0, id),
+                    0, len);
+        s.remaining -= len;
+        s.send_window -= len;
+        conn_send_window_ -= len;
+        progress = true;
+
+        if (last)
+          close_stream(id);
+        else
+          ready_.push_back(id);
+      }
+    }
+  }
+
+  template <class Threading>
+  inline bool
+  BasicHttp2<Threading>::unpad(Http2FrameHeader const& header,
+                               uint8_t*& payload, std::size_t& len)
+  {
+    len = header.length;
+    if (!(header.flags & kHttp2Padded))
+      return true;
+
+    if (len < 1 || payload[0] >= len) LS_UNLIKELY {
+      connection_error(kHttp2ProtocolError);
+      return false;
+    }
+    len -= 1 + payload[0];
+    ++payload;
+    return true;
+  }
+
+  template <class Threading>
+  inline Http2Error
+  BasicHttp2<Threading>::apply_setting(uint16_t id, uint32_t value)
+  {
+    switch (id) {
+    case kHttp2EnablePush:
+      if (value > 1) LS_UNLIKELY
+        return kHttp2ProtocolError;
+      break;
+    case kHttp2InitialWindowSize: {
+      if (value > kMaxWindow) LS_UNLIKELY
+        return kHttp2FlowControlError;
+      auto delta = static_cast<int64_t>(value) - peer_initial_window_;
+      peer_initial_window_ = value;
+      for (auto& [_, s]: streams_) {
+        s->send_window += delta;
+        if (s->send_window > kMaxWindow) LS_UNLIKELY
+          return kHttp2FlowControlError;
+        unblock(*s);
+      }
+      break;
+    }
+    case kHttp2MaxFrameSize:
+      if (value < kMaxFrameSize || value > 0xffffff) LS_UNLIKELY
+        return kHttp2ProtocolError;
+      peer_max_frame_size_ = value;
+      break;
+    default:
+      /*
+       * The encoder does not use the dynamic table, so the size of the
+       * client's table does not matter; and the server never pushes.
+       */
+      break;
+    }
+    return kHttp2NoError;
+  }
+
+  template <class Threading>
+  inline void
+  BasicHttp2<Threading>::handle_settings(Http2FrameHeader const& header,
+                                         uint8_t* payload)
+  {
+    if (header.stream_id != 0) LS_UNLIKELY
+      return connection_error(kHttp2ProtocolError);
+    if (header.flags & kHttp2Ack) {
+      if (header.length != 0) LS_UNLIKELY
+        connection_error(kHttp2FrameSizeError);
+      return;
+    }
+    if (header.length % 6 != 0) LS_UNLIKELY
+      return connection_error(kHttp2FrameSizeError);
+
+    for (std::size_t i = 0; i < header.length; i += 6) {
+      auto error = apply_setting((payload[i] << 8) | payload[i + 1],
+                                 http2_impl::read32(payload + i + 2));
+      if (error != kHttp2NoError) LS_UNLIKELY
+        return connection_error(error);
+    }
+    write_frame(0, Http2FrameType::kSettings, kHttp2Ack, 0);
+  }
+
+  template <class Threading>
+  inline void
+  BasicHttp2<Threading>::handle_window_update(Http2FrameHeader const& header,
+                                              uint8_t* payload)
+  {
+    if (header.length != 4) LS_UNLIKELY
+      return connection_error(kHttp2FrameSizeError);
+
+    int64_t increment = http2_impl::read32(payload) & 0x7fffffff;
+    if (header.stream_id == 0) {
+      if (increment == 0 || conn_send_window_ + increment > kMaxWindow)
+        LS_UNLIKELY return connection_error(increment ? kHttp2FlowControlError
+                                                      : kHttp2ProtocolError);
+      conn_send_window_ += increment;
+      return;
+    }
+
+    auto it = streams_.find(header.stream_id);
+    if (it == streams_.end())
+      return;
+    auto& s = *it->second;
+    if (increment == 0 || s.send_window + increment > kMaxWindow) LS_UNLIKELY {
+      write_rst_stream(s.id,
+                       increment ? kHttp2FlowControlError : kHttp2ProtocolError);
+      return close_stream(s.id);
+    }
+    s.send_window += increment;
+    unblock(s);
+  }
+
+  template <class Threading>
+  inline void
+  BasicHttp2<Threading>::handle_data(Http2FrameHeader const& header,
+                                     uint8_t* payload)
+  {
+    if (header.stream_id == 0) LS_UNLIKELY
+      return connection_error(kHttp2ProtocolError);
+    if (header.length > conn_recv_window_) LS_UNLIKELY
+      return connection_error(kHttp2FlowControlError);
+
+    /*
+     * The whole frame, padding included, counts against the windows
+     */
+    conn_recv_window_ -= header.length;
+    if (conn_recv_window_ <= kConnectionWindow / 2) {
+      write_window_update(0, kConnectionWindow - conn_recv_window_);
+      conn_recv_window_ = kConnectionWindow;
+    }
+
+    std::size_t len;
+    if (!unpad(header, payload, len)) LS_UNLIKELY
+      return;
+
+    auto it = streams_.find(header.stream_id);
+    if (it == streams_.end()) {
+      /*
+       * Frames of a stream that was reset may still be on their way
+       */
+      if (header.stream_id > last_stream_id_) LS_UNLIKELY
+        connection_error(kHttp2ProtocolError);
+      return;
+    }
+
+    auto& s = *it->second;
+    if (s.remote_closed || header.length > s.recv_window) LS_UNLIKELY {
+      write_rst_stream(s.id, s.remote_closed ? kHttp2StreamClosed
+                                             : kHttp2FlowControlError);
+      return close_stream(s.id);
+    }
+
+    bool eof = header.flags & kHttp2EndStream;
+    s.recv_window -= header.length;
+    on_body(s, payload, len, eof);
+
+    if (!eof && s.recv_window <= kStreamWindow / 2) {
+      write_window_update(s.id, kStreamWindow - s.recv_window);
+      s.recv_window = kStreamWindow;
+    }
+  }
+
+  template <class Threading>
+  inline void
+  BasicHttp2<Threading>::end_headers(uint32_t stream_id, uint8_t const* block,
+                                     std::size_t len, bool end_stream)
+  {
+    std::string path;
+    auto on_header = [&](std::string_view name, std::string_view value) {
+      if (name == ":path")
+        path = value;
+    };
+
+    /*
+     * The block is decoded even if the stream is refused, to keep the
+     * dynamic table in sync with the client's.
+     */
+    if (!decoder_.decode(block, len, on_header)) LS_UNLIKELY
+      return connection_error(kHttp2CompressionError);
+
+    auto it = streams_.find(stream_id);
+    if (it != streams_.end()) {
+      /*
+       * Trailers, which must end the stream
+       */
+      auto& s = *it->second;
+      if (s.remote_closed || !end_stream) LS_UNLIKELY
+        return connection_error(kHttp2ProtocolError);
+      return on_body(s, nullptr, 0, true);
+    }
+
+    if (stream_id % 2 == 0 || stream_id <= last_stream_id_) LS_UNLIKELY
+      return connection_error(kHttp2ProtocolError);
+    /*
+     * Streams above the id of our GOAWAY are ignored
+     */
+    if (goaway_sent_) LS_UNLIKELY
+      return;
+
+    last_stream_id_ = stream_id;
+    if (streams_.size() >= kMaxConcurrentStreams) LS_UNLIKELY
+      return write_rst_stream(stream_id, kHttp2RefusedStream);
+
+    auto& s = open_stream(stream_id, path);
+    if (end_stream)
+      on_body(s, nullptr, 0, true);
+  }
+
+  template <class Threading>
+  inline void
+  BasicHttp2<Threading>::handle_headers(Http2FrameHeader const& header,
+                                        uint8_t* payload)
+  {
+    if (header.stream_id == 0) LS_UNLIKELY
+      return connection_error(kHttp2ProtocolError);
+
+    std::size_t len;
+    if (!unpad(header, payload, len)) LS_UNLIKELY
+      return;
+    if (header.flags & kHttp2Priority) {
+      if (len < 5) LS_UNLIKELY
+        return connection_error(kHttp2FrameSizeError);
+      payload += 5;
+      len -= 5;
+    }
+
+    bool end_stream = header.flags & kHttp2EndStream;
+    if (header.flags & kHttp2EndHeaders)
+      return end_headers(header.stream_id, payload, len, end_stream);
+
+    header_block_.assign(payload, payload + len);
+    continuation_stream_ = header.stream_id;
+    continuation_end_stream_ = end_stream;
+  }
+
+  template <class Threading>
+  inline void
+  BasicHttp2<Threading>::handle_frame(Http2FrameHeader const& header,
+                                      uint8_t* payload)
+  {
+    if (continuation_stream_ && (header.type != Http2FrameType::kContinuation ||
+                                 header.stream_id != continuation_stream_))
+      LS_UNLIKELY return connection_error(kHttp2ProtocolError);
+
+    switch (header.type) {
+    case Http2FrameType::kData:
+      return handle_data(header, payload);
+    case Http2FrameType::kHeaders:
+      return handle_headers(header, payload);
+    case Http2FrameType::kPriority:
+      if (header.stream_id == 0) LS_UNLIKELY
+        return connection_error(kHttp2ProtocolError);
+      if (header.length != 5) LS_UNLIKELY
+        return connection_error(kHttp2FrameSizeError);
+      return;
+    case Http2FrameType::kRstStream:
+      if (header.stream_id == 0 || header.stream_id > last_stream_id_)
+        LS_UNLIKELY return connection_error(kHttp2ProtocolError);
+      if (header.length != 4) LS_UNLIKELY
+        return connection_error(kHttp2FrameSizeError);
+      return close_stream(header.stream_id);
+    case Http2FrameType::kSettings:
+      return handle_settings(header, payload);
+    case Http2FrameType::kPushPromise:
+      return connection_error(kHttp2ProtocolError);
+    case Http2FrameType::kPing:
+      if (header.stream_id != 0) LS_UNLIKELY
+        return connection_error(kHttp2ProtocolError);
+      if (header.length != 8) LS_UNLIKELY
+        return connection_error(kHttp2FrameSizeError);
+      if (!(header.flags & kHttp2Ack))
+        std::memcpy(write_frame(8, Http2FrameType::kPing, kHttp2Ack, 0),
+                    payload, 8);
+      return;
+    case Http2FrameType::kGoaway:
+      if (header.stream_id != 0) LS_UNLIKELY
+        return connection_error(kHttp2ProtocolError);
+      goaway_received_ = true;
+      return;
+    case Http2FrameType::kWindowUpdate:
+      return handle_window_update(header, payload);
+    case Http2FrameType::kContinuation:
+      if (!continuation_stream_) LS_UNLIKELY
+        return connection_error(kHttp2ProtocolError);
+      header_block_.insert(header_block_.end(), payload,
+                           payload + header.length);
+      if (header_block_.size() > kMaxHeaderBlock) LS_UNLIKELY
+        return connection_error(kHttp2EnhanceYourCalm);
+      if (header.flags & kHttp2EndHeaders) {
+        auto stream_id = continuation_stream_;
+        continuation_stream_ = 0;
+        end_headers(stream_id, header_block_.data(), header_block_.size(),
+                    continuation_end_stream_);
+      }
+      return;
+    }
+    /*
+     * Frames of unknown types are ignored
+     */
+  }
+
+  template <class Threading>
+  inline bool
+  BasicHttp2<Threading>::handle_start(uint8_t* data, std::size_t size,
+                                      std::size_t& offset)
+  {
+    auto n = std::min(size, kHttp2Preface.size());
+    if (std::memcmp(data, kHttp2Preface.data(), n) == 0) {
+      if (n < kHttp2Preface.size())
+        return false;
+      /*
+       * Prior knowledge: the server's SETTINGS is its preface
+       */
+      write_settings();
+      state_ = State::kPreface;
+      return true;
+    }
+
+    /*
+     * An HTTP/1.1 request, which must ask for an upgrade
+     */
+    if (!request_header_.is_ready()) {
+      auto header_end = request_header_.try_parse(
+          reinterpret_cast<char const*>(data), size);
+      if (!header_end) {
+        if (size > kMaxProgramSize) LS_UNLIKELY {
+          write_raw("HTTP/1.1 431 Request Header Fields Too Large\r\n"
+                    "Connection: close\r\nContent-Length: 0\r\n\r\n");
+          closing_ = true;
+        }
+        return false;
+      }
+      upgrade_header_end_ = *header_end;
+    }
+
+    auto header_end = upgrade_header_end_;
+    auto content_length = request_header_.get_content_length();
+    if (!request_header_.get_upgrade_h2c()) {
+      write_raw("HTTP/1.1 426 Upgrade Required\r\nUpgrade: h2c\r\n"
+                "Connection: Upgrade, close\r\nContent-Length: 0\r\n\r\n");
+      closing_ = true;
+      return false;
+    }
+    if (content_length > kMaxProgramSize) LS_UNLIKELY {
+      write_raw("HTTP/1.1 413 Payload Too Large\r\n"
+                "Connection: close\r\nContent-Length: 0\r\n\r\n");
+      closing_ = true;
+      return false;
+    }
+    /*
+     * The whole request must arrive before the protocol switches
+     */
+    if (size < header_end + content_length)
+      return false;
+
+    std::vector<uint8_t> settings;
+    bool valid = http2_impl::base64url_decode(
+                     request_header_.get_http2_settings(), settings) &&
+                 settings.size() % 6 == 0;
+    for (std::size_t i = 0; valid && i < settings.size(); i += 6)
+      valid = apply_setting((settings[i] << 8) | settings[i + 1],
+                            http2_impl::read32(settings.data() + i + 2)) ==
+              kHttp2NoError;
+    if (!valid) LS_UNLIKELY {
+      write_raw("HTTP/1.1 400 Bad Request\r\n"
+                "Connection: close\r\nContent-Length: 0\r\n\r\n");
+      closing_ = true;
+      return false;
+    }
+
+    write_raw("HTTP/1.1 101 Switching Protocols\r\n"
+              "Connection: Upgrade\r\nUpgrade: h2c\r\n\r\n");
+    write_settings();
+
+    /*
+     * The request is stream 1, half closed by the client
+     */
+    last_stream_id_ = 1;
+    auto& s = open_stream(1, request_header_.get_url());
+    on_body(s, data + header_end, content_length, true);
+
+    offset += header_end + content_length;
+    state_ = State::kPreface;
+    return true;
+  }
+
+  template <class Threading>
+  inline auto
+  BasicHttp2<Threading>::on_data()
+  {
+    auto data = BaseSession::data();
+    auto size = BaseSession::data_size();
+    std::size_t offset = 0;
+
+    while (!closing_) {
+      auto left = size - offset;
+
+      if (state_ == State::kStart) LS_UNLIKELY {
+        if (!handle_start(data + offset, left, offset))
+          break;
+        continue;
+      }
+
+      if (state_ == State::kPreface) LS_UNLIKELY {
+        auto n = std::min(left, kHttp2Preface.size());
+        if (std::memcmp(data + offset, kHttp2Preface.data(), n) != 0) {
+          connection_error(kHttp2ProtocolError);
+          break;
+        }
+        if (n < kHttp2Preface.size())
+          break;
+        offset += n;
+        state_ = State::kFrames;
+        continue;
+      }
+
+      if (left < Http2FrameHeader::kSize)
+        break;
+      auto header = Http2FrameHeader::decode(data + offset);
+      if (header.length > kMaxFrameSize) LS_UNLIKELY {
+        connection_error(kHttp2FrameSizeError);
+        break;
+      }
+      if (left - Http2FrameHeader::kSize < header.length)
+        break;
+
+      handle_frame(header, data + offset + Http2FrameHeader::kSize);
+      offset += Http2FrameHeader::kSize + header.length;
+    }
+
+    if (offset > 0)
+      BaseSession::consume(offset);
+
+    if (BaseSession::draining() && !goaway_sent_) LS_UNLIKELY
+      write_goaway(kHttp2NoError);
+    write_responses();
+    flush();
+
+    /*
+     * The session closes once the queued frames are sent
+     */
+    if (should_close()) LS_UNLIKELY
+      return BaseSession::kClose;
+    return BaseSession::kContinue;
+  }
+} // namespace lserver
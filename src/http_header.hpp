@@ -30,6 +30,7 @@
 #pragma once
 
 #include <map>
+#include <optional>
 #include <string.h>
 
 #include "dynamic_queue.hpp"
@@ -82,7 +83,7 @@ namespace lserver {
   class HttpRequestHeader {
 
   public:
-    enum class HeaderState { kNone, kConnection };
+    enum class HeaderState { kNone, kConnection, kUpgrade, kHttp2Settings };
 
     /*
      * Tries to find the full HTTP header in buffer 'data', and if
@@ -117,15 +118,26 @@ namespace lserver {
      */
     bool is_ready();
     std::string const& get_url() const;
+    /*
+     * Has the HTTP client asked to upgrade the connection to HTTP/2
+     * (h2c)? The HTTP2-Settings header, base64url encoded, holds its
+     * initial SETTINGS.
+     */
+    bool get_upgrade_h2c();
+    std::string const& get_http2_settings() const;
 
   private:
     std::optional<std::size_t>
     find_request_header_end_offset(char const* data_raw, std::size_t len);
 
     static inline std::map<std::string_view, HeaderState, nocase_compare>
-        header_names{{"connection"sv, HeaderState::kConnection}};
+        header_names{{"connection"sv, HeaderState::kConnection},
+                     {"upgrade"sv, HeaderState::kUpgrade},
+                     {"http2-settings"sv, HeaderState::kHttp2Settings}};
 
     bool keep_alive_ = false;
+    bool upgrade_h2c_ = false;
+    std::string http2_settings_;
     bool ready_ = false;
     HeaderState header_state_ = HeaderState::kNone;
     http_parser parser_;
@@ -188,6 +200,13 @@ namespace lserver {
         keep_alive_ = true;
       }
       break;
+    case HeaderState::kUpgrade:
+      upgrade_h2c_ = std::string_view{buf, len}.find("h2c") !=
+                     std::string_view::npos;
+      break;
+    case HeaderState::kHttp2Settings:
+      http2_settings_ = std::string{buf, len};
+      break;
     }
     header_state_ = HeaderState::kNone;
   }
@@ -238,6 +257,19 @@ namespace lserver {
     return url_;
   }
 
+  inline bool
+  HttpRequestHeader::get_upgrade_h2c()
+  {
+    assert(ready_);
+    return upgrade_h2c_;
+  }
+
+  inline std::string const&
+  HttpRequestHeader::get_http2_settings() const
+  {
+    return http2_settings_;
+  }
+
   namespace http_parser_internal {
 
     inline int
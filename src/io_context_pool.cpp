@@ -27,6 +27,7 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <algorithm>
 #include <exception>
 #include <stdexcept>
 
@@ -35,7 +36,13 @@
 namespace lserver {
 
   LSContextPool::LSContextPool(std::size_t pool_size, std::size_t max_pool_size,
-                               std::size_t thread_multiplier)
+                               std::size_t thread_multiplier, std::string name,
+                               std::vector<ThreadSetup> thread_setups,
+                               RunMode run_mode, bool single_threaded)
+      : name_{std::move(name)}
+      , thread_setups_{std::move(thread_setups)}
+      , run_mode_{run_mode}
+      , single_threaded_{single_threaded}
   {
     /*
      * This reservation is needed because LSContext instances should not
@@ -43,10 +50,9 @@ namespace lserver {
      * of LSContext.
      */
     lscontexts_.reserve(max_pool_size);
+    contexts_ = lscontexts_.data();
     for (std::size_t i = 0; i < pool_size; ++i)
       add_context(thread_multiplier);
-
-    next_context_ = std::begin(lscontexts_);
   }
 
   void
@@ -69,9 +75,17 @@ namespace lserver {
   LSContextPool::add_context(std::size_t num_threads)
   {
     std::unique_lock _{smtx_};
+    /*
+     * Nothing is touched before this, so that a bad thread count does not
+     * leave behind an active LSContext without threads.
+     */
+    LSContext::check_num_threads(num_threads, single_threaded_);
 
     for (auto& lscontext: lscontexts_) {
       if (lscontext.reusable()) {
+        auto index = &lscontext - data(lscontexts_);
+        lscontext.set_thread_setup(thread_setup(index));
+        lscontext.set_run_mode(run_mode_);
         lscontext.reuse(num_threads);
         return;
       }
@@ -83,9 +97,22 @@ namespace lserver {
     if (lscontexts_.size() == lscontexts_.capacity())
       throw std::logic_error{"Max contexts count will be exceeded."};
 
-    auto& context = lscontexts_.emplace_back();
+    auto& context = lscontexts_.emplace_back(single_threaded_);
+    context.set_thread_setup(thread_setup(lscontexts_.size() - 1));
+    context.set_run_mode(run_mode_);
     context.set_num_threads(num_threads);
     context.run_threads();
+    contexts_cnt_.store(lscontexts_.size(), std::memory_order_release);
+  }
+
+  ThreadSetup
+  LSContextPool::thread_setup(std::size_t index) const
+  {
+    ThreadSetup setup;
+    if (!thread_setups_.empty())
+      setup = thread_setups_[index % thread_setups_.size()];
+    setup.name = name_ + std::to_string(index);
+    return setup;
   }
 
   std::size_t
@@ -100,11 +127,9 @@ namespace lserver {
     return count;
   }
 
-  int
-  LSContextPool::deactivate_context(std::size_t index)
+  void
+  LSContextPool::check_deactivation(std::size_t index)
   {
-    std::unique_lock _{smtx_};
-
     /*
      * Perform some sanity check before trying to stop the LSContext
      * /////////////////////////////////////////////////////////////
@@ -125,20 +150,141 @@ namespace lserver {
      * /////////////////////////////////////////////////////////////
      * Sanity checks passed
      */
+  }
 
+  int
+  LSContextPool::deactivate_context(std::size_t index)
+  {
+    std::unique_lock _{smtx_};
+
+    check_deactivation(index);
     int rc = lscontexts_[index].stop(false);
     return (rc);
   }
 
+  void
+  LSContextPool::drain_context(std::size_t index,
+                               std::chrono::milliseconds timeout)
+  {
+    std::unique_lock _{smtx_};
+
+    check_deactivation(index);
+    lscontexts_[index].drain(timeout);
+  }
+
+  void
+  LSContextPool::set_context_threads(std::size_t index,
+                                     std::size_t num_threads)
+  {
+    /*
+     * A shared lock is enough, and it does not block the acceptor while
+     * the LSContext waits for its threads to retire.
+     */
+    std::shared_lock _{smtx_};
+
+    if (index >= lscontexts_.size())
+      throw std::logic_error{"Bad context index"};
+
+    lscontexts_[index].resize_threads(num_threads);
+  }
+
+  void
+  LSContextPool::set_context_run_mode(std::size_t index, RunMode mode)
+  {
+    std::shared_lock _{smtx_};
+
+    if (index >= lscontexts_.size())
+      throw std::logic_error{"Bad context index"};
+
+    lscontexts_[index].set_run_mode(mode);
+  }
+
   std::vector<ContextInfo>
   LSContextPool::get_contexts_info() const
   {
+    std::shared_lock _{smtx_};
     std::vector<ContextInfo> contexts_info;
 
-    for (auto const& lscontext: lscontexts_)
-      contexts_info.push_back(lscontext.get_context_info());
+    for (auto const& lscontext: lscontexts_) {
+      auto& ci = contexts_info.emplace_back(lscontext.get_context_info());
+      ci.context_index_ = contexts_info.size() - 1;
+    }
 
     return contexts_info;
   }
 
+  void
+  LSContextPool::probe_lag()
+  {
+    std::shared_lock _{smtx_};
+
+    for (auto& lscontext: lscontexts_)
+      lscontext.probe_lag();
+  }
+
+  void
+  LSContextPool::sample_tcp_info(double ratio)
+  {
+    std::shared_lock _{smtx_};
+
+    for (auto& lscontext: lscontexts_)
+      if (lscontext.is_active())
+        lscontext.sample_tcp_info(ratio);
+  }
+
+  std::size_t
+  LSContextPool::rebalance()
+  {
+    std::shared_lock _{smtx_};
+    std::vector<std::size_t> sessions;
+    std::size_t total = 0;
+    std::size_t active = 0;
+
+    for (auto& lscontext: lscontexts_) {
+      total += sessions.emplace_back(lscontext.sessions_count());
+      if (lscontext.is_active())
+        active++;
+    }
+
+    if (active == 0)
+      return 0;
+
+    auto fair = (total + active - 1) / active;
+    std::vector<std::size_t> surplus(lscontexts_.size(), 0);
+    std::vector<std::size_t> deficit(lscontexts_.size(), 0);
+
+    for (std::size_t i = 0; i < lscontexts_.size(); ++i) {
+      if (!lscontexts_[i].is_active())
+        surplus[i] = sessions[i];
+      else if (sessions[i] > fair)
+        surplus[i] = sessions[i] - fair;
+      else
+        deficit[i] = fair - sessions[i];
+    }
+
+    /*
+     * Fill the largest deficits first
+     */
+    std::size_t scheduled = 0;
+    for (std::size_t i = 0; i < lscontexts_.size(); ++i) {
+      LSContext::MigrationPlan plan;
+
+      while (surplus[i] > 0) {
+        auto target = std::max_element(deficit.begin(), deficit.end());
+        auto count = std::min(surplus[i], *target);
+        if (count == 0)
+          break;
+
+        plan.emplace_back(&lscontexts_[target - deficit.begin()], count);
+        surplus[i] -= count;
+        *target -= count;
+        scheduled += count;
+      }
+
+      lscontexts_[i].request_migration(std::move(plan));
+    }
+
+    return scheduled;
+  }
+
 } // namespace lserver
\ No newline at end of file
@@ -29,8 +29,11 @@
 
 #pragma once
 
+#include <atomic>
+#include <chrono>
 #include <list>
 #include <shared_mutex>
+#include <string>
 #include <vector>
 
 #include <asio.hpp>
@@ -38,6 +41,7 @@
 #include "lscontext.hpp"
 #include "pool.hpp"
 #include "strand_pool.hpp"
+#include "thread_setup.hpp"
 
 namespace lserver {
   /*
@@ -47,8 +51,16 @@ namespace lserver {
    */
   class LSContextPool final {
   public:
+    /*
+     * The threads of the LSContext with index i are set up with
+     * thread_setups[i % thread_setups.size()], and named after 'name' and
+     * the index. New and recycled LSContexts start in 'run_mode'. If
+     * 'single_threaded' is set, the LSContexts are built single threaded.
+     */
     LSContextPool(std::size_t pool_size, std::size_t max_pool_size,
-                  std::size_t thread_multiplier);
+                  std::size_t thread_multiplier, std::string name = "lsctx",
+                  std::vector<ThreadSetup> thread_setups = {},
+                  RunMode run_mode = {}, bool single_threaded = false);
     LSContextPool(LSContextPool const&) = delete;
     LSContextPool(LSContextPool&&) = delete;
     LSContextPool& operator=(LSContextPool const&) = delete;
@@ -83,13 +95,68 @@ namespace lserver {
      * be currently removed.
      */
     int deactivate_context(std::size_t index);
+    /*
+     * Deactivate LSContext with specified index, and drain its sessions
+     * within 'timeout'. See LSContext::drain().
+     *
+     * throws std::logic_error for the same reasons as deactivate_context().
+     */
+    void drain_context(std::size_t index, std::chrono::milliseconds timeout);
+    /*
+     * Changes the number of threads of the active LSContext with the
+     * specified index in place.
+     *
+     * throws std::logic_error if the index is invalid, the LSContext is
+     * not active, or the number of threads is out of range.
+     */
+    void set_context_threads(std::size_t index, std::size_t num_threads);
+    /*
+     * Changes the run mode of the LSContext with the specified index.
+     *
+     * throws std::logic_error if the index is invalid.
+     */
+    void set_context_run_mode(std::size_t index, RunMode mode);
     /*
      * Returns the number of active LSContexts in this pool
      */
     std::size_t active_contexts_count();
     std::vector<ContextInfo> get_contexts_info() const;
+    /*
+     * Posts a lag probe to every active LSContext
+     */
+    void probe_lag();
+    /*
+     * Samples TCP_INFO of about 'ratio' of the sessions of every active
+     * LSContext. See LSContext::sample_tcp_info().
+     */
+    void sample_tcp_info(double ratio);
+    /*
+     * Asks the LSContexts with more than their fair share of sessions, and
+     * the deactivated LSContexts that still have sessions, to move their
+     * surplus to the least loaded active LSContexts. Sessions move the next
+     * time they are idle between two transactions.
+     * Returns the number of sessions asked to move.
+     */
+    std::size_t rebalance();
+    /*
+     * Calls 'f' with each active LSContext and its index.
+     */
+    template <class F>
+    void for_each_active_context(F&& f);
 
   private:
+    /*
+     * Throws std::logic_error if the LSContext with the specified index
+     * cannot be deactivated.
+     */
+    void check_deactivation(std::size_t index);
+    ThreadSetup thread_setup(std::size_t index) const;
+
+    std::string name_;
+    std::vector<ThreadSetup> thread_setups_;
+    RunMode run_mode_;
+    bool single_threaded_;
+
     mutable std::shared_mutex smtx_;
     /*
      * A vector of active and inactive LSContexts of this.
@@ -102,34 +169,52 @@ namespace lserver {
      */
     std::vector<LSContext> lscontexts_;
     /*
-     * The next lscontext that will potentially be dispatched in the next
-     * call to get_context_round_robin()
+     * get_context_round_robin() runs without smtx_. It reads the LSContexts
+     * through contexts_, which is stable since lscontexts_ never
+     * reallocates, and sees only the first contexts_cnt_ of them, which
+     * are fully constructed.
+     */
+    LSContext* contexts_ = nullptr;
+    std::atomic<std::size_t> contexts_cnt_ = 0;
+    /*
+     * The index (modulo contexts_cnt_) of the lscontext that will
+     * potentially be dispatched in the next call to
+     * get_context_round_robin()
      */
-    decltype(lscontexts_)::iterator next_context_;
+    std::atomic<std::size_t> next_context_ = 0;
   };
 
-  inline std::tuple<LSContext*, POI>
-  LSContextPool::get_context_round_robin() noexcept
+  template <class F>
+  inline void
+  LSContextPool::for_each_active_context(F&& f)
   {
     std::shared_lock _{smtx_};
 
+    for (auto& lscontext: lscontexts_) {
+      if (lscontext.is_active())
+        f(lscontext, static_cast<std::size_t>(&lscontext - data(lscontexts_)));
+    }
+  }
+
+  inline std::tuple<LSContext*, POI>
+  LSContextPool::get_context_round_robin() noexcept
+  {
     /*
      * Find the next acitve LSContext
      */
     while (true) {
-      auto chosen_context = next_context_++;
+      auto cnt = contexts_cnt_.load(std::memory_order_acquire);
+      POI id = next_context_.fetch_add(1, std::memory_order_relaxed) % cnt;
+      auto chosen_context = contexts_ + id;
 
       /*
-       * Wrap around
+       * Hold before checking, so that LSContext::stop() either sees the
+       * hold or we see the LSContext deactivated.
        */
-      if (next_context_ == lscontexts_.end())
-        next_context_ = lscontexts_.begin();
-
-      if (chosen_context->is_active()) {
-        POI id = (&(*chosen_context) - data(lscontexts_));
-        chosen_context->hold();
-        return std::make_tuple(&(*chosen_context), id);
-      }
+      chosen_context->hold();
+      if (chosen_context->is_active()) LS_LIKELY
+        return std::make_tuple(chosen_context, id);
+      chosen_context->unhold();
     }
     __builtin_unreachable();
   }
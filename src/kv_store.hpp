@@ -0,0 +1,698 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2021, Amin Saba
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "common.hpp"
+#include "syncronization_utils.hpp"
+
+namespace lserver {
+
+  /*
+   * An in-memory key-value store, sharded by the hash of the keys. Each
+   * shard is an open addressing hash table with linear probing. The key and
+   * value of an entry are stored back to back in a record, bump allocated
+   * from an arena of the shard, and never modified in place: overwriting a
+   * value allocates a new record.
+   *
+   * Writers of a shard are serialized by its mutex. Readers take no lock:
+   * they validate their lookup against the version of the shard, which
+   * writers keep odd while they modify it (a seqlock). Records stay valid
+   * while a reader is inside the shard, because the tables and arenas that
+   * writers replace are freed only once the readers that entered before
+   * have left (see Shard::reclaim()).
+   *
+   * Expiry times are absolute, in milliseconds of steady_clock, and expired
+   * entries are dropped lazily.
+   */
+  class KvStore {
+  public:
+    /*
+     * 'shards_cnt' is rounded up to a power of two. If it is 0, there is a
+     * shard for each hardware thread.
+     */
+    explicit KvStore(std::size_t shards_cnt = 0);
+    KvStore(KvStore const&) = delete;
+    KvStore& operator=(KvStore const&) = delete;
+
+    /*
+     * Calls 'f' with the value of 'key' and returns true, or returns false
+     * if there is none. The value is valid only during the call.
+     */
+    template <class F>
+    bool get(std::string_view key, F&& f) const;
+    /*
+     * 'expire_at_ms' of 0 means no expiry
+     */
+    void set(std::string_view key, std::string_view value,
+             int64_t expire_at_ms = 0);
+    /*
+     * Returns true if 'key' existed
+     */
+    bool del(std::string_view key);
+    /*
+     * Sets the expiry of an existing 'key'. Returns false if there is none.
+     */
+    bool expire(std::string_view key, int64_t expire_at_ms);
+    std::size_t size() const noexcept;
+    std::size_t shards_count() const noexcept;
+    /*
+     * Number of tables and arenas replaced by writers and not freed yet
+     */
+    std::size_t retired_count() const noexcept;
+
+    static int64_t now_ms() noexcept;
+
+  private:
+    struct Record {
+      uint32_t key_len;
+      uint32_t value_len;
+
+      char const* key() const noexcept;
+      char const* value() const noexcept;
+      std::size_t size() const noexcept;
+    };
+
+    struct Slot {
+      /*
+       * kEmpty, kTombstone, or the hash of the key of 'record'
+       */
+      std::atomic<uint64_t> hash;
+      std::atomic<Record const*> record;
+      std::atomic<int64_t> expire_at_ms;
+    };
+
+    struct Table {
+      explicit Table(std::size_t capacity);
+
+      std::size_t mask;
+      std::unique_ptr<Slot[]> slots;
+    };
+
+    /*
+     * Blocks of records. Records are never freed one by one; the live ones
+     * are copied to a new arena when the garbage grows too large.
+     */
+    class Arena {
+    public:
+      Record* allocate(std::string_view key, std::string_view value);
+
+    private:
+      static constexpr std::size_t kBlockSize = 1ul << 20;
+      std::vector<std::unique_ptr<char[]>> blocks_;
+      char* cursor_ = nullptr;
+      std::size_t left_ = 0;
+    };
+
+    class ALIGN_DESTRUCTIVE Shard {
+    public:
+      Shard();
+
+      template <class F>
+      bool get(uint64_t hash, std::string_view key, F&& f) const;
+      void set(uint64_t hash, std::string_view key, std::string_view value,
+               int64_t expire_at_ms);
+      bool del(uint64_t hash, std::string_view key);
+      bool expire(uint64_t hash, std::string_view key, int64_t expire_at_ms);
+      std::size_t size() const noexcept;
+      std::size_t retired_count() const noexcept;
+
+    private:
+      /*
+       * Returns the slot of 'key', or nullptr. It is safe to call without
+       * the mutex, but the result must then be validated against version_.
+       */
+      Slot* find(Table const* table, uint64_t hash,
+                 std::string_view key) const noexcept;
+      /*
+       * Returns the live slot of 'key' or, if there is none, the slot to
+       * insert it in. Requires the mutex.
+       */
+      Slot* find_for_insert(uint64_t hash, std::string_view key) noexcept;
+      void remove(Slot* slot) noexcept;
+      /*
+       * Moves the live entries to a new table of 'capacity' slots and a new
+       * arena, and retires the old ones.
+       */
+      void rebuild(std::size_t capacity);
+      /*
+       * Frees the tables and arenas retired before the last flip of
+       * generation_ once its readers have left, and flips it again for
+       * the ones retired since.
+       */
+      void reclaim();
+      /*
+       * Waits for the readers of the previous generation while too many
+       * tables and arenas are retired, so that a reader preempted inside
+       * the shard cannot make writers pile them up. Requires the mutex,
+       * and version_ to be even, since such a reader may be waiting for
+       * the writer.
+       */
+      void limit_retired();
+      /*
+       * The stripe of readers_ that the calling thread counts itself in
+       */
+      static std::size_t reader_stripe() noexcept;
+
+      /*
+       * Makes version_ odd for the lifetime of the guard
+       */
+      class WriteGuard {
+      public:
+        explicit WriteGuard(Shard& shard);
+        ~WriteGuard();
+
+      private:
+        Shard& shard_;
+        std::scoped_lock<std::mutex> lock_;
+      };
+
+      /*
+       * Readers count themselves in the current generation, on the stripe
+       * of their thread, so that concurrent reads do not all write the
+       * same cache line.
+       */
+      struct ALIGN_DESTRUCTIVE ReaderStripe {
+        std::atomic<std::size_t> readers[2] = {};
+      };
+
+      struct Retired {
+        std::unique_ptr<Table> table;
+        std::unique_ptr<Arena> arena;
+      };
+
+      static constexpr std::size_t kInitialCapacity = 64;
+      static constexpr std::size_t kReaderStripes = 16;
+      static constexpr std::size_t kMaxRetired = 2;
+
+      mutable std::array<ReaderStripe, kReaderStripes> readers_;
+      std::atomic<unsigned> generation_ = 0;
+      std::atomic<uint64_t> version_ = 0;
+      std::atomic<Table*> table_;
+      std::mutex mtx_;
+      std::unique_ptr<Table> owned_table_;
+      std::unique_ptr<Arena> arena_;
+      /*
+       * Retired since the last flip of generation_, and before it
+       */
+      std::vector<Retired> retired_;
+      std::vector<Retired> draining_;
+      std::atomic<std::size_t> retired_cnt_ = 0;
+      std::atomic<std::size_t> size_ = 0;
+      std::size_t tombstones_ = 0;
+      std::size_t live_bytes_ = 0;
+      std::size_t dead_bytes_ = 0;
+    };
+
+    static constexpr uint64_t kEmpty = 0;
+    static constexpr uint64_t kTombstone = 1;
+
+    static uint64_t hash_of(std::string_view key) noexcept;
+    Shard& shard_of(uint64_t hash) const noexcept;
+    static bool expired(int64_t expire_at_ms, int64_t now) noexcept;
+
+    std::unique_ptr<Shard[]> shards_;
+    std::size_t shard_mask_;
+  };
+
+  inline char const*
+  KvStore::Record::key() const noexcept
+  {
+    return reinterpret_cast<char const*>(this + 1);
+  }
+
+  inline char const*
+  KvStore::Record::value() const noexcept
+  {
+    return key() + key_len;
+  }
+
+  inline std::size_t
+  KvStore::Record::size() const noexcept
+  {
+    return sizeof(Record) + key_len + value_len;
+  }
+
+  inline KvStore::Table::Table(std::size_t capacity)
+      : mask{capacity - 1}
+      , slots{std::make_unique<Slot[]>(capacity)}
+  { }
+
+  inline KvStore::Record*
+  KvStore::Arena::allocate(std::string_view key, std::string_view value)
+  {
+    auto size = sizeof(Record) + key.size() + value.size();
+    size = (size + alignof(Record) - 1) & ~(alignof(Record) - 1);
+
+    if (size > left_) {
+      auto block_size = std::max(kBlockSize, size);
+      cursor_ = blocks_.emplace_back(std::make_unique<char[]>(block_size)).get();
+      left_ = block_size;
+    }
+
+    auto record = reinterpret_cast<Record*>(cursor_);
+    cursor_ += size;
+    left_ -= size;
+
+    record->key_len = key.size();
+    record->value_len = value.size();
+    std::memcpy(record + 1, key.data(), key.size());
+    std::memcpy(reinterpret_cast<char*>(record + 1) + key.size(),
+                value.data(), value.size());
+    return record;
+  }
+
+  inline KvStore::Shard::Shard()
+      : owned_table_{std::make_unique<Table>(kInitialCapacity)}
+      , arena_{std::make_unique<Arena>()}
+  {
+    table_.store(owned_table_.get());
+  }
+
+  inline KvStore::Shard::WriteGuard::WriteGuard(Shard& shard)
+      : shard_{shard}
+      , lock_{shard.mtx_}
+  {
+    shard_.limit_retired();
+    shard_.version_.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+
+  inline KvStore::Shard::WriteGuard::~WriteGuard()
+  {
+    shard_.version_.fetch_add(1, std::memory_order_release);
+    shard_.reclaim();
+  }
+
+  inline KvStore::Slot*
+  KvStore::Shard::find(Table const* table, uint64_t hash,
+                       std::string_view key) const noexcept
+  {
+    for (auto i = hash & table->mask;; i = (i + 1) & table->mask) {
+      auto& slot = table->slots[i];
+      auto slot_hash = slot.hash.load(std::memory_order_relaxed);
+      if (slot_hash == kEmpty)
+        return nullptr;
+      if (slot_hash != hash)
+        continue;
+
+      auto record = slot.record.load(std::memory_order_acquire);
+      if (record && record->key_len == key.size() &&
+          std::memcmp(record->key(), key.data(), key.size()) == 0)
+        return &slot;
+    }
+  }
+
+  template <class F>
+  inline bool
+  KvStore::Shard::get(uint64_t hash, std::string_view key, F&& f) const
+  {
+    /*
+     * Entering the shard keeps the records and the table alive. A reader
+     * that joined a generation that was flipped under it could be missed
+     * by reclaim(), so it leaves and joins the new one before it loads the
+     * table.
+     */
+    auto& stripe = readers_[reader_stripe()];
+    unsigned generation;
+    while (true) {
+      generation = generation_.load();
+      stripe.readers[generation].fetch_add(1);
+      if (generation_.load() == generation) LS_LIKELY
+        break;
+      stripe.readers[generation].fetch_sub(1);
+    }
+    Record const* record = nullptr;
+
+    while (true) {
+      auto version = version_.load(std::memory_order_acquire);
+      if (version & 1) LS_UNLIKELY {
+        cpu_relax();
+        continue;
+      }
+
+      record = nullptr;
+      if (auto slot = find(table_.load(), hash, key)) {
+        record = slot->record.load(std::memory_order_relaxed);
+        if (expired(slot->expire_at_ms.load(std::memory_order_relaxed),
+                    now_ms()))
+          record = nullptr;
+      }
+
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (version_.load(std::memory_order_relaxed) == version) LS_LIKELY
+        break;
+    }
+
+    if (record)
+      f(std::string_view{record->value(), record->value_len});
+    stripe.readers[generation].fetch_sub(1);
+    return record != nullptr;
+  }
+
+  inline KvStore::Slot*
+  KvStore::Shard::find_for_insert(uint64_t hash, std::string_view key) noexcept
+  {
+    auto table = owned_table_.get();
+    Slot* tombstone = nullptr;
+
+    for (auto i = hash & table->mask;; i = (i + 1) & table->mask) {
+      auto& slot = table->slots[i];
+      auto slot_hash = slot.hash.load(std::memory_order_relaxed);
+      if (slot_hash == kEmpty)
+        return tombstone ? tombstone : &slot;
+      if (slot_hash == kTombstone) {
+        if (!tombstone)
+          tombstone = &slot;
+        continue;
+      }
+      if (slot_hash != hash)
+        continue;
+
+      auto record = slot.record.load(std::memory_order_relaxed);
+      if (record->key_len == key.size() &&
+          std::memcmp(record->key(), key.data(), key.size()) == 0)
+        return &slot;
+    }
+  }
+
+  inline void
+  KvStore::Shard::set(uint64_t hash, std::string_view key,
+                      std::string_view value, int64_t expire_at_ms)
+  {
+    WriteGuard _{*this};
+
+    /*
+     * Keep the load factor, tombstones included, below 3/4
+     */
+    auto capacity = owned_table_->mask + 1;
+    if ((size_.load() + tombstones_ + 1) * 4 > capacity * 3) LS_UNLIKELY
+      rebuild(size_.load() * 2 >= capacity ? capacity * 2 : capacity);
+
+    auto slot = find_for_insert(hash, key);
+    auto old = slot->record.load(std::memory_order_relaxed);
+    auto record = arena_->allocate(key, value);
+
+    if (old) {
+      dead_bytes_ += old->size();
+      live_bytes_ -= old->size();
+    } else {
+      if (slot->hash.load(std::memory_order_relaxed) == kTombstone)
+        --tombstones_;
+      size_.fetch_add(1, std::memory_order_relaxed);
+    }
+    live_bytes_ += record->size();
+
+    slot->record.store(record, std::memory_order_release);
+    slot->expire_at_ms.store(expire_at_ms, std::memory_order_relaxed);
+    slot->hash.store(hash, std::memory_order_relaxed);
+
+    /*
+     * Copy the live records to a new arena once most of it is garbage
+     */
+    if (dead_bytes_ > (1ul << 20) && dead_bytes_ > live_bytes_) LS_UNLIKELY
+      rebuild(capacity);
+  }
+
+  inline void
+  KvStore::Shard::remove(Slot* slot) noexcept
+  {
+    auto record = slot->record.load(std::memory_order_relaxed);
+    dead_bytes_ += record->size();
+    live_bytes_ -= record->size();
+    slot->record.store(nullptr, std::memory_order_relaxed);
+    slot->hash.store(kTombstone, std::memory_order_relaxed);
+    ++tombstones_;
+    size_.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  inline bool
+  KvStore::Shard::del(uint64_t hash, std::string_view key)
+  {
+    WriteGuard _{*this};
+
+    auto slot = find(owned_table_.get(), hash, key);
+    if (!slot)
+      return false;
+
+    bool existed =
+        !expired(slot->expire_at_ms.load(std::memory_order_relaxed), now_ms());
+    remove(slot);
+    return existed;
+  }
+
+  inline bool
+  KvStore::Shard::expire(uint64_t hash, std::string_view key,
+                         int64_t expire_at_ms)
+  {
+    WriteGuard _{*this};
+
+    auto slot = find(owned_table_.get(), hash, key);
+    if (!slot)
+      return false;
+    if (expired(slot->expire_at_ms.load(std::memory_order_relaxed),
+                now_ms())) {
+      remove(slot);
+      return false;
+    }
+
+    slot->expire_at_ms.store(expire_at_ms, std::memory_order_relaxed);
+    return true;
+  }
+
+  inline void
+  KvStore::Shard::rebuild(std::size_t capacity)
+  {
+    auto table = std::make_unique<Table>(capacity);
+    auto arena = std::make_unique<Arena>();
+    auto now = now_ms();
+    std::size_t size = 0;
+    live_bytes_ = 0;
+
+    for (std::size_t i = 0; i <= owned_table_->mask; ++i) {
+      auto& slot = owned_table_->slots[i];
+      auto record = slot.record.load(std::memory_order_relaxed);
+      auto expire_at_ms = slot.expire_at_ms.load(std::memory_order_relaxed);
+      if (!record || expired(expire_at_ms, now))
+        continue;
+
+      auto hash = slot.hash.load(std::memory_order_relaxed);
+      auto copy = arena->allocate({record->key(), record->key_len},
+                                  {record->value(), record->value_len});
+      auto j = hash & table->mask;
+      while (table->slots[j].hash.load(std::memory_order_relaxed) != kEmpty)
+        j = (j + 1) & table->mask;
+      table->slots[j].hash.store(hash, std::memory_order_relaxed);
+      table->slots[j].record.store(copy, std::memory_order_relaxed);
+      table->slots[j].expire_at_ms.store(expire_at_ms,
+                                         std::memory_order_relaxed);
+      live_bytes_ += copy->size();
+      ++size;
+    }
+
+    table_.store(table.get());
+    retired_.push_back({std::move(owned_table_), std::move(arena_)});
+    retired_cnt_.store(retired_.size() + draining_.size(),
+                       std::memory_order_relaxed);
+    owned_table_ = std::move(table);
+    arena_ = std::move(arena);
+    size_.store(size, std::memory_order_relaxed);
+    tombstones_ = 0;
+    dead_bytes_ = 0;
+  }
+
+  inline void
+  KvStore::Shard::reclaim()
+  {
+    if (retired_.empty() && draining_.empty()) LS_LIKELY
+      return;
+
+    /*
+     * Only the readers of the previous generation can still use the
+     * memory in draining_. New readers join the current one, so the
+     * previous one empties even under a steady stream of reads. A reader
+     * that joins it late sees the flip and moves on, and a reader that
+     * joins the current one sees the new table, since both sides use
+     * sequentially consistent operations.
+     */
+    if (!draining_.empty()) {
+      auto previous = generation_.load() ^ 1;
+      for (auto const& stripe: readers_)
+        if (stripe.readers[previous].load() != 0)
+          return;
+      draining_.clear();
+    }
+
+    if (!retired_.empty()) {
+      std::swap(draining_, retired_);
+      generation_.fetch_xor(1);
+    }
+    retired_cnt_.store(retired_.size() + draining_.size(),
+                       std::memory_order_relaxed);
+  }
+
+  inline void
+  KvStore::Shard::limit_retired()
+  {
+    while (retired_.size() + draining_.size() >= kMaxRetired) LS_UNLIKELY {
+      reclaim();
+      if (retired_.size() + draining_.size() >= kMaxRetired)
+        std::this_thread::yield();
+    }
+  }
+
+  inline std::size_t
+  KvStore::Shard::reader_stripe() noexcept
+  {
+    static std::atomic<std::size_t> next_stripe = 0;
+    thread_local std::size_t stripe =
+        next_stripe.fetch_add(1, std::memory_order_relaxed) % kReaderStripes;
+    return stripe;
+  }
+
+  inline std::size_t
+  KvStore::Shard::size() const noexcept
+  {
+    return size_.load(std::memory_order_relaxed);
+  }
+
+  inline std::size_t
+  KvStore::Shard::retired_count() const noexcept
+  {
+    return retired_cnt_.load(std::memory_order_relaxed);
+  }
+
+  inline KvStore::KvStore(std::size_t shards_cnt)
+  {
+    if (shards_cnt == 0)
+      shards_cnt = std::max(1u, std::thread::hardware_concurrency());
+    shards_cnt = std::bit_ceil(shards_cnt);
+
+    shards_ = std::make_unique<Shard[]>(shards_cnt);
+    shard_mask_ = shards_cnt - 1;
+  }
+
+  inline uint64_t
+  KvStore::hash_of(std::string_view key) noexcept
+  {
+    uint64_t hash = std::hash<std::string_view>{}(key);
+    return hash < 2 ? hash + 2 : hash;
+  }
+
+  inline KvStore::Shard&
+  KvStore::shard_of(uint64_t hash) const noexcept
+  {
+    /*
+     * The low bits pick the slot, so the shard comes from the high ones
+     */
+    return shards_[(hash >> 40) & shard_mask_];
+  }
+
+  inline bool
+  KvStore::expired(int64_t expire_at_ms, int64_t now) noexcept
+  {
+    return expire_at_ms != 0 && expire_at_ms <= now;
+  }
+
+  inline int64_t
+  KvStore::now_ms() noexcept
+  {
+    using namespace std::chrono;
+    return duration_cast<milliseconds>(steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  template <class F>
+  inline bool
+  KvStore::get(std::string_view key, F&& f) const
+  {
+    auto hash = hash_of(key);
+    return shard_of(hash).get(hash, key, std::forward<F>(f));
+  }
+
+  inline void
+  KvStore::set(std::string_view key, std::string_view value,
+               int64_t expire_at_ms)
+  {
+    auto hash = hash_of(key);
+    shard_of(hash).set(hash, key, value, expire_at_ms);
+  }
+
+  inline bool
+  KvStore::del(std::string_view key)
+  {
+    auto hash = hash_of(key);
+    return shard_of(hash).del(hash, key);
+  }
+
+  inline bool
+  KvStore::expire(std::string_view key, int64_t expire_at_ms)
+  {
+    auto hash = hash_of(key);
+    return shard_of(hash).expire(hash, key, expire_at_ms);
+  }
+
+  inline std::size_t
+  KvStore::size() const noexcept
+  {
+    std::size_t size = 0;
+    for (std::size_t i = 0; i <= shard_mask_; ++i)
+      size += shards_[i].size();
+    return size;
+  }
+
+  inline std::size_t
+  KvStore::shards_count() const noexcept
+  {
+    return shard_mask_ + 1;
+  }
+
+  inline std::size_t
+  KvStore::retired_count() const noexcept
+  {
+    std::size_t count = 0;
+    for (std::size_t i = 0; i <= shard_mask_; ++i)
+      count += shards_[i].retired_count();
+    return count;
+  }
+} // namespace lserver
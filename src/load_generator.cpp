@@ -0,0 +1,869 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2021, Amin Saba
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <fstream>
+#include <future>
+#include <numeric>
+#include <sstream>
+#include <thread>
+
+#include "common.hpp"
+#include "load_generator.hpp"
+#include "socket_options.hpp"
+#include "utils.hpp"
+
+namespace lserver {
+
+  using tcp = asio::ip::tcp;
+  using lg_clock = std::chrono::steady_clock;
+
+  /*
+   * Disables Nagle's algorithm on a TCP connection. Unix domain sockets
+   * have no such option.
+   */
+  static void
+  set_no_delay(stream_protocol::socket& socket,
+               stream_protocol::endpoint const& endpoint)
+  {
+    if (endpoint.protocol().family() != AF_UNIX)
+      socket.set_option(tcp::no_delay(true));
+  }
+
+  /*
+   * Drives a share of the connections and of the arrival rate of a
+   * LoadGenerator on a single LSContext. All of its methods run on the
+   * single thread of that LSContext.
+   */
+  class LoadGenerator::Driver {
+    struct Request {
+      lg_clock::time_point intended_time;
+      std::size_t workload;
+    };
+
+    class Connection;
+
+  public:
+    Driver(LSContext& lscontext, LoadProfile const& profile,
+           std::vector<std::string> const& requests,
+           std::size_t connections_cnt, double rate);
+    ~Driver() noexcept;
+    /*
+     * Must be called from the thread of the LSContext.
+     */
+    void start(lg_clock::time_point start_time);
+    /*
+     * Resolves when the driver has finished all of its outstanding
+     * requests and closed its connections.
+     */
+    std::future<LoadReport> get_report();
+
+  private:
+    void tick();
+    void issue(Request req);
+    void on_idle(Connection* conn);
+    void on_complete(Connection* conn, Request const& req, bool ok,
+                     lg_clock::time_point sent_time);
+    void finish_if_drained();
+    std::size_t pick_workload();
+
+    LSContext& lscontext_;
+    LoadProfile const& profile_;
+    std::vector<std::string> const& requests_;
+    stream_protocol::endpoint endpoint_;
+    asio::steady_timer timer_;
+    std::vector<std::unique_ptr<Connection>> connections_;
+    std::deque<Connection*> idle_;
+    /*
+     * Requests whose arrival time has passed, but that are still waiting
+     * for a free connection.
+     */
+    std::deque<Request> backlog_;
+    std::vector<std::size_t> cumulative_weights_;
+    std::size_t next_pick_ = 0;
+    lg_clock::duration interval_;
+    lg_clock::time_point next_arrival_;
+    lg_clock::time_point measure_start_;
+    lg_clock::time_point end_;
+    std::size_t in_flight_ = 0;
+    /*
+     * Closed loop: every connection issues its next request as soon as
+     * the previous one completes, between the start and end times.
+     */
+    bool closed_loop_;
+    bool looping_ = false;
+    bool finished_ = false;
+    LoadReport report_;
+    std::promise<LoadReport> report_promise_;
+  };
+
+  /*
+   * A keep-alive HTTP/1.1 client connection with at most one request in
+   * flight.
+   */
+  class LoadGenerator::Driver::Connection {
+  public:
+    Connection(Driver& driver, asio::io_context& io_context)
+        : driver_{driver}
+        , socket_{io_context}
+    { }
+
+    void connect();
+    void send(Request req);
+    void close();
+    bool busy() const { return busy_; }
+
+  private:
+    void read_header();
+    void read_body(std::size_t header_len, std::size_t body_len);
+    void read_remaining();
+    void done(bool ok);
+
+    Driver& driver_;
+    stream_protocol::socket socket_;
+    std::string buf_;
+    Request req_;
+    lg_clock::time_point sent_time_;
+    std::size_t body_remaining_ = 0;
+    bool busy_ = false;
+    bool keep_alive_ = true;
+    bool status_ok_ = false;
+    bool closed_ = false;
+  };
+
+  void
+  LoadGenerator::Driver::Connection::connect()
+  {
+    busy_ = true;
+    socket_ = stream_protocol::socket{socket_.get_executor()};
+    socket_.async_connect(driver_.endpoint_, [this](std::error_code error) {
+      busy_ = false;
+      if (error) LS_UNLIKELY {
+        lslog(2, "lsbench connect failed:", error.message());
+        closed_ = true;
+        driver_.finish_if_drained();
+        return;
+      }
+      set_no_delay(socket_, driver_.endpoint_);
+      keep_alive_ = true;
+      driver_.on_idle(this);
+    });
+  }
+
+  void
+  LoadGenerator::Driver::Connection::send(Request req)
+  {
+    req_ = req;
+    busy_ = true;
+    sent_time_ = lg_clock::now();
+    auto const& bytes = driver_.requests_[req.workload];
+    asio::async_write(socket_, asio::buffer(bytes),
+                      [this](std::error_code error, std::size_t n) {
+                        driver_.report_.bytes_sent += n;
+                        if (error) LS_UNLIKELY
+                          return done(false);
+                        read_header();
+                      });
+  }
+
+  void
+  LoadGenerator::Driver::Connection::read_header()
+  {
+    asio::async_read_until(
+        socket_, asio::dynamic_buffer(buf_), "\r\n\r\n",
+        [this](std::error_code error, std::size_t header_len) {
+          if (error) LS_UNLIKELY
+            return done(false);
+
+          auto const* h = buf_.data();
+          std::size_t body_len = 0;
+
+          constexpr char cl[] = "content-length:";
+          auto pos = nocase_find_substr(h, header_len, cl, sizeof(cl) - 1);
+          if (pos != std::string::npos)
+            body_len = std::strtoul(h + pos + sizeof(cl) - 1, nullptr, 10);
+
+          constexpr char cc[] = "connection: close";
+          keep_alive_ = (nocase_find_substr(h, header_len, cc,
+                                            sizeof(cc) - 1) ==
+                         std::string::npos);
+
+          /*
+           * "HTTP/1.1 XXX"
+           */
+          status_ok_ = header_len > 12 && h[9] == '2';
+          if (!status_ok_) LS_UNLIKELY
+            keep_alive_ = false;
+
+          read_body(header_len, body_len);
+        });
+  }
+
+  void
+  LoadGenerator::Driver::Connection::read_body(std::size_t header_len,
+                                               std::size_t body_len)
+  {
+    std::size_t buffered = buf_.size() - header_len;
+    driver_.report_.bytes_received += header_len;
+
+    if (buffered >= body_len) {
+      driver_.report_.bytes_received += body_len;
+      buf_.clear();
+      return done(status_ok_);
+    }
+
+    driver_.report_.bytes_received += buffered;
+    body_remaining_ = body_len - buffered;
+    buf_.resize(64 * 1024);
+    read_remaining();
+  }
+
+  void
+  LoadGenerator::Driver::Connection::read_remaining()
+  {
+    /*
+     * The body is discarded, so we just need to count the bytes
+     */
+    auto n = std::min(body_remaining_, buf_.size());
+    asio::async_read(socket_, asio::buffer(buf_.data(), n),
+                     [this](std::error_code error, std::size_t n) {
+                       driver_.report_.bytes_received += n;
+                       body_remaining_ -= n;
+                       if (error) LS_UNLIKELY
+                         return done(false);
+                       if (body_remaining_ > 0)
+                         return read_remaining();
+                       buf_.clear();
+                       done(status_ok_);
+                     });
+  }
+
+  void
+  LoadGenerator::Driver::Connection::done(bool ok)
+  {
+    busy_ = false;
+    driver_.on_complete(this, req_, ok, sent_time_);
+
+    if (closed_)
+      return;
+
+    if (!ok || !keep_alive_) LS_UNLIKELY {
+      buf_.clear();
+      asio::error_code ec;
+      socket_.close(ec);
+      connect();
+      return;
+    }
+
+    driver_.on_idle(this);
+  }
+
+  void
+  LoadGenerator::Driver::Connection::close()
+  {
+    closed_ = true;
+    asio::error_code ec;
+    socket_.close(ec);
+  }
+
+  LoadGenerator::Driver::Driver(LSContext& lscontext,
+                                LoadProfile const& profile,
+                                std::vector<std::string> const& requests,
+                                std::size_t connections_cnt, double rate)
+      : lscontext_{lscontext}
+      , profile_{profile}
+      , requests_{requests}
+      , endpoint_{make_stream_endpoint(profile.address, profile.port)}
+      , timer_{lscontext.get_io_context()}
+      , interval_{rate > 0 ? std::chrono::duration_cast<lg_clock::duration>(
+                                 std::chrono::duration<double>(1.0 / rate))
+                           : lg_clock::duration::zero()}
+      , closed_loop_{rate == 0}
+  {
+    for (std::size_t i = 0; i < connections_cnt; ++i)
+      connections_.emplace_back(
+          std::make_unique<Connection>(*this, lscontext_.get_io_context()));
+
+    std::size_t sum = 0;
+    for (auto const& w: profile_.workloads)
+      cumulative_weights_.push_back(sum += w.weight);
+  }
+
+  LoadGenerator::Driver::~Driver() noexcept = default;
+
+  void
+  LoadGenerator::Driver::start(lg_clock::time_point start_time)
+  {
+    next_arrival_ = start_time;
+    measure_start_ = start_time + profile_.warmup;
+    end_ = measure_start_ + profile_.duration;
+
+    for (auto& conn: connections_)
+      conn->connect();
+
+    timer_.expires_at(next_arrival_);
+    timer_.async_wait([this](std::error_code) { tick(); });
+  }
+
+  std::future<LoadReport>
+  LoadGenerator::Driver::get_report()
+  {
+    return report_promise_.get_future();
+  }
+
+  std::size_t
+  LoadGenerator::Driver::pick_workload()
+  {
+    /*
+     * Deterministic weighted round-robin over the workload mix
+     */
+    auto total = cumulative_weights_.back();
+    auto slot = next_pick_++ % total;
+    return std::upper_bound(cumulative_weights_.begin(),
+                            cumulative_weights_.end(), slot) -
+           cumulative_weights_.begin();
+  }
+
+  void
+  LoadGenerator::Driver::tick()
+  {
+    auto now = lg_clock::now();
+
+    if (closed_loop_) LS_UNLIKELY {
+      if (!looping_ && now < end_) {
+        looping_ = true;
+        for (auto n = idle_.size(); n > 0; --n)
+          issue(Request{now, pick_workload()});
+        timer_.expires_at(end_);
+        timer_.async_wait([this](std::error_code) { tick(); });
+        return;
+      }
+      looping_ = false;
+      next_arrival_ = end_;
+      finish_if_drained();
+      return;
+    }
+
+    /*
+     * Issue every arrival that is due, even if the timer fired late, so
+     * that the arrival rate does not depend on the responsiveness of
+     * the server.
+     */
+    while (next_arrival_ <= now && next_arrival_ < end_) {
+      issue(Request{next_arrival_, pick_workload()});
+      next_arrival_ += interval_;
+    }
+
+    if (next_arrival_ < end_) LS_LIKELY {
+      timer_.expires_at(next_arrival_);
+      timer_.async_wait([this](std::error_code) { tick(); });
+      return;
+    }
+
+    finish_if_drained();
+  }
+
+  void
+  LoadGenerator::Driver::issue(Request req)
+  {
+    if (req.intended_time >= measure_start_)
+      report_.requests_cnt++;
+
+    if (idle_.empty()) LS_UNLIKELY {
+      backlog_.push_back(req);
+      return;
+    }
+
+    auto conn = idle_.front();
+    idle_.pop_front();
+    in_flight_++;
+    conn->send(req);
+  }
+
+  void
+  LoadGenerator::Driver::on_idle(Connection* conn)
+  {
+    if (!backlog_.empty()) {
+      auto req = backlog_.front();
+      backlog_.pop_front();
+      in_flight_++;
+      conn->send(req);
+      return;
+    }
+
+    idle_.push_back(conn);
+
+    if (looping_) {
+      issue(Request{lg_clock::now(), pick_workload()});
+      return;
+    }
+
+    finish_if_drained();
+  }
+
+  void
+  LoadGenerator::Driver::on_complete(Connection* conn, Request const& req,
+                                     bool ok, lg_clock::time_point sent_time)
+  {
+    using std::chrono::duration_cast;
+    using std::chrono::microseconds;
+
+    in_flight_--;
+    if (req.intended_time < measure_start_)
+      return;
+
+    if (!ok) LS_UNLIKELY {
+      report_.errors_cnt++;
+      return;
+    }
+
+    auto now = lg_clock::now();
+    report_.completed_cnt++;
+    report_.latency.record(
+        duration_cast<microseconds>(now - req.intended_time).count());
+    report_.service_time.record(
+        duration_cast<microseconds>(now - sent_time).count());
+  }
+
+  void
+  LoadGenerator::Driver::finish_if_drained()
+  {
+    if (finished_ || next_arrival_ < end_)
+      return;
+
+    bool busy = std::any_of(connections_.begin(), connections_.end(),
+                            [](auto const& c) { return c->busy(); });
+    if (in_flight_ > 0 || busy)
+      return;
+
+    /*
+     * Requests still in the backlog at this point can never be sent,
+     * because all connections have failed.
+     */
+    report_.errors_cnt += backlog_.size();
+    backlog_.clear();
+
+    finished_ = true;
+    for (auto& conn: connections_)
+      conn->close();
+    report_promise_.set_value(report_);
+  }
+
+  /*
+   * Replays a share of the streams of a capture on a single LSContext,
+   * with the original timing of the connections and of their chunks.
+   * All of its methods run on the single thread of that LSContext.
+   */
+  class LoadGenerator::Replayer {
+    class Stream;
+
+  public:
+    Replayer(LSContext& lscontext, LoadProfile const& profile,
+             std::vector<CaptureStream const*> const& streams);
+    ~Replayer() noexcept;
+    void start(lg_clock::time_point start_time);
+    std::future<LoadReport> get_report();
+
+  private:
+    void on_stream_done(bool ok);
+
+    LSContext& lscontext_;
+    stream_protocol::endpoint endpoint_;
+    std::vector<std::unique_ptr<Stream>> streams_;
+    std::size_t active_cnt_ = 0;
+    LoadReport report_;
+    std::promise<LoadReport> report_promise_;
+  };
+
+  /*
+   * Re-sends the chunks of a single captured connection. Responses are
+   * read and discarded.
+   */
+  class LoadGenerator::Replayer::Stream {
+  public:
+    Stream(Replayer& replayer, asio::io_context& io_context,
+           CaptureStream const& captured)
+        : replayer_{replayer}
+        , captured_{captured}
+        , socket_{io_context}
+        , timer_{io_context}
+        , buf_(64 * 1024)
+    { }
+
+    void start(lg_clock::time_point start_time);
+
+  private:
+    void connect();
+    void send_next();
+    void read();
+    void shutdown();
+    void maybe_finish();
+
+    Replayer& replayer_;
+    CaptureStream const& captured_;
+    stream_protocol::socket socket_;
+    asio::steady_timer timer_;
+    std::vector<char> buf_;
+    lg_clock::time_point start_time_;
+    std::size_t next_chunk_ = 0;
+    bool reading_done_ = false;
+    bool failed_ = false;
+    bool finished_ = false;
+  };
+
+  void
+  LoadGenerator::Replayer::Stream::start(lg_clock::time_point start_time)
+  {
+    start_time_ = start_time;
+    timer_.expires_at(start_time_ + captured_.open_time);
+    timer_.async_wait([this](std::error_code) { connect(); });
+  }
+
+  void
+  LoadGenerator::Replayer::Stream::connect()
+  {
+    socket_.async_connect(replayer_.endpoint_, [this](std::error_code error) {
+      if (error) LS_UNLIKELY {
+        lslog(2, "lsbench connect failed:", error.message());
+        failed_ = true;
+        reading_done_ = true;
+        next_chunk_ = captured_.chunks.size();
+        return maybe_finish();
+      }
+      set_no_delay(socket_, replayer_.endpoint_);
+      read();
+      send_next();
+    });
+  }
+
+  void
+  LoadGenerator::Replayer::Stream::send_next()
+  {
+    if (next_chunk_ == captured_.chunks.size()) {
+      timer_.expires_at(start_time_ + captured_.close_time);
+      timer_.async_wait([this](std::error_code error) {
+        if (!error)
+          shutdown();
+      });
+      return maybe_finish();
+    }
+
+    auto const& chunk = captured_.chunks[next_chunk_];
+    auto due = start_time_ + chunk.time;
+    timer_.expires_at(due);
+    timer_.async_wait([this, &chunk, due](std::error_code) {
+      auto write_time = lg_clock::now();
+      asio::async_write(
+          socket_, asio::buffer(chunk.data, chunk.length),
+          [this, due, write_time](std::error_code error, std::size_t n) {
+            using std::chrono::duration_cast;
+            using std::chrono::microseconds;
+
+            auto& report = replayer_.report_;
+            auto now = lg_clock::now();
+            report.requests_cnt++;
+            report.bytes_sent += n;
+            next_chunk_++;
+
+            if (error) LS_UNLIKELY {
+              failed_ = true;
+              next_chunk_ = captured_.chunks.size();
+              return maybe_finish();
+            }
+
+            report.completed_cnt++;
+            report.latency.record(
+                duration_cast<microseconds>(now - due).count());
+            report.service_time.record(
+                duration_cast<microseconds>(now - write_time).count());
+            send_next();
+          });
+    });
+  }
+
+  void
+  LoadGenerator::Replayer::Stream::read()
+  {
+    socket_.async_read_some(
+        asio::buffer(buf_), [this](asio::error_code error, std::size_t n) {
+          replayer_.report_.bytes_received += n;
+          if (!error) LS_LIKELY
+            return read();
+
+          if (error != asio::error::eof &&
+              error != asio::error::operation_aborted)
+            failed_ = true;
+          reading_done_ = true;
+          maybe_finish();
+        });
+  }
+
+  void
+  LoadGenerator::Replayer::Stream::shutdown()
+  {
+    /*
+     * Half-close like the captured client did, and give the server some
+     * time to flush its responses and close its side.
+     */
+    asio::error_code ec;
+    socket_.shutdown(stream_protocol::socket::shutdown_send, ec);
+    timer_.expires_after(5s);
+    timer_.async_wait([this](std::error_code error) {
+      if (error)
+        return;
+      asio::error_code ec;
+      socket_.close(ec);
+    });
+  }
+
+  void
+  LoadGenerator::Replayer::Stream::maybe_finish()
+  {
+    if (finished_ || !reading_done_ ||
+        next_chunk_ < captured_.chunks.size())
+      return;
+
+    finished_ = true;
+    timer_.cancel();
+    asio::error_code ec;
+    socket_.close(ec);
+    replayer_.on_stream_done(!failed_);
+  }
+
+  LoadGenerator::Replayer::Replayer(
+      LSContext& lscontext, LoadProfile const& profile,
+      std::vector<CaptureStream const*> const& streams)
+      : lscontext_{lscontext}
+      , endpoint_{make_stream_endpoint(profile.address, profile.port)}
+  {
+    for (auto captured: streams)
+      streams_.emplace_back(std::make_unique<Stream>(
+          *this, lscontext_.get_io_context(), *captured));
+  }
+
+  LoadGenerator::Replayer::~Replayer() noexcept = default;
+
+  void
+  LoadGenerator::Replayer::start(lg_clock::time_point start_time)
+  {
+    active_cnt_ = streams_.size();
+    for (auto& stream: streams_)
+      stream->start(start_time);
+    if (streams_.empty())
+      report_promise_.set_value(report_);
+  }
+
+  std::future<LoadReport>
+  LoadGenerator::Replayer::get_report()
+  {
+    return report_promise_.get_future();
+  }
+
+  void
+  LoadGenerator::Replayer::on_stream_done(bool ok)
+  {
+    if (!ok) LS_UNLIKELY
+      report_.errors_cnt++;
+
+    if (--active_cnt_ > 0)
+      return;
+
+    /*
+     * The handlers aborted by the last stream are already queued, so
+     * this runs after all of them and the replayer can be destroyed once
+     * the report is ready.
+     */
+    asio::post(lscontext_.get_io_context(),
+               [this]() { report_promise_.set_value(report_); });
+  }
+
+  namespace {
+    /*
+     * Splits "value[:weight]"
+     */
+    std::pair<std::string, std::size_t>
+    weighted(std::string const& v)
+    {
+      auto colon = v.rfind(':');
+      if (colon == std::string::npos)
+        return {v, 1};
+      return {v.substr(0, colon), std::stoul(v.substr(colon + 1))};
+    }
+
+    std::string
+    read_file(std::string const& path)
+    {
+      std::ifstream f{path};
+      if (!f)
+        throw std::ios_base::failure{"Cannot read " + path};
+      std::stringstream ss;
+      ss << f.rdbuf();
+      return ss.str();
+    }
+  } // namespace
+
+  bool
+  parse_load_option(LoadProfile& profile, std::string const& name,
+                    std::string const& value)
+  {
+    using std::chrono::milliseconds;
+
+    if (name == "address")
+      profile.address = value;
+    else if (name == "port")
+      profile.port = std::stoul(value);
+    else if (name == "connections")
+      profile.connections = std::stoul(value);
+    else if (name == "rate")
+      profile.rate = std::stod(value);
+    else if (name == "warmup")
+      profile.warmup = milliseconds(static_cast<long>(std::stod(value) * 1000));
+    else if (name == "duration")
+      profile.duration =
+          milliseconds(static_cast<long>(std::stod(value) * 1000));
+    else if (name == "contexts")
+      profile.num_contexts = std::stoul(value);
+    else if (name == "sinkhole") {
+      auto [size, weight] = weighted(value);
+      profile.workloads.push_back(
+          {"/sinkhole/", std::string(std::stoul(size), 'A'), weight});
+    } else if (name == "vscript") {
+      auto [path, weight] = weighted(value);
+      profile.workloads.push_back({"/vscript/", read_file(path), weight});
+    } else if (name == "replay")
+      profile.replay_file = value;
+    else
+      return false;
+
+    return true;
+  }
+
+  LoadGenerator::LoadGenerator(LoadProfile profile)
+      : profile_{std::move(profile)}
+      , pool_{profile_.num_contexts, profile_.num_contexts, 1}
+  {
+    if (!profile_.replay_file.empty())
+      capture_ = std::make_unique<CaptureReader>(profile_.replay_file);
+    else if (profile_.workloads.empty())
+      throw InvalidArgs{};
+
+    if (profile_.rate < 0 ||
+        profile_.connections < profile_.num_contexts)
+      throw InvalidArgs{};
+  }
+
+  LoadGenerator::~LoadGenerator() noexcept
+  {
+    pool_.stop();
+  }
+
+  LoadReport
+  LoadGenerator::run()
+  {
+    if (capture_)
+      return replay();
+
+    std::vector<std::string> requests;
+    for (auto const& w: profile_.workloads) {
+      requests.push_back("POST " + w.url + " HTTP/1.1\r\nHost: " +
+                         profile_.address + ":" +
+                         std::to_string(profile_.port) +
+                         "\r\nConnection: keep-alive\r\nContent-Length: " +
+                         std::to_string(w.body.size()) + "\r\n\r\n" + w.body);
+    }
+
+    std::vector<std::unique_ptr<Driver>> drivers;
+    std::vector<std::future<LoadReport>> reports;
+    auto const n = profile_.num_contexts;
+    auto const start_time = lg_clock::now() + 100ms;
+
+    for (std::size_t i = 0; i < n; ++i) {
+      auto [lscontext, id] = pool_.get_context_round_robin();
+      auto conns = profile_.connections / n + (i < profile_.connections % n);
+      auto& driver = drivers.emplace_back(std::make_unique<Driver>(
+          *lscontext, profile_, requests, conns, profile_.rate / n));
+      reports.push_back(driver->get_report());
+      asio::post(lscontext->get_io_context(),
+                 [d = driver.get(), start_time]() { d->start(start_time); });
+      lscontext->unhold();
+    }
+
+    LoadReport report;
+    for (auto& r: reports)
+      report.merge(r.get());
+    report.duration_sec =
+        std::chrono::duration<double>(profile_.duration).count();
+
+    /*
+     * All connections are closed and timers are expired at this point,
+     * so the drivers can be destroyed while the LSContexts are idle.
+     */
+    drivers.clear();
+    return report;
+  }
+
+  LoadReport
+  LoadGenerator::replay()
+  {
+    auto const n = profile_.num_contexts;
+    std::vector<std::vector<CaptureStream const*>> shares(n);
+    std::size_t i = 0;
+    for (auto const& stream: capture_->streams()) {
+      /*
+       * A partial stream would replay a request that was never completed
+       */
+      if (!stream.complete)
+        continue;
+      shares[i++ % n].push_back(&stream);
+    }
+
+    std::vector<std::unique_ptr<Replayer>> replayers;
+    std::vector<std::future<LoadReport>> reports;
+    auto const start_time = lg_clock::now() + 100ms;
+
+    for (auto& share: shares) {
+      auto [lscontext, id] = pool_.get_context_round_robin();
+      auto& replayer = replayers.emplace_back(
+          std::make_unique<Replayer>(*lscontext, profile_, share));
+      reports.push_back(replayer->get_report());
+      asio::post(lscontext->get_io_context(),
+                 [r = replayer.get(), start_time]() { r->start(start_time); });
+      lscontext->unhold();
+    }
+
+    LoadReport report;
+    for (auto& r: reports)
+      report.merge(r.get());
+    report.duration_sec =
+        std::chrono::duration<double>(lg_clock::now() - start_time).count();
+
+    replayers.clear();
+    return report;
+  }
+
+} // namespace lserver
@@ -0,0 +1,219 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2021, Amin Saba
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <iomanip>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <asio.hpp>
+
+#include "capture.hpp"
+#include "histogram.hpp"
+#include "io_context_pool.hpp"
+
+namespace lserver {
+
+  using namespace std::literals;
+
+  /*
+   * A single type of request in the workload mix of a LoadGenerator.
+   */
+  struct Workload {
+    /*
+     * Request URL, e.g. "/sinkhole/" or "/vscript/"
+     */
+    std::string url;
+    /*
+     * Request body. For "/vscript/" requests this is the VScript text,
+     * including its length line, optionally followed by upload data.
+     */
+    std::string body;
+    /*
+     * Relative frequency of this workload in the mix.
+     */
+    std::size_t weight = 1;
+  };
+
+  struct LoadProfile {
+    /*
+     * IP address of the server, or "unix:PATH" for a Unix domain socket,
+     * in which case 'port' is not used.
+     */
+    std::string address = "127.0.0.1";
+    uint16_t port = 15001;
+    /*
+     * Number of keep-alive connections kept open against the server.
+     */
+    std::size_t connections = 64;
+    /*
+     * Total request arrival rate in requests per second. Arrivals are
+     * scheduled at a constant rate independently of the responses
+     * (open loop). If it is 0, each connection sends its next request as
+     * soon as the previous one completes (closed loop), which measures
+     * the peak throughput of the server at a fixed concurrency.
+     */
+    double rate = 1000;
+    std::chrono::milliseconds warmup = 1s;
+    std::chrono::milliseconds duration = 10s;
+    /*
+     * Number of single-threaded LSContexts driving the connections.
+     */
+    std::size_t num_contexts = 1;
+    std::vector<Workload> workloads;
+    /*
+     * If set, the streams of this capture file are replayed with their
+     * original timing, instead of running the workload mix. The report
+     * of a replay counts the captured chunks as requests, and failed
+     * connections as errors. Its latency is the delay of the write of
+     * each chunk from its captured time.
+     */
+    std::string replay_file;
+  };
+
+  struct LoadReport {
+    std::size_t requests_cnt = 0;
+    std::size_t completed_cnt = 0;
+    std::size_t errors_cnt = 0;
+    std::size_t bytes_sent = 0;
+    std::size_t bytes_received = 0;
+    double duration_sec = 0;
+    /*
+     * Microseconds from the time a request was scheduled to be sent, to
+     * the time its response was fully received. This includes the time
+     * the request waited for a free connection, so it is not subject to
+     * coordinated omission.
+     */
+    LatencyHistogram latency;
+    /*
+     * Microseconds from the time a request was actually written, to the
+     * time its response was fully received.
+     */
+    LatencyHistogram service_time;
+
+    void merge(LoadReport const& other);
+    double throughput() const;
+    template <class STRM>
+    void print(STRM& stream) const;
+  };
+
+  /*
+   * Applies the command line option "--name=value" to 'profile'. This is
+   * shared by the tools that embed a LoadGenerator.
+   * Returns false if 'name' is not a load profile option. Throws
+   * std::logic_error on malformed values, and std::ios_base::failure if a
+   * VScript file cannot be read.
+   */
+  bool parse_load_option(LoadProfile& profile, std::string const& name,
+                         std::string const& value);
+
+  /*
+   * Open/closed-loop HTTP load generator for LServer. It drives a set of
+   * keep-alive connections from a pool of LSContexts, each running a
+   * single thread, so the state of each driver needs no synchronization.
+   */
+  class LoadGenerator {
+  public:
+    /*
+     * Throws InvalidArgs if the profile is invalid, and
+     * std::ios_base::failure if the replay file cannot be read.
+     */
+    LoadGenerator(LoadProfile profile);
+    LoadGenerator(LoadGenerator const&) = delete;
+    LoadGenerator& operator=(LoadGenerator const&) = delete;
+    ~LoadGenerator() noexcept;
+    /*
+     * Blocks for the warmup and measurement periods of the profile, plus
+     * the time it takes to drain the outstanding requests, and returns
+     * the results of the measurement period.
+     */
+    LoadReport run();
+
+  private:
+    class Driver;
+    class Replayer;
+
+    LoadReport replay();
+
+    LoadProfile profile_;
+    LSContextPool pool_;
+    std::unique_ptr<CaptureReader> capture_;
+  };
+
+  inline void
+  LoadReport::merge(LoadReport const& other)
+  {
+    requests_cnt += other.requests_cnt;
+    completed_cnt += other.completed_cnt;
+    errors_cnt += other.errors_cnt;
+    bytes_sent += other.bytes_sent;
+    bytes_received += other.bytes_received;
+    latency.merge(other.latency);
+    service_time.merge(other.service_time);
+  }
+
+  inline double
+  LoadReport::throughput() const
+  {
+    return duration_sec > 0 ? completed_cnt / duration_sec : 0;
+  }
+
+  template <class STRM>
+  inline void
+  LoadReport::print(STRM& stream) const
+  {
+    auto row = [&stream](char const* name, LatencyHistogram const& h) {
+      stream << std::setw(14) << name;
+      for (double p: {50.0, 90.0, 99.0, 99.9, 99.99})
+        stream << std::setw(10) << h.value_at_percentile(p);
+      stream << std::setw(10) << h.max() << std::setw(12) << h.mean()
+             << "\n";
+    };
+
+    stream << std::fixed << std::setprecision(1);
+    stream << "Requests: " << requests_cnt << "  Completed: " << completed_cnt
+           << "  Errors: " << errors_cnt << "  Duration: " << duration_sec
+           << " s\n";
+    stream << "Throughput: " << throughput() << " req/s  Received: "
+           << bytes_received << " B  Sent: " << bytes_sent << " B\n\n";
+    stream << std::setw(14) << "(us)" << std::setw(10) << "p50"
+           << std::setw(10) << "p90" << std::setw(10) << "p99"
+           << std::setw(10) << "p99.9" << std::setw(10) << "p99.99"
+           << std::setw(10) << "max" << std::setw(12) << "mean"
+           << "\n";
+    row("Latency", latency);
+    row("Service time", service_time);
+  }
+
+} // namespace lserver
@@ -31,3 +31,4 @@
 
 #define EC_INVALID_COMMANDLINE_ARGS 1
 #define EC_INVALID_CONFIG_FILE 2
+#define EC_CONTROL_SERVER_ERROR 3
@@ -0,0 +1,159 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2021, Amin Saba
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <iostream>
+#include <string>
+
+#include <nlohmann/json.hpp>
+
+#include "common.hpp"
+#include "load_generator.hpp"
+#include "ls_error.hpp"
+
+using namespace lserver;
+
+/*
+ * lsbench: an open-loop load generator for LServer.
+ *
+ * Options (all in the form --name=value):
+ *   --address, --port      Server endpoint (127.0.0.1:15001). An address
+ *                          of unix:PATH connects to a Unix domain socket
+ *   --connections          Number of keep-alive connections (64)
+ *   --rate                 Total request rate in requests/sec (1000)
+ *   --warmup, --duration   Periods in seconds (1, 10)
+ *   --contexts             Number of client LSContexts (1)
+ *   --sinkhole=N[:W]       Upload N bytes to /sinkhole/ with weight W
+ *   --vscript=FILE[:W]     Send the VScript in FILE to /vscript/ with
+ *                          weight W
+ *   --replay=FILE          Replay the connections captured in FILE
+ *   --json                 Print the report as JSON
+ */
+
+namespace {
+
+  class BadOption : public std::exception { };
+
+  void
+  usage(char const* prog)
+  {
+    lslog_note(0, "Usage:", prog,
+               "[--address=IP|unix:PATH] [--port=N] [--connections=N]",
+               "[--rate=R] [--warmup=SEC] [--duration=SEC] [--contexts=N]",
+               "[--sinkhole=BYTES[:WEIGHT]]... [--vscript=FILE[:WEIGHT]]...",
+               "[--replay=FILE] [--json]");
+  }
+
+  LoadProfile
+  parse_args(int argc, char* argv[], bool& json)
+  {
+    LoadProfile profile;
+
+    for (int i = 1; i < argc; ++i) {
+      std::string arg{argv[i]};
+      if (arg == "--json") {
+        json = true;
+        continue;
+      }
+
+      auto eq = arg.find('=');
+      if (arg.rfind("--", 0) != 0 || eq == std::string::npos)
+        throw BadOption{};
+      auto name = arg.substr(2, eq - 2);
+      auto value = arg.substr(eq + 1);
+
+      try {
+        if (!parse_load_option(profile, name, value))
+          throw BadOption{};
+      } catch (std::logic_error&) {
+        throw BadOption{};
+      } catch (std::ios_base::failure&) {
+        throw BadOption{};
+      }
+    }
+
+    if (profile.workloads.empty() && profile.replay_file.empty())
+      profile.workloads.push_back({"/sinkhole/", "", 1});
+
+    return profile;
+  }
+
+  nlohmann::json
+  histogram_json(LatencyHistogram const& h)
+  {
+    return {{"p50", h.value_at_percentile(50)},
+            {"p90", h.value_at_percentile(90)},
+            {"p99", h.value_at_percentile(99)},
+            {"p99.9", h.value_at_percentile(99.9)},
+            {"p99.99", h.value_at_percentile(99.99)},
+            {"max", h.max()},
+            {"mean", h.mean()}};
+  }
+
+} // namespace
+
+int
+main(int argc, char* argv[])
+try {
+  bool json = false;
+  auto profile = parse_args(argc, argv, json);
+
+  LoadGenerator generator{profile};
+  auto report = generator.run();
+
+  if (json) {
+    nlohmann::json j = {{"requests", report.requests_cnt},
+                        {"completed", report.completed_cnt},
+                        {"errors", report.errors_cnt},
+                        {"duration_sec", report.duration_sec},
+                        {"throughput", report.throughput()},
+                        {"bytes_sent", report.bytes_sent},
+                        {"bytes_received", report.bytes_received},
+                        {"latency_us", histogram_json(report.latency)},
+                        {"service_time_us",
+                         histogram_json(report.service_time)}};
+    std::cout << j.dump(2) << "\n";
+  } else {
+    report.print(std::cout);
+  }
+
+  return (0);
+
+} catch (BadOption&) {
+  usage(argv[0]);
+  exit(EC_INVALID_COMMANDLINE_ARGS);
+
+} catch (InvalidArgs&) {
+  lslog_note(0, "Invalid load profile.");
+  usage(argv[0]);
+  exit(EC_INVALID_COMMANDLINE_ARGS);
+
+} catch (std::ios_base::failure& ex) {
+  lslog_note(0, ex.what());
+  exit(EC_INVALID_COMMANDLINE_ARGS);
+}
@@ -29,19 +29,50 @@
 
 #pragma once
 
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include <algorithm>
 #include <cassert>
 #include <chrono>
+#include <cmath>
+#include <condition_variable>
 #include <list>
-#include <stack>
+#include <mutex>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
 #include <asio.hpp>
 
+#include "histogram.hpp"
+#include "stats.hpp"
 #include "strand_pool.hpp"
+#include "syncronization_utils.hpp"
+#include "thread_setup.hpp"
 
 using namespace std::literals;
 
 namespace lserver {
+  /*
+   * How the threads of an LSContext wait for events.
+   */
+  struct RunMode {
+    /*
+     * If non-zero, the threads poll the io_context in a busy loop, and
+     * block only after no handler was ready for this long.
+     */
+    uint64_t spin_budget_us = 0;
+    /*
+     * If non-zero, SO_BUSY_POLL is set to this value on the sockets of
+     * the sessions set up from then on.
+     */
+    int busy_poll_us = 0;
+  };
+
   /*
    * Every Session instance requires a reference to an LSContext
    * instance. LSContext provides the Session with io_context,
@@ -54,13 +85,19 @@ namespace lserver {
   public:
     LS_SANITIZE
 
-    LSContext()
-        : io_context_{std::make_unique<asio::io_context>()}
+    /*
+     * A 'single_threaded' LSContext never runs more than one thread. Its
+     * io_context is built without locking of socket operations, so they
+     * must all be initiated from that thread.
+     */
+    explicit LSContext(bool single_threaded = false)
+        : io_context_{make_io_context(single_threaded)}
         , work_guard_{std::make_unique<work_guard_t>(
               io_context_->get_executor())}
-        , strand_pool_{std::make_unique<StrandPool>(0, false, *io_context_)}
+        , strand_pool_{std::make_unique<StrandPool>(StrandPool::kDefaultSize, *io_context_)}
         , ref_cnt_{std::make_unique<std::atomic<std::size_t>>(0)}
         , hold_cnt_{std::make_unique<std::atomic<std::size_t>>(0)}
+        , single_threaded_{single_threaded}
     { }
 
     LSContext(LSContext const&) = delete;
@@ -81,8 +118,67 @@ namespace lserver {
      * Set the number of threads that should run on each io_context.
      */
     void set_num_threads(std::size_t num_threads);
+    /*
+     * Throws std::logic_error if an LSContext cannot run 'num_threads'
+     * threads.
+     */
+    static void check_num_threads(std::size_t num_threads,
+                                  bool single_threaded);
+    /*
+     * Set the placement and scheduling of the threads started from now on.
+     * The name of each thread is the name of 'setup' followed by the
+     * number of the thread.
+     */
+    void set_thread_setup(ThreadSetup setup);
+    /*
+     * Changes how the threads of this LSContext wait for events. This takes
+     * effect without restarting the threads.
+     */
+    void set_run_mode(RunMode mode);
+    /*
+     * Applies the socket options of the run mode to the socket of a new
+     * session.
+     */
+    void tune_socket(int fd) const noexcept;
     void run_threads();
+    /*
+     * Changes the number of threads of an active LSContext in place.
+     * Removing threads blocks until the retired threads finish their
+     * current handlers.
+     * Throws std::logic_error if the LSContext is not active, or the
+     * number of threads is out of range.
+     */
+    void resize_threads(std::size_t num_threads);
+    /*
+     * Returns true if sessions on this LSContext need a strand. This is
+     * cheap enough to be checked before scheduling every handler.
+     */
+    bool needs_strand() const noexcept;
+    bool single_threaded() const noexcept;
+    /*
+     * Deactivates this LSContext. If 'force' is false, it fails with EBUSY
+     * if the LSContext is held, and otherwise returns immediately: the
+     * threads keep serving the ongoing sessions and exit once they are
+     * drained. If 'force' is true, it blocks until the threads exit.
+     */
     int stop(bool force);
+    /*
+     * Deactivates this LSContext and drains its sessions: they are asked to
+     * close after their current transaction, and those left after 'timeout'
+     * are closed by force. Unlike stop(false), it does not fail if the
+     * LSContext is held. The threads exit once the sessions are drained.
+     */
+    void drain(std::chrono::milliseconds timeout);
+    /*
+     * Returns true while the sessions of this LSContext are being drained
+     */
+    bool draining() const noexcept;
+    /*
+     * Tracks the sockets of the sessions of this LSContext, so that they
+     * can be closed by force at the end of a drain.
+     */
+    void track_socket(int fd);
+    void untrack_socket(int fd);
     /*
      * Blocks and joins on all of the threads running in this LSContext instance
      */
@@ -112,7 +208,8 @@ namespace lserver {
     bool reusable();
     /*
      * Reactivate a deactivated instance so that it can start serving session
-     * requests again.
+     * requests again, with 'threads_cnt' threads.
+     * Throws std::logic_error if the number of threads is out of range.
      */
     void reuse(std::size_t threads_cnt);
     ContextInfo get_context_info() const;
@@ -125,37 +222,202 @@ namespace lserver {
      * Returns true if and only if the underlying asio::io_context is stopped
      */
     bool stopped();
+    /*
+     * Posts a probe to the io_context to measure how long a ready handler
+     * waits before it runs. The result is reported by get_context_info().
+     */
+    void probe_lag();
+    /*
+     * Reads TCP_INFO of about 'ratio' of the tracked sockets, and replaces
+     * the TCP histograms reported by get_context_info() with theirs. The
+     * sampled sockets rotate from one call to the next. This runs on the
+     * calling thread, not on the io_context.
+     */
+    void sample_tcp_info(double ratio);
     /*
      * Borrows a strand attached to the io_context of this LSContext.
      * The borrowed strand should be returned to this LSContext,
      * through 'put_strand'.
      * This method may return 'nullptr' if there is just a single thread
-     * running in this LSContext, and thus no strand is needed anyway.
+     * running in this LSContext, and thus no strand is needed anyway,
+     * unless 'always' is set for a session that can have several handlers
+     * in flight and must stay serialized if threads are added later.
+     * The strands come from a fixed ring and may be shared by sessions.
      */
-    Strand* borrow_strand();
+    Strand* borrow_strand(bool always = false);
     void put_strand(Strand* s) noexcept;
+    /*
+     * Number of sessions currently assigned to this LSContext
+     */
+    std::size_t sessions_count() const noexcept;
+    /*
+     * Asks sessions of this LSContext to move the next time they are idle:
+     * up to 'second' sessions to each 'first' LSContext of 'plan'. This
+     * replaces any previous plan, and an empty plan cancels it.
+     */
+    using MigrationPlan = std::vector<std::pair<LSContext*, std::size_t>>;
+    void request_migration(MigrationPlan plan);
+    /*
+     * Returns true if sessions of this LSContext are asked to move. This is
+     * checked by keep-alive sessions between their transactions.
+     */
+    bool migration_pending() const noexcept;
+    /*
+     * Claims one of the requested migrations. On success it returns the
+     * target LSContext, already ref()ed and hold()ed on behalf of the
+     * session. The session unhold()s it once its next operation is
+     * scheduled there. Returns nullptr if there is nothing to claim, or if
+     * the target is no longer active.
+     */
+    LSContext* claim_migration();
 
   private:
+    /*
+     * Thrown by a handler to make the thread running it leave
+     * io_context::run(). Other threads are not affected.
+     */
+    struct RetireThread { };
+
+    void spawn_thread();
+    /*
+     * The event loop of each thread
+     */
+    void run_loop();
+    /*
+     * Checks the progress of a drain, and closes the remaining sessions by
+     * force if its deadline is passed. Runs periodically on the io_context
+     * until the drain is complete.
+     */
+    void check_drain();
+    void schedule_drain_check();
+    /*
+     * Joins the threads, and replaces the io_context and the strand pool
+     * with fresh ones.
+     */
+    void reset_io_context();
+    static std::unique_ptr<asio::io_context>
+    make_io_context(bool single_threaded);
+    /*
+     * Sum of the CPU time consumed by the threads of this LSContext
+     */
+    uint64_t cpu_time_us() const;
+
     std::list<std::unique_ptr<std::thread>> threads_;
     std::unique_ptr<asio::io_context> io_context_;
     std::unique_ptr<work_guard_t> work_guard_;
-    std::stack<Strand*> strands_;
     std::size_t num_threads_;
+    ThreadSetup thread_setup_;
+    std::atomic<uint64_t> spin_budget_us_ = 0;
+    std::atomic<int> busy_poll_us_ = 0;
+    /*
+     * Number of times a thread stopped spinning and blocked, and the total
+     * time the threads spun without finding any handler.
+     */
+    std::atomic<uint64_t> spin_sleeps_cnt_ = 0;
+    std::atomic<uint64_t> spin_idle_us_ = 0;
+    std::size_t spawned_cnt_ = 0;
+    std::atomic<bool> multi_threaded_ = false;
     std::unique_ptr<StrandPool> strand_pool_;
     std::unique_ptr<std::atomic<std::size_t>> ref_cnt_ = 0;
     std::unique_ptr<std::atomic<std::size_t>> hold_cnt_ = 0;
     std::atomic<bool> active_ = true;
+    bool single_threaded_ = false;
+    std::atomic<bool> probe_pending_ = false;
+    std::atomic<int64_t> probe_posted_ns_ = 0;
+    std::atomic<uint64_t> loop_lag_us_ = 0;
+    struct TcpInfoHistograms {
+      LatencyHistogram rtt_us;
+      LatencyHistogram total_retrans;
+      LatencyHistogram snd_cwnd;
+      LatencyHistogram unacked_bytes;
+    };
+    /*
+     * Serializes the sampling rounds, and guards their results
+     */
+    mutable std::mutex tcp_info_mtx_;
+    std::unique_ptr<TcpInfoHistograms> tcp_info_;
+    std::size_t tcp_info_round_ = 0;
     mutable std::mutex mtx_;
+    /*
+     * Serializes resize_threads() calls, which release mtx_ while they
+     * wait for threads to retire.
+     */
+    std::mutex resize_mtx_;
+    std::mutex retire_mtx_;
+    std::condition_variable retire_cv_;
+    std::vector<std::thread::id> retired_ids_;
+    std::mutex migration_mtx_;
+    MigrationPlan migration_plan_;
+    /*
+     * Mirrors !migration_plan_.empty() to keep the check of sessions
+     * lock free.
+     */
+    std::atomic<bool> migration_pending_ = false;
+    std::mutex sockets_mtx_;
+    std::unordered_set<int> sockets_;
+    std::unique_ptr<asio::steady_timer> drain_timer_;
+    std::chrono::steady_clock::time_point drain_deadline_;
+    std::atomic<bool> draining_ = false;
+    std::atomic<std::size_t> drain_forced_cnt_ = 0;
   };
 
   inline void
-  LSContext::set_num_threads(std::size_t num_threads)
+  LSContext::check_num_threads(std::size_t num_threads, bool single_threaded)
   {
     if (num_threads < 1)
       throw std::logic_error{"Thread multiplier should greater than 0"};
     if (num_threads > 64)
       throw std::logic_error{"Thread multiplier should be less than 65"};
+    if (single_threaded && num_threads > 1)
+      throw std::logic_error{"Context is single threaded"};
+  }
+
+  inline void
+  LSContext::set_num_threads(std::size_t num_threads)
+  {
+    check_num_threads(num_threads, single_threaded_);
     num_threads_ = num_threads;
+    multi_threaded_.store(num_threads > 1);
+  }
+
+  inline void
+  LSContext::set_thread_setup(ThreadSetup setup)
+  {
+    thread_setup_ = std::move(setup);
+  }
+
+  inline void
+  LSContext::set_run_mode(RunMode mode)
+  {
+    std::scoped_lock _{mtx_};
+    spin_budget_us_.store(mode.spin_budget_us);
+    busy_poll_us_.store(mode.busy_poll_us);
+
+    /*
+     * Wake up the blocked threads, so that they pick up the new mode
+     * right away.
+     */
+    for (std::size_t i = 0; i < threads_.size(); ++i)
+      asio::post(*io_context_, []() { });
+  }
+
+  inline void
+  LSContext::tune_socket(int fd) const noexcept
+  {
+    if (int us = busy_poll_us_.load(std::memory_order_relaxed)) LS_UNLIKELY
+      setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &us, sizeof(us));
+  }
+
+  inline bool
+  LSContext::needs_strand() const noexcept
+  {
+    return multi_threaded_.load(std::memory_order_relaxed);
+  }
+
+  inline bool
+  LSContext::single_threaded() const noexcept
+  {
+    return single_threaded_;
   }
 
   inline asio::io_context&
@@ -196,18 +458,226 @@ namespace lserver {
   LSContext::stop(bool force)
   {
     std::scoped_lock _{mtx_};
-    if (int rc = removable(); rc > 0 && !force)
+    /*
+     * The acceptor holds an LSContext before it checks that it is active,
+     * without taking mtx_. So we deactivate first and check the holds
+     * after, and either the acceptor or we back off.
+     */
+    bool was_active = active_.exchange(false);
+    if (int rc = removable(); rc > 0 && !force) {
+      active_.store(was_active);
       return (rc);
+    }
 
-    active_.store(false);
     work_guard_.reset();
+
+    /*
+     * Without the work guard, the threads return from io_context::run()
+     * when the last session is closed. The LSContext is recycled later
+     * by reuse().
+     */
+    if (!force)
+      return (0);
+
+    reset_io_context();
+    return (0);
+  }
+
+  inline std::unique_ptr<asio::io_context>
+  LSContext::make_io_context(bool single_threaded)
+  {
+    if (single_threaded)
+      return std::make_unique<asio::io_context>(
+          ASIO_CONCURRENCY_HINT_UNSAFE_IO);
+    return std::make_unique<asio::io_context>();
+  }
+
+  inline void
+  LSContext::reset_io_context()
+  {
+    draining_.store(false);
     wait();
+    drain_timer_.reset();
     io_context_->stop();
     while (!io_context_->stopped())
       io_context_->run();
-    io_context_ = std::make_unique<asio::io_context>();
-    strand_pool_ = std::make_unique<StrandPool>(0, false, *io_context_);
-    return (0);
+    io_context_ = make_io_context(single_threaded_);
+    strand_pool_ = std::make_unique<StrandPool>(StrandPool::kDefaultSize, *io_context_);
+    /*
+     * A pending probe was destroyed with the old io_context
+     */
+    probe_pending_.store(false);
+  }
+
+  inline void
+  LSContext::drain(std::chrono::milliseconds timeout)
+  {
+    std::scoped_lock _{mtx_};
+    if (!active_.load())
+      throw std::logic_error{"Context is not active"};
+
+    /*
+     * The work guard is kept until the drain is complete, so that a session
+     * accepted by a pending accept still finds running threads.
+     */
+    active_.store(false);
+    draining_.store(true);
+    drain_deadline_ = std::chrono::steady_clock::now() + timeout;
+    drain_forced_cnt_.store(0);
+    drain_timer_ = std::make_unique<asio::steady_timer>(*io_context_);
+    schedule_drain_check();
+  }
+
+  inline bool
+  LSContext::draining() const noexcept
+  {
+    return draining_.load(std::memory_order_relaxed);
+  }
+
+  inline void
+  LSContext::track_socket(int fd)
+  {
+    std::scoped_lock _{sockets_mtx_};
+    sockets_.insert(fd);
+  }
+
+  inline void
+  LSContext::untrack_socket(int fd)
+  {
+    std::scoped_lock _{sockets_mtx_};
+    sockets_.erase(fd);
+  }
+
+  inline void
+  LSContext::schedule_drain_check()
+  {
+    auto remaining = drain_deadline_ - std::chrono::steady_clock::now();
+    drain_timer_->expires_after(
+        std::clamp<std::chrono::steady_clock::duration>(remaining, 0ms,
+                                                        100ms));
+    drain_timer_->async_wait([this](asio::error_code error) {
+      if (!error)
+        check_drain();
+    });
+  }
+
+  inline void
+  LSContext::check_drain()
+  {
+    /*
+     * stop(true) holds mtx_ while it joins the threads. It clears
+     * draining_ first, and this handler must not keep the threads busy
+     * then.
+     */
+    std::unique_lock lock{mtx_, std::try_to_lock};
+    if (!draining_.load())
+      return;
+    if (!lock.owns_lock()) {
+      schedule_drain_check();
+      return;
+    }
+
+    bool expired = std::chrono::steady_clock::now() >= drain_deadline_;
+    if (expired) {
+      /*
+       * Shutting the sockets down completes the pending operations of
+       * their sessions with an error, and the sessions close themselves.
+       */
+      std::scoped_lock _{sockets_mtx_};
+      if (drain_forced_cnt_.load() == 0)
+        drain_forced_cnt_.store(sockets_.size());
+      for (auto fd: sockets_)
+        ::shutdown(fd, SHUT_RDWR);
+    }
+
+    if ((expired || *ref_cnt_ == 0) && removable() == 0) {
+      draining_.store(false);
+      work_guard_.reset();
+      return;
+    }
+
+    schedule_drain_check();
+  }
+
+  inline void
+  LSContext::probe_lag()
+  {
+    using namespace std::chrono;
+
+    std::scoped_lock _{mtx_};
+    if (!active_.load() || probe_pending_.exchange(true))
+      return;
+
+    auto posted = steady_clock::now();
+    probe_posted_ns_.store(
+        duration_cast<nanoseconds>(posted.time_since_epoch()).count());
+    asio::post(*io_context_, [this, posted]() {
+      loop_lag_us_.store(
+          duration_cast<microseconds>(steady_clock::now() - posted).count());
+      probe_pending_.store(false);
+    });
+  }
+
+  inline void
+  LSContext::sample_tcp_info(double ratio)
+  {
+    if (ratio <= 0)
+      return;
+
+    /*
+     * Every 'stride'th socket is sampled, starting at an offset that
+     * advances each round, so that all of them are covered in 'stride'
+     * rounds.
+     */
+    auto stride = static_cast<std::size_t>(
+        std::max(1.0, std::round(1.0 / std::min(ratio, 1.0))));
+    auto histograms = std::make_unique<TcpInfoHistograms>();
+
+    std::scoped_lock lock{tcp_info_mtx_};
+    std::size_t offset = tcp_info_round_++ % stride;
+
+    {
+      /*
+       * Sessions untrack their sockets before closing them, so holding
+       * sockets_mtx_ keeps the descriptors from being reused under us.
+       */
+      std::scoped_lock _{sockets_mtx_};
+      std::size_t i = 0;
+      for (auto fd: sockets_) {
+        if (i++ % stride != offset)
+          continue;
+
+        tcp_info ti;
+        socklen_t len = sizeof(ti);
+        if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len) != 0)
+          continue;
+        histograms->rtt_us.record(ti.tcpi_rtt);
+        histograms->total_retrans.record(ti.tcpi_total_retrans);
+        histograms->snd_cwnd.record(ti.tcpi_snd_cwnd);
+        histograms->unacked_bytes.record(uint64_t{ti.tcpi_unacked} *
+                                         ti.tcpi_snd_mss);
+      }
+    }
+
+    tcp_info_ = std::move(histograms);
+  }
+
+  inline uint64_t
+  LSContext::cpu_time_us() const
+  {
+    uint64_t total = 0;
+
+    for (auto const& thread: threads_) {
+      clockid_t cid;
+      timespec ts;
+      if (!thread->joinable() ||
+          pthread_getcpuclockid(thread->native_handle(), &cid) != 0 ||
+          clock_gettime(cid, &ts) != 0)
+        continue;
+      total += ts.tv_sec * 1000000ul + ts.tv_nsec / 1000;
+    }
+
+    return total;
   }
 
   inline void
@@ -221,10 +691,145 @@ namespace lserver {
   inline void
   LSContext::run_threads()
   {
-    for (std::size_t i = 0; i < num_threads_; ++i) {
-      threads_.emplace_back(
-          std::make_unique<std::thread>([&]() { io_context_->run(); }));
+    for (std::size_t i = 0; i < num_threads_; ++i)
+      spawn_thread();
+  }
+
+  inline void
+  LSContext::spawn_thread()
+  {
+    auto setup = thread_setup_;
+    if (!setup.name.empty())
+      setup.name += "." + std::to_string(spawned_cnt_++);
+
+    threads_.emplace_back(std::make_unique<std::thread>([this, setup]() {
+      apply_thread_setup(setup);
+      try {
+        run_loop();
+      } catch (RetireThread&) {
+        std::scoped_lock _{retire_mtx_};
+        retired_ids_.push_back(std::this_thread::get_id());
+        retire_cv_.notify_all();
+      }
+    }));
+  }
+
+  inline void
+  LSContext::run_loop()
+  {
+    using namespace std::chrono;
+
+    while (true) {
+      if (spin_budget_us_.load(std::memory_order_relaxed) == 0) LS_LIKELY {
+        if (io_context_->run_one() == 0)
+          return;
+        continue;
+      }
+
+      /*
+       * Spin on poll_one() until no handler was ready for the spin budget,
+       * then block in run_one() until the next one is.
+       */
+      auto idle_since = steady_clock::now();
+      auto last_check = idle_since;
+      nanoseconds idle{0};
+      bool stopped = false;
+
+      while (true) {
+        if (io_context_->poll_one() > 0) {
+          idle += last_check - idle_since;
+          idle_since = last_check = steady_clock::now();
+          continue;
+        }
+        if ((stopped = io_context_->stopped()))
+          break;
+
+        last_check = steady_clock::now();
+        if (last_check - idle_since >= microseconds{spin_budget_us_.load()})
+          break;
+        cpu_relax();
+      }
+
+      idle += last_check - idle_since;
+      spin_idle_us_.fetch_add(duration_cast<microseconds>(idle).count());
+      if (stopped)
+        return;
+
+      spin_sleeps_cnt_.fetch_add(1);
+      if (io_context_->run_one() == 0)
+        return;
+    }
+  }
+
+  inline void
+  LSContext::resize_threads(std::size_t num_threads)
+  {
+    std::scoped_lock resize_lock{resize_mtx_};
+    std::size_t retire_cnt = 0;
+
+    {
+      std::scoped_lock _{mtx_};
+      if (!active_.load())
+        throw std::logic_error{"Context is not active"};
+
+      auto current = num_threads_;
+      if (num_threads <= current) {
+        if (num_threads < 1)
+          throw std::logic_error{"Thread multiplier should greater than 0"};
+        retire_cnt = current - num_threads;
+      } else {
+        /*
+         * New sessions get a strand from now on, and the existing ones
+         * get one before their next handler is scheduled, so it is safe
+         * to start the new threads right away.
+         */
+        set_num_threads(num_threads);
+        for (auto i = current; i < num_threads; ++i)
+          spawn_thread();
+        return;
+      }
+
+      retired_ids_.clear();
+      for (std::size_t i = 0; i < retire_cnt; ++i)
+        asio::post(*io_context_, []() { throw RetireThread{}; });
+    }
+
+    if (retire_cnt == 0)
+      return;
+
+    /*
+     * Wait without holding mtx_, because sessions of this LSContext may
+     * need it to borrow strands.
+     */
+    {
+      std::unique_lock lock{retire_mtx_};
+      while (!retire_cv_.wait_for(lock, 100ms, [&]() {
+        return retired_ids_.size() >= retire_cnt;
+      })) {
+        /*
+         * The pending retire handlers are dropped if the LSContext is
+         * stopped in the meantime.
+         */
+        if (!active_.load())
+          return;
+      }
     }
+
+    std::scoped_lock _{mtx_};
+    threads_.remove_if([this](auto const& thread) {
+      auto id = thread->get_id();
+      if (std::find(retired_ids_.begin(), retired_ids_.end(), id) ==
+          retired_ids_.end())
+        return false;
+      thread->join();
+      return true;
+    });
+    retired_ids_.clear();
+
+    /*
+     * Sessions that already have a strand keep it.
+     */
+    set_num_threads(threads_.size());
   }
 
   inline void
@@ -234,19 +839,72 @@ namespace lserver {
   }
 
   inline Strand*
-  LSContext::borrow_strand()
+  LSContext::borrow_strand(bool always)
   {
-    std::scoped_lock _{mtx_};
     /*
      * Avoid the overhead of strand if there is just one thread
      * running in this LSContext.
      */
-    if (num_threads_ == 1)
+    if (!always && !needs_strand())
       return nullptr;
 
-    auto s = strand_pool_->borrow();
-    assert(s);
-    return s;
+    return strand_pool_->borrow();
+  }
+
+  inline std::size_t
+  LSContext::sessions_count() const noexcept
+  {
+    return ref_cnt_->load();
+  }
+
+  inline void
+  LSContext::request_migration(MigrationPlan plan)
+  {
+    std::scoped_lock _{migration_mtx_};
+    std::erase_if(plan, [this](auto const& step) {
+      return step.first == this || step.second == 0;
+    });
+    migration_plan_ = std::move(plan);
+    migration_pending_.store(!migration_plan_.empty());
+  }
+
+  inline bool
+  LSContext::migration_pending() const noexcept
+  {
+    return migration_pending_.load(std::memory_order_relaxed);
+  }
+
+  inline LSContext*
+  LSContext::claim_migration()
+  {
+    std::scoped_lock _{migration_mtx_};
+
+    while (!migration_plan_.empty()) {
+      auto& [target, count] = migration_plan_.back();
+
+      /*
+       * Holding the target keeps it from being deactivated before the
+       * session has scheduled its next operation on it.
+       */
+      std::unique_lock lock{target->mtx_};
+      if (!target->active_.load()) {
+        lock.unlock();
+        migration_plan_.pop_back();
+        continue;
+      }
+      target->hold();
+      target->ref();
+      lock.unlock();
+
+      auto claimed = target;
+      if (--count == 0)
+        migration_plan_.pop_back();
+      migration_pending_.store(!migration_plan_.empty());
+      return claimed;
+    }
+
+    migration_pending_.store(false);
+    return nullptr;
   }
 
   inline bool
@@ -285,18 +943,29 @@ namespace lserver {
   LSContext::reusable()
   {
     // XXX Is ref_cnt_ == 0 constraint necessary?
-    return !active_.load() && *ref_cnt_ == 0;
+    return !active_.load() && !draining_.load() && *ref_cnt_ == 0;
   }
 
   inline void
   LSContext::reuse(std::size_t threads_cnt)
   {
     std::scoped_lock _{mtx_};
-    std::list<std::unique_ptr<std::thread>> threads;
-    std::swap(threads, threads_);
+    /*
+     * This throws before the LSContext is touched if it cannot run
+     * 'threads_cnt' threads. It also decides whether needs_strand() holds
+     * for the sessions of the new run, which may differ from the last one.
+     */
+    set_num_threads(threads_cnt);
+    /*
+     * The threads of a drained LSContext have returned, or are about to
+     * return, from io_context::run().
+     */
+    reset_io_context();
+    threads_.clear();
+    spawned_cnt_ = 0;
     work_guard_ = std::make_unique<work_guard_t>(io_context_->get_executor());
     active_.store(true);
-    num_threads_ = threads_cnt;
+    drain_forced_cnt_.store(0);
     run_threads();
   }
 
@@ -310,7 +979,9 @@ namespace lserver {
   inline ContextInfo
   LSContext::get_context_info() const
   {
-    std::vector<ContextInfo> contexts_info;
+    using namespace std::chrono;
+
+    std::scoped_lock _{mtx_};
     ContextInfo context_info;
 
     context_info.context_index_ = 0;
@@ -320,6 +991,48 @@ namespace lserver {
     context_info.strand_pool_size_ = strand_pool_->get_size();
     context_info.strand_pool_flight_ = strand_pool_->get_in_flight_cnt();
     context_info.active_ = active_.load();
+    context_info.spin_budget_us_ = spin_budget_us_.load();
+    context_info.busy_poll_us_ = busy_poll_us_.load();
+    context_info.spin_sleeps_cnt_ = spin_sleeps_cnt_.load();
+    context_info.spin_idle_us_ = spin_idle_us_.load();
+    context_info.draining_ = draining_.load();
+    context_info.drain_forced_cnt_ = drain_forced_cnt_.load();
+    context_info.drain_remaining_ms_ = 0;
+    if (context_info.draining_)
+      context_info.drain_remaining_ms_ = std::max<int64_t>(
+          0, duration_cast<milliseconds>(drain_deadline_ - steady_clock::now())
+                 .count());
+    context_info.cpu_time_us_ = cpu_time_us();
+
+    auto summarize = [](LatencyHistogram const& h) {
+      return HistogramSummary{h.value_at_percentile(50),
+                              h.value_at_percentile(99), h.max()};
+    };
+    {
+      std::scoped_lock tcp_info_lock{tcp_info_mtx_};
+      context_info.tcp_info_samples_cnt_ =
+          tcp_info_ ? tcp_info_->rtt_us.count() : 0;
+      if (tcp_info_) {
+        context_info.tcp_rtt_us_ = summarize(tcp_info_->rtt_us);
+        context_info.tcp_total_retrans_ = summarize(tcp_info_->total_retrans);
+        context_info.tcp_snd_cwnd_ = summarize(tcp_info_->snd_cwnd);
+        context_info.tcp_unacked_bytes_ = summarize(tcp_info_->unacked_bytes);
+      }
+    }
+
+    /*
+     * A probe that has not run yet is at least as late as it has been
+     * waiting.
+     */
+    context_info.loop_lag_us_ = loop_lag_us_.load();
+    if (probe_pending_.load()) {
+      auto waiting = duration_cast<microseconds>(
+                         steady_clock::now().time_since_epoch() -
+                         nanoseconds{probe_posted_ns_.load()})
+                         .count();
+      context_info.loop_lag_us_ =
+          std::max<uint64_t>(context_info.loop_lag_us_, waiting);
+    }
 
     return context_info;
   }
@@ -0,0 +1,415 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2021, Amin Saba
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+#include <nlohmann/json.hpp>
+
+#include "common.hpp"
+#include "load_generator.hpp"
+#include "ls_error.hpp"
+#include "lscomm.grpc.pb.h"
+#include "lscomm.pb.h"
+
+using namespace lserver;
+
+/*
+ * lssweep: walks a grid of (num_workers x num_threads_per_worker)
+ * topologies of a live LServer instance through its control server, runs
+ * a fixed workload mix against each point with an embedded LoadGenerator,
+ * and reports the Pareto-optimal points with respect to throughput, p99
+ * latency, and the number of threads used.
+ *
+ * Options (all in the form --name=value):
+ *   --control=IP:PORT      Control server endpoint (127.0.0.1:5050)
+ *   --server-id=N          Server to reconfigure (0)
+ *   --workers=N,N,...      Number of LSContexts to test (1,2,4)
+ *   --threads=N,N,...      Number of threads per LSContext to test (1,2)
+ *   --json                 Print the report as JSON instead of CSV
+ * and all of the load profile options of lsbench.
+ *
+ * The server's max_num_workers should be at least one more than the
+ * largest value in --workers, because a new topology is brought up
+ * before the last context of the previous one is deactivated.
+ */
+
+namespace {
+
+  class BadOption : public std::exception { };
+
+  class ControlError : public std::runtime_error {
+    using std::runtime_error::runtime_error;
+  };
+
+  struct SweepOptions {
+    std::string control = "127.0.0.1:5050";
+    int server_id = 0;
+    std::vector<std::size_t> workers{1, 2, 4};
+    std::vector<std::size_t> threads{1, 2};
+    bool json = false;
+  };
+
+  struct SweepPoint {
+    std::size_t workers;
+    std::size_t threads;
+    double throughput;
+    double server_tps;
+    uint64_t p50;
+    uint64_t p99;
+    uint64_t p999;
+    std::size_t errors;
+    bool pareto = false;
+
+    std::size_t
+    cores() const
+    {
+      return workers * threads;
+    }
+
+    /*
+     * True if 'this' is at least as good as 'other' in every dimension,
+     * and strictly better in one of them.
+     */
+    bool
+    dominates(SweepPoint const& other) const
+    {
+      bool no_worse = throughput >= other.throughput && p99 <= other.p99 &&
+                      cores() <= other.cores();
+      bool better = throughput > other.throughput || p99 < other.p99 ||
+                    cores() < other.cores();
+      return no_worse && better;
+    }
+  };
+
+  /*
+   * Thin synchronous wrapper around the control server stub.
+   */
+  class ControlClient {
+  public:
+    ControlClient(std::string const& address, int server_id)
+        : stub_{StatsService::NewStub(grpc::CreateChannel(
+              address, grpc::InsecureChannelCredentials()))}
+        , server_id_{server_id}
+    { }
+
+    void
+    add_context(std::size_t num_threads)
+    {
+      grpc::ClientContext ctx;
+      AddContextRequest req;
+      AddContextReply reply;
+      req.set_server_id(server_id_);
+      req.set_num_threads(num_threads);
+      check(stub_->AddContext(&ctx, req, &reply));
+    }
+
+    int
+    deactivate_context(std::size_t index)
+    {
+      grpc::ClientContext ctx;
+      DeactivateContextRequest req;
+      DeactivateContextReply reply;
+      req.set_server_id(server_id_);
+      req.set_context_index(index);
+      check(stub_->DeactivateContext(&ctx, req, &reply));
+      return reply.status_code();
+    }
+
+    std::vector<GetContextInfoReply::ServerInfo::ContextInfo>
+    contexts_info()
+    {
+      grpc::ClientContext ctx;
+      GetContextInfoRequest req;
+      GetContextInfoReply reply;
+      check(stub_->GetContextsInfo(&ctx, req, &reply));
+      if (server_id_ >= reply.server_info_size())
+        throw ControlError{"Bad server id"};
+      auto const& ci = reply.server_info(server_id_).contexts_info();
+      return {ci.begin(), ci.end()};
+    }
+
+    std::size_t
+    transactions_total()
+    {
+      grpc::ClientContext ctx;
+      StatsRequest req;
+      StatsReply reply;
+      check(stub_->GetStats(&ctx, req, &reply));
+      if (server_id_ >= reply.stats_rec_size())
+        throw ControlError{"Bad server id"};
+      return reply.stats_rec(server_id_).stats_transactions_cnt_total();
+    }
+
+  private:
+    void
+    check(grpc::Status const& status)
+    {
+      if (!status.ok())
+        throw ControlError{status.error_message()};
+    }
+
+    std::unique_ptr<StatsService::Stub> stub_;
+    int server_id_;
+  };
+
+  void
+  usage(char const* prog)
+  {
+    lslog_note(0, "Usage:", prog, "[--control=IP:PORT] [--server-id=N]",
+               "[--workers=N,...] [--threads=N,...] [--json]",
+               "[lsbench load options]");
+  }
+
+  std::vector<std::size_t>
+  parse_list(std::string const& value)
+  {
+    std::vector<std::size_t> list;
+    std::stringstream ss{value};
+    std::string item;
+    while (std::getline(ss, item, ','))
+      list.push_back(std::stoul(item));
+    if (list.empty() || std::count(list.begin(), list.end(), 0))
+      throw BadOption{};
+    return list;
+  }
+
+  void
+  parse_args(int argc, char* argv[], SweepOptions& options,
+             LoadProfile& profile)
+  {
+    for (int i = 1; i < argc; ++i) {
+      std::string arg{argv[i]};
+      if (arg == "--json") {
+        options.json = true;
+        continue;
+      }
+
+      auto eq = arg.find('=');
+      if (arg.rfind("--", 0) != 0 || eq == std::string::npos)
+        throw BadOption{};
+      auto name = arg.substr(2, eq - 2);
+      auto value = arg.substr(eq + 1);
+
+      try {
+        if (name == "control")
+          options.control = value;
+        else if (name == "server-id")
+          options.server_id = std::stoi(value);
+        else if (name == "workers")
+          options.workers = parse_list(value);
+        else if (name == "threads")
+          options.threads = parse_list(value);
+        else if (!parse_load_option(profile, name, value))
+          throw BadOption{};
+      } catch (std::logic_error&) {
+        throw BadOption{};
+      } catch (std::ios_base::failure&) {
+        throw BadOption{};
+      }
+    }
+
+    if (profile.workloads.empty())
+      profile.workloads.push_back({"/sinkhole/", "", 1});
+  }
+
+  void
+  wait_sessions_drained(ControlClient& control)
+  {
+    for (int i = 0; i < 100; ++i) {
+      std::size_t active_sessions = 0;
+      for (auto const& ci: control.contexts_info())
+        active_sessions += ci.active_sessions_cnt();
+      if (active_sessions == 0)
+        return;
+      std::this_thread::sleep_for(50ms);
+    }
+    lslog_note(0, "Sessions of the previous point did not drain");
+  }
+
+  void
+  deactivate(ControlClient& control, std::size_t index)
+  {
+    for (int i = 0; i < 100; ++i) {
+      int rc = control.deactivate_context(index);
+      if (rc == 0)
+        return;
+      if (rc != EBUSY)
+        break;
+      std::this_thread::sleep_for(20ms);
+    }
+    throw ControlError{"Cannot deactivate context " + std::to_string(index)};
+  }
+
+  /*
+   * Converge the server to 'workers' active LSContexts each running
+   * 'threads' threads.
+   */
+  void
+  reconfigure(ControlClient& control, std::size_t workers,
+              std::size_t threads)
+  {
+    wait_sessions_drained(control);
+
+    std::vector<std::size_t> old_active;
+    for (auto const& ci: control.contexts_info())
+      if (ci.active())
+        old_active.push_back(ci.context_index());
+
+    /*
+     * At least one context must stay active at any time, so keep the
+     * first one until the new ones are up.
+     */
+    for (std::size_t i = 1; i < old_active.size(); ++i)
+      deactivate(control, old_active[i]);
+
+    for (std::size_t i = 0; i < workers; ++i)
+      control.add_context(threads);
+
+    if (!old_active.empty())
+      deactivate(control, old_active[0]);
+  }
+
+  SweepPoint
+  measure(ControlClient& control, LoadProfile const& profile,
+          std::size_t workers, std::size_t threads)
+  {
+    auto t0 = std::chrono::steady_clock::now();
+    auto trans0 = control.transactions_total();
+
+    LoadGenerator generator{profile};
+    auto report = generator.run();
+
+    auto trans1 = control.transactions_total();
+    auto elapsed = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - t0)
+                       .count();
+
+    return SweepPoint{workers,
+                      threads,
+                      report.throughput(),
+                      (trans1 - trans0) / elapsed,
+                      report.latency.value_at_percentile(50),
+                      report.latency.value_at_percentile(99),
+                      report.latency.value_at_percentile(99.9),
+                      report.errors_cnt};
+  }
+
+  void
+  mark_pareto(std::vector<SweepPoint>& points)
+  {
+    for (auto& p: points)
+      p.pareto = std::none_of(points.begin(), points.end(),
+                              [&p](auto const& q) { return q.dominates(p); });
+  }
+
+  void
+  print_csv(std::vector<SweepPoint> const& points)
+  {
+    std::cout << "workers,threads,cores,throughput,server_tps,p50_us,p99_us,"
+                 "p999_us,errors,pareto\n";
+    for (auto const& p: points)
+      std::cout << p.workers << "," << p.threads << "," << p.cores() << ","
+                << p.throughput << "," << p.server_tps << "," << p.p50 << ","
+                << p.p99 << "," << p.p999 << "," << p.errors << ","
+                << p.pareto << "\n";
+  }
+
+  void
+  print_json(std::vector<SweepPoint> const& points)
+  {
+    auto all = nlohmann::json::array();
+    auto pareto = nlohmann::json::array();
+
+    for (auto const& p: points) {
+      nlohmann::json j = {{"workers", p.workers},
+                          {"threads", p.threads},
+                          {"cores", p.cores()},
+                          {"throughput", p.throughput},
+                          {"server_tps", p.server_tps},
+                          {"p50_us", p.p50},
+                          {"p99_us", p.p99},
+                          {"p999_us", p.p999},
+                          {"errors", p.errors}};
+      if (p.pareto)
+        pareto.push_back(j);
+      all.push_back(std::move(j));
+    }
+
+    std::cout << nlohmann::json{{"points", all}, {"pareto", pareto}}.dump(2)
+              << "\n";
+  }
+
+} // namespace
+
+int
+main(int argc, char* argv[])
+try {
+  SweepOptions options;
+  LoadProfile profile;
+  parse_args(argc, argv, options, profile);
+
+  ControlClient control{options.control, options.server_id};
+  std::vector<SweepPoint> points;
+
+  for (auto workers: options.workers) {
+    for (auto threads: options.threads) {
+      lslog_note(1, "Sweep point: workers", workers, "threads", threads);
+      reconfigure(control, workers, threads);
+      points.push_back(measure(control, profile, workers, threads));
+    }
+  }
+
+  mark_pareto(points);
+  if (options.json)
+    print_json(points);
+  else
+    print_csv(points);
+
+  return (0);
+
+} catch (BadOption&) {
+  usage(argv[0]);
+  exit(EC_INVALID_COMMANDLINE_ARGS);
+
+} catch (InvalidArgs&) {
+  lslog_note(0, "Invalid load profile.");
+  usage(argv[0]);
+  exit(EC_INVALID_COMMANDLINE_ARGS);
+
+} catch (ControlError& ex) {
+  lslog_note(0, "Control server error:", ex.what());
+  exit(EC_CONTROL_SERVER_ERROR);
+}
@@ -28,16 +28,55 @@
  */
 
 #include "args_parser.hpp"
+#include "autoscaler.hpp"
 #include "common.hpp"
 #include "config.hpp"
 #include "http.hpp"
+#include "http2.hpp"
 #include "ls_error.hpp"
 #include "manager.hpp"
 #include "portal.hpp"
+#include "resp.hpp"
+#include "rpc.hpp"
 #include "signal_manager.hpp"
+#include "tcp_protocols.hpp"
+#include "udp_protocols.hpp"
 
 using namespace lserver;
 
+/*
+ * Creates the server for the protocol of the listener
+ */
+template <class Threading>
+static void
+create_server(ServerManager& server_manager, LSConfig const& config)
+{
+  if (config.listen_protocol_ == "h2c")
+    server_manager.create_server<BasicHttp2<Threading>>(config);
+  else if (config.listen_protocol_ == "tcp_sink")
+    server_manager.create_server<BasicTcpSink<Threading>>(config);
+  else if (config.listen_protocol_ == "tcp_echo")
+    server_manager.create_server<BasicTcpEcho<Threading>>(config);
+  else if (config.listen_protocol_ == "rpc")
+    server_manager.create_server<BasicRpc<Threading>>(config);
+  else if (config.listen_protocol_ == "resp")
+    server_manager.create_server<BasicResp<Threading>>(config);
+  else if (config.listen_protocol_ == "udp_sink")
+    server_manager.create_server<BasicUdpSink<Threading>,
+                                 DatagramServer<BasicUdpSink<Threading>>>(
+        config);
+  else if (config.listen_protocol_ == "udp_echo")
+    server_manager.create_server<BasicUdpEcho<Threading>,
+                                 DatagramServer<BasicUdpEcho<Threading>>>(
+        config);
+  else if (config.listen_protocol_ == "udp_vscript")
+    server_manager.create_server<BasicUdpVScript<Threading>,
+                                 DatagramServer<BasicUdpVScript<Threading>>>(
+        config);
+  else
+    server_manager.create_server<BasicHttp<Threading>>(config);
+}
+
 int
 main(int argc, char* argv[])
 try {
@@ -50,19 +89,41 @@ try {
    *    The server manager is responsible for create/destroy/control server
    *    instances.
    * 2- Add one or more Server instances s to the server manager.
+   *    Then move the main thread to the CPUs of the control threads, so
+   *    that the threads created after this point inherit them.
    * 3- Optionally create a Portal which allows communication with/control of
    *    the servers.
-   * 4- Create a signal manager which allows gracefull shutdown of the server.
+   * 4- Optionally create an Autoscaler which adjusts the number of
+   *    LSContexts of the servers to their load.
+   * 5- Create a signal manager which allows gracefull shutdown of the server.
    */
 
   ServerManager server_manager;
-  server_manager.create_server<Http>(config);
+  if (config.single_threaded_contexts_)
+    create_server<SingleThreaded>(server_manager, config);
+  else
+    create_server<MultiThreaded>(server_manager, config);
+
+  apply_thread_setup(config.control_thread_setup_);
 
   Portal portal{server_manager, config.header_interval_,
                 config.control_listen_address_, config.control_listen_port_};
-  portal.start();
+  portal.start("lsportal");
+
+  std::optional<Autoscaler> autoscaler;
+  if (config.autoscaler_enabled_) {
+    autoscaler.emplace(server_manager, config);
+    autoscaler->start("lsautoscaler");
+  }
 
   SignalManager sigman{[&]() {
+    /*
+     * The autoscaler should not touch the servers while they are stopping
+     */
+    if (autoscaler) {
+      autoscaler->stop();
+      autoscaler->wait();
+    }
     server_manager.stop();
     portal.stop();
   }};
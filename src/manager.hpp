@@ -50,9 +50,10 @@ namespace lserver {
     ~ServerManager();
     /*
      * Create a managed server using P as the Session (CRTP-base) derived
-     * protocol.
+     * protocol. 'S' is the type of the server, e.g. a DatagramServer for a
+     * datagram protocol.
      */
-    template <class P>
+    template <class P, class S = Server<P>>
     ServerHandle create_server(auto config);
     AbstractServer* get_server(ServerHandle sh);
     std::vector<ServerInfo> get_servers_info();
@@ -69,11 +70,11 @@ namespace lserver {
     ServerHandle handle_id_ = 0;
   };
 
-  template <class P>
+  template <class P, class S>
   inline ServerManager::ServerHandle
   ServerManager::create_server(auto config)
   {
-    auto srv = new Server<P>(config);
+    auto srv = new S(config);
     auto [iter, inserted] = servers_.insert(std::make_pair(handle_id_++, srv));
     if (!inserted) {
       delete srv;
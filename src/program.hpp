@@ -32,6 +32,7 @@
 #include <cstdint>
 #include <list>
 #include <mutex>
+#include <queue>
 #include <string>
 
 #include <nlohmann/json.hpp>
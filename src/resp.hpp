@@ -0,0 +1,525 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2021, Amin Saba
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <cstring>
+#include <limits>
+#include <string_view>
+#include <vector>
+
+#include "common.hpp"
+#include "kv_store.hpp"
+#include "session.hpp"
+
+namespace lserver {
+
+  /*
+   * Bulk strings, i.e. keys and values, larger than this close the
+   * connection, since the whole command must fit in the receive buffer
+   * of the session.
+   */
+  inline constexpr std::size_t kRespMaxBulk = 128 * 1024;
+  inline constexpr std::size_t kRespMaxArgs = 1024;
+  /*
+   * Larger commands close the connection too, e.g. a SET of a large key
+   * and a large value, or an MGET of many keys.
+   */
+  inline constexpr std::size_t kRespMaxCommand = 192 * 1024;
+
+  /*
+   * A subset of RESP, the protocol of Redis, serving a KvStore shared by
+   * all the sessions: GET, SET (with EX or PX), DEL, MGET, EXPIRE and PING.
+   * Commands must be RESP arrays of bulk strings; inline commands are not
+   * supported.
+   *
+   * Clients may pipeline commands. All the complete commands of a read are
+   * executed in order, and their replies are written to a single buffer,
+   * sent once.
+   *
+   * 'Threading' is the threading policy of the protocol, see MultiThreaded
+   * and SingleThreaded.
+   */
+  template <class Threading>
+  class BasicResp final : public Session<BasicResp<Threading>> {
+    using BaseSession = Session<BasicResp<Threading>>;
+
+  public:
+    using threading_policy = Threading;
+    /*
+     * Replies are sent while the next pipelined commands are received
+     */
+    using duplex_policy = FullDuplex;
+
+    void start();
+
+    /*
+     * "callbacks" called by the CRTP base (Session)
+     */
+    void on_error(std::error_code error);
+    void on_closed();
+    auto on_sent();
+    auto on_data();
+    void on_backpressure_relieved();
+
+    static KvStore& store() noexcept;
+
+  private:
+    enum ParseStatus { kParsed, kIncomplete, kMalformed };
+
+    /*
+     * Parses the command at the start of [p, end) into args_, and sets
+     * 'consumed' to its length.
+     */
+    ParseStatus parse(char const* p, char const* end, std::size_t& consumed);
+    void execute();
+
+    void get();
+    void set();
+    void del();
+    void mget();
+    void expire();
+
+    void reply(std::string_view s);
+    void reply_bulk(std::string_view s);
+    void reply_integer(char prefix, int64_t n);
+    void reply_error(std::string_view message);
+    void reply_arity_error();
+    void release_replies();
+
+    static constexpr std::size_t kReadSize = 64 * 1024;
+    static constexpr std::size_t kReplyBufferSz = 4 * 1024;
+    static_assert(kRespMaxCommand < BaseSession::kMaxReceiveSize,
+                  "A command must fit in the receive buffer");
+
+    static inline KvStore store_;
+
+    std::vector<std::string_view> args_;
+    /*
+     * The reply buffer of the read being handled
+     */
+    DynamicString* replies_ = nullptr;
+    /*
+     * Reply buffers handed to the session and not sent yet. The session
+     * calls on_sent() once its queue is empty, i.e. all of them are sent.
+     */
+    std::vector<DynamicString*> in_flight_;
+    /*
+     * Reading stops while the session is backpressured
+     */
+    bool paused_ = false;
+  };
+
+  using Resp = BasicResp<MultiThreaded>;
+
+  namespace resp_impl {
+    /*
+     * Parses the decimal number ending in CRLF at the start of [p, end),
+     * and returns the position after the CRLF, or nullptr if the line is
+     * incomplete. 'malformed' is set if the line is not a number.
+     */
+    inline char const*
+    parse_number(char const* p, char const* end, int64_t& n, bool& malformed)
+    {
+      auto eol = static_cast<char const*>(std::memchr(p, '\r', end - p));
+      if (!eol || eol + 1 == end)
+        return nullptr;
+
+      auto [ptr, ec] = std::from_chars(p, eol, n);
+      if (ec != std::errc{} || ptr != eol || eol[1] != '\n') LS_UNLIKELY
+        malformed = true;
+      return eol + 2;
+    }
+
+    inline bool
+    iequals(std::string_view a, std::string_view b) noexcept
+    {
+      return a.size() == b.size() &&
+             std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+               return (x | 0x20) == y;
+             });
+    }
+
+    inline bool
+    to_integer(std::string_view s, int64_t& n) noexcept
+    {
+      auto [ptr, ec] = std::from_chars(s.data(), s.data() + s.size(), n);
+      return ec == std::errc{} && ptr == s.data() + s.size();
+    }
+
+    /*
+     * Sets 'expire_at_ms' to 'ttl' (positive) units of 'unit_ms' from now.
+     * Returns false if that does not fit in an int64_t.
+     */
+    inline bool
+    expire_time(int64_t ttl, int64_t unit_ms, int64_t& expire_at_ms) noexcept
+    {
+      auto now = KvStore::now_ms();
+      if (ttl > (std::numeric_limits<int64_t>::max() - now) / unit_ms) LS_UNLIKELY
+        return false;
+      expire_at_ms = now + ttl * unit_ms;
+      return true;
+    }
+  } // namespace resp_impl
+
+  template <class Threading>
+  inline void
+  BasicResp<Threading>::start()
+  {
+    /*
+     * A session closed on a malformed command is reused with the rest
+     * of that command still in its buffer.
+     */
+    BaseSession::reset_buffers();
+    paused_ = false;
+    BaseSession::reserve_receive_buffer(kReadSize);
+  }
+
+  template <class Threading>
+  inline void
+  BasicResp<Threading>::on_error(std::error_code error)
+  {
+    lslog(
+        3, "Resp service: ",
+        std::error_condition{error.value(), std::system_category()}.message());
+  }
+
+  template <class Threading>
+  inline void
+  BasicResp<Threading>::on_closed()
+  {
+    release_replies();
+  }
+
+  template <class Threading>
+  inline KvStore&
+  BasicResp<Threading>::store() noexcept
+  {
+    return store_;
+  }
+
+  template <class Threading>
+  inline void
+  BasicResp<Threading>::release_replies()
+  {
+    for (auto replies: in_flight_)
+      BaseSession::release_send_buffer(replies);
+    in_flight_.clear();
+  }
+
+  template <class Threading>
+  inline auto
+  BasicResp<Threading>::on_sent()
+  {
+    release_replies();
+    /*
+     * The next read is already in flight, or is started once the
+     * backpressure is relieved.
+     */
+    return BaseSession::kData;
+  }
+
+  template <class Threading>
+  inline void
+  BasicResp<Threading>::on_backpressure_relieved()
+  {
+    if (paused_) {
+      paused_ = false;
+      BaseSession::receive();
+    }
+  }
+
+  template <class Threading>
+  inline void
+  BasicResp<Threading>::reply(std::string_view s)
+  {
+    auto size = replies_->size();
+    if (size + s.size() > replies_->capacity()) LS_UNLIKELY
+      replies_->resize(std::max(replies_->capacity() * 2, size + s.size()));
+    std::memcpy(replies_->data() + size, s.data(), s.size());
+    replies_->fill(size + s.size());
+  }
+
+  template <class Threading>
+  inline void
+  BasicResp<Threading>::reply_integer(char prefix, int64_t n)
+  {
+    std::array<char, 24> buf;
+    buf[0] = prefix;
+    auto end = std::to_chars(buf.data() + 1, buf.data() + buf.size() - 2, n).ptr;
+    *end++ = '\r';
+    *end++ = '\n';
+    reply({buf.data(), static_cast<std::size_t>(end - buf.data())});
+  }
+
+  template <class Threading>
+  inline void
+  BasicResp<Threading>::reply_bulk(std::string_view s)
+  {
+    reply_integer('$', s.size());
+    reply(s);
+    reply("\r\n");
+  }
+
+  template <class Threading>
+  inline void
+  BasicResp<Threading>::reply_error(std::string_view message)
+  {
+    reply("-ERR ");
+    reply(message);
+    reply("\r\n");
+  }
+
+  template <class Threading>
+  inline void
+  BasicResp<Threading>::reply_arity_error()
+  {
+    reply("-ERR wrong number of arguments for '");
+    reply(args_[0]);
+    reply("' command\r\n");
+  }
+
+  template <class Threading>
+  inline void
+  BasicResp<Threading>::get()
+  {
+    if (args_.size() != 2) LS_UNLIKELY
+      return reply_arity_error();
+
+    if (!store_.get(args_[1], [this](std::string_view v) { reply_bulk(v); }))
+      reply("$-1\r\n");
+  }
+
+  template <class Threading>
+  inline void
+  BasicResp<Threading>::set()
+  {
+    if (args_.size() != 3 && args_.size() != 5) LS_UNLIKELY
+      return reply_arity_error();
+
+    int64_t expire_at_ms = 0;
+    if (args_.size() == 5) {
+      int64_t ttl;
+      bool seconds = resp_impl::iequals(args_[3], "ex");
+      if (!seconds && !resp_impl::iequals(args_[3], "px")) LS_UNLIKELY
+        return reply_error("syntax error");
+      if (!resp_impl::to_integer(args_[4], ttl) || ttl <= 0 ||
+          !resp_impl::expire_time(ttl, seconds ? 1000 : 1, expire_at_ms)) LS_UNLIKELY
+        return reply_error("invalid expire time in 'set' command");
+    }
+
+    store_.set(args_[1], args_[2], expire_at_ms);
+    reply("+OK\r\n");
+  }
+
+  template <class Threading>
+  inline void
+  BasicResp<Threading>::del()
+  {
+    if (args_.size() < 2) LS_UNLIKELY
+      return reply_arity_error();
+
+    int64_t n = 0;
+    for (std::size_t i = 1; i < args_.size(); ++i)
+      n += store_.del(args_[i]);
+    reply_integer(':', n);
+  }
+
+  template <class Threading>
+  inline void
+  BasicResp<Threading>::mget()
+  {
+    if (args_.size() < 2) LS_UNLIKELY
+      return reply_arity_error();
+
+    reply_integer('*', args_.size() - 1);
+    for (std::size_t i = 1; i < args_.size(); ++i)
+      if (!store_.get(args_[i], [this](std::string_view v) { reply_bulk(v); }))
+        reply("$-1\r\n");
+  }
+
+  template <class Threading>
+  inline void
+  BasicResp<Threading>::expire()
+  {
+    if (args_.size() != 3) LS_UNLIKELY
+      return reply_arity_error();
+
+    int64_t seconds;
+    if (!resp_impl::to_integer(args_[2], seconds)) LS_UNLIKELY
+      return reply_error("value is not an integer or out of range");
+
+    /*
+     * Like Redis, a non-positive timeout deletes the key
+     */
+    if (seconds <= 0)
+      return reply_integer(':', store_.del(args_[1]));
+
+    int64_t expire_at_ms;
+    if (!resp_impl::expire_time(seconds, 1000, expire_at_ms)) LS_UNLIKELY
+      return reply_error("invalid expire time in 'expire' command");
+    reply_integer(':', store_.expire(args_[1], expire_at_ms));
+  }
+
+  template <class Threading>
+  inline void
+  BasicResp<Threading>::execute()
+  {
+    using resp_impl::iequals;
+    auto command = args_[0];
+
+    if (iequals(command, "get"))
+      get();
+    else if (iequals(command, "set"))
+      set();
+    else if (iequals(command, "mget"))
+      mget();
+    else if (iequals(command, "del"))
+      del();
+    else if (iequals(command, "expire"))
+      expire();
+    else if (iequals(command, "ping"))
+      args_.size() > 1 ? reply_bulk(args_[1]) : reply("+PONG\r\n");
+    else {
+      reply("-ERR unknown command '");
+      reply(command.substr(0, 64));
+      reply("'\r\n");
+    }
+  }
+
+  template <class Threading>
+  inline typename BasicResp<Threading>::ParseStatus
+  BasicResp<Threading>::parse(char const* p, char const* end,
+                              std::size_t& consumed)
+  {
+    auto start = p;
+    int64_t argc;
+    bool malformed = false;
+
+    if (*p != '*') LS_UNLIKELY
+      return kMalformed;
+    p = resp_impl::parse_number(p + 1, end, argc, malformed);
+    if (!p)
+      return kIncomplete;
+    if (malformed || argc < 1 || argc > static_cast<int64_t>(kRespMaxArgs)) LS_UNLIKELY
+      return kMalformed;
+
+    args_.clear();
+    for (int64_t i = 0; i < argc; ++i) {
+      int64_t len;
+      if (p == end)
+        return kIncomplete;
+      if (*p != '$') LS_UNLIKELY
+        return kMalformed;
+      p = resp_impl::parse_number(p + 1, end, len, malformed);
+      if (!p)
+        return kIncomplete;
+      if (malformed || len < 0 || len > static_cast<int64_t>(kRespMaxBulk)) LS_UNLIKELY
+        return kMalformed;
+      if (static_cast<std::size_t>(p - start + len + 2) > kRespMaxCommand) LS_UNLIKELY
+        return kMalformed;
+      if (end - p < len + 2)
+        return kIncomplete;
+      if (p[len] != '\r' || p[len + 1] != '\n') LS_UNLIKELY
+        return kMalformed;
+
+      args_.emplace_back(p, len);
+      p += len + 2;
+    }
+
+    if (static_cast<std::size_t>(p - start) > kRespMaxCommand) LS_UNLIKELY
+      return kMalformed;
+
+    consumed = p - start;
+    return kParsed;
+  }
+
+  template <class Threading>
+  inline auto
+  BasicResp<Threading>::on_data()
+  {
+    auto data = reinterpret_cast<char const*>(BaseSession::data());
+    auto end = data + BaseSession::data_size();
+    std::size_t offset = 0;
+    auto status = kIncomplete;
+
+    /*
+     * Execute the complete commands, and leave a partial one in the buffer
+     * for the next read to complete.
+     */
+    while (data + offset < end) {
+      std::size_t consumed;
+      status = parse(data + offset, end, consumed);
+      if (status != kParsed)
+        break;
+
+      if (!replies_) {
+        replies_ = BaseSession::prepare_send_buffer(kReplyBufferSz);
+        replies_->clear();
+      }
+      BaseSession::transaction_started();
+      execute();
+      offset += consumed;
+    }
+
+    /*
+     * The headers of a command of many arguments may fill the buffer
+     * before any of them is found too large.
+     */
+    if (status == kIncomplete &&
+        static_cast<std::size_t>(end - data) - offset > kRespMaxCommand) LS_UNLIKELY
+      status = kMalformed;
+
+    if (offset > 0)
+      BaseSession::consume(offset);
+    if (replies_) {
+      in_flight_.push_back(replies_);
+      BaseSession::send(replies_);
+      replies_ = nullptr;
+    }
+
+    if (status == kMalformed) LS_UNLIKELY {
+      lslog(3, "Resp service: malformed command");
+      return BaseSession::kClose;
+    }
+    /*
+     * The session closes once the queued replies are sent
+     */
+    if (BaseSession::draining()) LS_UNLIKELY
+      return BaseSession::kClose;
+    if (BaseSession::backpressured()) LS_UNLIKELY {
+      paused_ = true;
+      return BaseSession::kData;
+    }
+    return BaseSession::kContinue;
+  }
+} // namespace lserver
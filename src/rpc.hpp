@@ -0,0 +1,540 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2021, Amin Saba
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <endian.h>
+
+#include <cstdint>
+#include <cstring>
+#include <list>
+#include <span>
+#include <vector>
+
+#include "common.hpp"
+#include "lsvm.hpp"
+#include "program.hpp"
+#include "session.hpp"
+
+namespace lserver {
+
+  /*
+   * Every frame of the RPC protocol starts with this header, in little
+   * endian byte order, followed by 'payload_len' bytes of payload. A
+   * request names the method to call, and its response carries the same
+   * request id and method id, and a status. A client may have many
+   * requests in flight on a connection, and must match the responses to
+   * them by request id, since they may come back in any order.
+   */
+  struct RpcFrameHeader {
+    static constexpr std::size_t kSize = 12;
+
+    uint32_t payload_len = 0;
+    uint32_t request_id = 0;
+    uint16_t method_id = 0;
+    uint16_t status = 0;
+
+    void encode(uint8_t* out) const noexcept;
+    static RpcFrameHeader decode(uint8_t const* in) noexcept;
+  };
+
+  enum RpcStatus : uint16_t {
+    kRpcOk = 0,
+    kRpcUnknownMethod = 1,
+    kRpcBadRequest = 2,
+    kRpcTooLarge = 3,
+  };
+
+  /*
+   * Requests with a larger payload close the connection, since the whole
+   * frame must fit in the receive buffer of the session.
+   */
+  inline constexpr std::size_t kRpcMaxPayload = 128 * 1024;
+
+  /*
+   * A request, as seen by a method handler
+   */
+  class RpcCall {
+  public:
+    RpcCall(std::span<uint8_t> payload, DynamicString* response,
+            LSVirtualMachine* vm);
+    /*
+     * Makes the response payload 'n' bytes long, and returns a pointer to
+     * it for the handler to fill.
+     */
+    uint8_t* respond(std::size_t n);
+
+    std::span<uint8_t> payload;
+    LSVirtualMachine* vm;
+    uint16_t status = kRpcOk;
+
+  private:
+    /*
+     * The response frame, with room for its header at the front
+     */
+    DynamicString* response_;
+  };
+
+  /*
+   * Method handlers are classes with a unique 'id_' and a static 'call()'
+   * that handles an RpcCall. RpcMethodList dispatches a call to the
+   * handler of its method id, the same way OpList instantiates VScript
+   * operations by name.
+   * A handler that may run for long sets 'offloaded_' to true. Its calls
+   * then run on any thread of the LSContext, and their responses are sent
+   * as they complete, so they do not hold up the requests behind them.
+   */
+  template <class... M>
+  class RpcMethodList;
+
+  /*
+   * Marks the end of the recursion, and is reached only if no handler has
+   * the method id.
+   */
+  template <>
+  class RpcMethodList<> {
+  public:
+    static inline bool
+    dispatch(uint16_t method_id, RpcCall& call)
+    {
+      return false;
+    }
+
+    static inline bool
+    offloaded(uint16_t method_id)
+    {
+      return false;
+    }
+  };
+
+  template <class H, class... T>
+  class RpcMethodList<H, T...> : public RpcMethodList<T...> {
+    using Base = RpcMethodList<T...>;
+
+  public:
+    /*
+     * Calls the handler of 'method_id'. Returns false if there is none.
+     */
+    static inline bool dispatch(uint16_t method_id, RpcCall& call);
+    /*
+     * Returns true if the handler of 'method_id' is offloaded
+     */
+    static inline bool offloaded(uint16_t method_id);
+  };
+
+  /*
+   * Sends the payload back
+   */
+  struct RpcEchoMethod {
+    static constexpr uint16_t id_ = 1;
+    static void call(RpcCall& call);
+  };
+
+  /*
+   * Runs a VScript. The payload has the same format as the body of an HTTP
+   * request to /vscript/: the length of the program on the first line, the
+   * program, and then the data it processes. The response payload has the
+   * size set by the DOWNLOAD operation of the program.
+   */
+  struct RpcVScriptMethod {
+    static constexpr uint16_t id_ = 2;
+    static constexpr bool offloaded_ = true;
+    static void call(RpcCall& call);
+  };
+
+  using RpcMethods = RpcMethodList<RpcEchoMethod, RpcVScriptMethod>;
+
+  /*
+   * Length-prefixed binary RPC over TCP. All the complete requests of a
+   * read are handled in order, and their responses are queued together,
+   * so that they leave in a single gather write. The responses of
+   * offloaded methods are sent on their own once they complete. Reading
+   * goes on while responses are being sent or computed.
+   *
+   * 'Threading' is the threading policy of the protocol, see MultiThreaded
+   * and SingleThreaded. 'Methods' is an RpcMethodList of the handlers.
+   */
+  template <class Threading, class Methods = RpcMethods>
+  class BasicRpc final : public Session<BasicRpc<Threading, Methods>> {
+    using BaseSession = Session<BasicRpc<Threading, Methods>>;
+
+  public:
+    using threading_policy = Threading;
+    /*
+     * Responses are sent while the next requests are received
+     */
+    using duplex_policy = FullDuplex;
+
+    void start();
+    /*
+     * "callbacks" called by the CRTP base (Session)
+     */
+    void on_error(std::error_code error);
+    void on_closed();
+    auto on_sent();
+    auto on_data();
+
+  private:
+    /*
+     * A request of an offloaded method. The payload is copied, since the
+     * receive buffer moves on.
+     */
+    struct OffloadedCall {
+      RpcFrameHeader request;
+      std::vector<uint8_t> payload;
+      DynamicString* response;
+    };
+    using CallIterator = typename std::list<OffloadedCall>::iterator;
+
+    /*
+     * Calls the method of 'request', and fills 'response' with its
+     * response frame.
+     */
+    static void call_method(RpcFrameHeader const& request,
+                            std::span<uint8_t> payload,
+                            DynamicString* response);
+    /*
+     * Calls the method of 'request', and returns its response frame
+     */
+    DynamicString* dispatch(RpcFrameHeader const& request,
+                            std::span<uint8_t> payload);
+    /*
+     * Calls the method of 'request' off the session, and sends its response
+     * frame from offload_done().
+     */
+    void offload(RpcFrameHeader const& request, std::span<uint8_t> payload);
+    void offload_done(CallIterator call);
+    void release_responses();
+
+    static constexpr std::size_t kReadSize = 64 * 1024;
+    static constexpr std::size_t kResponseBufferSz = 4 * 1024;
+    static inline LSVirtualMachine vm_;
+    /*
+     * Response frames handed to the session and not sent yet. The session
+     * calls on_sent() once its queue is empty, i.e. all of them are sent.
+     */
+    std::vector<DynamicString*> in_flight_;
+    /*
+     * Offloaded calls whose responses are not handed to the session yet
+     */
+    std::list<OffloadedCall> offloaded_;
+    /*
+     * Set if the session should close once the offloaded calls are
+     * complete and their responses are sent.
+     */
+    bool close_pending_ = false;
+  };
+
+  using Rpc = BasicRpc<MultiThreaded>;
+
+  inline void
+  RpcFrameHeader::encode(uint8_t* out) const noexcept
+  {
+    auto len = htole32(payload_len);
+    auto id = htole32(request_id);
+    auto method = htole16(method_id);
+    auto st = htole16(status);
+
+    std::memcpy(out, &len, 4);
+    std::memcpy(out + 4, &id, 4);
+    std::memcpy(out + 8, &method, 2);
+    std::memcpy(out + 10, &st, 2);
+  }
+
+  inline RpcFrameHeader
+  RpcFrameHeader::decode(uint8_t const* in) noexcept
+  {
+    RpcFrameHeader header;
+
+    std::memcpy(&header.payload_len, in, 4);
+    std::memcpy(&header.request_id, in + 4, 4);
+    std::memcpy(&header.method_id, in + 8, 2);
+    std::memcpy(&header.status, in + 10, 2);
+    header.payload_len = le32toh(header.payload_len);
+    header.request_id = le32toh(header.request_id);
+    header.method_id = le16toh(header.method_id);
+    header.status = le16toh(header.status);
+    return header;
+  }
+
+  inline RpcCall::RpcCall(std::span<uint8_t> payload, DynamicString* response,
+                          LSVirtualMachine* vm)
+      : payload{payload}
+      , vm{vm}
+      , response_{response}
+  { }
+
+  inline uint8_t*
+  RpcCall::respond(std::size_t n)
+  {
+    auto size = RpcFrameHeader::kSize + n;
+    if (size > response_->capacity()) LS_UNLIKELY
+      response_->resize(size);
+    response_->fill(size);
+    return reinterpret_cast<uint8_t*>(response_->data()) +
+           RpcFrameHeader::kSize;
+  }
+
+  template <class H, class... T>
+  inline bool
+  RpcMethodList<H, T...>::dispatch(uint16_t method_id, RpcCall& call)
+  {
+    if (method_id == H::id_) {
+      H::call(call);
+      return true;
+    } else
+      return Base::dispatch(method_id, call);
+  }
+
+  template <class H, class... T>
+  inline bool
+  RpcMethodList<H, T...>::offloaded(uint16_t method_id)
+  {
+    if (method_id == H::id_) {
+      if constexpr (requires { H::offloaded_; })
+        return H::offloaded_;
+      return false;
+    } else
+      return Base::offloaded(method_id);
+  }
+
+  inline void
+  RpcEchoMethod::call(RpcCall& call)
+  {
+    auto n = call.payload.size();
+    if (n > 0)
+      std::memcpy(call.respond(n), call.payload.data(), n);
+  }
+
+  inline void
+  RpcVScriptMethod::call(RpcCall& call)
+  {
+    Program program;
+    std::size_t consume_len;
+
+    auto status = Program::try_parse(program, consume_len, call.payload.data(),
+                                     call.payload.size());
+    if (status != SUCCESS) {
+      call.status = kRpcBadRequest;
+      return;
+    }
+
+    program.set_vm(call.vm);
+    program.feed(call.payload.data() + consume_len,
+                 call.payload.size() - consume_len, true);
+
+    /*
+     * Like Http, the downloaded bytes are whatever the buffer holds
+     */
+    auto download_size = program.get_response().download_size;
+    if (download_size > kRpcMaxPayload) {
+      call.status = kRpcTooLarge;
+      return;
+    }
+    if (download_size > 0)
+      call.respond(download_size);
+  }
+
+  template <class Threading, class Methods>
+  inline void
+  BasicRpc<Threading, Methods>::start()
+  {
+    /*
+     * A session closed on a bad frame is reused with that frame still
+     * in its buffer.
+     */
+    BaseSession::reset_buffers();
+    BaseSession::reserve_receive_buffer(kReadSize);
+    close_pending_ = false;
+  }
+
+  template <class Threading, class Methods>
+  inline void
+  BasicRpc<Threading, Methods>::on_error(std::error_code error)
+  {
+    lslog(
+        3, "Rpc service: ",
+        std::error_condition{error.value(), std::system_category()}.message());
+  }
+
+  template <class Threading, class Methods>
+  inline void
+  BasicRpc<Threading, Methods>::on_closed()
+  {
+    release_responses();
+    /*
+     * The session is finalized after the offloaded calls are complete,
+     * but the responses of those that completed while it was closing are
+     * never handed to it.
+     */
+    for (auto& call: offloaded_)
+      BaseSession::release_send_buffer(call.response);
+    offloaded_.clear();
+  }
+
+  template <class Threading, class Methods>
+  inline void
+  BasicRpc<Threading, Methods>::release_responses()
+  {
+    for (auto response: in_flight_)
+      BaseSession::release_send_buffer(response);
+    in_flight_.clear();
+  }
+
+  template <class Threading, class Methods>
+  inline auto
+  BasicRpc<Threading, Methods>::on_sent()
+  {
+    release_responses();
+    if (close_pending_ && offloaded_.empty()) LS_UNLIKELY
+      return BaseSession::kClose;
+    /*
+     * The next read is already in flight, or reading has stopped for the
+     * session to close.
+     */
+    return BaseSession::kData;
+  }
+
+  template <class Threading, class Methods>
+  inline void
+  BasicRpc<Threading, Methods>::call_method(RpcFrameHeader const& request,
+                                            std::span<uint8_t> payload,
+                                            DynamicString* response)
+  {
+    response->clear();
+    response->fill(RpcFrameHeader::kSize);
+
+    RpcCall call{payload, response, &vm_};
+    if (!Methods::dispatch(request.method_id, call)) LS_UNLIKELY
+      call.status = kRpcUnknownMethod;
+
+    RpcFrameHeader{
+        .payload_len =
+            static_cast<uint32_t>(response->size() - RpcFrameHeader::kSize),
+        .request_id = request.request_id,
+        .method_id = request.method_id,
+        .status = call.status}
+        .encode(reinterpret_cast<uint8_t*>(response->data()));
+  }
+
+  template <class Threading, class Methods>
+  inline DynamicString*
+  BasicRpc<Threading, Methods>::dispatch(RpcFrameHeader const& request,
+                                         std::span<uint8_t> payload)
+  {
+    auto response = BaseSession::prepare_send_buffer(kResponseBufferSz);
+    call_method(request, payload, response);
+    return response;
+  }
+
+  template <class Threading, class Methods>
+  inline void
+  BasicRpc<Threading, Methods>::offload(RpcFrameHeader const& request,
+                                        std::span<uint8_t> payload)
+  {
+    auto call = offloaded_.insert(
+        offloaded_.end(),
+        OffloadedCall{request,
+                      {payload.begin(), payload.end()},
+                      BaseSession::prepare_send_buffer(kResponseBufferSz)});
+
+    /*
+     * The worker only touches its own element, while the session may
+     * insert and erase others.
+     */
+    BaseSession::offload(
+        [c = &*call]() {
+          call_method(c->request, {c->payload.data(), c->payload.size()},
+                      c->response);
+        },
+        [this, call]() { offload_done(call); });
+  }
+
+  template <class Threading, class Methods>
+  inline void
+  BasicRpc<Threading, Methods>::offload_done(CallIterator call)
+  {
+    auto response = call->response;
+    offloaded_.erase(call);
+    in_flight_.push_back(response);
+    BaseSession::send(response);
+  }
+
+  template <class Threading, class Methods>
+  inline auto
+  BasicRpc<Threading, Methods>::on_data()
+  {
+    auto data = BaseSession::data();
+    auto size = BaseSession::data_size();
+    auto batch_start = in_flight_.size();
+    std::size_t offset = 0;
+    bool bad_frame = false;
+
+    /*
+     * Handle the complete frames, and leave a partial one in the buffer
+     * for the next read to complete.
+     */
+    while (size - offset >= RpcFrameHeader::kSize) {
+      auto request = RpcFrameHeader::decode(data + offset);
+      if (request.payload_len > kRpcMaxPayload) LS_UNLIKELY {
+        bad_frame = true;
+        break;
+      }
+      if (size - offset - RpcFrameHeader::kSize < request.payload_len)
+        break;
+
+      BaseSession::transaction_started();
+      std::span<uint8_t> payload{data + offset + RpcFrameHeader::kSize,
+                                 request.payload_len};
+      if (Methods::offloaded(request.method_id)) LS_UNLIKELY
+        offload(request, payload);
+      else
+        in_flight_.push_back(dispatch(request, payload));
+      offset += RpcFrameHeader::kSize + request.payload_len;
+    }
+
+    if (offset > 0)
+      BaseSession::consume(offset);
+    if (in_flight_.size() > batch_start)
+      BaseSession::send(in_flight_.begin() + batch_start, in_flight_.end());
+
+    /*
+     * The session closes once the queued responses are sent. If calls are
+     * still offloaded, it stops reading and closes from on_sent() once
+     * their responses are sent too.
+     */
+    if (bad_frame || BaseSession::draining()) LS_UNLIKELY {
+      if (offloaded_.empty())
+        return BaseSession::kClose;
+      close_pending_ = true;
+      return BaseSession::kData;
+    }
+    return BaseSession::kContinue;
+  }
+} // namespace lserver
@@ -29,19 +29,24 @@
 
 #pragma once
 
+#include <unistd.h>
+
 #include <atomic>
+#include <chrono>
 #include <memory>
-#include <optional>
 #include <type_traits>
 
 #include <asio.hpp>
 
+#include "capture.hpp"
 #include "common.hpp"
 #include "config.hpp"
 #include "io_context_pool.hpp"
 #include "session.hpp"
 #include "session_pool.hpp"
+#include "socket_options.hpp"
 #include "syncronization_utils.hpp"
+#include "tls.hpp"
 #ifdef ENABLE_STATISTICS
 #include "stats.hpp"
 #endif
@@ -80,7 +85,35 @@ namespace lserver {
      * Deactivate the LSContext with id 'context_id'.
      */
     virtual int deactivate_context(std::size_t context_index) = 0;
+    /*
+     * Deactivate the LSContext with id 'context_id', and drain its sessions
+     * within 'timeout' (zero uses the configured timeout). Returns 0.
+     */
+    virtual int drain_context(std::size_t context_index,
+                              std::chrono::milliseconds timeout) = 0;
+    /*
+     * Change the number of threads of an active LSContext in place.
+     */
+    virtual void set_context_threads(std::size_t context_index,
+                                     std::size_t thread_cnt) = 0;
+    /*
+     * Change how the threads of an LSContext wait for events.
+     */
+    virtual void set_context_run_mode(std::size_t context_index,
+                                      RunMode mode) = 0;
     virtual ServerInfo get_server_info() const = 0;
+    /*
+     * Starts measuring the event loop lag of the LSContexts, and samples
+     * the TCP_INFO of their sessions, which are reported by the next calls
+     * to get_server_info().
+     */
+    virtual void probe_contexts() = 0;
+    /*
+     * Asks the idle keep-alive sessions of the overloaded LSContexts to
+     * move to the least loaded ones. Returns the number of sessions asked
+     * to move.
+     */
+    virtual std::size_t rebalance_contexts() = 0;
 #ifdef ENABLE_STATISTICS
     virtual LSStats get_stats() const = 0;
 #endif
@@ -94,28 +127,67 @@ namespace lserver {
     void stop() override;
     void wait() override;
     /*
-     * Acquires an LSContext and calls async_accept() to accept a new
-     * connection. This method does not block and returns immediately.
+     * Waits for new connections to accept. This method does not block and
+     * returns immediately.
      */
     void dispatch();
     void add_context(std::size_t thread_cnt) override;
     int deactivate_context(std::size_t context_index) override;
+    int drain_context(std::size_t context_index,
+                      std::chrono::milliseconds timeout) override;
+    void set_context_threads(std::size_t context_index,
+                             std::size_t thread_cnt) override;
+    void set_context_run_mode(std::size_t context_index,
+                              RunMode mode) override;
     ServerInfo get_server_info() const override;
+    void probe_contexts() override;
+    std::size_t rebalance_contexts() override;
 #ifdef ENABLE_STATISTICS
     LSStats get_stats() const override;
 #endif
 
   private:
+    /*
+     * A SingleThreaded protocol runs on single threaded LSContexts. Their
+     * sockets may only be used from their own thread, so the acceptor
+     * always gets its own LSContext and sessions are started on their
+     * LSContext.
+     */
+    static constexpr bool kSingleThreaded = is_single_threaded_v<P>;
+
+    bool separate_acceptor() const;
+    /*
+     * True if the server listens on a Unix domain socket
+     */
+    bool listen_unix() const;
+    /*
+     * The socket options that apply to the sockets of the listener
+     */
+    SocketOptions socket_options() const;
+    /*
+     * Accepts the pending connections, each one on the next LSContext.
+     */
+    void accept();
+
     LSConfig config_;
+    /*
+     * Bytes queued by all the sessions of this server and not sent yet
+     */
+    std::atomic<std::size_t> send_bytes_ = 0;
+    /*
+     * Set if the sessions of this server are wrapped in TLS
+     */
+    std::unique_ptr<TlsContext> tls_;
+    SessionOptions session_options_;
     LSContextPool workers_pool_;
-    SessionPool<P> pool_;
-    LSContextPool acceptor_pool_;
     /*
-     * Holds the socket for the next incomming connection. This is built on
-     * the next chosen LSContext and is passed to the acceptor.
+     * Outlives the sessions in pool_, which may write to it until they
+     * are destroyed.
      */
-    std::optional<tcp::socket> socket_;
-    tcp::acceptor acceptor_;
+    std::unique_ptr<CaptureWriter> capture_;
+    SessionPool<P> pool_;
+    LSContextPool acceptor_pool_;
+    asio::basic_socket_acceptor<stream_protocol> acceptor_;
     TriggerGuard shutdown_guard_;
 #ifdef ENABLE_STATISTICS
     ServerStats stats_;
@@ -126,24 +198,56 @@ namespace lserver {
   SESSION_CONCEPT
   Server<P>::Server(LSConfig config)
       : config_{config}
+      , tls_{config_.tls_enabled_
+                 ? std::make_unique<TlsContext>(
+                       config_.tls_certificate_file_,
+                       config_.tls_private_key_file_, config_.tls_ktls_,
+                       alpn_protocol(config_.listen_protocol_))
+                 : nullptr}
+      , session_options_{.speculative_io_budget_ =
+                             config_.speculative_io_budget_,
+                         .send_high_watermark_ = config_.send_high_watermark_,
+                         .send_low_watermark_ = config_.send_low_watermark_,
+                         .max_send_bytes_ = config_.max_send_bytes_,
+                         .send_bytes_ = &send_bytes_,
+                         .socket_options_ = socket_options(),
+                         .socket_buffer_min_ = config_.socket_buffer_min_,
+                         .socket_buffer_max_ = config_.socket_buffer_max_,
+                         .tls_context_ = tls_.get()}
       , workers_pool_{config_.num_workers_, config_.max_num_workers_,
-                      config_.num_threads_per_worker_}
+                      config_.num_threads_per_worker_, "lsworker",
+                      config_.worker_thread_setups_,
+                      RunMode{config_.spin_budget_us_, config_.busy_poll_us_},
+                      kSingleThreaded}
+      , capture_{config_.capture_enabled_
+                     ? std::make_unique<CaptureWriter>(
+                           config_.capture_file_,
+                           config_.capture_sampling_rate_,
+                           config_.capture_max_size_)
+                     : nullptr}
       , pool_(config_.max_session_pool_size_, config_.eager_session_pool_)
-      , acceptor_pool_{1, 1, 1}
-      , acceptor_{config_.separate_acceptor_thread_
+      , acceptor_pool_{1, 1, 1, "lsacceptor", {config_.acceptor_thread_setup_}}
+      , acceptor_{separate_acceptor()
                       ? std::get<0>(acceptor_pool_.get_context_round_robin())
                             ->get_io_context()
                       : std::get<0>(workers_pool_.get_context_round_robin())
                             ->get_io_context()}
   {
-    asio::ip::tcp::endpoint ep(asio::ip::tcp::v4(), config_.listen_port_);
+    stream_protocol::endpoint ep{
+        tcp::endpoint{tcp::v4(), config_.listen_port_}};
+    if (listen_unix())
+      ep = asio::local::stream_protocol::endpoint{config_.listen_unix_path_};
     acceptor_.open(ep.protocol());
     acceptor_.set_option(
-        asio::ip::tcp::acceptor::reuse_address(config_.reuse_address_));
+        asio::socket_base::reuse_address(config_.reuse_address_));
     acceptor_.set_option(asio::socket_base::linger(
         config_.socket_close_linger_, config_.socket_close_linger_timeout_));
+    if (listen_unix())
+      remove_stale_unix_socket(config_.listen_unix_path_);
     acceptor_.bind(ep);
+    apply_listener_options(acceptor_.native_handle(), socket_options());
     acceptor_.listen();
+    acceptor_.non_blocking(true);
   }
 
 #ifdef ENABLE_STATISTICS
@@ -156,6 +260,29 @@ namespace lserver {
   }
 #endif
 
+  template <class P>
+  SESSION_CONCEPT bool
+  Server<P>::separate_acceptor() const
+  {
+    return config_.separate_acceptor_thread_ || kSingleThreaded;
+  }
+
+  template <class P>
+  SESSION_CONCEPT bool
+  Server<P>::listen_unix() const
+  {
+    return !config_.listen_unix_path_.empty();
+  }
+
+  template <class P>
+  SESSION_CONCEPT SocketOptions
+  Server<P>::socket_options() const
+  {
+    if (listen_unix())
+      return local_socket_options(config_.socket_options_);
+    return config_.socket_options_;
+  }
+
   template <class P>
   SESSION_CONCEPT void
   Server<P>::stop()
@@ -167,12 +294,16 @@ namespace lserver {
      */
     shutdown_guard_.trigger();
 
-    socket_ = std::nullopt;
     acceptor_.close();
-    if (config_.separate_acceptor_thread_)
+    if (listen_unix())
+      ::unlink(config_.listen_unix_path_.c_str());
+    if (separate_acceptor())
       acceptor_pool_.stop();
     workers_pool_.stop();
     lslog_note(0, "Workers pool stopped");
+
+    if (capture_)
+      capture_->flush();
   }
 
   template <class P>
@@ -180,6 +311,8 @@ namespace lserver {
   Server<P>::add_context(std::size_t thread_cnt)
   {
     workers_pool_.add_context(thread_cnt);
+    if (config_.rebalance_on_context_change_)
+      workers_pool_.rebalance();
   }
 
   template <class P>
@@ -187,55 +320,118 @@ namespace lserver {
   Server<P>::deactivate_context(std::size_t context_index)
   {
     int rc = workers_pool_.deactivate_context(context_index);
+    if (rc == 0 && config_.rebalance_on_context_change_)
+      workers_pool_.rebalance();
     return (rc);
   }
 
+  template <class P>
+  SESSION_CONCEPT int
+  Server<P>::drain_context(std::size_t context_index,
+                           std::chrono::milliseconds timeout)
+  {
+    if (timeout == 0ms)
+      timeout = std::chrono::milliseconds{config_.drain_timeout_ms_};
+    workers_pool_.drain_context(context_index, timeout);
+    if (config_.rebalance_on_context_change_)
+      workers_pool_.rebalance();
+    return (0);
+  }
+
   template <class P>
   SESSION_CONCEPT void
-  Server<P>::dispatch()
+  Server<P>::set_context_threads(std::size_t context_index,
+                                 std::size_t thread_cnt)
   {
-    auto [lscontext, id] = workers_pool_.get_context_round_robin();
-    socket_.emplace(lscontext->get_io_context());
+    workers_pool_.set_context_threads(context_index, thread_cnt);
+  }
 
+  template <class P>
+  SESSION_CONCEPT void
+  Server<P>::set_context_run_mode(std::size_t context_index, RunMode mode)
+  {
+    workers_pool_.set_context_run_mode(context_index, mode);
+  }
+
+  template <class P>
+  SESSION_CONCEPT void
+  Server<P>::dispatch()
+  {
     /*
      * Prevent triggering of server shutdown while we are registering an
-     * asyncronous accept.
+     * asyncronous wait.
      */
     SCOPED_GUARD_OR_RETURN(shutdown_guard_);
 
-    acceptor_.async_accept(*socket_, [this, lscontext = lscontext,
-                                      id = id](std::error_code error) {
-      P* protocol;
+    acceptor_.async_wait(asio::socket_base::wait_read,
+                         [this](std::error_code) { this->accept(); });
+  }
 
-      /*
-       * Prevent triggering of server shutdown while we are starting a
-       * new session.
-       */
-      SCOPED_GUARD_OR_RETURN(shutdown_guard_);
+  template <class P>
+  SESSION_CONCEPT void
+  Server<P>::accept()
+  {
+    /*
+     * Prevent triggering of server shutdown while we are starting new
+     * sessions.
+     */
+    SCOPED_GUARD_OR_RETURN(shutdown_guard_);
+
+    /*
+     * The LSContext is chosen once a connection is ready rather than when
+     * the wait is registered, so that an idle listener does not keep a
+     * context held, which would block its drain or deactivation. The
+     * reactor only reports the edges of the readiness of the listener, so
+     * we accept until it would block.
+     */
+    while (true) {
+      auto [lscontext, id] = workers_pool_.get_context_round_robin();
+      stream_protocol::socket socket{lscontext->get_io_context()};
+      asio::error_code error;
+      P* protocol;
 
+      acceptor_.accept(socket, error);
       if (!error && (protocol = pool_.borrow(id))) {
-        protocol->setup(*lscontext, std::move(*socket_));
-        protocol->session_start();
+        protocol->setup(*lscontext, std::move(socket), session_options_,
+                        capture_.get());
+        if constexpr (kSingleThreaded)
+          asio::post(lscontext->get_io_context(),
+                     [protocol]() { protocol->session_start(); });
+        else
+          protocol->session_start();
 #ifdef ENABLE_STATISTICS
         stats_.stats_accepted_cnt.fetch_add(1);
 #endif
-      } else {
-        /*
-         * Normally this is done by the Session instance. We need to do
-         * it manually in the unhappy path.
-         */
-        lscontext->unhold();
+        continue;
       }
 
-      this->dispatch();
-    });
+      /*
+       * Normally this is done by the Session instance. We need to do
+       * it manually in the unhappy path.
+       */
+      lscontext->unhold();
+
+      if (!error || error == asio::error::connection_aborted)
+        continue;
+      if (error == asio::error::would_block)
+        break;
+
+      /*
+       * The connection is still pending (e.g. out of file descriptors),
+       * so no new edge will wake us up. Retry.
+       */
+      asio::post(acceptor_.get_executor(), [this]() { this->accept(); });
+      return;
+    }
+
+    this->dispatch();
   }
 
   template <class P>
   SESSION_CONCEPT void
   Server<P>::wait()
   {
-    if (config_.separate_acceptor_thread_)
+    if (separate_acceptor())
       acceptor_pool_.wait();
     workers_pool_.wait();
   }
@@ -248,4 +444,20 @@ namespace lserver {
     si.contexts_info_ = workers_pool_.get_contexts_info();
     return si;
   }
+
+  template <class P>
+  SESSION_CONCEPT void
+  Server<P>::probe_contexts()
+  {
+    workers_pool_.probe_lag();
+    if (config_.tcp_info_sample_ratio_ > 0)
+      workers_pool_.sample_tcp_info(config_.tcp_info_sample_ratio_);
+  }
+
+  template <class P>
+  SESSION_CONCEPT std::size_t
+  Server<P>::rebalance_contexts()
+  {
+    return workers_pool_.rebalance();
+  }
 } // namespace lserver
\ No newline at end of file
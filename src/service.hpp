@@ -30,8 +30,11 @@
 #pragma once
 
 #include <functional>
+#include <string>
 #include <thread>
 
+#include "thread_setup.hpp"
+
 namespace lserver {
   /*
    * CRTP base class for creating a general service type. The derived
@@ -43,7 +46,10 @@ namespace lserver {
   class Service {
   public:
     Service() = default;
-    void start();
+    /*
+     * Starts the service thread, named 'name' if it is not empty.
+     */
+    void start(std::string name = {});
     void stop();
     /*
      * Joins and blocks on the service thread.
@@ -61,9 +67,12 @@ namespace lserver {
 
   template <class S>
   void
-  Service<S>::start()
+  Service<S>::start(std::string name)
   {
-    thread_ = std::thread{std::bind(&Service::service_loop, this)};
+    thread_ = std::thread{[this, name]() {
+      set_thread_name(name);
+      service_loop();
+    }};
   }
 
   template <class S>
@@ -30,18 +30,27 @@
 #pragma once
 
 #include <sys/time.h>
+#include <unistd.h>
 
+#include <algorithm>
 #include <any>
+#include <array>
 #include <atomic>
+#include <bit>
 #include <exception>
+#include <span>
+#include <type_traits>
 
 #include <asio.hpp>
 
+#include "capture.hpp"
 #include "common.hpp"
 #include "dynamic_queue.hpp"
 #include "io_context_pool.hpp"
 #include "program.hpp"
+#include "socket_options.hpp"
 #include "syncronization_utils.hpp"
+#include "tls.hpp"
 #ifdef ENABLE_STATISTICS
 #include "stats.hpp"
 #endif
@@ -64,6 +73,100 @@ namespace lserver {
   template <class P>
   concept IsSession = std::derived_from<P, Session<P>>;
 #endif
+
+  /*
+   * Threading policies of a protocol, declared as its 'threading_policy'
+   * member type. A MultiThreaded protocol (the default) serializes its
+   * handlers on a strand whenever its LSContext runs more than one thread.
+   * A SingleThreaded protocol runs only on single threaded LSContexts, so
+   * the strand handling is compiled out of its Session.
+   */
+  struct MultiThreaded { };
+  struct SingleThreaded { };
+
+  template <class P, class = void>
+  struct threading_policy {
+    using type = MultiThreaded;
+  };
+
+  template <class P>
+  struct threading_policy<P, std::void_t<typename P::threading_policy>> {
+    using type = typename P::threading_policy;
+  };
+
+  /*
+   * Must not be used before P is complete, e.g. in the class body of the
+   * CRTP base.
+   */
+  template <class P>
+  inline constexpr bool is_single_threaded_v =
+      std::is_same_v<typename threading_policy<P>::type, SingleThreaded>;
+
+  /*
+   * Duplex policies of a protocol, declared as its 'duplex_policy' member
+   * type. A HalfDuplex protocol (the default) either receives or sends, so
+   * a session has a single handler in flight. A FullDuplex protocol keeps
+   * a receive and a send in flight together: their handlers would run
+   * concurrently as soon as threads are added to its LSContext, so a
+   * MultiThreaded one gets a strand even on a single threaded LSContext.
+   */
+  struct HalfDuplex { };
+  struct FullDuplex { };
+
+  template <class P, class = void>
+  struct duplex_policy {
+    using type = HalfDuplex;
+  };
+
+  template <class P>
+  struct duplex_policy<P, std::void_t<typename P::duplex_policy>> {
+    using type = typename P::duplex_policy;
+  };
+
+  template <class P>
+  inline constexpr bool is_full_duplex_v =
+      std::is_same_v<typename duplex_policy<P>::type, FullDuplex>;
+  /*
+   * Per server settings of the sessions, handed to Session::setup().
+   */
+  struct SessionOptions {
+    /*
+     * If non-zero, a session first tries to read or write without waiting,
+     * and goes through the reactor only if the socket is not ready. The
+     * completion is still posted, so the protocol sees no difference. At
+     * most this many operations complete this way in a row.
+     */
+    std::size_t speculative_io_budget_ = 0;
+    /*
+     * If non-zero, a session whose queued outgoing bytes exceed
+     * send_high_watermark_ is backpressured, until they fall to
+     * send_low_watermark_.
+     */
+    std::size_t send_high_watermark_ = 0;
+    std::size_t send_low_watermark_ = 0;
+    /*
+     * If non-zero, the sessions are also backpressured while the queued
+     * outgoing bytes of all the sessions sharing 'send_bytes_' exceed
+     * max_send_bytes_.
+     */
+    std::size_t max_send_bytes_ = 0;
+    std::atomic<std::size_t>* send_bytes_ = nullptr;
+    SocketOptions socket_options_;
+    /*
+     * If socket_buffer_max_ is non-zero, SO_RCVBUF and SO_SNDBUF of each
+     * session start at socket_buffer_min_, double while a transaction
+     * transfers more than they hold, up to socket_buffer_max_, and fall
+     * back to socket_buffer_min_ between transactions.
+     */
+    std::size_t socket_buffer_min_ = 0;
+    std::size_t socket_buffer_max_ = 0;
+    /*
+     * If set, each session runs a TLS handshake before the protocol sees
+     * its connection.
+     */
+    TlsContext* tls_context_ = nullptr;
+  };
+
   /*
    * The CRTP base template Session<P> provides the base networking
    * services for the upper layer 'Protocol'.
@@ -83,7 +186,13 @@ namespace lserver {
     class BadReceptionState : std::exception { };
 
     Session() = default;
-    void setup(LSContext& lscontext, tcp::socket&& socket);
+    /*
+     * If 'capture' is given, the inbound byte stream of the connection may
+     * be sampled into it.
+     */
+    void setup(LSContext& lscontext, stream_protocol::socket&& socket,
+               SessionOptions const& options = {},
+               CaptureWriter* capture = nullptr);
     void session_start();
     template <class F>
     void set_finalized_cb(F&& on_finalized_cb);
@@ -93,6 +202,12 @@ namespace lserver {
 
   protected:
     enum Feedback { kFinished, kContinue, kClose, kData };
+    /*
+     * The receive buffer does not grow beyond this. A protocol must not
+     * wait for more data once it holds this many bytes, or it would never
+     * get any.
+     */
+    static constexpr std::size_t kMaxReceiveSize = 256 * 1024ul;
 
     ~Session() noexcept = default;
     Session(Session const&) = delete;
@@ -106,7 +221,20 @@ namespace lserver {
      * derived 'P' class, like on_data(), on_error(), and on_closed().
      */
     void receive();
+    /*
+     * Queues 'qb' to be sent. If this takes the session above its send
+     * watermark, the protocol's optional on_backpressure() is called before
+     * this returns, and it should stop producing until its optional
+     * on_backpressure_relieved() is called.
+     */
     void send(DynQue::QueueBuffer* qb);
+    /*
+     * Queues the buffers of [first, last) at once, so that they leave in a
+     * single gather write if nothing else is being sent.
+     */
+    template <class It>
+    void send(It first, It last);
+    bool backpressured() const noexcept;
     /*
      * Throws away 'length' bytes of data from the input stream of this
      * session. If 'length' is zero all currently buffered data is
@@ -125,6 +253,12 @@ namespace lserver {
      */
     uint8_t* data();
     void set_expected_data_length(std::size_t len);
+    /*
+     * Makes room in the receive buffer for reads of up to 'n' bytes. A
+     * session that has not set an expected data length otherwise reads
+     * only as much as its buffer already holds, which starts at 512 bytes.
+     */
+    void reserve_receive_buffer(std::size_t n);
     std::size_t get_bytes_received();
     std::size_t data_size();
     /*
@@ -141,19 +275,132 @@ namespace lserver {
 
     void transaction_started();
     void transaction_finished();
+    /*
+     * Returns true if the LSContext of this session is being drained, and
+     * the session should close after its current transaction. A session
+     * that can move to another LSContext instead is not asked to close.
+     */
+    bool draining();
+    /*
+     * Runs 'work' on any thread of the LSContext, and then 'done' like a
+     * handler of this session, on the strand it has now. 'work' must not
+     * touch the session. 'done' is skipped if the session is closed in
+     * the meantime, but the session is not finalized before it has run.
+     */
+    template <class W, class D>
+    void offload(W&& work, D&& done);
 
   private:
     void async_receive();
-    void async_send();
+    /*
+     * Sends the buffers at the front of outgoing_queue_, up to
+     * kMaxGatherBuffers of them in a single write, starting 'offset' bytes
+     * into the front one.
+     */
+    void async_send(std::size_t offset = 0);
+    /*
+     * Fills gather_ with the queued bytes that follow the first 'skip'
+     * bytes of the front buffer. Returns the number of buffers used.
+     */
+    std::size_t gather(std::size_t skip);
+    /*
+     * Queues 'qb', and returns true if the queue was empty before.
+     */
+    bool enqueue(DynQue::QueueBuffer* qb);
+    void start_send();
+    /*
+     * Reads what the socket has without waiting, and posts its completion.
+     * Returns false if nothing could be read, or the speculative budget is
+     * spent.
+     */
+    bool try_receive_now(std::size_t max_transfer_sz);
+    /*
+     * Posts 'handler' like the completion of an asynchronous operation of
+     * this session, i.e. on its strand if it has one.
+     */
+    template <class F>
+    void post_completion(F&& handler);
+    /*
+     * Counts an operation of this session as outstanding, and returns
+     * 'handler' wrapped so that it is skipped once the session is closing,
+     * and the operation is counted as complete when it returns. Every
+     * handler the session schedules goes through this.
+     */
+    template <class F>
+    auto track_op(F&& handler);
+    /*
+     * Finalizes a closing session once its last outstanding operation is
+     * complete.
+     */
+    void complete_op();
+    /*
+     * Calls 'handler' with an error code once the socket is ready for
+     * 'type', on the strand of the session if it has one.
+     */
+    template <class F>
+    void async_wait(stream_protocol::socket::wait_type type, F&& handler);
+    /*
+     * Drives the TLS handshake, and starts receiving once it is done.
+     */
+    void tls_handshake();
+    /*
+     * The counterparts of async_receive() and async_send() for a direction
+     * of a TLS connection that the kernel did not take over.
+     */
+    void tls_receive(std::size_t max_transfer_sz);
+    void tls_send(std::size_t offset);
     void async_close(std::error_code error);
+    /*
+     * A session that was set up while its LSContext had a single thread
+     * has no strand. If threads were added to the LSContext since, it
+     * gets one here, before its next handler is scheduled. Since the
+     * session has no other handler in flight at that point, this is
+     * safe. FullDuplex sessions always have a strand already.
+     */
+    void ensure_strand();
+    /*
+     * Moves an idle session to another LSContext, if its LSContext is
+     * asked to give away sessions. The socket is released from the
+     * io_context of the current LSContext and registered with the new one,
+     * and the strand and the reference to the LSContext are swapped.
+     * Returns true if the session was moved, in which case its next
+     * receive is already scheduled on the new LSContext.
+     */
+    bool try_migrate();
     void receive_event_cb(std::error_code error, std::size_t bytes_transferred);
-    void send_event_cb(std::error_code error, std::size_t bytes_transferred);
+    /*
+     * 'offset' is where the write started in the front buffer
+     */
+    void send_event_cb(std::error_code error, std::size_t offset,
+                       std::size_t bytes_transferred);
+    /*
+     * Account for 'n' bytes queued or sent, and enter or leave the
+     * backpressured state. send_accounted() returns true if the session
+     * left it.
+     */
+    void queue_accounted(std::size_t n);
+    bool send_accounted(std::size_t n);
+    /*
+     * Calls the optional on_backpressure_relieved() of the protocol
+     */
+    void notify_relieved();
+    /*
+     * Set or clear TCP_CORK on the socket, if the tcp_cork option is set.
+     */
+    void cork(bool on);
+    /*
+     * Sets the socket buffer 'name' (SO_RCVBUF or SO_SNDBUF), currently
+     * 'current' bytes, to 'wanted' rounded up to a power of two, within the
+     * socket buffer bounds.
+     */
+    void size_buffer(int name, std::size_t& current, std::size_t wanted);
     /*
      * Tries to close down the current session. If called multiple times
      * in a single session, exactly one of the calls goes through and just
      * one shutdown sequence is performed for the session.
      * It may defer close down if there are still outging data queue and
-     * waiting to be sent out.
+     * waiting to be sent out. Otherwise the pending operations are
+     * cancelled, and the session is finalized once they are complete.
      */
     void close_once();
     /*
@@ -172,12 +419,24 @@ namespace lserver {
      * from this queue and sent one-by-one.
      */
     DynQue outgoing_queue_;
+    static constexpr std::size_t kMaxGatherBuffers = 16;
+    /*
+     * The buffers of the write in flight
+     */
+    std::array<asio::const_buffer, kMaxGatherBuffers> gather_;
     /*
      * 'ubuf_' is the underlying buffer used for reception of data in each
      * Session instance.
      */
     std::vector<uint8_t> ubuf_;
-    std::optional<tcp::socket> socket_;
+    std::optional<stream_protocol::socket> socket_;
+    TlsStream tls_;
+    /*
+     * Small outgoing buffers of a user space TLS connection are copied
+     * here, up to a full record.
+     */
+    static constexpr std::size_t kTlsMaxRecordSize = 16384;
+    std::vector<uint8_t> tls_coalesce_;
     /*
      * The LSContext in which this Session instance is attached. It has the
      * io_context, plus a pool of strands, a thread pool, and other items
@@ -192,6 +451,11 @@ namespace lserver {
      * LSContext strand poool.
      */
     Strand* strand_ = nullptr;
+    CaptureWriter* capture_ = nullptr;
+    /*
+     * Non-zero if the inbound stream of this session is being captured.
+     */
+    uint64_t capture_stream_id_ = 0;
     /*
      * This is set by the CRTP derived Protocol class to hint the Session as to
      * the amount of data it expects to see comming from over the connection.
@@ -206,6 +470,24 @@ namespace lserver {
      */
     bool expected_data_chunck_sz_set_ = false;
     std::atomic<bool> prepare_for_shutdown_ = false;
+    SessionOptions options_;
+    /*
+     * Bytes queued in outgoing_queue_ and not sent yet. Only maintained if
+     * a send watermark or max_send_bytes_ is set.
+     */
+    std::size_t outgoing_bytes_ = 0;
+    bool backpressured_ = false;
+    bool corked_ = false;
+    /*
+     * Socket buffer sizes last set by size_buffer()
+     */
+    std::size_t rcvbuf_ = 0;
+    std::size_t sndbuf_ = 0;
+    /*
+     * Number of operations that may still complete speculatively before
+     * the session goes through the reactor again.
+     */
+    std::size_t speculative_left_ = 0;
     /*
      * The session calls this callback as the last thing in its chain of
      * shutdown. A Server instance may use this callback to recycle or re-pool
@@ -213,6 +495,14 @@ namespace lserver {
      */
     std::function<void(P*)> finalized_;
     ResetableOnceFlag close_once_flag_;
+    /*
+     * A FullDuplex session has a receive and a send in flight together, so
+     * when one of them closes the session, the other is still queued. The
+     * session must not be finalized, and possibly reused for another
+     * connection, before that handler has run.
+     */
+    std::atomic<std::size_t> pending_ops_ = 0;
+    std::atomic<bool> closing_ = false;
 
     std::size_t bytes_received_ = 0;
     std::size_t bytes_sent_ = 0;
@@ -243,19 +533,56 @@ namespace lserver {
   Session<P>::session_start()
   {
     get_protocol()->start();
-    receive();
+    if (options_.tls_context_) LS_UNLIKELY {
+      if (tls_.open(*options_.tls_context_, socket_->native_handle())) LS_LIKELY
+        tls_handshake();
+      else
+        async_close(std::make_error_code(std::errc::not_enough_memory));
+    } else {
+      receive();
+    }
     lscontext_->unhold();
   }
 
   template <class P>
   inline void
-  Session<P>::setup(LSContext& lscontext, tcp::socket&& socket)
+  Session<P>::setup(LSContext& lscontext, stream_protocol::socket&& socket,
+                    SessionOptions const& options, CaptureWriter* capture)
   {
+    options_ = options;
+    speculative_left_ = 0;
     lscontext.ref();
     lscontext_ = &lscontext;
-    strand_ = lscontext_->borrow_strand();
+    if constexpr (!is_single_threaded_v<P>)
+      strand_ = lscontext_->borrow_strand(is_full_duplex_v<P>);
     socket_.emplace(std::move(socket));
+    lscontext_->track_socket(socket_->native_handle());
+    lscontext_->tune_socket(socket_->native_handle());
+    apply_socket_options(socket_->native_handle(), options_.socket_options_);
+    corked_ = false;
+    rcvbuf_ = sndbuf_ = 0;
+    if (options_.socket_buffer_max_) LS_UNLIKELY {
+      size_buffer(SO_RCVBUF, rcvbuf_, 0);
+      size_buffer(SO_SNDBUF, sndbuf_, 0);
+    }
+    /*
+     * Speculative reads and writes, and OpenSSL, must fail with EAGAIN
+     * rather than wait.
+     */
+    if (options_.speculative_io_budget_ || options_.tls_context_) LS_UNLIKELY {
+      asio::error_code ec;
+      socket_->non_blocking(true, ec);
+    }
     close_once_flag_.reset();
+    closing_.store(false);
+    pending_ops_.store(0);
+    /*
+     * A session closed with sends pending, e.g. by a reset, leaves this
+     * set, and it would close the next connection after its first send.
+     */
+    prepare_for_shutdown_.store(false);
+    capture_ = capture;
+    capture_stream_id_ = capture ? capture->open_stream() : 0;
   }
 
   template <class P>
@@ -272,6 +599,35 @@ namespace lserver {
   Session<P>::transaction_finished()
   { }
 
+  template <class P>
+  inline bool
+  Session<P>::draining()
+  {
+    return lscontext_->draining() && !lscontext_->migration_pending();
+  }
+
+  template <class P>
+  template <class W, class D>
+  inline void
+  Session<P>::offload(W&& work, D&& done)
+  {
+    Strand* strand = nullptr;
+    if constexpr (!is_single_threaded_v<P>) {
+      ensure_strand();
+      strand = strand_;
+    }
+
+    asio::post(lscontext_->get_io_context(),
+               [lscontext = lscontext_, strand, work = std::forward<W>(work),
+                done = track_op(std::forward<D>(done))]() mutable {
+                 work();
+                 if (strand) LS_LIKELY
+                   asio::post(*strand, std::move(done));
+                 else
+                   asio::post(lscontext->get_io_context(), std::move(done));
+               });
+  }
+
   template <class P>
   inline void
   Session<P>::reset_buffers()
@@ -293,13 +649,125 @@ namespace lserver {
   template <class P>
   inline void
   Session<P>::send(DynQue::QueueBuffer* qb)
+  {
+    if (enqueue(qb)) LS_LIKELY
+      start_send();
+  }
+
+  template <class P>
+  template <class It>
+  inline void
+  Session<P>::send(It first, It last)
+  {
+    bool idle = false;
+    for (; first != last; ++first)
+      idle |= enqueue(*first);
+
+    if (idle) LS_LIKELY
+      start_send();
+  }
+
+  template <class P>
+  inline bool
+  Session<P>::enqueue(DynQue::QueueBuffer* qb)
   {
     bool idle = outgoing_queue_.empty();
     outgoing_queue_.push(qb);
 
-    if (idle) LS_LIKELY {
-      async_send();
-    }
+    if (options_.send_high_watermark_ || options_.max_send_bytes_) LS_UNLIKELY
+      queue_accounted(qb->size());
+
+    if (options_.socket_buffer_max_ && qb->size() > sndbuf_) LS_UNLIKELY
+      size_buffer(SO_SNDBUF, sndbuf_, qb->size());
+
+    return idle;
+  }
+
+  template <class P>
+  inline void
+  Session<P>::start_send()
+  {
+    if (options_.socket_options_.tcp_cork && !corked_) LS_UNLIKELY
+      cork(true);
+    async_send();
+  }
+
+  template <class P>
+  inline bool
+  Session<P>::backpressured() const noexcept
+  {
+    return backpressured_;
+  }
+
+  template <class P>
+  inline void
+  Session<P>::queue_accounted(std::size_t n)
+  {
+    outgoing_bytes_ += n;
+    std::size_t total = 0;
+    if (options_.max_send_bytes_)
+      total = options_.send_bytes_->fetch_add(n) + n;
+
+    if (backpressured_)
+      return;
+
+    bool above =
+        (options_.send_high_watermark_ &&
+         outgoing_bytes_ > options_.send_high_watermark_) ||
+        (options_.max_send_bytes_ && total > options_.max_send_bytes_);
+    if (!above)
+      return;
+
+    backpressured_ = true;
+    if constexpr (requires(P& p) { p.on_backpressure(); })
+      get_protocol()->on_backpressure();
+  }
+
+  template <class P>
+  inline bool
+  Session<P>::send_accounted(std::size_t n)
+  {
+    outgoing_bytes_ -= n;
+    std::size_t total = 0;
+    if (options_.max_send_bytes_)
+      total = options_.send_bytes_->fetch_sub(n) - n;
+
+    if (!backpressured_ || outgoing_bytes_ > options_.send_low_watermark_)
+      return false;
+    /*
+     * A session with nothing queued is not held back by the others, or
+     * it would never be resumed.
+     */
+    if (options_.max_send_bytes_ && total > options_.max_send_bytes_ &&
+        outgoing_bytes_ > 0)
+      return false;
+
+    backpressured_ = false;
+    return true;
+  }
+
+  template <class P>
+  inline void
+  Session<P>::cork(bool on)
+  {
+    corked_ = on;
+    set_socket_option(socket_->native_handle(), IPPROTO_TCP, TCP_CORK, on,
+                      "TCP_CORK");
+  }
+
+  template <class P>
+  inline void
+  Session<P>::size_buffer(int name, std::size_t& current, std::size_t wanted)
+  {
+    wanted = std::clamp(std::bit_ceil(wanted), options_.socket_buffer_min_,
+                        options_.socket_buffer_max_);
+    if (wanted == current)
+      return;
+
+    current = wanted;
+    set_socket_option(socket_->native_handle(), SOL_SOCKET, name,
+                      static_cast<int>(wanted),
+                      name == SO_RCVBUF ? "SO_RCVBUF" : "SO_SNDBUF");
   }
 
   template <class P>
@@ -342,6 +810,13 @@ namespace lserver {
     expected_data_chunck_sz_set_ = true;
   }
 
+  template <class P>
+  inline void
+  Session<P>::reserve_receive_buffer(std::size_t n)
+  {
+    ubuf_.reserve(n);
+  }
+
   template <class P>
   inline std::size_t
   Session<P>::get_bytes_received()
@@ -364,12 +839,100 @@ namespace lserver {
             bytes_received_ >= expected_data_chunck_sz_);
   }
 
+  template <class P>
+  inline void
+  Session<P>::ensure_strand()
+  {
+    if (!strand_ && lscontext_->needs_strand()) LS_UNLIKELY
+      strand_ = lscontext_->borrow_strand();
+  }
+
+  template <class P>
+  inline bool
+  Session<P>::try_migrate()
+  {
+    if (!lscontext_->migration_pending()) LS_LIKELY
+      return false;
+
+    /*
+     * Only a session between two transactions can move: no pipelined
+     * request is buffered, nothing is being sent or offloaded, and no
+     * shutdown is pending. The handler that calls this is the only
+     * outstanding one.
+     */
+    if (data_size() > 0 || !outgoing_queue_.empty() ||
+        prepare_for_shutdown_.load() || pending_ops_.load() > 1)
+      return false;
+
+    auto target = lscontext_->claim_migration();
+    if (!target)
+      return false;
+
+    asio::error_code ec;
+    auto protocol = socket_->local_endpoint(ec).protocol();
+    stream_protocol::socket::native_handle_type fd = -1;
+    if (!ec)
+      fd = socket_->release(ec);
+    if (ec) LS_UNLIKELY {
+      target->deref();
+      target->unhold();
+      return false;
+    }
+    /*
+     * Untracked before it may be closed below, since a new connection may
+     * reuse the descriptor right after.
+     */
+    lscontext_->untrack_socket(fd);
+
+    socket_.emplace(target->get_io_context());
+    socket_->assign(protocol, fd, ec);
+    if (ec) LS_UNLIKELY {
+      /*
+       * The next read fails on the closed socket and closes the session
+       * on its new LSContext.
+       */
+      log_error("Failed to migrate session socket");
+      ::close(fd);
+    }
+
+    if constexpr (!is_single_threaded_v<P>) {
+      if (strand_) LS_UNLIKELY
+        lscontext_->put_strand(strand_);
+      strand_ = target->borrow_strand(is_full_duplex_v<P>);
+    }
+
+    if (!ec) LS_LIKELY {
+      target->track_socket(fd);
+      target->tune_socket(fd);
+      apply_socket_options(fd, options_.socket_options_);
+      if (options_.speculative_io_budget_ || options_.tls_context_) LS_UNLIKELY
+        socket_->non_blocking(true, ec);
+    }
+    lscontext_->deref();
+    lscontext_ = target;
+
+    /*
+     * The socket operations of a single threaded LSContext may only be
+     * initiated from its own thread.
+     */
+    if constexpr (is_single_threaded_v<P>) {
+      asio::post(target->get_io_context(), [this, target]() {
+        async_receive();
+        target->unhold();
+      });
+    } else {
+      async_receive();
+      target->unhold();
+    }
+    return true;
+  }
+
   template <class P>
   inline void
   Session<P>::async_receive()
   {
     std::size_t next_transfer_sz = 1;
-    const std::size_t max_transfer_sz_ = 256 * 1024ul;
+    const std::size_t max_transfer_sz_ = kMaxReceiveSize;
 
     /*
      * If the expected_data_chunck_sz_ is not set, we will have to set
@@ -391,15 +954,33 @@ namespace lserver {
       next_transfer_sz = std::min(expected_remaining_data_sz, max_transfer_sz_);
     }
 
+    if (tls_.user_space_receive()) LS_UNLIKELY {
+      tls_receive(max_transfer_sz_);
+      return;
+    }
+
+    if (try_receive_now(max_transfer_sz_)) LS_UNLIKELY {
+      if (lscontext_->stopped()) LS_UNLIKELY
+        close_once();
+      return;
+    }
+
     auto dynbuf = asio::dynamic_buffer(ubuf_, max_transfer_sz_);
     auto condition = asio::transfer_at_least(next_transfer_sz);
-    auto cb = std::bind(&Session::receive_event_cb, this, _1, _2);
+    auto cb = track_op(std::bind(&Session::receive_event_cb, this, _1, _2));
 
-    if (strand_) LS_UNLIKELY
-      asio::async_read(*socket_, std::move(dynbuf), condition,
-                       strand_->wrap(std::move(cb)));
-    else
+    if constexpr (is_single_threaded_v<P>) {
       asio::async_read(*socket_, std::move(dynbuf), condition, std::move(cb));
+    } else {
+      ensure_strand();
+
+      if (strand_) LS_UNLIKELY
+        asio::async_read(*socket_, std::move(dynbuf), condition,
+                         asio::bind_executor(*strand_, std::move(cb)));
+      else
+        asio::async_read(*socket_, std::move(dynbuf), condition,
+                         std::move(cb));
+    }
 
     /*
      * If lscontext_ was stopped before the above calls to async_read(), we
@@ -409,6 +990,255 @@ namespace lserver {
       close_once();
   }
 
+  template <class P>
+  template <class F>
+  inline void
+  Session<P>::post_completion(F&& handler)
+  {
+    if constexpr (!is_single_threaded_v<P>) {
+      ensure_strand();
+      if (strand_) LS_UNLIKELY {
+        asio::post(*strand_, track_op(std::forward<F>(handler)));
+        return;
+      }
+    }
+    asio::post(lscontext_->get_io_context(),
+               track_op(std::forward<F>(handler)));
+  }
+
+  template <class P>
+  template <class F>
+  inline auto
+  Session<P>::track_op(F&& handler)
+  {
+    pending_ops_.fetch_add(1);
+    return [this, handler = std::forward<F>(handler)](auto&&... args) mutable {
+      if (!closing_.load()) LS_LIKELY
+        handler(std::forward<decltype(args)>(args)...);
+      complete_op();
+    };
+  }
+
+  template <class P>
+  inline void
+  Session<P>::complete_op()
+  {
+    if (pending_ops_.fetch_sub(1) == 1 && closing_.load()) LS_UNLIKELY
+      close_once_flag_.run_once(std::bind(&Session<P>::finalize, this));
+  }
+
+  template <class P>
+  inline bool
+  Session<P>::try_receive_now(std::size_t max_transfer_sz)
+  {
+    /*
+     * Grow the buffer the same way asio::async_read does for a dynamic
+     * buffer.
+     */
+    auto size = ubuf_.size();
+    auto n = std::min(std::max<std::size_t>(512, ubuf_.capacity() - size),
+                      std::min<std::size_t>(65536, max_transfer_sz - size));
+
+    if (speculative_left_ == 0 || n == 0) LS_LIKELY {
+      speculative_left_ = options_.speculative_io_budget_;
+      return false;
+    }
+    ubuf_.resize(size + n);
+
+    asio::error_code ec;
+    auto bytes_transferred =
+        socket_->read_some(asio::buffer(std::data(ubuf_) + size, n), ec);
+    ubuf_.resize(size + bytes_transferred);
+
+    if (ec == asio::error::would_block || ec == asio::error::try_again) {
+      speculative_left_ = options_.speculative_io_budget_;
+      return false;
+    }
+
+    --speculative_left_;
+    post_completion([this, error = std::error_code{ec}, bytes_transferred]() {
+      receive_event_cb(error, bytes_transferred);
+    });
+    return true;
+  }
+
+  template <class P>
+  template <class F>
+  inline void
+  Session<P>::async_wait(stream_protocol::socket::wait_type type, F&& handler)
+  {
+    if constexpr (!is_single_threaded_v<P>) {
+      ensure_strand();
+      if (strand_) LS_UNLIKELY {
+        socket_->async_wait(
+            type,
+            asio::bind_executor(*strand_, track_op(std::forward<F>(handler))));
+        return;
+      }
+    }
+    socket_->async_wait(type, track_op(std::forward<F>(handler)));
+  }
+
+  template <class P>
+  inline void
+  Session<P>::tls_handshake()
+  {
+    auto status = tls_.handshake();
+    switch (status) {
+    case TlsStream::kDone:
+      receive();
+      return;
+    case TlsStream::kWantRead:
+    case TlsStream::kWantWrite:
+      async_wait(status == TlsStream::kWantRead
+                     ? stream_protocol::socket::wait_read
+                     : stream_protocol::socket::wait_write,
+                 [this](std::error_code error) {
+                   if (error) LS_UNLIKELY
+                     async_close(error);
+                   else
+                     tls_handshake();
+                 });
+      break;
+    case TlsStream::kClosed:
+      async_close(std::error_code{});
+      return;
+    case TlsStream::kFailed:
+      async_close(std::make_error_code(std::errc::protocol_error));
+      return;
+    }
+
+    if (lscontext_->stopped()) LS_UNLIKELY
+      close_once();
+  }
+
+  template <class P>
+  inline void
+  Session<P>::tls_receive(std::size_t max_transfer_sz)
+  {
+    /*
+     * The buffer grows like in try_receive_now(). A record is decrypted
+     * straight into it.
+     */
+    auto size = ubuf_.size();
+    auto n = std::min(std::max<std::size_t>(512, ubuf_.capacity() - size),
+                      std::min<std::size_t>(65536, max_transfer_sz - size));
+    ubuf_.resize(size + n);
+
+    std::size_t bytes_transferred = 0;
+    auto status = n == 0 ? TlsStream::kFailed
+                         : tls_.read(std::data(ubuf_) + size, n,
+                                     bytes_transferred);
+    ubuf_.resize(size + bytes_transferred);
+
+    std::error_code error;
+    switch (status) {
+    case TlsStream::kDone:
+      break;
+    case TlsStream::kWantRead:
+    case TlsStream::kWantWrite:
+      async_wait(status == TlsStream::kWantRead
+                     ? stream_protocol::socket::wait_read
+                     : stream_protocol::socket::wait_write,
+                 [this, max_transfer_sz](std::error_code ec) {
+                   if (ec) LS_UNLIKELY
+                     receive_event_cb(ec, 0);
+                   else
+                     tls_receive(max_transfer_sz);
+                 });
+      if (lscontext_->stopped()) LS_UNLIKELY
+        close_once();
+      return;
+    case TlsStream::kClosed:
+      error = asio::error_code{asio::error::eof};
+      break;
+    case TlsStream::kFailed:
+      error = std::make_error_code(std::errc::protocol_error);
+      break;
+    }
+
+    post_completion([this, error, bytes_transferred]() {
+      receive_event_cb(error, bytes_transferred);
+    });
+  }
+
+  template <class P>
+  inline void
+  Session<P>::tls_send(std::size_t offset)
+  {
+    auto cnt = gather(offset);
+    auto status = TlsStream::kDone;
+    std::size_t written = 0;
+
+    auto write = [&](uint8_t const* data, std::size_t size) {
+      while (size > 0 && status == TlsStream::kDone) {
+        std::size_t n = 0;
+        status = tls_.write(data, size, n);
+        if (status == TlsStream::kDone) LS_LIKELY {
+          data += n;
+          size -= n;
+          written += n;
+        }
+      }
+    };
+
+    /*
+     * Small buffers are coalesced, so that e.g. a response header and its
+     * body leave in one record and one write(2), rather than one each.
+     */
+    tls_coalesce_.clear();
+    for (std::size_t i = 0; i < cnt && status == TlsStream::kDone; ++i) {
+      auto data = static_cast<uint8_t const*>(gather_[i].data());
+      auto size = gather_[i].size();
+
+      if (!tls_coalesce_.empty() &&
+          tls_coalesce_.size() + size > kTlsMaxRecordSize) {
+        write(tls_coalesce_.data(), tls_coalesce_.size());
+        tls_coalesce_.clear();
+      }
+      if (size >= kTlsMaxRecordSize)
+        write(data, size);
+      else
+        tls_coalesce_.insert(tls_coalesce_.end(), data, data + size);
+    }
+    if (!tls_coalesce_.empty())
+      write(tls_coalesce_.data(), tls_coalesce_.size());
+
+    std::error_code error;
+    switch (status) {
+    case TlsStream::kDone:
+      break;
+    case TlsStream::kWantRead:
+    case TlsStream::kWantWrite:
+      /*
+       * What was written completes now, and the rest is retried from the
+       * new front of the queue, with the same bytes.
+       */
+      if (written > 0)
+        break;
+      async_wait(status == TlsStream::kWantRead
+                     ? stream_protocol::socket::wait_read
+                     : stream_protocol::socket::wait_write,
+                 [this, offset](std::error_code ec) {
+                   if (ec) LS_UNLIKELY
+                     send_event_cb(ec, offset, 0);
+                   else
+                     tls_send(offset);
+                 });
+      return;
+    case TlsStream::kClosed:
+      error = std::make_error_code(std::errc::broken_pipe);
+      break;
+    case TlsStream::kFailed:
+      error = std::make_error_code(std::errc::protocol_error);
+      break;
+    }
+
+    post_completion([this, error, offset, written]() {
+      send_event_cb(error, offset, written);
+    });
+  }
+
   template <class P>
   inline P*
   Session<P>::get_protocol()
@@ -429,6 +1259,32 @@ namespace lserver {
 
     bytes_received_ += bytes_transferred;
 
+    /*
+     * A transaction that outgrows the receive buffer doubles it, and a
+     * request of known length gets room for the rest of it at once.
+     */
+    if (options_.socket_buffer_max_) LS_UNLIKELY {
+      auto wanted = bytes_received_ > rcvbuf_ ? 2 * rcvbuf_ : rcvbuf_;
+      if (expected_data_chunck_sz_set_ &&
+          expected_data_chunck_sz_ > bytes_received_)
+        wanted =
+            std::max(wanted, expected_data_chunck_sz_ - bytes_received_);
+      if (wanted > rcvbuf_)
+        size_buffer(SO_RCVBUF, rcvbuf_, wanted);
+    }
+
+    if (options_.socket_options_.tcp_quickack) LS_UNLIKELY
+      set_socket_option(socket_->native_handle(), IPPROTO_TCP, TCP_QUICKACK,
+                        1, "TCP_QUICKACK");
+
+    /*
+     * The new bytes are appended to the end of ubuf_
+     */
+    if (capture_stream_id_) LS_UNLIKELY
+      capture_->write(capture_stream_id_,
+                      std::data(ubuf_) + std::size(ubuf_) - bytes_transferred,
+                      bytes_transferred);
+
     /*
      * Notify the CRTP derived protocol of new data and decide what
      * to do next (continue or close), based on the return value.
@@ -449,24 +1305,80 @@ namespace lserver {
 #endif
   }
 
+  template <class P>
+  inline std::size_t
+  Session<P>::gather(std::size_t skip)
+  {
+    std::size_t cnt = 0;
+
+    outgoing_queue_.for_each([&](DynQue::QueueBuffer* qb) {
+      if (skip >= qb->size()) {
+        skip -= qb->size();
+        return true;
+      }
+      gather_[cnt++] = asio::buffer(qb->data() + skip, qb->size() - skip);
+      skip = 0;
+      return cnt < kMaxGatherBuffers;
+    });
+
+    return cnt;
+  }
+
   template <class P>
   inline void
-  Session<P>::async_send()
+  Session<P>::async_send(std::size_t offset)
   {
-    auto qb = outgoing_queue_.front();
-    if (strand_) LS_UNLIKELY {
-      asio::async_write(
-          *socket_, asio::buffer(qb->data(), qb->size()),
-          strand_->wrap(std::bind(&Session::send_event_cb, this, _1, _2)));
-    } else {
-      asio::async_write(*socket_, asio::buffer(qb->data(), qb->size()),
-                        std::bind(&Session::send_event_cb, this, _1, _2));
+    if (tls_.user_space_send()) LS_UNLIKELY {
+      tls_send(offset);
+      return;
+    }
+
+    auto cnt = gather(offset);
+    /*
+     * Bytes already written by a speculative write
+     */
+    std::size_t written = 0;
+
+    if (speculative_left_ > 0) LS_UNLIKELY {
+      asio::error_code ec;
+      auto buffers = std::span{gather_.data(), cnt};
+      written = socket_->write_some(buffers, ec);
+
+      if (ec != asio::error::would_block && ec != asio::error::try_again) {
+        --speculative_left_;
+        if (ec || written == asio::buffer_size(buffers)) {
+          post_completion(
+              [this, error = std::error_code{ec}, offset, written]() {
+                send_event_cb(error, offset, written);
+              });
+          return;
+        }
+        cnt = gather(offset + written);
+      }
     }
+    speculative_left_ = options_.speculative_io_budget_;
+
+    auto buffers = std::span<asio::const_buffer const>{gather_.data(), cnt};
+    auto cb = track_op([this, offset, written](std::error_code error,
+                                               std::size_t bytes_transferred) {
+      send_event_cb(error, offset, written + bytes_transferred);
+    });
+
+    if constexpr (!is_single_threaded_v<P>) {
+      ensure_strand();
+      if (strand_) LS_UNLIKELY {
+        asio::async_write(*socket_, buffers,
+                          asio::bind_executor(*strand_, std::move(cb)));
+        return;
+      }
+    }
+
+    asio::async_write(*socket_, buffers, std::move(cb));
   }
 
   template <class P>
   inline void
-  Session<P>::send_event_cb(std::error_code error,
+  Session<P>::send_event_cb(std::error_code error, std::size_t offset,
                             std::size_t bytes_transferred)
   {
     bytes_sent_ += bytes_transferred;
@@ -476,20 +1388,60 @@ namespace lserver {
 
     if (error) LS_UNLIKELY {
       outgoing_queue_.clear();
+      if (outgoing_bytes_) LS_UNLIKELY
+        send_accounted(outgoing_bytes_);
       report_error(error);
       async_close(error);
       return;
     }
 
-    outgoing_queue_.pop();
+    /*
+     * Pop the buffers that are sent completely. 'done' ends up as the
+     * offset of the next write in the new front buffer.
+     */
+    bool accounted = options_.send_high_watermark_ || options_.max_send_bytes_;
+    bool relieved = false;
+    auto done = offset + bytes_transferred;
+    while (!outgoing_queue_.empty()) {
+      auto size = outgoing_queue_.front()->size();
+      if (done < size)
+        break;
+      done -= size;
+      if (accounted) LS_UNLIKELY
+        relieved |= send_accounted(size);
+      outgoing_queue_.pop();
+    }
+
+    if (options_.socket_buffer_max_ && bytes_sent_ > sndbuf_) LS_UNLIKELY
+      size_buffer(SO_SNDBUF, sndbuf_, 2 * sndbuf_);
+
     if (!outgoing_queue_.empty())  LS_LIKELY{
-      async_send();
+      async_send(done);
     } else {
       /*
        * Notify the CRTP derived protocol.
        */
       switch (get_protocol()->on_sent()) {
       case kContinue:
+        /*
+         * The session waits for the next request, which may never come.
+         */
+        if (options_.socket_buffer_max_) LS_UNLIKELY {
+          size_buffer(SO_RCVBUF, rcvbuf_, 0);
+          size_buffer(SO_SNDBUF, sndbuf_, 0);
+        }
+        /*
+         * A session that moves is served on the target LSContext right
+         * away, so this handler must not touch it after that.
+         */
+        if (corked_ && outgoing_queue_.empty()) LS_UNLIKELY
+          cork(false);
+        if (relieved) LS_UNLIKELY {
+          relieved = false;
+          notify_relieved();
+        }
+        if (try_migrate()) LS_UNLIKELY
+          return;
         async_receive();
         break;
       case kClose:
@@ -501,14 +1453,35 @@ namespace lserver {
         __builtin_unreachable();
         break;
       }
+      /*
+       * The response is complete, let its last partial segment go.
+       */
+      if (corked_ && outgoing_queue_.empty()) LS_UNLIKELY
+        cork(false);
       /*
        * If we have pending shutdown request(s), we queue another async close
        */
       if (prepare_for_shutdown_.load()) LS_UNLIKELY {
         prepare_for_shutdown_.store(false);
         async_close(std::error_code{});
+        return;
       }
     }
+
+    /*
+     * This is done last, so that a send() from the protocol does not race
+     * with the async_send() above.
+     */
+    if (relieved) LS_UNLIKELY
+      notify_relieved();
+  }
+
+  template <class P>
+  inline void
+  Session<P>::notify_relieved()
+  {
+    if constexpr (requires(P& p) { p.on_backpressure_relieved(); })
+      get_protocol()->on_backpressure_relieved();
   }
 
   template <class P>
@@ -525,7 +1498,19 @@ namespace lserver {
       return;
     }
 
-    close_once_flag_.run_once(std::bind(&Session<P>::finalize, this));
+    if (closing_.exchange(true))
+      return;
+
+    /*
+     * The aborted operations complete without calling their handlers, and
+     * the last of them finalizes the session. The handlers of a stopped
+     * io_context never run, so it is finalized right away.
+     */
+    asio::error_code ec;
+    if (socket_) LS_LIKELY
+      socket_->cancel(ec);
+    if (pending_ops_.load() == 0 || lscontext_->stopped()) LS_UNLIKELY
+      close_once_flag_.run_once(std::bind(&Session<P>::finalize, this));
   }
 
   template <class P>
@@ -535,11 +1520,11 @@ namespace lserver {
     if (error) LS_UNLIKELY 
       report_error(error);
 
-    if (strand_) LS_UNLIKELY
-      asio::post(*strand_, std::bind(&Session::close_once, this));
+    if (!is_single_threaded_v<P> && strand_) LS_UNLIKELY
+      asio::post(*strand_, track_op(std::bind(&Session::close_once, this)));
     else
       asio::post(lscontext_->get_io_context(),
-                 std::bind(&Session::close_once, this));
+                 track_op(std::bind(&Session::close_once, this)));
 
     /*
      * If lscontext_ was stopped before the above calls to async_close(), we
@@ -555,7 +1540,10 @@ namespace lserver {
   inline void
   Session<P>::report_error(std::error_code& error)
   {
-    if (error.value() == 2)
+    /*
+     * End of stream, and operations cancelled by the session itself
+     */
+    if (error.value() == 2 || error == asio::error::operation_aborted)
       return;
 
     get_protocol()->on_error(error);
@@ -567,8 +1555,16 @@ namespace lserver {
   {
     try {
       /*
-       * Let the destructor of asio::tcp::socket take care of shutting
-       * down and closing the socket.
+       * The socket must not be shut down by a drain once it is closed,
+       * since its descriptor may be reused.
+       */
+      if (socket_) LS_LIKELY
+        lscontext_->untrack_socket(socket_->native_handle());
+      if (tls_.active()) LS_UNLIKELY
+        tls_.shutdown();
+      /*
+       * Let the destructor of the socket take care of shutting down and
+       * closing it.
        */
       socket_ = std::nullopt;
     } catch (std::system_error&) {
@@ -577,12 +1573,25 @@ namespace lserver {
 
     get_protocol()->on_closed();
 
+    /*
+     * Give the bytes that were never sent back to the server.
+     */
+    if (outgoing_bytes_) LS_UNLIKELY
+      send_accounted(outgoing_bytes_);
+    backpressured_ = false;
+
+    if (capture_stream_id_) LS_UNLIKELY
+      capture_->close_stream(capture_stream_id_);
+    capture_stream_id_ = 0;
+
     /*
      * Return strand_ to strand pool of lscontext_
      */
-    if (strand_) LS_UNLIKELY
-      lscontext_->put_strand(strand_);
-    strand_ = nullptr;
+    if constexpr (!is_single_threaded_v<P>) {
+      if (strand_) LS_UNLIKELY
+        lscontext_->put_strand(strand_);
+      strand_ = nullptr;
+    }
 
     /*
      * If we have an LSContext, we are responsible for deref()ing it.
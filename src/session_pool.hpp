@@ -114,6 +114,12 @@ namespace lserver {
       session_stats_.stats_bytes_received_delta_.fetch_add(
           bytes_received_delta);
       session_stats_.stats_bytes_sent_delta_.fetch_add(bytes_sent_delta);
+
+      session_stats_.stats_transactions_cnt_total_.fetch_add(
+          transaction_cnt_delta);
+      session_stats_.stats_bytes_received_total_.fetch_add(
+          bytes_received_delta);
+      session_stats_.stats_bytes_sent_total_.fetch_add(bytes_sent_delta);
     }
 
     return std::tie(Base::get_stats(), session_stats_);
@@ -35,6 +35,7 @@
 #include <asio.hpp>
 
 #include "common.hpp"
+#include "thread_setup.hpp"
 
 namespace lserver {
 
@@ -71,6 +72,7 @@ namespace lserver {
   inline void
   SignalManager::run()
   {
+    set_thread_name("lssignal");
     signals_.async_wait(std::bind(&SignalManager::handler, this, _1, _2));
     ioc_.run();
   }
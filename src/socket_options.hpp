@@ -0,0 +1,205 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2021, Amin Saba
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+#include <asio.hpp>
+
+#include "common.hpp"
+
+namespace lserver {
+
+  /*
+   * Options of the sockets of a server. A zero value leaves the kernel
+   * default in place.
+   */
+  struct SocketOptions {
+    bool tcp_nodelay = false;
+    /*
+     * Cork the socket while a response is being sent, so that its header
+     * and body leave in full segments.
+     */
+    bool tcp_cork = false;
+    /*
+     * Ack right away rather than delaying the acks. The kernel clears it
+     * by itself, so it is set again after each read.
+     */
+    bool tcp_quickack = false;
+    int rcvbuf = 0;
+    int sndbuf = 0;
+    int notsent_lowat = 0;
+    /*
+     * Options of the listening socket
+     */
+    int defer_accept_s = 0;
+    int fastopen_qlen = 0;
+  };
+
+  /*
+   * The socket type of the stream listeners and their sessions. It is
+   * either a TCP or a Unix domain socket, chosen by the listen address.
+   */
+  using stream_protocol = asio::generic::stream_protocol;
+
+  /*
+   * Listen and connect addresses of the form "unix:PATH" name a Unix
+   * domain stream socket rather than an IP address.
+   */
+  inline constexpr std::string_view kUnixAddressPrefix = "unix:";
+
+  inline bool
+  is_unix_address(std::string_view address)
+  {
+    return address.starts_with(kUnixAddressPrefix);
+  }
+
+  inline std::string
+  unix_address_path(std::string_view address)
+  {
+    return std::string{address.substr(kUnixAddressPrefix.size())};
+  }
+
+  /*
+   * Returns the endpoint of 'address', which is "unix:PATH" or an IP
+   * address, in which case 'port' is its port.
+   */
+  inline stream_protocol::endpoint
+  make_stream_endpoint(std::string_view address, uint16_t port)
+  {
+    if (is_unix_address(address))
+      return asio::local::stream_protocol::endpoint{
+          unix_address_path(address)};
+    return asio::ip::tcp::endpoint{asio::ip::make_address(address), port};
+  }
+
+  /*
+   * Removes the socket file at 'path' if no server accepts on it anymore,
+   * e.g. after a crash, so that it can be bound again. A live socket is
+   * left in place, and the bind fails as for a TCP port in use.
+   */
+  inline void
+  remove_stale_unix_socket(std::string const& path)
+  {
+    struct stat st;
+    if (::stat(path.c_str(), &st) != 0 || !S_ISSOCK(st.st_mode))
+      return;
+
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+      return;
+    if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 &&
+        errno == ECONNREFUSED)
+      ::unlink(path.c_str());
+    ::close(fd);
+  }
+
+  /*
+   * Returns the options that apply to Unix domain sockets, i.e. without
+   * the TCP ones.
+   */
+  inline SocketOptions
+  local_socket_options(SocketOptions options)
+  {
+    options.tcp_nodelay = false;
+    options.tcp_cork = false;
+    options.tcp_quickack = false;
+    options.notsent_lowat = 0;
+    options.defer_accept_s = 0;
+    options.fastopen_qlen = 0;
+    return options;
+  }
+
+  inline void
+  set_socket_option(int fd, int level, int name, int value, char const* what)
+  {
+    if (setsockopt(fd, level, name, &value, sizeof(value)) != 0) LS_UNLIKELY
+      lslog(3, "Cannot set socket option ", what, ": ", std::strerror(errno));
+  }
+
+  /*
+   * Applies the options of an accepted socket.
+   */
+  inline void
+  apply_socket_options(int fd, SocketOptions const& options)
+  {
+    if (options.tcp_nodelay)
+      set_socket_option(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+    if (options.tcp_quickack)
+      set_socket_option(fd, IPPROTO_TCP, TCP_QUICKACK, 1, "TCP_QUICKACK");
+    if (options.rcvbuf)
+      set_socket_option(fd, SOL_SOCKET, SO_RCVBUF, options.rcvbuf,
+                        "SO_RCVBUF");
+    if (options.sndbuf)
+      set_socket_option(fd, SOL_SOCKET, SO_SNDBUF, options.sndbuf,
+                        "SO_SNDBUF");
+    if (options.notsent_lowat)
+      set_socket_option(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+                        options.notsent_lowat, "TCP_NOTSENT_LOWAT");
+  }
+
+  /*
+   * Applies the options of a listening socket. This must be called
+   * before listen().
+   */
+  inline void
+  apply_listener_options(int fd, SocketOptions const& options)
+  {
+    if (options.defer_accept_s)
+      set_socket_option(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                        options.defer_accept_s, "TCP_DEFER_ACCEPT");
+    if (options.fastopen_qlen)
+      set_socket_option(fd, IPPROTO_TCP, TCP_FASTOPEN, options.fastopen_qlen,
+                        "TCP_FASTOPEN");
+    /*
+     * Buffer sizes set on the listener are inherited by the accepted
+     * sockets, and are needed before the handshake for a larger window
+     * scale.
+     */
+    if (options.rcvbuf)
+      set_socket_option(fd, SOL_SOCKET, SO_RCVBUF, options.rcvbuf,
+                        "SO_RCVBUF");
+  }
+
+} // namespace lserver
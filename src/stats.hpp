@@ -40,13 +40,55 @@
 
 namespace lserver {
 
+  /*
+   * A few percentiles of a LatencyHistogram, for reporting
+   */
+  struct HistogramSummary {
+    uint64_t p50_ = 0;
+    uint64_t p99_ = 0;
+    uint64_t max_ = 0;
+  };
+
   struct ContextInfo {
     std::size_t context_index_;
     std::size_t threads_cnt_;
     std::size_t active_sessions_cnt_;
     std::size_t strand_pool_size_;
     std::size_t strand_pool_flight_;
+    /*
+     * Total CPU time consumed by the threads of the context
+     */
+    uint64_t cpu_time_us_;
+    /*
+     * Time the last lag probe waited in the event loop of the context
+     */
+    uint64_t loop_lag_us_;
+    /*
+     * Time left before the remaining sessions of a draining context are
+     * closed by force, and the number of sessions closed that way.
+     */
+    uint64_t drain_remaining_ms_;
+    std::size_t drain_forced_cnt_;
+    /*
+     * Run mode of the context, the number of times its threads stopped
+     * spinning and blocked, and the time they spun without finding work.
+     */
+    uint64_t spin_budget_us_;
+    int busy_poll_us_;
+    uint64_t spin_sleeps_cnt_;
+    uint64_t spin_idle_us_;
+    /*
+     * Kernel TCP_INFO of the sessions sampled by the last sampling round:
+     * smoothed RTT, total retransmitted segments, congestion window in
+     * segments, and bytes sent but not acked yet.
+     */
+    std::size_t tcp_info_samples_cnt_;
+    HistogramSummary tcp_rtt_us_;
+    HistogramSummary tcp_total_retrans_;
+    HistogramSummary tcp_snd_cwnd_;
+    HistogramSummary tcp_unacked_bytes_;
     bool active_;
+    bool draining_;
   };
 
   struct ServerInfo {
@@ -122,7 +164,19 @@ namespace lserver {
     std::atomic<std::size_t> stats_transactions_cnt_delta_ = 0;
     std::atomic<std::size_t> stats_bytes_received_delta_ = 0;
     std::atomic<std::size_t> stats_bytes_sent_delta_ = 0;
+    /*
+     * Running totals of the above deltas since server startup. These are
+     * not affected by clear(), so that multiple consumers of statistics
+     * (e.g. the Portal and control server clients) can compute their own
+     * rates from them.
+     */
+    std::atomic<std::size_t> stats_transactions_cnt_total_ = 0;
+    std::atomic<std::size_t> stats_bytes_received_total_ = 0;
+    std::atomic<std::size_t> stats_bytes_sent_total_ = 0;
 
+    /*
+     * Clears the delta fields only.
+     */
     void
     clear()
     {
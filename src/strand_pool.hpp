@@ -29,43 +29,75 @@
 
 #pragma once
 
+#include <atomic>
+#include <vector>
+
 #include <asio.hpp>
 
-#include "pool.hpp"
 #include "strand_proxy.hpp"
 
 namespace lserver {
 
-  class StrandPool : public Pool<Strand, StrandPool> {
-    using Base = Pool<Strand, StrandPool>;
-
+  /*
+   * A fixed ring of strands, handed out round robin. A strand only
+   * serializes the handlers bound to it, so sessions can share one.
+   * asio already maps io_context::strand objects onto a fixed set of
+   * implementations, so sharing costs no parallelism in practice, while
+   * borrowing and returning a strand become single atomic operations.
+   */
+  class StrandPool {
   public:
-    StrandPool(std::size_t max_size, bool eager, asio::io_context& io_context);
+    static constexpr std::size_t kDefaultSize = 64;
+
+    StrandPool(std::size_t size, asio::io_context& io_context);
+    StrandPool(StrandPool const&) = delete;
+    StrandPool& operator=(StrandPool const&) = delete;
+
+    Strand* borrow() noexcept;
+    void put_back(Strand* p) noexcept;
+    std::size_t get_size() const noexcept;
     /*
-     * create/destroy functions to be used by the CRTP base
+     * Number of strands currently borrowed. Shared strands are counted
+     * once per borrower.
      */
-    Strand* create();
-    void destroy(Strand* p);
+    std::size_t get_in_flight_cnt() const noexcept;
 
   private:
-    asio::io_context& io_context_;
+    std::vector<Strand> strands_;
+    std::atomic<std::size_t> next_ = 0;
+    std::atomic<std::size_t> in_flight_cnt_ = 0;
   };
 
-  inline StrandPool::StrandPool(std::size_t max_size, bool eager,
-                                asio::io_context& io_context)
-      : Base(max_size, eager)
-      , io_context_{io_context}
-  { }
+  inline StrandPool::StrandPool(std::size_t size, asio::io_context& io_context)
+  {
+    strands_.reserve(size);
+    for (std::size_t i = 0; i < size; ++i)
+      strands_.emplace_back(io_context);
+  }
 
   inline Strand*
-  StrandPool::create()
+  StrandPool::borrow() noexcept
   {
-    return new Strand{io_context_};
+    in_flight_cnt_.fetch_add(1, std::memory_order_relaxed);
+    auto index = next_.fetch_add(1, std::memory_order_relaxed);
+    return &strands_[index % strands_.size()];
   }
 
   inline void
-  StrandPool::destroy(Strand* p)
+  StrandPool::put_back(Strand*) noexcept
+  {
+    in_flight_cnt_.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  inline std::size_t
+  StrandPool::get_size() const noexcept
+  {
+    return strands_.size();
+  }
+
+  inline std::size_t
+  StrandPool::get_in_flight_cnt() const noexcept
   {
-    delete p;
+    return in_flight_cnt_.load(std::memory_order_relaxed);
   }
-} // namespace lserver
\ No newline at end of file
+} // namespace lserver
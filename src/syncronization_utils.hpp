@@ -30,12 +30,27 @@
 #pragma once
 
 #include <atomic>
-#include <condition_variable>
 #include <list>
 #include <mutex>
 
+#include "common.hpp"
+
 
 namespace lserver {
+  /*
+   * Hints the CPU that the calling thread is spinning, which saves power
+   * and frees resources for the sibling hardware thread.
+   */
+  inline void
+  cpu_relax() noexcept
+  {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    asm volatile("yield" ::: "memory");
+#endif
+  }
+
 /*
  * Define and hold a scoped_guard from the TriggerGuard 'gv' in the current
  * scope. Return immediately if shutdown_guard is already triggered.
@@ -53,7 +68,10 @@ namespace lserver {
    * certain operation is in progress.
    * Each invocation of 'acquire_scoped_guard()' creates a scoped guard that
    * blocks all trigger attempts during its lifetime. Trigger request will
-   * unblock and continue when there are no scoped guards in scope.
+   * unblock and continue when there are no scoped guards in scope. Once a
+   * trigger is requested, no new scoped guard is granted.
+   * Acquiring and releasing a guard is a single atomic operation, so the
+   * guards do not contend on a lock.
    */
   class TriggerGuard {
     class ScopedGuard;
@@ -67,10 +85,13 @@ namespace lserver {
 
   private:
     void release_scoped_guard();
-    std::atomic<bool> triggered_ = false;
-    std::atomic<std::size_t> ref_cnt_ = 0;
-    mutable std::mutex mtx_;
-    mutable std::condition_variable cv_;
+    /*
+     * The lowest bit of state_ is set once a trigger is requested, and
+     * the rest counts the scoped guards in scope.
+     */
+    static constexpr std::size_t kTriggered = 1;
+    static constexpr std::size_t kGuard = 2;
+    std::atomic<std::size_t> state_ = 0;
   };
 
   /*
@@ -79,9 +100,9 @@ namespace lserver {
    */
   class TriggerGuard::ScopedGuard {
   public:
-    ScopedGuard(TriggerGuard& trigger_guard, bool triggered)
+    ScopedGuard(TriggerGuard& trigger_guard, bool acquired)
         : trigger_guard_{trigger_guard}
-        , triggered_{triggered}
+        , acquired_{acquired}
     { }
 
     ~ScopedGuard() noexcept
@@ -91,70 +112,75 @@ namespace lserver {
        * this guard instance, then it has bestowed upon us a lock, we should
        * now release.
        */
-      if (!triggered_)
+      if (acquired_)
         trigger_guard_.release_scoped_guard();
     }
 
-    operator bool() { return !trigger_guard_.triggered_.load(); }
+    operator bool() const { return acquired_; }
 
   private:
     TriggerGuard& trigger_guard_;
-    bool triggered_;
+    bool acquired_;
   };
 
   /*
    * Similar functionality to std::once_flag/call_once, but is also reusable.
+   * Unlike std::call_once, a concurrent caller does not wait for the
+   * invocation to finish.
    */
   class ResetableOnceFlag {
   public:
     void
     reset()
     {
-      /*
-       * Mutex is just needed to enforce "synchronizes with" with
-       * calls to run_once().
-       */
-      std::scoped_lock _{mtx_};
-      invoked_ = false;
+      invoked_.store(false, std::memory_order_release);
     }
 
     void
     run_once(auto&& F)
     {
-      std::scoped_lock _{mtx_};
-      if (!invoked_)
+      if (!invoked_.exchange(true, std::memory_order_acq_rel))
         F();
-      invoked_ = true;
     }
 
   private:
-    std::mutex mtx_;
-    bool invoked_;
+    std::atomic<bool> invoked_ = false;
   };
 
   inline void
   TriggerGuard::trigger()
   {
-    std::unique_lock lk{mtx_};
-    if (triggered_)
+    auto state = state_.fetch_or(kTriggered);
+    if (state & kTriggered)
       throw InactiveTriggerGuardInvoked{};
-    cv_.wait(lk, [this] { return (ref_cnt_.load() == 0); });
-    triggered_.store(true);
+
+    while ((state = state_.load()) != kTriggered)
+      state_.wait(state);
+  }
+
+  inline bool
+  TriggerGuard::triggered()
+  {
+    return (state_.load() & kTriggered);
   }
 
   inline auto
   TriggerGuard::acquire_scoped_guard() -> ScopedGuard
   {
-    std::unique_lock _{mtx_};
-    if (!triggered_.load())
-      ref_cnt_.fetch_add(1);
-    return ScopedGuard{*this, triggered_.load()};
+    if (state_.fetch_add(kGuard) & kTriggered) LS_UNLIKELY {
+      release_scoped_guard();
+      return ScopedGuard{*this, false};
+    }
+    return ScopedGuard{*this, true};
   }
 
   inline void
   TriggerGuard::release_scoped_guard()
   {
-    ref_cnt_.fetch_sub(1);
-    cv_.notify_all();
+    /*
+     * Only a pending trigger waits for the guards to go.
+     */
+    if (state_.fetch_sub(kGuard) & kTriggered) LS_UNLIKELY
+      state_.notify_all();
   }
 } // namespace lserver
\ No newline at end of file
@@ -0,0 +1,183 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2021, Amin Saba
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <cstring>
+
+#include "common.hpp"
+#include "session.hpp"
+
+namespace lserver {
+
+  /*
+   * Minimal protocols over raw TCP. They do no parsing, so benchmarks
+   * against them measure the Session/LSContext/Pool stack alone, and the
+   * difference to Http is the cost of the HTTP layer.
+   *
+   * 'Threading' is the threading policy of the protocol, see
+   * MultiThreaded and SingleThreaded.
+   */
+
+  /*
+   * Reads and discards everything the client sends.
+   */
+  template <class Threading>
+  class BasicTcpSink final : public Session<BasicTcpSink<Threading>> {
+    using BaseSession = Session<BasicTcpSink<Threading>>;
+
+  public:
+    using threading_policy = Threading;
+
+    void start();
+    void on_error(std::error_code error);
+    void on_closed() { }
+    auto on_sent();
+    auto on_data();
+  };
+
+  /*
+   * Sends back everything the client sends. A read is echoed before the
+   * next one is started, so the session never has more than one read
+   * worth of data in flight.
+   */
+  template <class Threading>
+  class BasicTcpEcho final : public Session<BasicTcpEcho<Threading>> {
+    using BaseSession = Session<BasicTcpEcho<Threading>>;
+
+  public:
+    using threading_policy = Threading;
+
+    BasicTcpEcho();
+    void start();
+    void on_error(std::error_code error);
+    void on_closed() { }
+    auto on_sent();
+    auto on_data();
+
+  private:
+    /*
+     * The received bytes are copied once into this buffer, which is
+     * recycled by the outgoing queue after each send.
+     */
+    DynamicString* d_;
+  };
+
+  using TcpSink = BasicTcpSink<MultiThreaded>;
+  using TcpEcho = BasicTcpEcho<MultiThreaded>;
+
+  /*
+   * Size of the reads of the raw TCP protocols, which never know how much
+   * data to expect.
+   */
+  inline constexpr std::size_t kTcpBaselineReadSize = 64 * 1024;
+
+  template <class Threading>
+  inline void
+  BasicTcpSink<Threading>::start()
+  {
+    BaseSession::reserve_receive_buffer(kTcpBaselineReadSize);
+  }
+
+  template <class Threading>
+  inline void
+  BasicTcpSink<Threading>::on_error(std::error_code error)
+  {
+    lslog(
+        3, "TcpSink service: ",
+        std::error_condition{error.value(), std::system_category()}.message());
+  }
+
+  template <class Threading>
+  inline auto
+  BasicTcpSink<Threading>::on_sent()
+  {
+    return BaseSession::kContinue;
+  }
+
+  template <class Threading>
+  inline auto
+  BasicTcpSink<Threading>::on_data()
+  {
+    BaseSession::transaction_started();
+    BaseSession::consume();
+    return BaseSession::kContinue;
+  }
+
+  template <class Threading>
+  BasicTcpEcho<Threading>::BasicTcpEcho()
+      : d_{BaseSession::prepare_send_buffer(256 * 1024)}
+  { }
+
+  template <class Threading>
+  inline void
+  BasicTcpEcho<Threading>::start()
+  {
+    BaseSession::reserve_receive_buffer(kTcpBaselineReadSize);
+  }
+
+  template <class Threading>
+  inline void
+  BasicTcpEcho<Threading>::on_error(std::error_code error)
+  {
+    lslog(
+        3, "TcpEcho service: ",
+        std::error_condition{error.value(), std::system_category()}.message());
+  }
+
+  template <class Threading>
+  inline auto
+  BasicTcpEcho<Threading>::on_sent()
+  {
+    return BaseSession::kContinue;
+  }
+
+  template <class Threading>
+  inline auto
+  BasicTcpEcho<Threading>::on_data()
+  {
+    auto n = BaseSession::data_size();
+    if (n == 0) LS_UNLIKELY
+      return BaseSession::kContinue;
+
+    BaseSession::transaction_started();
+    d_->clear();
+    if (n > d_->capacity()) LS_UNLIKELY
+      d_->resize(n);
+    std::memcpy(d_->data(), BaseSession::data(), n);
+    d_->fill(n);
+    BaseSession::consume();
+
+    /*
+     * The next read is started by on_sent()
+     */
+    BaseSession::send(d_);
+    return BaseSession::kData;
+  }
+} // namespace lserver
@@ -0,0 +1,175 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2021, Amin Saba
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "common.hpp"
+
+namespace lserver {
+
+  /*
+   * Placement and scheduling of a thread. A thread applies its own
+   * ThreadSetup when it starts.
+   */
+  struct ThreadSetup {
+    /*
+     * Thread name, truncated to the 15 characters allowed by Linux. An
+     * empty name leaves the name of the thread unchanged.
+     */
+    std::string name;
+    /*
+     * CPUs the thread may run on. Empty means no pinning.
+     */
+    std::vector<int> cpus;
+    int policy = SCHED_OTHER;
+    int priority = 0;
+  };
+
+  /*
+   * Parses a CPU list in the format of cpuset(7), e.g. "0-3,8,10-11".
+   * Throws std::invalid_argument if the list is malformed.
+   */
+  inline std::vector<int>
+  parse_cpu_list(std::string const& list)
+  {
+    std::vector<int> cpus;
+    std::size_t pos = 0;
+
+    while (pos < list.size()) {
+      auto end = list.find(',', pos);
+      if (end == std::string::npos)
+        end = list.size();
+      auto item = list.substr(pos, end - pos);
+      pos = end + 1;
+
+      int first, last;
+      try {
+        std::size_t idx;
+        first = last = std::stoi(item, &idx);
+        if (idx < item.size()) {
+          if (item[idx] != '-')
+            throw std::invalid_argument{item};
+          std::size_t idx2;
+          last = std::stoi(item.substr(idx + 1), &idx2);
+          if (idx + 1 + idx2 != item.size())
+            throw std::invalid_argument{item};
+        }
+      } catch (std::logic_error&) {
+        throw std::invalid_argument{"Bad CPU list: " + list};
+      }
+      if (first < 0 || last < first || last >= CPU_SETSIZE)
+        throw std::invalid_argument{"Bad CPU range in: " + list};
+      for (int cpu = first; cpu <= last; ++cpu)
+        cpus.push_back(cpu);
+    }
+
+    return cpus;
+  }
+
+  /*
+   * Parses the name of a scheduler policy: other, batch, idle, fifo or rr.
+   * Throws std::invalid_argument for any other name.
+   */
+  inline int
+  parse_sched_policy(std::string const& name)
+  {
+    if (name == "other")
+      return SCHED_OTHER;
+    if (name == "batch")
+      return SCHED_BATCH;
+    if (name == "idle")
+      return SCHED_IDLE;
+    if (name == "fifo")
+      return SCHED_FIFO;
+    if (name == "rr")
+      return SCHED_RR;
+    throw std::invalid_argument{"Bad scheduler policy: " + name};
+  }
+
+  /*
+   * Returns the CPUs the calling thread may run on
+   */
+  inline std::vector<int>
+  current_thread_cpus()
+  {
+    std::vector<int> cpus;
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    if (pthread_getaffinity_np(pthread_self(), sizeof(set), &set) == 0)
+      for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+        if (CPU_ISSET(cpu, &set))
+          cpus.push_back(cpu);
+
+    return cpus;
+  }
+
+  inline void
+  set_thread_name(std::string const& name)
+  {
+    if (!name.empty())
+      pthread_setname_np(pthread_self(), name.substr(0, 15).c_str());
+  }
+
+  /*
+   * Applies 'setup' to the calling thread. Failures (e.g. lack of
+   * privilege for a real-time policy) are logged, and the thread keeps
+   * running with its current settings.
+   */
+  inline void
+  apply_thread_setup(ThreadSetup const& setup)
+  {
+    set_thread_name(setup.name);
+
+    if (!setup.cpus.empty()) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      for (auto cpu: setup.cpus)
+        CPU_SET(cpu, &set);
+      if (int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+        lslog_note(0, "Cannot set the CPU affinity of thread", setup.name,
+                   std::strerror(rc));
+    }
+
+    sched_param param{};
+    param.sched_priority = setup.priority;
+    if (int rc = pthread_setschedparam(pthread_self(), setup.policy, &param))
+      lslog_note(0, "Cannot set the scheduler policy of thread", setup.name,
+                 std::strerror(rc));
+  }
+
+} // namespace lserver
@@ -0,0 +1,349 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2021, Amin Saba
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <signal.h>
+
+#include <atomic>
+#include <cerrno>
+#include <memory>
+#include <string>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include "common.hpp"
+#include "config.hpp"
+
+namespace lserver {
+
+  /*
+   * The ALPN name of a listen protocol of the config, or an empty string
+   * if it has none. h2c over TLS is HTTP/2 proper.
+   */
+  inline std::string
+  alpn_protocol(std::string const& listen_protocol)
+  {
+    if (listen_protocol == "h2c")
+      return "h2";
+    if (listen_protocol == "http")
+      return "http/1.1";
+    return {};
+  }
+
+  /*
+   * Server side TLS settings, shared by all the sessions of a server.
+   */
+  class TlsContext {
+  public:
+    /*
+     * 'alpn' is the protocol selected if the client offers it, e.g. "h2".
+     * If it is empty, ALPN is not negotiated. Throws ConfigParseError if
+     * the certificate or the private key cannot be loaded.
+     */
+    TlsContext(std::string const& certificate_file,
+               std::string const& private_key_file, bool ktls,
+               std::string alpn = {});
+
+    SSL_CTX* get() const noexcept { return ctx_.get(); }
+    /*
+     * Called by each session after its handshake with the directions that
+     * the kernel took over. The first session that is left with a user
+     * space direction, while kTLS was asked for, is logged.
+     */
+    void note_offload(bool send, bool receive);
+
+  private:
+    static int select_alpn(SSL* ssl, unsigned char const** out,
+                           unsigned char* outlen, unsigned char const* in,
+                           unsigned int inlen, void* arg);
+
+    std::unique_ptr<SSL_CTX, decltype(&SSL_CTX_free)> ctx_{nullptr,
+                                                           SSL_CTX_free};
+    /*
+     * ALPN protocol in wire format: a length byte followed by the name
+     */
+    std::string alpn_;
+    bool ktls_;
+    std::atomic<bool> fallback_logged_ = false;
+  };
+
+  /*
+   * The TLS state of one connection. The records are read and written by
+   * OpenSSL on the socket descriptor itself, which must be non-blocking.
+   * Once the handshake is done, each direction that the kernel took over
+   * (kTLS) is plain socket I/O again, and only the other directions go
+   * through read() and write().
+   */
+  class TlsStream {
+  public:
+    enum Status { kDone, kWantRead, kWantWrite, kClosed, kFailed };
+
+    TlsStream() = default;
+    TlsStream(TlsStream const&) = delete;
+    TlsStream& operator=(TlsStream const&) = delete;
+    ~TlsStream() { reset(); }
+
+    bool open(TlsContext& context, int fd);
+    Status handshake();
+    /*
+     * Read or write up to 'n' bytes of application data. 'transferred' is
+     * set to the bytes done if kDone is returned. A write that returned
+     * kWantRead or kWantWrite must be retried with the same bytes.
+     */
+    Status read(void* data, std::size_t n, std::size_t& transferred);
+    Status write(void const* data, std::size_t n, std::size_t& transferred);
+    /*
+     * Sends close_notify if it can be sent without waiting, and frees the
+     * connection.
+     */
+    void shutdown();
+    void reset();
+
+    bool active() const noexcept { return ssl_ != nullptr; }
+    /*
+     * True if the records of that direction are handled in user space,
+     * i.e. the handshake is done and the kernel did not take it over.
+     */
+    bool user_space_receive() const noexcept { return user_receive_; }
+    bool user_space_send() const noexcept { return user_send_; }
+
+  private:
+    /*
+     * status() reads the error queue and errno of the last call, so they
+     * are cleared before each call.
+     */
+    static void clear_errors();
+    Status status(int rc);
+
+    SSL* ssl_ = nullptr;
+    TlsContext* context_ = nullptr;
+    bool user_receive_ = false;
+    bool user_send_ = false;
+  };
+
+  inline TlsContext::TlsContext(std::string const& certificate_file,
+                                std::string const& private_key_file,
+                                bool ktls, std::string alpn)
+      : ktls_{ktls}
+  {
+    /*
+     * OpenSSL writes with write(2), so a write to a connection reset by
+     * the peer would raise SIGPIPE. The sessions handle EPIPE themselves.
+     */
+    ::signal(SIGPIPE, SIG_IGN);
+
+    ctx_.reset(SSL_CTX_new(TLS_server_method()));
+    if (!ctx_) {
+      lslog(0, "Could not create the TLS context");
+      throw ConfigParseError{};
+    }
+
+    SSL_CTX_set_min_proto_version(ctx_.get(), TLS1_2_VERSION);
+    SSL_CTX_set_options(ctx_.get(), SSL_OP_NO_RENEGOTIATION);
+#ifdef SSL_OP_ENABLE_KTLS
+    if (ktls_)
+      SSL_CTX_set_options(ctx_.get(), SSL_OP_ENABLE_KTLS);
+#else
+    ktls_ = false;
+#endif
+    /*
+     * A write is retried from the session's queued buffer, which may have
+     * moved, and may complete partially like a socket write. Idle pooled
+     * sessions do not keep record buffers.
+     */
+    SSL_CTX_set_mode(ctx_.get(), SSL_MODE_ENABLE_PARTIAL_WRITE |
+                                     SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                                     SSL_MODE_RELEASE_BUFFERS);
+
+    if (SSL_CTX_use_certificate_chain_file(ctx_.get(),
+                                           certificate_file.c_str()) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx_.get(), private_key_file.c_str(),
+                                    SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx_.get()) != 1) {
+      char reason[256];
+      ERR_error_string_n(ERR_get_error(), reason, sizeof(reason));
+      lslog(0, "Could not load the TLS certificate ", certificate_file,
+            " or key ", private_key_file, ": ", reason);
+      throw ConfigParseError{};
+    }
+
+    if (!alpn.empty()) {
+      alpn_.push_back(static_cast<char>(alpn.size()));
+      alpn_ += alpn;
+      SSL_CTX_set_alpn_select_cb(ctx_.get(), &TlsContext::select_alpn, this);
+    }
+  }
+
+  inline int
+  TlsContext::select_alpn(SSL*, unsigned char const** out,
+                          unsigned char* outlen, unsigned char const* in,
+                          unsigned int inlen, void* arg)
+  {
+    auto self = static_cast<TlsContext*>(arg);
+    auto ours = reinterpret_cast<unsigned char const*>(self->alpn_.data());
+    unsigned char* selected = nullptr;
+
+    if (SSL_select_next_proto(&selected, outlen, ours, self->alpn_.size(), in,
+                              inlen) != OPENSSL_NPN_NEGOTIATED)
+      return SSL_TLSEXT_ERR_NOACK;
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+  }
+
+  inline void
+  TlsContext::note_offload(bool send, bool receive)
+  {
+    if (!ktls_ || (send && receive)) LS_LIKELY
+      return;
+
+    [[maybe_unused]] auto direction = send      ? "receiving"
+                                      : receive ? "sending"
+                                                : "sending and receiving";
+    if (!fallback_logged_.exchange(true))
+      lslog(1, "kTLS is not available, TLS records are handled in user "
+               "space for ",
+            direction);
+  }
+
+  inline bool
+  TlsStream::open(TlsContext& context, int fd)
+  {
+    reset();
+    ssl_ = SSL_new(context.get());
+    if (!ssl_) LS_UNLIKELY
+      return false;
+
+    if (SSL_set_fd(ssl_, fd) != 1) LS_UNLIKELY {
+      reset();
+      return false;
+    }
+    SSL_set_accept_state(ssl_);
+    context_ = &context;
+    return true;
+  }
+
+  inline auto
+  TlsStream::handshake() -> Status
+  {
+    clear_errors();
+    auto rc = SSL_do_handshake(ssl_);
+    if (rc != 1)
+      return status(rc);
+
+    bool kernel_send = false;
+    bool kernel_receive = false;
+#ifdef SSL_OP_ENABLE_KTLS
+    kernel_send = BIO_get_ktls_send(SSL_get_wbio(ssl_));
+    kernel_receive = BIO_get_ktls_recv(SSL_get_rbio(ssl_));
+#endif
+    user_send_ = !kernel_send;
+    user_receive_ = !kernel_receive;
+    context_->note_offload(kernel_send, kernel_receive);
+    return kDone;
+  }
+
+  inline auto
+  TlsStream::read(void* data, std::size_t n, std::size_t& transferred)
+      -> Status
+  {
+    clear_errors();
+    auto rc = SSL_read_ex(ssl_, data, n, &transferred);
+    return rc == 1 ? kDone : status(rc);
+  }
+
+  inline auto
+  TlsStream::write(void const* data, std::size_t n, std::size_t& transferred)
+      -> Status
+  {
+    clear_errors();
+    auto rc = SSL_write_ex(ssl_, data, n, &transferred);
+    return rc == 1 ? kDone : status(rc);
+  }
+
+  inline auto
+  TlsStream::status(int rc) -> Status
+  {
+    switch (SSL_get_error(ssl_, rc)) {
+    case SSL_ERROR_WANT_READ:
+      return kWantRead;
+    case SSL_ERROR_WANT_WRITE:
+      return kWantWrite;
+    case SSL_ERROR_ZERO_RETURN:
+      return kClosed;
+    case SSL_ERROR_SYSCALL:
+      /*
+       * A peer that closes without close_notify is treated like a plain
+       * TCP end of stream.
+       */
+      if (ERR_peek_error() == 0 && errno == 0)
+        return kClosed;
+      return kFailed;
+    default:
+#ifdef SSL_R_UNEXPECTED_EOF_WHILE_READING
+      /*
+       * OpenSSL 3 reports an end of stream without close_notify this way
+       */
+      if (ERR_GET_REASON(ERR_peek_error()) ==
+          SSL_R_UNEXPECTED_EOF_WHILE_READING)
+        return kClosed;
+#endif
+      return kFailed;
+    }
+  }
+
+  inline void
+  TlsStream::clear_errors()
+  {
+    ERR_clear_error();
+    errno = 0;
+  }
+
+  inline void
+  TlsStream::shutdown()
+  {
+    if (ssl_ && SSL_is_init_finished(ssl_) &&
+        !(SSL_get_shutdown(ssl_) & SSL_SENT_SHUTDOWN)) {
+      clear_errors();
+      SSL_shutdown(ssl_);
+    }
+    reset();
+  }
+
+  inline void
+  TlsStream::reset()
+  {
+    if (ssl_)
+      SSL_free(ssl_);
+    ssl_ = nullptr;
+    context_ = nullptr;
+    user_receive_ = user_send_ = false;
+  }
+} // namespace lserver
@@ -0,0 +1,132 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2021, Amin Saba
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <cstring>
+#include <span>
+
+#include "common.hpp"
+#include "datagram_server.hpp"
+#include "lsvm.hpp"
+#include "program.hpp"
+
+namespace lserver {
+
+  /*
+   * Protocols of a DatagramServer. Each datagram is a transaction of its
+   * own, and its reply, if any, goes back to the peer that sent it.
+   *
+   * 'Threading' is the threading policy of the protocol, see
+   * MultiThreaded and SingleThreaded. It only picks the kind of LSContext
+   * the endpoints run on, since an endpoint never runs two handlers at
+   * once.
+   */
+
+  /*
+   * Discards every datagram.
+   */
+  template <class Threading>
+  class BasicUdpSink {
+  public:
+    using threading_policy = Threading;
+
+    void
+    on_datagram(std::span<uint8_t>, DatagramReply&)
+    { }
+  };
+
+  /*
+   * Sends every datagram back to its peer.
+   */
+  template <class Threading>
+  class BasicUdpEcho {
+  public:
+    using threading_policy = Threading;
+
+    void
+    on_datagram(std::span<uint8_t> datagram, DatagramReply& reply)
+    {
+      if (!datagram.empty())
+        std::memcpy(reply.append(datagram.size()), datagram.data(),
+                    datagram.size());
+    }
+  };
+
+  /*
+   * Runs each datagram as a VScript, in the same format as the body of an
+   * HTTP /vscript/ request. The bytes of its DOWNLOAD come back as as many
+   * datagrams as they need. A datagram that is not a whole VScript gets
+   * no reply, like one lost on the way.
+   */
+  template <class Threading>
+  class BasicUdpVScript {
+  public:
+    using threading_policy = Threading;
+
+    /*
+     * Bound to what a peer may ask for with a single datagram
+     */
+    static constexpr std::size_t kMaxDownload = 1024 * 1024;
+
+    void on_datagram(std::span<uint8_t> datagram, DatagramReply& reply);
+
+  private:
+    static inline LSVirtualMachine vm_;
+  };
+
+  using UdpSink = BasicUdpSink<MultiThreaded>;
+  using UdpEcho = BasicUdpEcho<MultiThreaded>;
+  using UdpVScript = BasicUdpVScript<MultiThreaded>;
+
+  template <class Threading>
+  inline void
+  BasicUdpVScript<Threading>::on_datagram(std::span<uint8_t> datagram,
+                                          DatagramReply& reply)
+  {
+    Program program;
+    std::size_t consume_len;
+
+    auto status = Program::try_parse(program, consume_len, datagram.data(),
+                                     datagram.size());
+    if (status != SUCCESS) LS_UNLIKELY
+      return;
+
+    program.set_vm(&vm_);
+    program.feed(datagram.data() + consume_len, datagram.size() - consume_len,
+                 true);
+
+    /*
+     * Like Http, the downloaded bytes are whatever the buffer holds
+     */
+    auto download_size = program.get_response().download_size;
+    if (download_size > 0 && download_size <= kMaxDownload)
+      reply.append(download_size);
+  }
+} // namespace lserver
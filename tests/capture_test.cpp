@@ -0,0 +1,165 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2021, Amin Saba
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <gtest/gtest.h>
+
+#include <sys/stat.h>
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "capture.hpp"
+
+using namespace lserver;
+
+class CaptureFixture : public ::testing::Test {
+protected:
+  void
+  TearDown() override
+  {
+    std::remove(path_.c_str());
+  }
+
+  std::string path_ = "capture_test.capture";
+};
+
+TEST_F(CaptureFixture, round_trip)
+{
+  std::string a = "GET / HTTP/1.1\r\n";
+  std::string b = "\r\n";
+  std::string c = "POST /sinkhole/ HTTP/1.1\r\n\r\n";
+
+  {
+    CaptureWriter writer{path_, 1, 1 << 20};
+    auto s1 = writer.open_stream();
+    auto s2 = writer.open_stream();
+    ASSERT_NE(s1, 0);
+    ASSERT_NE(s2, 0);
+    ASSERT_NE(s1, s2);
+
+    writer.write(s1, reinterpret_cast<uint8_t const*>(a.data()), a.size());
+    writer.write(s2, reinterpret_cast<uint8_t const*>(c.data()), c.size());
+    writer.write(s1, reinterpret_cast<uint8_t const*>(b.data()), b.size());
+    writer.close_stream(s1);
+  }
+
+  CaptureReader reader{path_};
+  auto const& streams = reader.streams();
+  ASSERT_EQ(streams.size(), 2);
+
+  auto const& first = streams[0];
+  ASSERT_EQ(first.chunks.size(), 2);
+  EXPECT_EQ(std::string(reinterpret_cast<char const*>(first.chunks[0].data),
+                        first.chunks[0].length),
+            a);
+  EXPECT_EQ(std::string(reinterpret_cast<char const*>(first.chunks[1].data),
+                        first.chunks[1].length),
+            b);
+  EXPECT_LE(first.open_time, first.chunks[0].time);
+  EXPECT_LE(first.chunks[0].time, first.chunks[1].time);
+  EXPECT_LE(first.chunks[1].time, first.close_time);
+  EXPECT_TRUE(first.complete);
+
+  /*
+   * The close of the second stream was not captured
+   */
+  auto const& second = streams[1];
+  ASSERT_EQ(second.chunks.size(), 1);
+  EXPECT_EQ(second.chunks[0].length, c.size());
+  EXPECT_EQ(second.close_time, second.chunks[0].time);
+  EXPECT_FALSE(second.complete);
+}
+
+TEST_F(CaptureFixture, sampling_rate)
+{
+  CaptureWriter writer{path_, 0.25, 1 << 20};
+  int sampled = 0;
+  for (int i = 0; i < 100; ++i)
+    sampled += writer.open_stream() != 0;
+  EXPECT_EQ(sampled, 25);
+}
+
+TEST_F(CaptureFixture, max_size)
+{
+  std::string data(1000, 'A');
+  {
+    CaptureWriter writer{path_, 1, 4096};
+    auto s = writer.open_stream();
+    for (int i = 0; i < 10; ++i)
+      writer.write(s, reinterpret_cast<uint8_t const*>(data.data()),
+                   data.size());
+    EXPECT_EQ(writer.open_stream(), 0);
+    writer.close_stream(s);
+  }
+
+  CaptureReader reader{path_};
+  ASSERT_EQ(reader.streams().size(), 1);
+  EXPECT_EQ(reader.streams()[0].chunks.size(), 3);
+  EXPECT_FALSE(reader.streams()[0].complete);
+}
+
+TEST_F(CaptureFixture, full_file_closes_open_streams)
+{
+  std::string data(1000, 'A');
+  std::vector<uint64_t> ids;
+  {
+    CaptureWriter writer{path_, 1, 4096};
+    for (int i = 0; i < 8; ++i)
+      ids.push_back(writer.open_stream());
+
+    /*
+     * Only the first stream loses data
+     */
+    for (int i = 0; i < 10; ++i)
+      writer.write(ids[0], reinterpret_cast<uint8_t const*>(data.data()),
+                   data.size());
+    for (auto id: ids)
+      writer.close_stream(id);
+  }
+
+  CaptureReader reader{path_};
+  auto const& streams = reader.streams();
+  ASSERT_EQ(streams.size(), ids.size());
+  EXPECT_FALSE(streams[0].complete);
+  for (std::size_t i = 1; i < streams.size(); ++i)
+    EXPECT_TRUE(streams[i].complete);
+
+  struct stat st;
+  ASSERT_EQ(stat(path_.c_str(), &st), 0);
+  EXPECT_LE(st.st_size, 4096);
+}
+
+TEST_F(CaptureFixture, not_a_capture)
+{
+  std::FILE* f = std::fopen(path_.c_str(), "w");
+  std::fputs("not a capture file at all", f);
+  std::fclose(f);
+  EXPECT_THROW(CaptureReader{path_}, std::ios_base::failure);
+}
@@ -0,0 +1,91 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2021, Amin Saba
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <gtest/gtest.h>
+
+#include "histogram.hpp"
+
+using namespace lserver;
+
+TEST(LatencyHistogram, empty)
+{
+  LatencyHistogram h;
+  EXPECT_EQ(h.count(), 0);
+  EXPECT_EQ(h.min(), 0);
+  EXPECT_EQ(h.max(), 0);
+  EXPECT_EQ(h.value_at_percentile(99), 0);
+}
+
+TEST(LatencyHistogram, exact_small_values)
+{
+  LatencyHistogram h;
+  for (uint64_t v = 1; v <= 100; ++v)
+    h.record(v);
+
+  EXPECT_EQ(h.count(), 100);
+  EXPECT_EQ(h.min(), 1);
+  EXPECT_EQ(h.max(), 100);
+  EXPECT_EQ(h.value_at_percentile(50), 50);
+  EXPECT_EQ(h.value_at_percentile(99), 99);
+  EXPECT_EQ(h.value_at_percentile(100), 100);
+  EXPECT_DOUBLE_EQ(h.mean(), 50.5);
+}
+
+class LatencyHistogramPrecision : public ::testing::TestWithParam<uint64_t> { };
+
+TEST_P(LatencyHistogramPrecision, relative_error)
+{
+  LatencyHistogram h;
+  auto v = GetParam();
+  h.record(v);
+  h.record(v * 2);
+
+  auto p50 = h.value_at_percentile(50);
+  EXPECT_GE(p50, v);
+  EXPECT_LE(p50 - v, v / 50);
+  EXPECT_EQ(h.value_at_percentile(100), v * 2);
+}
+
+INSTANTIATE_TEST_SUITE_P(T1, LatencyHistogramPrecision,
+                         ::testing::Values(127, 128, 1000, 12345, 1000000,
+                                           1ul << 40, 3ul << 60));
+
+TEST(LatencyHistogram, merge)
+{
+  LatencyHistogram h1, h2;
+  h1.record(10, 3);
+  h2.record(1000, 1);
+  h1.merge(h2);
+
+  EXPECT_EQ(h1.count(), 4);
+  EXPECT_EQ(h1.min(), 10);
+  EXPECT_EQ(h1.max(), 1000);
+  EXPECT_EQ(h1.value_at_percentile(75), 10);
+  EXPECT_EQ(h1.value_at_percentile(76), 1000);
+}
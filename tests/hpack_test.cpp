@@ -0,0 +1,165 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2021, Amin Saba
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <gtest/gtest.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "hpack.hpp"
+
+using namespace lserver;
+
+namespace {
+  using Headers = std::vector<std::pair<std::string, std::string>>;
+
+  std::vector<uint8_t>
+  from_hex(std::string_view hex)
+  {
+    std::vector<uint8_t> bytes;
+    for (std::size_t i = 0; i + 1 < hex.size(); i += 2)
+      bytes.push_back(std::stoi(std::string{hex.substr(i, 2)}, nullptr, 16));
+    return bytes;
+  }
+
+  Headers
+  decode(HpackDecoder& decoder, std::string_view hex)
+  {
+    Headers headers;
+    auto block = from_hex(hex);
+    EXPECT_TRUE(decoder.decode(block.data(), block.size(),
+                               [&](std::string_view name, std::string_view value) {
+                                 headers.emplace_back(name, value);
+                               }));
+    return headers;
+  }
+} // namespace
+
+/*
+ * The request examples of RFC 7541, Appendix C.3 and C.4
+ */
+TEST(HpackDecoderTest, requests_without_huffman)
+{
+  HpackDecoder decoder;
+
+  EXPECT_EQ(decode(decoder, "828684410f7777772e6578616d706c652e636f6d"),
+            (Headers{{":method", "GET"},
+                     {":scheme", "http"},
+                     {":path", "/"},
+                     {":authority", "www.example.com"}}));
+  EXPECT_EQ(decoder.table_size(), 57);
+
+  EXPECT_EQ(decode(decoder, "828684be58086e6f2d6361636865"),
+            (Headers{{":method", "GET"},
+                     {":scheme", "http"},
+                     {":path", "/"},
+                     {":authority", "www.example.com"},
+                     {"cache-control", "no-cache"}}));
+  EXPECT_EQ(decoder.table_size(), 110);
+
+  EXPECT_EQ(
+      decode(decoder, "828785bf400a637573746f6d2d6b65790c637573746f6d2d76616c7565"),
+      (Headers{{":method", "GET"},
+               {":scheme", "https"},
+               {":path", "/index.html"},
+               {":authority", "www.example.com"},
+               {"custom-key", "custom-value"}}));
+  EXPECT_EQ(decoder.table_size(), 164);
+}
+
+TEST(HpackDecoderTest, requests_with_huffman)
+{
+  HpackDecoder decoder;
+
+  EXPECT_EQ(decode(decoder, "828684418cf1e3c2e5f23a6ba0ab90f4ff"),
+            (Headers{{":method", "GET"},
+                     {":scheme", "http"},
+                     {":path", "/"},
+                     {":authority", "www.example.com"}}));
+  EXPECT_EQ(decode(decoder, "828684be5886a8eb10649cbf"),
+            (Headers{{":method", "GET"},
+                     {":scheme", "http"},
+                     {":path", "/"},
+                     {":authority", "www.example.com"},
+                     {"cache-control", "no-cache"}}));
+  EXPECT_EQ(decode(decoder, "828785bf408825a849e95ba97d7f8925a849e95bb8e8b4bf"),
+            (Headers{{":method", "GET"},
+                     {":scheme", "https"},
+                     {":path", "/index.html"},
+                     {":authority", "www.example.com"},
+                     {"custom-key", "custom-value"}}));
+  EXPECT_EQ(decoder.table_size(), 164);
+}
+
+TEST(HpackDecoderTest, invalid_blocks)
+{
+  HpackDecoder decoder;
+  auto noop = [](std::string_view, std::string_view) {};
+
+  for (auto hex: {
+           "be",       // index beyond both tables
+           "80",       // index 0
+           "0f",       // truncated integer
+           "4003",     // string longer than the block
+           "008180",   // huffman padding of zeros
+           "3fe221",   // table size update above the limit
+           "823f01",   // table size update after a field
+       }) {
+    auto block = from_hex(hex);
+    EXPECT_FALSE(decoder.decode(block.data(), block.size(), noop)) << hex;
+  }
+}
+
+TEST(HpackEncoderTest, round_trip)
+{
+  uint8_t buffer[256];
+  auto end = HpackEncoder::encode_status(200, buffer);
+  EXPECT_EQ(end - buffer, 1);
+  end = HpackEncoder::encode_status(418, end);
+  end = HpackEncoder::encode("content-length", "1048576", end);
+  end = HpackEncoder::encode(":method", "GET", end);
+  end = HpackEncoder::encode("x-long-name-beyond-the-prefix", "v", end);
+
+  HpackDecoder decoder;
+  Headers headers;
+  EXPECT_TRUE(decoder.decode(buffer, end - buffer,
+                             [&](std::string_view name, std::string_view value) {
+                               headers.emplace_back(name, value);
+                             }));
+  EXPECT_EQ(headers, (Headers{{":status", "200"},
+                              {":status", "418"},
+                              {"content-length", "1048576"},
+                              {":method", "GET"},
+                              {"x-long-name-beyond-the-prefix", "v"}}));
+  /*
+   * Nothing is added to the dynamic table
+   */
+  EXPECT_EQ(decoder.table_size(), 0);
+}
@@ -0,0 +1,185 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2021, Amin Saba
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "kv_store.hpp"
+
+using namespace lserver;
+
+namespace {
+  std::string
+  value_of(KvStore const& store, std::string_view key)
+  {
+    std::string value;
+    if (!store.get(key, [&](std::string_view v) { value = v; }))
+      return "<none>";
+    return value;
+  }
+} // namespace
+
+TEST(KvStoreTest, set_get_del)
+{
+  KvStore store{4};
+
+  EXPECT_EQ(value_of(store, "a"), "<none>");
+  store.set("a", "1");
+  store.set("b", "");
+  EXPECT_EQ(value_of(store, "a"), "1");
+  EXPECT_EQ(value_of(store, "b"), "");
+  EXPECT_EQ(store.size(), 2);
+
+  store.set("a", "overwritten");
+  EXPECT_EQ(value_of(store, "a"), "overwritten");
+  EXPECT_EQ(store.size(), 2);
+
+  EXPECT_TRUE(store.del("a"));
+  EXPECT_FALSE(store.del("a"));
+  EXPECT_EQ(value_of(store, "a"), "<none>");
+  EXPECT_EQ(store.size(), 1);
+}
+
+TEST(KvStoreTest, expire)
+{
+  KvStore store{1};
+  auto now = KvStore::now_ms();
+
+  store.set("old", "x", now - 1);
+  store.set("new", "y", now + 60'000);
+  EXPECT_EQ(value_of(store, "old"), "<none>");
+  EXPECT_EQ(value_of(store, "new"), "y");
+
+  EXPECT_FALSE(store.expire("old", now + 60'000));
+  EXPECT_FALSE(store.expire("missing", now + 60'000));
+  EXPECT_TRUE(store.expire("new", now - 1));
+  EXPECT_EQ(value_of(store, "new"), "<none>");
+}
+
+TEST(KvStoreTest, growth_and_compaction)
+{
+  KvStore store{2};
+  std::string value(1000, 'v');
+
+  for (int i = 0; i < 10'000; ++i)
+    store.set("key" + std::to_string(i), std::to_string(i));
+  EXPECT_EQ(store.size(), 10'000);
+
+  /*
+   * Rewriting and deleting leaves garbage behind, which is compacted
+   */
+  for (int round = 0; round < 5; ++round)
+    for (int i = 0; i < 10'000; i += 2)
+      store.set("key" + std::to_string(i), value);
+  for (int i = 1; i < 10'000; i += 2)
+    EXPECT_TRUE(store.del("key" + std::to_string(i)));
+
+  EXPECT_EQ(store.size(), 5'000);
+  for (int i = 0; i < 10'000; ++i)
+    ASSERT_EQ(value_of(store, "key" + std::to_string(i)),
+              i % 2 ? "<none>" : value);
+}
+
+TEST(KvStoreTest, concurrent_readers)
+{
+  KvStore store{2};
+  std::atomic<bool> done = false;
+  std::atomic<int> torn = 0;
+
+  for (int i = 0; i < 256; ++i)
+    store.set("key" + std::to_string(i), std::string(64, 'a'));
+
+  /*
+   * A reader must see whole values, all of one letter, while the writer
+   * overwrites them and the shards are rebuilt under it.
+   */
+  std::vector<std::thread> readers;
+  for (int t = 0; t < 3; ++t)
+    readers.emplace_back([&] {
+      while (!done.load())
+        for (int i = 0; i < 256; ++i)
+          store.get("key" + std::to_string(i), [&](std::string_view v) {
+            if (v.size() != 64 || v.find_first_not_of(v[0]) != v.npos)
+              ++torn;
+          });
+    });
+
+  for (int round = 0; round < 2'000; ++round) {
+    for (int i = 0; i < 256; ++i)
+      store.set("key" + std::to_string(i),
+                std::string(64, 'a' + round % 26));
+    store.set("tmp" + std::to_string(round), "x");
+    store.del("tmp" + std::to_string(round));
+  }
+  done.store(true);
+  for (auto& t: readers)
+    t.join();
+
+  EXPECT_EQ(torn.load(), 0);
+  EXPECT_EQ(store.size(), 256);
+}
+
+TEST(KvStoreTest, retired_memory_is_bounded)
+{
+  KvStore store{1};
+  std::atomic<bool> done = false;
+
+  for (int i = 0; i < 256; ++i)
+    store.set("key" + std::to_string(i), std::string(4096, 'a'));
+
+  /*
+   * There is always a reader in the shard, and the writer rebuilds it
+   * about once per round. The replaced arenas must still be freed.
+   */
+  std::vector<std::thread> readers;
+  for (int t = 0; t < 4; ++t)
+    readers.emplace_back([&] {
+      while (!done.load())
+        for (int i = 0; i < 256; ++i)
+          store.get("key" + std::to_string(i), [](std::string_view) { });
+    });
+
+  std::size_t peak = 0;
+  for (int round = 0; round < 200; ++round) {
+    for (int i = 0; i < 256; ++i)
+      store.set("key" + std::to_string(i),
+                std::string(4096, 'a' + round % 26));
+    peak = std::max(peak, store.retired_count());
+  }
+  done.store(true);
+  for (auto& t: readers)
+    t.join();
+
+  EXPECT_LE(peak, 4);
+}
@@ -0,0 +1,398 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2021, Amin Saba
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <algorithm>
+#include <csignal>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+#include <yaml-cpp/yaml.h>
+
+#include "load_generator.hpp"
+#include "socket_options.hpp"
+
+using namespace lserver;
+
+/*
+ * End-to-end performance regression suite. It starts an lserver binary on
+ * loopback with a generated config, and a second one on a Unix domain
+ * socket, runs a set of canned closed-loop workloads against them, and
+ * compares throughput and p99 latency with a baseline file recorded on
+ * the same machine. The small request cases run on both, so that their
+ * results compare the two transports.
+ *
+ * Usage:
+ *   perf_regression_test --lserver=PATH --baseline=FILE [--update-baseline]
+ *
+ * With --update-baseline the measured values are written back to the
+ * baseline file instead of being checked. Otherwise a case without a
+ * baseline entry fails, so that an empty or stale baseline file cannot
+ * pass unnoticed.
+ */
+
+namespace {
+
+  struct PerfOptions {
+    std::string lserver;
+    std::string baseline;
+    bool update_baseline = false;
+    uint16_t port = 15981;
+    uint16_t control_port = 5981;
+    std::string unix_address = "unix:perf_regression.sock";
+    uint16_t unix_control_port = 5982;
+  };
+
+  struct PerfResult {
+    double throughput;
+    uint64_t p99;
+  };
+
+  struct PerfCase {
+    std::string name;
+    std::string url;
+    std::string body;
+    std::size_t connections;
+    /*
+     * Run against the server on the Unix domain socket
+     */
+    bool unix_socket = false;
+  };
+
+  void
+  PrintTo(PerfCase const& pc, std::ostream* os)
+  {
+    *os << pc.name;
+  }
+
+  PerfOptions options;
+  YAML::Node baseline;
+  std::map<std::string, PerfResult> results;
+
+  /*
+   * Prepends the length line to a VScript
+   */
+  std::string
+  vscript(std::string const& script, std::string const& data = "")
+  {
+    return std::to_string(script.size()) + "\n" + script + data;
+  }
+
+  std::string
+  generate_config(std::string const& path, std::string const& address,
+                  uint16_t control_port)
+  {
+    std::ofstream f{path};
+    f << "listen:\n"
+         "  ip: "
+      << address
+      << "\n"
+         "  port: "
+      << options.port
+      << "\n"
+         "  reuse_address: true\n"
+         "  separate_acceptor_thread: true\n"
+         "control_server:\n"
+         "  ip: 127.0.0.1\n"
+         "  port: "
+      << control_port
+      << "\n"
+         "networking:\n"
+         "  socket_close_linger: false\n"
+         "  socket_close_linger_timeout: 0\n"
+         "  max_connections_per_source: 1000\n"
+         "concurrency:\n"
+         "  num_workers: 2\n"
+         "  max_num_workers: 2\n"
+         "  num_threads_per_worker: 1\n"
+         "sessions:\n"
+         "  max_session_pool_size: 1000\n"
+         "  max_transfer_size: 262144\n"
+         "  eager_session_pool: false\n"
+         "logging:\n"
+         "  header_interval: 24\n";
+    return path;
+  }
+
+  bool
+  server_ready(std::string const& address)
+  {
+    asio::io_context ioc;
+    stream_protocol::socket s{ioc};
+    asio::error_code ec;
+    s.connect(make_stream_endpoint(address, options.port), ec);
+    return !ec;
+  }
+
+} // namespace
+
+/*
+ * Runs the two lserver processes for the whole suite.
+ */
+class PerfRegression : public ::testing::TestWithParam<PerfCase> {
+protected:
+  static void
+  SetUpTestSuite()
+  {
+    tcp_pid_ = start_server("127.0.0.1", options.control_port,
+                            "perf_regression_config.yaml");
+    unix_pid_ = start_server(options.unix_address, options.unix_control_port,
+                             "perf_regression_unix_config.yaml");
+    if (tcp_pid_ <= 0 || unix_pid_ <= 0)
+      FAIL() << "Cannot start " << options.lserver;
+  }
+
+  static void
+  TearDownTestSuite()
+  {
+    stop_server(tcp_pid_);
+    stop_server(unix_pid_);
+  }
+
+  void
+  SetUp() override
+  {
+    if ((GetParam().unix_socket ? unix_pid_ : tcp_pid_) <= 0)
+      GTEST_FAIL() << "lserver is not running";
+  }
+
+  /*
+   * Returns the pid of the lserver listening on 'address', or -1 if it
+   * did not come up.
+   */
+  static pid_t
+  start_server(std::string const& address, uint16_t control_port,
+               std::string const& config_name)
+  {
+    auto config_path = generate_config(config_name, address, control_port);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+      /*
+       * The Portal prints statistics to stdout every second
+       */
+      int null_fd = open("/dev/null", O_WRONLY);
+      dup2(null_fd, STDOUT_FILENO);
+      execl(options.lserver.c_str(), options.lserver.c_str(),
+            config_path.c_str(), nullptr);
+      _exit(127);
+    }
+
+    for (int i = 0; i < 100 && pid > 0; ++i) {
+      if (waitpid(pid, nullptr, WNOHANG) != 0)
+        return -1;
+      if (server_ready(address))
+        return pid;
+      std::this_thread::sleep_for(100ms);
+    }
+
+    if (pid > 0) {
+      kill(pid, SIGKILL);
+      waitpid(pid, nullptr, 0);
+    }
+    return -1;
+  }
+
+  static void
+  stop_server(pid_t pid)
+  {
+    if (pid <= 0)
+      return;
+
+    kill(pid, SIGTERM);
+    for (int i = 0; i < 100; ++i) {
+      if (waitpid(pid, nullptr, WNOHANG) == pid)
+        return;
+      std::this_thread::sleep_for(100ms);
+    }
+
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+    ADD_FAILURE() << "lserver did not shut down gracefully";
+  }
+
+  PerfResult
+  run(PerfCase const& pc)
+  {
+    LoadProfile profile;
+    profile.address = pc.unix_socket ? options.unix_address : "127.0.0.1";
+    profile.port = options.port;
+    profile.connections = pc.connections;
+    profile.rate = 0;
+    profile.warmup = 2s;
+    profile.duration = 10s;
+    profile.num_contexts = std::min<std::size_t>(2, pc.connections);
+    profile.workloads.push_back({pc.url, pc.body, 1});
+
+    LoadGenerator generator{profile};
+    auto report = generator.run();
+    EXPECT_EQ(report.errors_cnt, 0);
+
+    return {report.throughput(), report.latency.value_at_percentile(99)};
+  }
+
+  static inline pid_t tcp_pid_ = -1;
+  static inline pid_t unix_pid_ = -1;
+};
+
+TEST_P(PerfRegression, baseline)
+{
+  auto const& pc = GetParam();
+  auto result = run(pc);
+
+  RecordProperty("throughput", std::to_string(result.throughput));
+  RecordProperty("p99_us", std::to_string(result.p99));
+  std::cout << pc.name << ": " << result.throughput << " req/s, p99 "
+            << result.p99 << " us\n";
+
+  if (options.update_baseline) {
+    results[pc.name] = result;
+    return;
+  }
+
+  auto base = baseline["cases"][pc.name];
+  if (!base) {
+    ADD_FAILURE() << pc.name << " has no baseline in " << options.baseline
+                  << ", record one with --update-baseline";
+    return;
+  }
+
+  auto throughput_tol = baseline["tolerance"]["throughput"].as<double>(0.15);
+  auto p99_tol = baseline["tolerance"]["p99"].as<double>(0.5);
+
+  EXPECT_GE(result.throughput,
+            base["throughput"].as<double>() * (1 - throughput_tol));
+  EXPECT_LE(result.p99, base["p99_us"].as<double>() * (1 + p99_tol));
+}
+
+INSTANTIATE_TEST_SUITE_P(
+    Workloads, PerfRegression,
+    ::testing::Values(
+        PerfCase{"tiny_keepalive", "/sinkhole/", std::string(16, 'A'), 64},
+        PerfCase{"tiny_keepalive_unix", "/sinkhole/", std::string(16, 'A'),
+                 64, true},
+        PerfCase{"tiny_pingpong", "/sinkhole/", std::string(16, 'A'), 1},
+        PerfCase{"tiny_pingpong_unix", "/sinkhole/", std::string(16, 'A'), 1,
+                 true},
+        PerfCase{"large_upload", "/sinkhole/", std::string(1 << 20, 'A'),
+                 16},
+        PerfCase{"large_download", "/vscript/",
+                 vscript("[\n{\"0\": {\"DOWNLOAD\" : \"1048576\"}}\n]\n"),
+                 16},
+        PerfCase{"lock_contention", "/vscript/",
+                 vscript("[\n{\"0\": {\"LOCK\" : \"1\"}},\n"
+                         "{\"1\": {\"LOOP\" : \"20000\"}},\n"
+                         "{\"2\": {\"UNLOCK\" : \"1\"}}\n]\n",
+                         "ABC"),
+                 64},
+        PerfCase{"cpu_loop", "/vscript/",
+                 vscript("[\n{\"0\": {\"LOOP\" : \"200000\"}}\n]\n"), 64}),
+    [](auto const& info) { return info.param.name; });
+
+namespace {
+
+  void
+  write_baseline()
+  {
+    /*
+     * Keep the cases that were filtered out of this run
+     */
+    for (auto const& c: baseline["cases"])
+      results.try_emplace(c.first.as<std::string>(),
+                          PerfResult{c.second["throughput"].as<double>(),
+                                     c.second["p99_us"].as<uint64_t>()});
+
+    YAML::Emitter out;
+    out << YAML::DoublePrecision(3);
+    out << YAML::Comment("Recorded by perf_regression_test --update-baseline")
+        << YAML::Newline;
+    out << YAML::BeginMap;
+    out << YAML::Key << "tolerance" << YAML::Value << YAML::BeginMap;
+    out << YAML::Key << "throughput" << YAML::Value
+        << baseline["tolerance"]["throughput"].as<double>(0.15);
+    out << YAML::Key << "p99" << YAML::Value
+        << baseline["tolerance"]["p99"].as<double>(0.5);
+    out << YAML::EndMap;
+    out << YAML::Key << "cases" << YAML::Value << YAML::BeginMap;
+    for (auto const& [name, r]: results) {
+      out << YAML::Key << name << YAML::Value << YAML::Flow << YAML::BeginMap
+          << YAML::Key << "throughput" << YAML::Value
+          << static_cast<uint64_t>(r.throughput) << YAML::Key << "p99_us"
+          << YAML::Value << r.p99 << YAML::EndMap;
+    }
+    out << YAML::EndMap << YAML::EndMap;
+
+    std::ofstream{options.baseline} << out.c_str() << "\n";
+  }
+
+} // namespace
+
+int
+main(int argc, char* argv[])
+{
+  ::testing::InitGoogleTest(&argc, argv);
+
+  for (int i = 1; i < argc; ++i) {
+    std::string arg{argv[i]};
+    if (arg.rfind("--lserver=", 0) == 0)
+      options.lserver = arg.substr(10);
+    else if (arg.rfind("--baseline=", 0) == 0)
+      options.baseline = arg.substr(11);
+    else if (arg == "--update-baseline")
+      options.update_baseline = true;
+    else {
+      std::cerr << "Usage: " << argv[0]
+                << " --lserver=PATH --baseline=FILE [--update-baseline]\n";
+      return 1;
+    }
+  }
+
+  if (options.lserver.empty() || options.baseline.empty()) {
+    std::cerr << "--lserver and --baseline are required\n";
+    return 1;
+  }
+
+  try {
+    baseline = YAML::LoadFile(options.baseline);
+  } catch (YAML::BadFile&) {
+    baseline = YAML::Node{};
+  }
+
+  auto rc = RUN_ALL_TESTS();
+  if (options.update_baseline && rc == 0)
+    write_baseline();
+  return rc;
+}
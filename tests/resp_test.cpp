@@ -0,0 +1,222 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2021, Amin Saba
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <gtest/gtest.h>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include "io_context_pool.hpp"
+#include "resp.hpp"
+
+using namespace lserver;
+using namespace std::chrono_literals;
+
+namespace {
+  /*
+   * A Resp session on one end of a socket pair, and a blocking client on
+   * the other one.
+   */
+  class RespFixture : public ::testing::Test {
+  protected:
+    void
+    SetUp() override
+    {
+      int fds[2];
+      ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+      fd_ = fds[1];
+
+      auto& lscontext = *std::get<0>(pool_.get_context_round_robin());
+      SessionOptions options;
+      options.socket_options_ = local_socket_options(options.socket_options_);
+      session_.set_finalized_cb([this](Resp*) { closed_.store(true); });
+      session_.setup(lscontext,
+                     stream_protocol::socket{lscontext.get_io_context(),
+                                             stream_protocol{AF_UNIX, SOCK_STREAM},
+                                             fds[0]},
+                     options);
+      session_.session_start();
+    }
+
+    void
+    TearDown() override
+    {
+      close(fd_);
+      EXPECT_TRUE(wait_closed());
+      pool_.stop();
+      pool_.wait();
+    }
+
+    /*
+     * The session is finalized shortly after its socket is closed
+     */
+    bool
+    wait_closed()
+    {
+      for (int i = 0; i < 1000 && !closed_.load(); ++i)
+        std::this_thread::sleep_for(1ms);
+      return closed_.load();
+    }
+
+    void
+    send(std::string const& data)
+    {
+      ASSERT_EQ(write(fd_, data.data(), data.size()),
+                static_cast<ssize_t>(data.size()));
+    }
+
+    /*
+     * Returns what the session sends until it pauses for a while, or
+     * closes the connection.
+     */
+    std::string
+    receive()
+    {
+      std::string data;
+      char buffer[4096];
+      pollfd pfd{fd_, POLLIN, 0};
+      while (poll(&pfd, 1, 200) > 0) {
+        auto n = read(fd_, buffer, sizeof(buffer));
+        if (n <= 0)
+          break;
+        data.append(buffer, n);
+      }
+      return data;
+    }
+
+    static std::string
+    command(std::initializer_list<std::string_view> args)
+    {
+      std::string s = "*" + std::to_string(args.size()) + "\r\n";
+      for (auto arg: args)
+        s += "$" + std::to_string(arg.size()) + "\r\n" + std::string(arg) +
+             "\r\n";
+      return s;
+    }
+
+    LSContextPool pool_{1, 1, 1, "resptest"};
+    Resp session_;
+    std::atomic<bool> closed_ = false;
+    int fd_ = -1;
+  };
+} // namespace
+
+TEST_F(RespFixture, pipelined_commands)
+{
+  send(command({"SET", "resp_test:a", "1"}) + command({"GET", "resp_test:a"}) +
+       command({"get", "resp_test:none"}) + command({"PING"}));
+  EXPECT_EQ(receive(), "+OK\r\n$1\r\n1\r\n$-1\r\n+PONG\r\n");
+}
+
+TEST_F(RespFixture, partial_command)
+{
+  auto set = command({"SET", "resp_test:b", "hello"});
+  send(set.substr(0, 10));
+  EXPECT_EQ(receive(), "");
+  send(set.substr(10) + command({"MGET", "resp_test:b", "resp_test:none"}));
+  EXPECT_EQ(receive(), "+OK\r\n*2\r\n$5\r\nhello\r\n$-1\r\n");
+}
+
+TEST_F(RespFixture, del_and_expire)
+{
+  send(command({"SET", "resp_test:c", "x"}) +
+       command({"EXPIRE", "resp_test:c", "100"}) +
+       command({"DEL", "resp_test:c", "resp_test:none"}) +
+       command({"EXPIRE", "resp_test:c", "100"}));
+  EXPECT_EQ(receive(), "+OK\r\n:1\r\n:1\r\n:0\r\n");
+}
+
+TEST_F(RespFixture, errors)
+{
+  send(command({"GET"}) + command({"FLUSHALL"}) +
+       command({"SET", "resp_test:d", "x", "XX", "1"}) +
+       command({"EXPIRE", "resp_test:d", "soon"}));
+  EXPECT_EQ(receive(),
+            "-ERR wrong number of arguments for 'GET' command\r\n"
+            "-ERR unknown command 'FLUSHALL'\r\n"
+            "-ERR syntax error\r\n"
+            "-ERR value is not an integer or out of range\r\n");
+}
+
+TEST_F(RespFixture, expire_time_overflow)
+{
+  send(command({"SET", "resp_test:e", "x", "EX", "9223372036854775"}) +
+       command({"SET", "resp_test:e", "x", "PX", "9223372036854775807"}) +
+       command({"SET", "resp_test:e", "x", "EX", "0"}) +
+       command({"SET", "resp_test:e", "x"}) +
+       command({"EXPIRE", "resp_test:e", "9223372036854775807"}));
+  EXPECT_EQ(receive(), "-ERR invalid expire time in 'set' command\r\n"
+                       "-ERR invalid expire time in 'set' command\r\n"
+                       "-ERR invalid expire time in 'set' command\r\n"
+                       "+OK\r\n"
+                       "-ERR invalid expire time in 'expire' command\r\n");
+}
+
+TEST_F(RespFixture, malformed_command_closes)
+{
+  send(command({"PING"}) + "GET resp_test:a\r\n");
+  EXPECT_EQ(receive(), "+PONG\r\n");
+  EXPECT_TRUE(wait_closed());
+}
+
+TEST_F(RespFixture, oversized_command_closes)
+{
+  /*
+   * Each bulk string is within kRespMaxBulk, but the command is larger
+   * than the receive buffer of the session.
+   */
+  std::string big(kRespMaxBulk, 'x');
+  auto set = command({"SET", big, big});
+  std::thread writer{[&]() {
+    ::send(fd_, set.data(), set.size(), MSG_NOSIGNAL);
+  }};
+  EXPECT_TRUE(wait_closed());
+  shutdown(fd_, SHUT_RDWR);
+  writer.join();
+}
+
+TEST_F(RespFixture, command_of_many_arguments_closes)
+{
+  std::string mget = "*" + std::to_string(kRespMaxArgs) + "\r\n$4\r\nMGET\r\n";
+  std::string key(1000, 'k');
+  for (std::size_t i = 1; i < kRespMaxArgs; ++i)
+    mget += "$" + std::to_string(key.size()) + "\r\n" + key + "\r\n";
+  std::thread writer{[&]() {
+    ::send(fd_, mget.data(), mget.size(), MSG_NOSIGNAL);
+  }};
+  EXPECT_TRUE(wait_closed());
+  shutdown(fd_, SHUT_RDWR);
+  writer.join();
+}
@@ -0,0 +1,299 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2021, Amin Saba
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <gtest/gtest.h>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include "io_context_pool.hpp"
+#include "rpc.hpp"
+
+using namespace lserver;
+using namespace std::chrono_literals;
+
+namespace {
+  struct ReverseMethod {
+    static constexpr uint16_t id_ = 7;
+
+    static void
+    call(RpcCall& call)
+    {
+      auto out = call.respond(call.payload.size());
+      std::reverse_copy(call.payload.begin(), call.payload.end(), out);
+    }
+  };
+
+  class RpcFixture : public ::testing::Test {
+  protected:
+    void
+    SetUp() override
+    {
+      response_ = queue_.prepare(64);
+      response_->clear();
+      response_->fill(RpcFrameHeader::kSize);
+    }
+
+    void
+    TearDown() override
+    {
+      queue_.free(response_);
+    }
+
+    std::string
+    response_payload() const
+    {
+      return std::string{response_->data() + RpcFrameHeader::kSize,
+                          response_->size() - RpcFrameHeader::kSize};
+    }
+
+    std::span<uint8_t>
+    as_payload(std::string& s)
+    {
+      return {reinterpret_cast<uint8_t*>(s.data()), s.size()};
+    }
+
+    DynamicQueue<> queue_;
+    DynamicString* response_;
+    LSVirtualMachine vm_;
+  };
+
+  /*
+   * Echoes the payload after a while, off the session
+   */
+  struct SlowEchoMethod {
+    static constexpr uint16_t id_ = 8;
+    static constexpr bool offloaded_ = true;
+
+    static void
+    call(RpcCall& call)
+    {
+      std::this_thread::sleep_for(100ms);
+      RpcEchoMethod::call(call);
+    }
+  };
+
+  using TestRpc =
+      BasicRpc<MultiThreaded, RpcMethodList<RpcEchoMethod, SlowEchoMethod>>;
+
+  /*
+   * An Rpc session on one end of a socket pair, and a blocking client on
+   * the other one.
+   */
+  class RpcSessionFixture : public ::testing::Test {
+  protected:
+    void
+    SetUp() override
+    {
+      int fds[2];
+      ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+      fd_ = fds[1];
+
+      auto& lscontext = *std::get<0>(pool_.get_context_round_robin());
+      SessionOptions options;
+      options.socket_options_ = local_socket_options(options.socket_options_);
+      session_.set_finalized_cb([this](TestRpc*) { closed_.store(true); });
+      session_.setup(lscontext,
+                     stream_protocol::socket{lscontext.get_io_context(),
+                                             stream_protocol{AF_UNIX, SOCK_STREAM},
+                                             fds[0]},
+                     options);
+      session_.session_start();
+    }
+
+    void
+    TearDown() override
+    {
+      close(fd_);
+      for (int i = 0; i < 1000 && !closed_.load(); ++i)
+        std::this_thread::sleep_for(1ms);
+      EXPECT_TRUE(closed_.load());
+      pool_.stop();
+      pool_.wait();
+    }
+
+    void
+    send(uint32_t request_id, uint16_t method_id, std::string const& payload)
+    {
+      std::string frame(RpcFrameHeader::kSize, '\0');
+      RpcFrameHeader{.payload_len = static_cast<uint32_t>(payload.size()),
+                     .request_id = request_id,
+                     .method_id = method_id}
+          .encode(reinterpret_cast<uint8_t*>(frame.data()));
+      frame += payload;
+      ASSERT_EQ(write(fd_, frame.data(), frame.size()),
+                static_cast<ssize_t>(frame.size()));
+    }
+
+    /*
+     * Reads exactly 'n' bytes, or less if the session does not send them
+     * in time.
+     */
+    std::string
+    receive(std::size_t n)
+    {
+      std::string data(n, '\0');
+      std::size_t got = 0;
+      pollfd pfd{fd_, POLLIN, 0};
+      while (got < n && poll(&pfd, 1, 2000) > 0) {
+        auto r = read(fd_, data.data() + got, n - got);
+        if (r <= 0)
+          break;
+        got += r;
+      }
+      data.resize(got);
+      return data;
+    }
+
+    /*
+     * Reads the next response frame, and returns its header and payload
+     */
+    std::pair<RpcFrameHeader, std::string>
+    receive_frame()
+    {
+      auto header = receive(RpcFrameHeader::kSize);
+      if (header.size() < RpcFrameHeader::kSize)
+        return {};
+      auto decoded = RpcFrameHeader::decode(
+          reinterpret_cast<uint8_t const*>(header.data()));
+      return {decoded, receive(decoded.payload_len)};
+    }
+
+    LSContextPool pool_{1, 1, 2, "rpctest"};
+    TestRpc session_;
+    std::atomic<bool> closed_ = false;
+    int fd_ = -1;
+  };
+} // namespace
+
+TEST(RpcFrameHeaderTest, round_trip)
+{
+  RpcFrameHeader header{.payload_len = 0x01020304,
+                        .request_id = 42,
+                        .method_id = 2,
+                        .status = kRpcTooLarge};
+  uint8_t wire[RpcFrameHeader::kSize];
+  header.encode(wire);
+
+  /*
+   * Little endian on the wire
+   */
+  EXPECT_EQ(wire[0], 0x04);
+  EXPECT_EQ(wire[3], 0x01);
+
+  auto decoded = RpcFrameHeader::decode(wire);
+  EXPECT_EQ(decoded.payload_len, header.payload_len);
+  EXPECT_EQ(decoded.request_id, header.request_id);
+  EXPECT_EQ(decoded.method_id, header.method_id);
+  EXPECT_EQ(decoded.status, header.status);
+}
+
+TEST_F(RpcSessionFixture, out_of_order_responses)
+{
+  /*
+   * The slow request is offloaded, so the one pipelined behind it is
+   * answered first.
+   */
+  send(1, SlowEchoMethod::id_, "slow");
+  send(2, RpcEchoMethod::id_, "fast");
+
+  auto [first, first_payload] = receive_frame();
+  EXPECT_EQ(first.request_id, 2u);
+  EXPECT_EQ(first.method_id, RpcEchoMethod::id_);
+  EXPECT_EQ(first_payload, "fast");
+
+  auto [second, second_payload] = receive_frame();
+  EXPECT_EQ(second.request_id, 1u);
+  EXPECT_EQ(second.method_id, SlowEchoMethod::id_);
+  EXPECT_EQ(second.status, kRpcOk);
+  EXPECT_EQ(second_payload, "slow");
+}
+
+TEST_F(RpcSessionFixture, close_waits_for_offloaded_call)
+{
+  /*
+   * The connection goes away while the call runs. The session is only
+   * finalized after it is complete.
+   */
+  send(1, SlowEchoMethod::id_, "slow");
+  std::this_thread::sleep_for(20ms);
+  shutdown(fd_, SHUT_WR);
+  std::this_thread::sleep_for(30ms);
+  EXPECT_FALSE(closed_.load());
+}
+
+TEST_F(RpcFixture, dispatch)
+{
+  using Methods = RpcMethodList<RpcEchoMethod, ReverseMethod>;
+  std::string payload = "abc";
+
+  RpcCall reverse{as_payload(payload), response_, &vm_};
+  ASSERT_TRUE(Methods::dispatch(ReverseMethod::id_, reverse));
+  EXPECT_EQ(reverse.status, kRpcOk);
+  EXPECT_EQ(response_payload(), "cba");
+
+  RpcCall echo{as_payload(payload), response_, &vm_};
+  ASSERT_TRUE(Methods::dispatch(RpcEchoMethod::id_, echo));
+  EXPECT_EQ(response_payload(), "abc");
+
+  RpcCall unknown{as_payload(payload), response_, &vm_};
+  EXPECT_FALSE(Methods::dispatch(RpcVScriptMethod::id_, unknown));
+}
+
+TEST_F(RpcFixture, large_response)
+{
+  std::string payload(1000, 'x');
+
+  RpcCall echo{as_payload(payload), response_, &vm_};
+  RpcEchoMethod::call(echo);
+  EXPECT_EQ(response_payload(), payload);
+}
+
+TEST_F(RpcFixture, vscript)
+{
+  std::string script = R"([{"0": {"DOWNLOAD" : "100"}}])";
+  std::string payload = std::to_string(script.size()) + "\n" + script;
+
+  RpcCall call{as_payload(payload), response_, &vm_};
+  RpcVScriptMethod::call(call);
+  EXPECT_EQ(call.status, kRpcOk);
+  EXPECT_EQ(response_->size() - RpcFrameHeader::kSize, 100);
+
+  std::string bad = "garbage";
+  RpcCall bad_call{as_payload(bad), response_, &vm_};
+  RpcVScriptMethod::call(bad_call);
+  EXPECT_EQ(bad_call.status, kRpcBadRequest);
+}
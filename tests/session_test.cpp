@@ -0,0 +1,152 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2021, Amin Saba
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <gtest/gtest.h>
+
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include "io_context_pool.hpp"
+#include "tcp_protocols.hpp"
+
+using namespace lserver;
+using namespace std::chrono_literals;
+
+namespace {
+  /*
+   * A TcpEcho session with TCP_CORK on one end of a loopback TCP
+   * connection, and a blocking client on the other one. The pool has two
+   * LSContexts, so that the session can move.
+   */
+  class SessionFixture : public ::testing::Test {
+  protected:
+    void
+    SetUp() override
+    {
+      int listener = socket(AF_INET, SOCK_STREAM, 0);
+      ASSERT_GE(listener, 0);
+      sockaddr_in addr{};
+      addr.sin_family = AF_INET;
+      addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      socklen_t len = sizeof(addr);
+      ASSERT_EQ(bind(listener, reinterpret_cast<sockaddr*>(&addr), len), 0);
+      ASSERT_EQ(listen(listener, 1), 0);
+      ASSERT_EQ(
+          getsockname(listener, reinterpret_cast<sockaddr*>(&addr), &len), 0);
+
+      fd_ = socket(AF_INET, SOCK_STREAM, 0);
+      ASSERT_EQ(connect(fd_, reinterpret_cast<sockaddr*>(&addr), len), 0);
+      int server_fd = accept(listener, nullptr, nullptr);
+      close(listener);
+      ASSERT_GE(server_fd, 0);
+
+      source_ = std::get<0>(pool_.get_context_round_robin());
+      target_ = std::get<0>(pool_.get_context_round_robin());
+      target_->unhold();
+      ASSERT_NE(source_, target_);
+
+      SessionOptions options;
+      options.socket_options_.tcp_cork = true;
+      session_.set_finalized_cb([this](TcpEcho*) { closed_.store(true); });
+      session_.setup(*source_,
+                     stream_protocol::socket{source_->get_io_context(),
+                                             stream_protocol{AF_INET, SOCK_STREAM},
+                                             server_fd},
+                     options);
+      session_.session_start();
+    }
+
+    void
+    TearDown() override
+    {
+      close(fd_);
+      for (int i = 0; i < 1000 && !closed_.load(); ++i)
+        std::this_thread::sleep_for(1ms);
+      EXPECT_TRUE(closed_.load());
+      pool_.stop();
+      pool_.wait();
+    }
+
+    /*
+     * Sends 'data' and returns what is echoed back, which is shorter if
+     * it does not come in time.
+     */
+    std::string
+    echo(std::string const& data)
+    {
+      EXPECT_EQ(write(fd_, data.data(), data.size()),
+                static_cast<ssize_t>(data.size()));
+
+      std::string echoed(data.size(), '\0');
+      std::size_t got = 0;
+      pollfd pfd{fd_, POLLIN, 0};
+      while (got < data.size() && poll(&pfd, 1, 1000) > 0) {
+        auto n = read(fd_, echoed.data() + got, data.size() - got);
+        if (n <= 0)
+          break;
+        got += n;
+      }
+      echoed.resize(got);
+      return echoed;
+    }
+
+    LSContextPool pool_{2, 2, 2, "sessiontest"};
+    LSContext* source_ = nullptr;
+    LSContext* target_ = nullptr;
+    TcpEcho session_;
+    std::atomic<bool> closed_ = false;
+    int fd_ = -1;
+  };
+} // namespace
+
+TEST_F(SessionFixture, migrate_corked_session)
+{
+  EXPECT_EQ(echo("before"), "before");
+
+  /*
+   * The session moves once its next response is sent, uncorked, and the
+   * ones after it are served by the target LSContext.
+   */
+  source_->request_migration({{target_, 1}});
+  EXPECT_EQ(echo("moving"), "moving");
+  for (int i = 0; i < 100; ++i)
+    ASSERT_EQ(echo("after " + std::to_string(i)), "after " + std::to_string(i));
+
+  EXPECT_FALSE(source_->migration_pending());
+  EXPECT_EQ(source_->sessions_count(), 0u);
+  EXPECT_EQ(target_->sessions_count(), 1u);
+}
@@ -0,0 +1,106 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2021, Amin Saba
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include "syncronization_utils.hpp"
+
+using namespace std::literals;
+using namespace lserver;
+
+TEST(TriggerGuard, guard_blocks_trigger)
+{
+  TriggerGuard tg;
+  std::atomic<bool> triggered = false;
+  std::optional<std::thread> t;
+
+  {
+    auto guard = tg.acquire_scoped_guard();
+    ASSERT_TRUE(guard);
+
+    t.emplace([&]() {
+      tg.trigger();
+      triggered.store(true);
+    });
+
+    /*
+     * A pending trigger refuses new guards, but waits for ours.
+     */
+    while (!tg.triggered())
+      std::this_thread::yield();
+    EXPECT_FALSE(tg.acquire_scoped_guard());
+    std::this_thread::sleep_for(50ms);
+    EXPECT_FALSE(triggered.load());
+  }
+
+  t->join();
+  EXPECT_TRUE(triggered.load());
+  EXPECT_FALSE(tg.acquire_scoped_guard());
+}
+
+TEST(TriggerGuard, concurrent_guards)
+{
+  TriggerGuard tg;
+  std::atomic<std::size_t> acquired = 0;
+  std::vector<std::thread> threads;
+
+  for (int i = 0; i < 4; ++i) {
+    threads.emplace_back([&]() {
+      while (auto guard = tg.acquire_scoped_guard())
+        acquired.fetch_add(1);
+    });
+  }
+
+  while (acquired.load() < 10000)
+    std::this_thread::yield();
+  tg.trigger();
+  for (auto& t: threads)
+    t.join();
+  EXPECT_TRUE(tg.triggered());
+}
+
+TEST(ResetableOnceFlag, run_once)
+{
+  ResetableOnceFlag flag;
+  int cnt = 0;
+
+  flag.reset();
+  flag.run_once([&]() { ++cnt; });
+  flag.run_once([&]() { ++cnt; });
+  EXPECT_EQ(cnt, 1);
+
+  flag.reset();
+  flag.run_once([&]() { ++cnt; });
+  EXPECT_EQ(cnt, 2);
+}
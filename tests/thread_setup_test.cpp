@@ -0,0 +1,81 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2021, Amin Saba
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <gtest/gtest.h>
+
+#include <thread>
+
+#include "thread_setup.hpp"
+
+using namespace lserver;
+
+TEST(ThreadSetup, parse_cpu_list)
+{
+  EXPECT_TRUE(parse_cpu_list("").empty());
+  EXPECT_EQ(parse_cpu_list("3"), (std::vector<int>{3}));
+  EXPECT_EQ(parse_cpu_list("0-3,8,10-11"),
+            (std::vector<int>{0, 1, 2, 3, 8, 10, 11}));
+  EXPECT_EQ(parse_cpu_list("2-2"), (std::vector<int>{2}));
+}
+
+TEST(ThreadSetup, parse_bad_cpu_list)
+{
+  for (auto list: {"a", "1-", "-1", "3-1", "1x", "0,,1", "0-1-2"})
+    EXPECT_THROW(parse_cpu_list(list), std::invalid_argument) << list;
+}
+
+TEST(ThreadSetup, parse_sched_policy)
+{
+  EXPECT_EQ(parse_sched_policy("other"), SCHED_OTHER);
+  EXPECT_EQ(parse_sched_policy("batch"), SCHED_BATCH);
+  EXPECT_EQ(parse_sched_policy("fifo"), SCHED_FIFO);
+  EXPECT_EQ(parse_sched_policy("rr"), SCHED_RR);
+  EXPECT_THROW(parse_sched_policy("deadline"), std::invalid_argument);
+}
+
+TEST(ThreadSetup, apply)
+{
+  auto cpus = current_thread_cpus();
+  ASSERT_FALSE(cpus.empty());
+
+  std::thread t{[&]() {
+    apply_thread_setup({"lstest", {cpus.front()}, SCHED_BATCH, 0});
+
+    char name[16];
+    pthread_getname_np(pthread_self(), name, sizeof(name));
+    EXPECT_STREQ(name, "lstest");
+    EXPECT_EQ(current_thread_cpus(), std::vector<int>{cpus.front()});
+
+    int policy;
+    sched_param param;
+    pthread_getschedparam(pthread_self(), &policy, &param);
+    EXPECT_EQ(policy, SCHED_BATCH);
+  }};
+  t.join();
+}
@@ -0,0 +1,224 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2021, Amin Saba
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <gtest/gtest.h>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+
+#include "tls.hpp"
+
+using namespace lserver;
+
+namespace {
+  /*
+   * A self-signed P-256 certificate and its key, in a temporary directory
+   */
+  struct SelfSigned {
+    SelfSigned()
+    {
+      char dir[] = "/tmp/tls_testXXXXXX";
+      EXPECT_NE(mkdtemp(dir), nullptr);
+      dir_ = dir;
+      certificate_file_ = dir_ + "/cert.pem";
+      private_key_file_ = dir_ + "/key.pem";
+
+      auto key = EVP_EC_gen("P-256");
+      auto cert = X509_new();
+      ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+      X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+      X509_gmtime_adj(X509_getm_notAfter(cert), 3600);
+      X509_set_pubkey(cert, key);
+      auto name = X509_get_subject_name(cert);
+      X509_NAME_add_entry_by_txt(
+          name, "CN", MBSTRING_ASC,
+          reinterpret_cast<unsigned char const*>("localhost"), -1, -1, 0);
+      X509_set_issuer_name(cert, name);
+      X509_sign(cert, key, EVP_sha256());
+
+      auto f = fopen(certificate_file_.c_str(), "w");
+      PEM_write_X509(f, cert);
+      fclose(f);
+      f = fopen(private_key_file_.c_str(), "w");
+      PEM_write_PrivateKey(f, key, nullptr, nullptr, 0, nullptr, nullptr);
+      fclose(f);
+      X509_free(cert);
+      EVP_PKEY_free(key);
+    }
+
+    ~SelfSigned()
+    {
+      unlink(certificate_file_.c_str());
+      unlink(private_key_file_.c_str());
+      rmdir(dir_.c_str());
+    }
+
+    std::string dir_;
+    std::string certificate_file_;
+    std::string private_key_file_;
+  };
+
+  /*
+   * A server TlsStream and an OpenSSL client on the two ends of a
+   * non-blocking socket pair.
+   */
+  class TlsFixture : public ::testing::Test {
+  protected:
+    void
+    SetUp() override
+    {
+      ASSERT_EQ(
+          socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds_), 0);
+      context_.emplace(certs_.certificate_file_, certs_.private_key_file_,
+                       false, "h2");
+      ASSERT_TRUE(server_.open(*context_, fds_[0]));
+
+      client_ctx_ = SSL_CTX_new(TLS_client_method());
+      client_ = SSL_new(client_ctx_);
+      SSL_set_fd(client_, fds_[1]);
+      SSL_set_connect_state(client_);
+      static unsigned char const kProtocols[] = "\x08http/1.1\x02h2";
+      SSL_set_alpn_protos(client_, kProtocols, sizeof(kProtocols) - 1);
+    }
+
+    void
+    TearDown() override
+    {
+      server_.reset();
+      SSL_free(client_);
+      SSL_CTX_free(client_ctx_);
+      close(fds_[0]);
+      if (fds_[1] >= 0)
+        close(fds_[1]);
+    }
+
+    /*
+     * Runs both ends of the handshake in turns, until the server is done
+     */
+    TlsStream::Status
+    handshake()
+    {
+      auto status = TlsStream::kWantRead;
+      for (int i = 0; i < 16 && status != TlsStream::kDone; ++i) {
+        SSL_do_handshake(client_);
+        status = server_.handshake();
+        if (status == TlsStream::kFailed || status == TlsStream::kClosed)
+          break;
+      }
+      SSL_do_handshake(client_);
+      return status;
+    }
+
+    SelfSigned certs_;
+    int fds_[2] = {-1, -1};
+    std::optional<TlsContext> context_;
+    TlsStream server_;
+    SSL_CTX* client_ctx_ = nullptr;
+    SSL* client_ = nullptr;
+  };
+} // namespace
+
+TEST_F(TlsFixture, handshake_and_alpn)
+{
+  ASSERT_EQ(handshake(), TlsStream::kDone);
+  EXPECT_TRUE(SSL_is_init_finished(client_));
+
+  unsigned char const* selected = nullptr;
+  unsigned int length = 0;
+  SSL_get0_alpn_selected(client_, &selected, &length);
+  EXPECT_EQ(std::string(reinterpret_cast<char const*>(selected), length),
+            "h2");
+
+  /*
+   * kTLS was not asked for, so both directions are in user space
+   */
+  EXPECT_TRUE(server_.user_space_receive());
+  EXPECT_TRUE(server_.user_space_send());
+}
+
+TEST_F(TlsFixture, read_and_write)
+{
+  ASSERT_EQ(handshake(), TlsStream::kDone);
+
+  char buffer[64];
+  std::size_t n = 0;
+  EXPECT_EQ(server_.read(buffer, sizeof(buffer), n), TlsStream::kWantRead);
+
+  ASSERT_EQ(SSL_write(client_, "ping", 4), 4);
+  ASSERT_EQ(server_.read(buffer, sizeof(buffer), n), TlsStream::kDone);
+  EXPECT_EQ(std::string(buffer, n), "ping");
+
+  ASSERT_EQ(server_.write("pong", 4, n), TlsStream::kDone);
+  EXPECT_EQ(n, 4u);
+  ASSERT_EQ(SSL_read(client_, buffer, sizeof(buffer)), 4);
+  EXPECT_EQ(std::string(buffer, 4), "pong");
+}
+
+TEST_F(TlsFixture, end_of_stream)
+{
+  ASSERT_EQ(handshake(), TlsStream::kDone);
+
+  char buffer[64];
+  std::size_t n = 0;
+  SSL_shutdown(client_);
+  EXPECT_EQ(server_.read(buffer, sizeof(buffer), n), TlsStream::kClosed);
+
+  /*
+   * A peer that goes away without close_notify ends the stream as well.
+   * It reads the session tickets first, or its close would be a reset.
+   */
+  TearDown();
+  SetUp();
+  ASSERT_EQ(handshake(), TlsStream::kDone);
+  EXPECT_LE(SSL_read(client_, buffer, sizeof(buffer)), 0);
+  close(fds_[1]);
+  fds_[1] = -1;
+  EXPECT_EQ(server_.read(buffer, sizeof(buffer), n), TlsStream::kClosed);
+}
+
+TEST_F(TlsFixture, garbage_fails_the_handshake)
+{
+  ASSERT_EQ(write(fds_[1], "GET / HTTP/1.1\r\n\r\n", 18), 18);
+  EXPECT_EQ(server_.handshake(), TlsStream::kFailed);
+}
+
+TEST(TlsContextTest, missing_certificate)
+{
+  EXPECT_THROW(TlsContext("/nonexistent/cert.pem", "/nonexistent/key.pem",
+                          true),
+               ConfigParseError);
+}
@@ -0,0 +1,164 @@
+/*
+ * BSD 2-Clause License
+ *
+ * Copyright (c) 2021, Amin Saba
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <gtest/gtest.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "io_context_pool.hpp"
+#include "udp_protocols.hpp"
+
+using namespace lserver;
+using namespace std::chrono_literals;
+
+namespace {
+  class UdpFixture : public ::testing::Test {
+  protected:
+    void
+    SetUp() override
+    {
+      options_.max_datagram_size_ = 1000;
+      fd_ = socket(AF_INET, SOCK_DGRAM, 0);
+      ASSERT_GE(fd_, 0);
+    }
+
+    void
+    TearDown() override
+    {
+      close(fd_);
+      pool_.stop();
+      pool_.wait();
+    }
+
+    LSContext&
+    context()
+    {
+      return *std::get<0>(pool_.get_context_round_robin());
+    }
+
+    void
+    send_to(uint16_t port, std::string const& datagram)
+    {
+      sockaddr_in addr{};
+      addr.sin_family = AF_INET;
+      addr.sin_port = htons(port);
+      addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      ASSERT_EQ(sendto(fd_, datagram.data(), datagram.size(), 0,
+                       reinterpret_cast<sockaddr*>(&addr), sizeof(addr)),
+                static_cast<ssize_t>(datagram.size()));
+    }
+
+    /*
+     * Returns the sizes of the datagrams received until none comes for
+     * a while.
+     */
+    std::vector<std::size_t>
+    receive_sizes()
+    {
+      std::vector<std::size_t> sizes;
+      std::vector<char> buffer(65536);
+      pollfd pfd{fd_, POLLIN, 0};
+      while (poll(&pfd, 1, 500) > 0) {
+        auto n = recv(fd_, buffer.data(), buffer.size(), 0);
+        if (n < 0)
+          break;
+        sizes.push_back(n);
+      }
+      return sizes;
+    }
+
+    template <class P>
+    static void
+    close_endpoint(DatagramEndpoint<P>& endpoint)
+    {
+      endpoint.close();
+      for (int i = 0; i < 1000 && !endpoint.closed(); ++i)
+        std::this_thread::sleep_for(1ms);
+      EXPECT_TRUE(endpoint.closed());
+    }
+
+    LSContextPool pool_{1, 1, 1, "udptest"};
+    DatagramOptions options_;
+    int fd_ = -1;
+  };
+} // namespace
+
+TEST_F(UdpFixture, echo)
+{
+  DatagramEndpoint<UdpEcho> endpoint{options_};
+  endpoint.open(context());
+  ASSERT_NE(endpoint.port(), 0);
+
+  send_to(endpoint.port(), "hello");
+  std::vector<char> buffer(64);
+  pollfd pfd{fd_, POLLIN, 0};
+  ASSERT_EQ(poll(&pfd, 1, 1000), 1);
+  auto n = recv(fd_, buffer.data(), buffer.size(), 0);
+  EXPECT_EQ(std::string(buffer.data(), n), "hello");
+
+  close_endpoint(endpoint);
+}
+
+TEST_F(UdpFixture, vscript_reply_is_segmented)
+{
+  DatagramEndpoint<UdpVScript> endpoint{options_};
+  endpoint.open(context());
+
+  std::string script = R"([{"0": {"DOWNLOAD" : "2500"}}])";
+  send_to(endpoint.port(), std::to_string(script.size()) + "\n" + script);
+  EXPECT_EQ(receive_sizes(), (std::vector<std::size_t>{1000, 1000, 500}));
+
+  send_to(endpoint.port(), "garbage");
+  EXPECT_TRUE(receive_sizes().empty());
+
+  close_endpoint(endpoint);
+}
+
+TEST_F(UdpFixture, close_releases_the_context)
+{
+  DatagramEndpoint<UdpSink> endpoint{options_};
+  endpoint.open(context());
+  close_endpoint(endpoint);
+
+  /*
+   * It opens again, as it does when its LSContext is reused
+   */
+  endpoint.open(context());
+  EXPECT_FALSE(endpoint.closed());
+  close_endpoint(endpoint);
+}